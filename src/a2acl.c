@@ -20,19 +20,44 @@
  * Retreive, validate and modify access policies.
  */
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "a2acl.h"
 
+/* policies are split in chunks of at least this size for parsing */
+#define PARSECHUNKMIN (1024 * 1024)
+#define MAXPARSETHREADS 16
+
+/*
+ * Compiled ACL rules start with RULEMAGIC, which can't be the first byte of an
+ * ACL rule in text form, followed by a header and segments, see
+ * a2acl_compilerule.
+ */
+#define RULEMAGIC 0x01
+#define RULEHDRSZ 3
+#define RULESEGSZ 4
+
+/* Bloom filter block size in bytes, bits per key and bits set per key */
+#define BLOOMBLOCK 64
+#define BLOOMBITS 10
+#define BLOOMK 7
+
+/* generalizations of a remote id that are looked up at once, see lookup */
+#define NRKEYS 16
+
 static const char basechar[256] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	    0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -80,6 +105,21 @@ static const char basechar[256] = {
 size_t a2id_localpart_options(char *dst, size_t dstsize, int *nropts,
     const a2id *a2id);
 
+/*
+ * Initialize an ACL rule segment iterator in "it", to be used by
+ * a2acl_nextsegment(3). "aclrule" is not copied and must stay valid while "it"
+ * is in use.
+ */
+static void
+initit(struct a2aclit *it, const char *aclrule, size_t aclrulesize)
+{
+	it->initialized = 42;
+	it->state = S;
+	it->aclrule = aclrule;
+	it->aclrulesize = aclrulesize;
+	it->n = 0;
+}
+
 /*
  * Allocate and initialize a new ACL rule segment iterator, to be used by
  * a2acl_nextsegment(3).
@@ -97,42 +137,31 @@ a2acl_newit(const char *aclrule, size_t aclrulesize)
 	if ((it = calloc(1, sizeof(*it))) == NULL)
 		return NULL;
 
-	it->initialized = 42;
-	it->state = S;
-	it->aclrule = aclrule;
-	it->aclrulesize = aclrulesize;
-	it->n = 0;
+	initit(it, aclrule, aclrulesize);
 
 	return it;
 }
 
 /*
- * Check if "id" matches with "aclseg".
- *
- * Signature presence is tested if required, but not validated.
+ * Check if a local ID with the options "idoptseg" of "idoptsegsize" bytes, as
+ * returned by a2id_localpart_options, matches with "aclseg". "hassig" must be
+ * set if the local ID has a signature.
  *
  * Return 1 if true, 0 if false.
  */
-int
-a2acl_aclsegmatch(const a2id *id, const struct a2aclseg *aclseg)
+static int
+segmatch(const char *idoptseg, size_t idoptsegsize, int hassig,
+    const struct a2aclseg *aclseg)
 {
-	char idoptseg[A2ID_MAXLOCALPART_OPTIONSSZ];
-	size_t idoptsegsize;
-
-	if (id == NULL || aclseg == NULL)
-		return 0;
-
 	/* Handle signature presence requirements. */
 	if (aclseg->reqsigflags)
-		if (a2id_hassignature(id) == 0)
+		if (hassig == 0)
 			return 0;
 
 	/* Handle wildcard ACL */
 	if (aclseg->segsize == 0)
 		return 1;
 
-	idoptsegsize = a2id_localpart_options(idoptseg, sizeof(idoptseg), NULL,
-	    id);
 	if (idoptsegsize == 0)
 		return 0;
 
@@ -156,6 +185,28 @@ a2acl_aclsegmatch(const a2id *id, const struct a2aclseg *aclseg)
 	return 0;
 }
 
+/*
+ * Check if "id" matches with "aclseg".
+ *
+ * Signature presence is tested if required, but not validated.
+ *
+ * Return 1 if true, 0 if false.
+ */
+int
+a2acl_aclsegmatch(const a2id *id, const struct a2aclseg *aclseg)
+{
+	char idoptseg[A2ID_MAXLOCALPART_OPTIONSSZ];
+	size_t idoptsegsize;
+
+	if (id == NULL || aclseg == NULL)
+		return 0;
+
+	idoptsegsize = a2id_localpart_options(idoptseg, sizeof(idoptseg), NULL,
+	    id);
+
+	return segmatch(idoptseg, idoptsegsize, a2id_hassignature(id), aclseg);
+}
+
 /*
  * Parse an ACL rule. Returns whenever a new segment is parsed or the end of the
  * ACL rule is reached. "aclit" should be created once with a2acl_newit(3) and
@@ -310,339 +361,1376 @@ done:
 }
 
 /*
- * Determine if communication between "remoteid" and "localid" is whitelisted,
- * greylisted, blacklisted or abandoned.
- *
- * The result is written to "list" in the form of the first letter of the list
- * this pair is on which is one of: 'W', 'G', 'B', 'A'. If no policy is found it
- * is set to 'G'.
+ * Write "n" to "dst" as two bytes, little endian.
+ */
+static void
+putu16(char *dst, size_t n)
+{
+	dst[0] = n & 0xff;
+	dst[1] = n >> 8 & 0xff;
+}
+
+/*
+ * Read two bytes, little endian, from "src".
+ */
+static size_t
+getu16(const char *src)
+{
+	return (unsigned char)src[0] | (unsigned char)src[1] << 8;
+}
+
+/*
+ * Compile the ACL rule "aclrule" in text form to a form that can be matched
+ * without parsing it again. The compiled rule is only written to "dst" if it
+ * fits in "dstsize" bytes. It consists of:
  *
- * "remoteid" will be generalized until an ACL rule is found or until it equals
- * the most general selector "@." which can not be further generalized.
+ *    magic     1 byte, RULEMAGIC
+ *    nsegs     2 bytes
+ *    segments  "nsegs" times: the list character, 1 if a signature is
+ *              required or 0 if not, the size of the segment name in 2 bytes
+ *              and the segment name itself
  *
- * Returns 0 on success and updates "*list" to point to the applicable list-
- * character which is either a 'W', 'G', 'B', or 'A'. Returns -1 on error.
+ * All numbers are little endian and have no alignment, so a compiled rule can
+ * be used in place wherever a database keeps it. A compiled rule is never more
+ * than three times the size of "aclrule" plus RULEHDRSZ.
  *
- * XXX returns -1 if an ACL rule is syntactically incorrect, these checks should
- * better be done on import.
+ * Returns the size of the compiled rule, which is larger than "dstsize" if it
+ * was not written, or -1 if "aclrule" is invalid.
  */
-int
-a2acl_whichlist(char *list, a2id *remoteid, const a2id *localid)
+ssize_t
+a2acl_compilerule(char *dst, size_t dstsize, const char *aclrule,
+    size_t aclrulesize)
 {
 	struct a2aclseg aclseg;
-	struct a2aclit *it;
-	char aclrule[A2ACL_MAXLEN], coreid[A2ID_MAXSZ], remotestr[A2ID_MAXSZ];
-	size_t aclrulesize, remotestrsz, coreidsz;
-	int match, r;
+	struct a2aclit it;
+	size_t nsegs, size;
+	char list;
+	int r;
+
+	nsegs = 0;
+	size = RULEHDRSZ;
+	initit(&it, aclrule, aclrulesize);
+	while ((r = a2acl_nextsegment(&list, &aclseg, &it)) == 1) {
+		if (size + RULESEGSZ + aclseg.segsize <= dstsize) {
+			dst[size] = list;
+			dst[size + 1] = aclseg.reqsigflags != 0;
+			putu16(&dst[size + 2], aclseg.segsize);
+			if (aclseg.segsize > 0)
+				memcpy(&dst[size + RULESEGSZ], aclseg.seg,
+				    aclseg.segsize);
+		}
+		size += RULESEGSZ + aclseg.segsize;
+		nsegs++;
+	}
 
-	coreidsz = a2id_coreform(coreid, sizeof(coreid), localid);
-	if (coreidsz >= sizeof(coreid))
+	if (r == -1 || nsegs == 0 || nsegs > UINT16_MAX)
 		return -1;
 
-	for (;;) {
-		remotestrsz = a2id_tostr(remotestr, sizeof(remotestr), remoteid);
-		if (remotestrsz >= sizeof(remotestr))
-			return -1;
-
-		aclrulesize = sizeof(aclrule);
-		if (a2acl_getaclrule(aclrule, &aclrulesize, remotestr,
-		    remotestrsz, coreid, coreidsz) == -1)
-			return -1;
+	if (size <= dstsize) {
+		dst[0] = RULEMAGIC;
+		putu16(&dst[1], nsegs);
+	}
 
-		if (aclrulesize == 0) {
-			if (a2id_generalize(remoteid))
-				continue;
-			else
-				break;
-		}
+	return size;
+}
 
-		if ((it = a2acl_newit(aclrule, aclrulesize)) == NULL)
-			return -1;
+/*
+ * Return the number of segments of the compiled ACL rule "rule", or -1 if it is
+ * not a compiled rule.
+ */
+static ssize_t
+compiledsegs(const char *rule, size_t rulesize)
+{
+	if (rulesize < RULEHDRSZ || rule[0] != RULEMAGIC)
+		return -1;
 
-		/* iterate over acl segments and see if there is a match */
-		match = 0;
-		while ((r = a2acl_nextsegment(list, &aclseg, it)) == 1) {
-			if (a2acl_aclsegmatch(localid, &aclseg)) {
-				match = 1;
-				break;
-			}
-		}
+	return getu16(&rule[1]);
+}
 
-		free(it);
-		it = NULL;
+/*
+ * Set "list" and "aclseg" to the segment at offset "off" in the compiled ACL
+ * rule "rule" and advance "off" to the next segment.
+ *
+ * Returns 0 on success, -1 if the segment is not within the rule.
+ */
+static int
+compiledseg(char *list, struct a2aclseg *aclseg, const char *rule,
+    size_t rulesize, size_t *off)
+{
+	const char *sp;
 
-		if (r == -1)
-			return -1;
+	if (rulesize - *off < RULESEGSZ)
+		return -1;
 
-		if (match)
-			return 0;
+	sp = &rule[*off];
+	*list = sp[0];
+	aclseg->reqsigflags = sp[1];
+	aclseg->segsize = getu16(&sp[2]);
+	*off += RULESEGSZ;
 
-		if (a2id_generalize(remoteid) != 1)
-			break;
-	}
+	if (rulesize - *off < aclseg->segsize)
+		return -1;
 
-	/* default policy */
-	*list = 'G';
+	aclseg->seg = &rule[*off];
+	*off += aclseg->segsize;
 	return 0;
 }
 
 /*
- * Parse an ACL policy line consisting of a remote selector, a local id and an
- * ACL rule. The IDs and ACL rule are only parsed loosely and "line" must have
- * the following form:
- *
- *    policyline = *WSP remotesel 1*WSP localid 1*WSP aclrule
- *    remotesel  = 2*graph
- *    localid    = 3*graph
- *    aclrule    = 3*print
- *    graph      = %x21-7e
- *    print      = %x20-7e
+ * Write the ACL rule "rule" in text form to "dst". A compiled rule is written
+ * the same way as it was written in the policy, but with single spaces. A rule
+ * that is not compiled is copied. Up to "dstsize" - 1 characters are written
+ * and "dst" is nul terminated, unless "dstsize" is 0.
  *
- * Return 0 on success and set "remotesel", "localid" and "aclrule" to point to
- * the start of the respective part in "line". Sizes are updated accordingly and
- * "err" is set to NULL.
- * Return -1 on error. If there was a syntax error in "line" then "err" is set
- * to point to the first erroneous character in "line". If there was another
- * error then "err" is set to NULL and errno is set.
+ * Returns the length of the text, which is >= "dstsize" if "dst" contains a
+ * truncated copy, or -1 if "rule" is not a valid compiled rule.
  */
-int
-a2acl_parsepolicyline(const char **remotesel, size_t *remoteselsize,
-    const char **localid, size_t *localidsize, const char **aclrule,
-    size_t *aclrulesize, const char *line, size_t linesize, const char **err)
+ssize_t
+a2acl_ruletostr(char *dst, size_t dstsize, const char *rule, size_t rulesize)
 {
-	const size_t minrulelen = sizeof("@. a@b %B+") - 1;
-	size_t n;
-
-	*err = NULL;
-	n = 0;
-
-	if (remotesel == NULL || remoteselsize == NULL || localid == NULL ||
-	    localidsize == NULL || aclrule == NULL || aclrulesize == NULL ||
-	    line == NULL || linesize == 0 || err == NULL) {
-		errno = EINVAL;
-		return -1;
+	struct a2aclseg aclseg;
+	ssize_t nsegs;
+	size_t i, off;
+	int n, len;
+	char list, prevlist;
+
+	if (rulesize == 0 || rule[0] != RULEMAGIC) {
+		if (dstsize > 0) {
+			len = rulesize < dstsize ? rulesize : dstsize - 1;
+			memcpy(dst, rule, len);
+			dst[len] = '\0';
+		}
+		return rulesize;
 	}
 
-	if (linesize < minrulelen) {
-		*err = &line[0];
+	if ((nsegs = compiledsegs(rule, rulesize)) == -1)
 		return -1;
-	}
-
-	/*
-	 * Parse remote selector.
-	 */
 
-	while (n < linesize && isblank(line[n]))
-		n++;
-	if (n == linesize) {
-		*err = &line[n - 1];
-		return -1;
-	}
+	if (dstsize > 0)
+		dst[0] = '\0';
 
-	*remotesel = &line[n];
+	len = 0;
+	prevlist = '\0';
+	off = RULEHDRSZ;
+	for (i = 0; i < (size_t)nsegs; i++) {
+		if (compiledseg(&list, &aclseg, rule, rulesize, &off) == -1)
+			return -1;
 
-	while (n < linesize && isgraph(line[n]))
-		n++;
-	if (n == linesize) {
-		*err = &line[n - 1];
-		return -1;
-	}
+		if (list != prevlist)
+			n = snprintf(dst + len, (size_t)len < dstsize ?
+			    dstsize - len : 0, "%s%%%c +%.*s%s", len ? " " : "",
+			    list, (int)aclseg.segsize, aclseg.seg,
+			    aclseg.reqsigflags ? "+" : "");
+		else
+			n = snprintf(dst + len, (size_t)len < dstsize ?
+			    dstsize - len : 0, " +%.*s%s", (int)aclseg.segsize,
+			    aclseg.seg, aclseg.reqsigflags ? "+" : "");
+		if (n < 0)
+			return -1;
 
-	if (!isblank(line[n])) {
-		*err = &line[n];
-		return -1;
+		len += n;
+		prevlist = list;
 	}
 
-	*remoteselsize = &line[n] - *remotesel;
-	if (*remoteselsize < 2) {
-		*err = &line[n];
-		return -1;
-	}
+	return len;
+}
 
-	/*
-	 * Parse local id.
-	 */
+/*
+ * Determine if "localid" matches any of the segments of the compiled ACL rule
+ * "rule", see a2acl_compilerule. The options of "localid" are determined once
+ * for all segments.
+ *
+ * Returns 1 if "localid" matches, 0 if not and -1 if "rule" is invalid.
+ */
+static int
+compiledrulematch(char *list, const char *rule, size_t rulesize,
+    const a2id *localid)
+{
+	struct a2aclseg aclseg;
+	char idoptseg[A2ID_MAXLOCALPART_OPTIONSSZ];
+	size_t i, idoptsegsize, off;
+	ssize_t nsegs;
+	int hassig;
 
-	while (n < linesize && isblank(line[n]))
-		n++;
-	if (n == linesize) {
-		*err = &line[n - 1];
+	if ((nsegs = compiledsegs(rule, rulesize)) == -1)
 		return -1;
-	}
-
-	*localid = &line[n];
 
-	while (n < linesize && isgraph(line[n]))
-		n++;
-	if (n == linesize) {
-		*err = &line[n - 1];
-		return -1;
-	}
+	idoptsegsize = a2id_localpart_options(idoptseg, sizeof(idoptseg), NULL,
+	    localid);
+	hassig = a2id_hassignature(localid);
 
-	if (!isblank(line[n])) {
-		*err = &line[n];
-		return -1;
-	}
+	off = RULEHDRSZ;
+	for (i = 0; i < (size_t)nsegs; i++) {
+		if (compiledseg(list, &aclseg, rule, rulesize, &off) == -1)
+			return -1;
 
-	*localidsize = &line[n] - *localid;
-	if (*localidsize < 3) {
-		*err = &line[n];
-		return -1;
+		if (segmatch(idoptseg, idoptsegsize, hassig, &aclseg))
+			return 1;
 	}
 
-	/*
-	 * Parse ACL rule until end of line.
-	 */
+	return 0;
+}
 
-	while (n < linesize && isblank(line[n]))
-		n++;
-	if (n == linesize) {
-		*err = &line[n - 1];
-		return -1;
-	}
+/*
+ * Determine if "localid" matches any of the segments of "aclrule". If so,
+ * "list" is set to the list-character of the matching segment.
+ *
+ * "aclrule" is either compiled by a2acl_compilerule, as done on import, or in
+ * text form, in which case it is parsed.
+ *
+ * Returns 1 if "localid" matches, 0 if not and -1 on error.
+ */
+static int
+aclrulematch(char *list, const char *aclrule, size_t aclrulesize,
+    const a2id *localid)
+{
+	struct a2aclseg aclseg;
+	struct a2aclit it;
+	int match, r;
 
-	*aclrule = &line[n];
+	if (aclrule[0] == RULEMAGIC)
+		return compiledrulematch(list, aclrule, aclrulesize, localid);
 
-	while (n < linesize && isprint(line[n]))
-		n++;
+	initit(&it, aclrule, aclrulesize);
 
-	if (n != linesize) {
-		assert(n < linesize);
-		*err = &line[n];
-		return -1;
+	/* iterate over acl segments and see if there is a match */
+	match = 0;
+	while ((r = a2acl_nextsegment(list, &aclseg, &it)) == 1) {
+		if (a2acl_aclsegmatch(localid, &aclseg)) {
+			match = 1;
+			break;
+		}
 	}
 
-	*aclrulesize = (&line[n - 1] - *aclrule) + 1;
-	if (*aclrulesize < 3) {
-		*err = &line[n - 1];
+	if (r == -1)
 		return -1;
-	}
 
-	return 0;
+	return match;
 }
 
 /*
- * Import an ACL policy from a readable descriptor yielding ACL rules.
- *
- * Each line in the file must be of the format "remotesel localid aclrule".
- * Extraneous blanks are ignored.
+ * Look up the generalizations of "remoteid" for "localid", most specific first,
+ * until an ACL rule is found that matches "localid", see a2acl_whichlist. The
+ * generalizations are looked up in batches of up to NRKEYS keys with
+ * a2acl_viewaclrules, which continues after a rule that does not match.
  *
- * Returns the number of imported ACL rules on success or -1 on error with errno
- * set. If "errstr" is passed and -1 is returned a descriptive error is set in
- * "errstr", nul terminated and at most "errstrsize" bytes, including the
- * terminating nul.
+ * "gen" is set to the number of times "remoteid" is generalized to get the
+ * selector of the matching rule, or the most general selector if no rule
+ * matched.
  */
-ssize_t
-a2acl_fromdes(int d, char *errstr, size_t errstrsize)
+static int
+lookup(a2acl_ctx *ctx, char *list, const a2id *remoteid, const a2id *localid,
+    size_t *gen)
 {
-	const ssize_t minrulelen = sizeof("@. a@b %B+") - 1;
-	const char *remotesel, *localid, *aclrule, *err;
-	char *line;
-	ssize_t i, n;
-	size_t remoteselsize, localidsize, aclrulesize, s;
-	FILE *fp;
+	struct a2aclkey keys[NRKEYS];
+	a2id_gencursor cursor;
+	const char *aclrule;
+	char coreid[A2ID_MAXSZ], remotestr[NRKEYS][A2ID_MAXSZ];
+	size_t aclrulesize, coreidsz, first, idx, n, ngen, remotestrsz;
+	int r;
 
-	if (errstrsize)
-		errstr[0] = '\0';
+	coreidsz = a2id_coreform(coreid, sizeof(coreid), localid);
+	if (coreidsz >= sizeof(coreid))
+		return -1;
 
-	if ((fp = fdopen(d, "re")) == NULL)
-		return -1; /* errno set */
+	a2id_gencursor_init(&cursor, remoteid);
 
-	i = 0;
-	line = NULL;
+	/* generalizations before the current batch */
+	ngen = 0;
 
-	while ((n = getline(&line, &s, fp)) > 0) {
-		i++;
-		if (n < minrulelen) {
-			if (errstrsize)
-				snprintf(errstr, errstrsize, "illegal ACL rule "
-				    "at line %zu: %s", i, line);
-			errno = EINVAL;
-			free(line);
-			return -1;
+	do {
+		for (n = 0; n < NRKEYS; n++) {
+			remotestrsz = a2id_gencursor_next(remotestr[n],
+			    sizeof(remotestr[n]), &cursor);
+			if (remotestrsz == 0)
+				break;
+			if (remotestrsz >= sizeof(remotestr[n]))
+				return -1;
+
+			keys[n].remotesel = remotestr[n];
+			keys[n].remoteselsize = remotestrsz;
+			keys[n].localid = coreid;
+			keys[n].localidsize = coreidsz;
+		}
+
+		for (first = 0; first < n; first += idx + 1) {
+			if (a2acl_viewaclrules(ctx, &idx, &aclrule,
+			    &aclrulesize, &keys[first], n - first) == -1)
+				return -1;
+
+			if (idx == n - first)
+				break;
+
+			r = aclrulematch(list, aclrule, aclrulesize, localid);
+			if (r == -1)
+				return -1;
+
+			if (r == 1) {
+				*gen = ngen + first + idx;
+				return 0;
+			}
+		}
+
+		ngen += n;
+	} while (n == NRKEYS);
+
+	/* default policy */
+	*list = 'G';
+	*gen = ngen > 0 ? ngen - 1 : 0;
+	return 0;
+}
+
+/*
+ * Generalize "remoteid" until an ACL rule is found that matches "localid", see
+ * a2acl_whichlist.
+ */
+static int
+whichlist(a2acl_ctx *ctx, char *list, a2id *remoteid, const a2id *localid)
+{
+	size_t gen;
+
+	if (lookup(ctx, list, remoteid, localid, &gen) == -1)
+		return -1;
+
+	while (gen-- > 0)
+		a2id_generalize(remoteid);
+
+	return 0;
+}
+
+/*
+ * Determine if communication between "remoteid" and "localid" is whitelisted,
+ * greylisted, blacklisted or abandoned.
+ *
+ * The result is written to "list" in the form of the first letter of the list
+ * this pair is on which is one of: 'W', 'G', 'B', 'A'. If no policy is found it
+ * is set to 'G'.
+ *
+ * "remoteid" will be generalized until an ACL rule is found or until it equals
+ * the most general selector "@." which can not be further generalized.
+ *
+ * ACL rules are looked up in "ctx" and all lookups see the same version of the
+ * database. Several threads may call this function on the same "ctx" at the
+ * same time.
+ *
+ * Returns 0 on success and updates "*list" to point to the applicable list-
+ * character which is either a 'W', 'G', 'B', or 'A'. Returns -1 on error.
+ *
+ * ACL rules of an imported policy are checked and compiled on import, so they
+ * are matched without parsing. Returns -1 if an ACL rule that was stored in
+ * text form with a2acl_putaclrule is syntactically incorrect.
+ */
+int
+a2acl_whichlist(a2acl_ctx *ctx, char *list, a2id *remoteid,
+    const a2id *localid)
+{
+	int r;
+
+	if (a2acl_beginread(ctx) == -1)
+		return -1;
+
+	r = whichlist(ctx, list, remoteid, localid);
+
+	if (a2acl_endread(ctx) == -1)
+		return -1;
+
+	return r;
+}
+
+/*
+ * Same as a2acl_whichlist, but "remoteid" is not modified. Each generalization
+ * of "remoteid" is written to a buffer instead, so that the same "remoteid" can
+ * be used for many local ids without parsing or copying it each time.
+ */
+int
+a2acl_whichlist_const(a2acl_ctx *ctx, char *list, const a2id *remoteid,
+    const a2id *localid)
+{
+	size_t gen;
+	int r;
+
+	if (a2acl_beginread(ctx) == -1)
+		return -1;
+
+	r = lookup(ctx, list, remoteid, localid, &gen);
+
+	if (a2acl_endread(ctx) == -1)
+		return -1;
+
+	return r;
+}
+
+/*
+ * Mix the bits of "h" like the finalizer of splitmix64.
+ */
+static uint64_t
+mix64(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+/*
+ * Return the hash of the key "remotesel localid" of an ACL rule, for the Bloom
+ * filter of a database backend.
+ */
+uint64_t
+a2acl_keyhash(const char *remotesel, size_t remoteselsize,
+    const char *localid, size_t localidsize)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t h;
+	size_t i;
+
+	/* FNV-1a, keys are short */
+	h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < remoteselsize; i++)
+		h = (h ^ (unsigned char)remotesel[i]) * prime;
+	h = (h ^ ' ') * prime;
+	for (i = 0; i < localidsize; i++)
+		h = (h ^ (unsigned char)localid[i]) * prime;
+
+	return mix64(h);
+}
+
+/*
+ * Return the size in bytes of a Bloom filter for "nkeys" keys, or 0 if it would
+ * be too large.
+ *
+ * The filter is split in blocks of one cache line and all bits of a key are set
+ * in the same block, so that checking a key touches only one cache line. With
+ * ten bits per key about one in a hundred keys that are not in the filter is
+ * reported to be in it.
+ */
+size_t
+a2acl_bloomsize(size_t nkeys)
+{
+	size_t nblocks;
+
+	if (nkeys > SIZE_MAX / BLOOMBITS - BLOOMBLOCK * 8)
+		return 0;
+
+	nblocks = (nkeys * BLOOMBITS + BLOOMBLOCK * 8 - 1) / (BLOOMBLOCK * 8);
+	if (nblocks == 0)
+		nblocks = 1;
+
+	if (nblocks > UINT32_MAX || nblocks > SIZE_MAX / BLOOMBLOCK)
+		return 0;
+
+	return nblocks * BLOOMBLOCK;
+}
+
+/*
+ * Return the offset of the block of the key with hash "hash" in a Bloom filter
+ * of "filtersize" bytes.
+ */
+static size_t
+bloomblock(size_t filtersize, uint64_t hash)
+{
+	uint64_t nblocks;
+
+	nblocks = filtersize / BLOOMBLOCK;
+	return ((hash >> 32) * nblocks >> 32) * BLOOMBLOCK;
+}
+
+/*
+ * Add the key with hash "hash" to the Bloom filter "filter" of "filtersize"
+ * bytes, as returned by a2acl_bloomsize.
+ */
+void
+a2acl_bloomadd(uint8_t *filter, size_t filtersize, uint64_t hash)
+{
+	uint8_t *bp;
+	uint64_t x;
+	int i;
+
+	if (filtersize < BLOOMBLOCK)
+		return;
+
+	bp = &filter[bloomblock(filtersize, hash)];
+
+	/* nine bits per bit position in the block */
+	x = mix64(hash + 0x9e3779b97f4a7c15ULL);
+	for (i = 0; i < BLOOMK; i++, x >>= 9)
+		bp[(x & 511) >> 3] |= 1 << (x & 7);
+}
+
+/*
+ * Return 1 if the key with hash "hash" might be in the Bloom filter "filter" of
+ * "filtersize" bytes, 0 if it certainly is not.
+ */
+int
+a2acl_bloomhas(const uint8_t *filter, size_t filtersize, uint64_t hash)
+{
+	const uint8_t *bp;
+	uint64_t x;
+	int i;
+
+	/* not a filter, the key might be anywhere */
+	if (filtersize < BLOOMBLOCK)
+		return 1;
+
+	bp = &filter[bloomblock(filtersize, hash)];
+
+	x = mix64(hash + 0x9e3779b97f4a7c15ULL);
+	for (i = 0; i < BLOOMK; i++, x >>= 9)
+		if ((bp[(x & 511) >> 3] & 1 << (x & 7)) == 0)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Parse an ACL policy line consisting of a remote selector, a local id and an
+ * ACL rule. The IDs and ACL rule are only parsed loosely and "line" must have
+ * the following form:
+ *
+ *    policyline = *WSP remotesel 1*WSP localid 1*WSP aclrule
+ *    remotesel  = 2*graph
+ *    localid    = 3*graph
+ *    aclrule    = 3*print
+ *    graph      = %x21-7e
+ *    print      = %x20-7e
+ *
+ * Return 0 on success and set "remotesel", "localid" and "aclrule" to point to
+ * the start of the respective part in "line". Sizes are updated accordingly and
+ * "err" is set to NULL.
+ * Return -1 on error. If there was a syntax error in "line" then "err" is set
+ * to point to the first erroneous character in "line". If there was another
+ * error then "err" is set to NULL and errno is set.
+ */
+int
+a2acl_parsepolicyline(const char **remotesel, size_t *remoteselsize,
+    const char **localid, size_t *localidsize, const char **aclrule,
+    size_t *aclrulesize, const char *line, size_t linesize, const char **err)
+{
+	const size_t minrulelen = sizeof("@. a@b %B+") - 1;
+	size_t n;
+
+	*err = NULL;
+	n = 0;
+
+	if (remotesel == NULL || remoteselsize == NULL || localid == NULL ||
+	    localidsize == NULL || aclrule == NULL || aclrulesize == NULL ||
+	    line == NULL || linesize == 0 || err == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (linesize < minrulelen) {
+		*err = &line[0];
+		return -1;
+	}
+
+	/*
+	 * Parse remote selector.
+	 */
+
+	while (n < linesize && isblank(line[n]))
+		n++;
+	if (n == linesize) {
+		*err = &line[n - 1];
+		return -1;
+	}
+
+	*remotesel = &line[n];
+
+	while (n < linesize && isgraph(line[n]))
+		n++;
+	if (n == linesize) {
+		*err = &line[n - 1];
+		return -1;
+	}
+
+	if (!isblank(line[n])) {
+		*err = &line[n];
+		return -1;
+	}
+
+	*remoteselsize = &line[n] - *remotesel;
+	if (*remoteselsize < 2) {
+		*err = &line[n];
+		return -1;
+	}
+
+	/*
+	 * Parse local id.
+	 */
+
+	while (n < linesize && isblank(line[n]))
+		n++;
+	if (n == linesize) {
+		*err = &line[n - 1];
+		return -1;
+	}
+
+	*localid = &line[n];
+
+	while (n < linesize && isgraph(line[n]))
+		n++;
+	if (n == linesize) {
+		*err = &line[n - 1];
+		return -1;
+	}
+
+	if (!isblank(line[n])) {
+		*err = &line[n];
+		return -1;
+	}
+
+	*localidsize = &line[n] - *localid;
+	if (*localidsize < 3) {
+		*err = &line[n];
+		return -1;
+	}
+
+	/*
+	 * Parse ACL rule until end of line.
+	 */
+
+	while (n < linesize && isblank(line[n]))
+		n++;
+	if (n == linesize) {
+		*err = &line[n - 1];
+		return -1;
+	}
+
+	*aclrule = &line[n];
+
+	while (n < linesize && isprint(line[n]))
+		n++;
+
+	if (n != linesize) {
+		assert(n < linesize);
+		*err = &line[n];
+		return -1;
+	}
+
+	*aclrulesize = (&line[n - 1] - *aclrule) + 1;
+	if (*aclrulesize < 3) {
+		*err = &line[n - 1];
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read everything from descriptor "d" into a newly allocated buffer.
+ *
+ * Return 0 on success and set "buf" and "bufsize", "buf" must be free(3)d by
+ * the caller. Return -1 on error with errno set.
+ */
+static int
+readall(int d, char **buf, size_t *bufsize)
+{
+	char *nbuf;
+	size_t size, cap;
+	ssize_t n;
+
+	size = 0;
+	cap = 0;
+	*buf = NULL;
+
+	do {
+		if (cap - size < 4096) {
+			cap = cap ? cap * 2 : 65536;
+			if ((nbuf = realloc(*buf, cap)) == NULL) {
+				free(*buf);
+				return -1; /* errno set */
+			}
+			*buf = nbuf;
+		}
+
+		if ((n = read(d, *buf + size, cap - size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			free(*buf);
+			return -1; /* errno set */
+		}
+		size += n;
+	} while (n > 0);
+
+	*bufsize = size;
+	return 0;
+}
+
+/*
+ * A newline aligned part of a policy that is parsed by one thread.
+ *
+ * "err" is 0 if all lines are parsed, EINVAL if line "errline" (counting from
+ * 0 in this chunk) is invalid or another errno value if something else failed.
+ * "errpos" points to the first erroneous character of the line, or is NULL if
+ * the line is too short.
+ */
+struct parsechunk {
+	const char *start, *end;
+	struct a2aclrule *rules;
+	size_t nrules, cap;
+	int err;
+	size_t errline;
+	const char *errlinep, *errpos;
+	size_t errlinesize;
+};
+
+/*
+ * Parse all lines of a chunk, stop at the first error.
+ */
+static void *
+parsechunk(void *arg)
+{
+	const size_t minrulelen = sizeof("@. a@b %B+") - 1;
+	struct parsechunk *pc = arg;
+	struct a2aclrule *rules, *rp;
+	const char *line, *eol;
+	size_t n;
+
+	for (line = pc->start; line < pc->end; line = eol + 1) {
+		if ((eol = memchr(line, '\n', pc->end - line)) == NULL)
+			eol = pc->end;
+		n = eol - line;
+
+		if (pc->nrules == pc->cap) {
+			pc->cap = pc->cap ? pc->cap * 2 : 1024;
+			if (SIZE_MAX / sizeof(*rules) < pc->cap) {
+				pc->err = ENOMEM;
+				return NULL;
+			}
+			if ((rules = realloc(pc->rules,
+			    pc->cap * sizeof(*rules))) == NULL) {
+				pc->err = errno;
+				return NULL;
+			}
+			pc->rules = rules;
 		}
 
-		if (line[n - 1] == '\n') {
-			line[n - 1] = '\0';
-			n--;
+		rp = &pc->rules[pc->nrules];
+		pc->errpos = NULL;
+		if (n < minrulelen || a2acl_parsepolicyline(&rp->remotesel,
+		    &rp->remoteselsize, &rp->localid, &rp->localidsize,
+		    &rp->aclrule, &rp->aclrulesize, line, n,
+		    &pc->errpos) == -1) {
+			if (n >= minrulelen && pc->errpos == NULL) {
+				pc->err = errno;
+				return NULL;
+			}
+			pc->err = EINVAL;
+			pc->errline = pc->nrules;
+			pc->errlinep = line;
+			pc->errlinesize = n;
+			return NULL;
 		}
 
-		if (a2acl_parsepolicyline((const char **)&remotesel,
-		    &remoteselsize, (const char **)&localid, &localidsize,
-		    (const char **)&aclrule, &aclrulesize, line, n,
-		    (const char **)&err) == -1) {
-			if (err) {
-				if (errstrsize)
-					snprintf(errstr, errstrsize, "illegal "
-					    "ACL policy line at #%zu,%lu: %s",
-					    i, err - line, line);
-				errno = EINVAL;
-				free(line);
-				return -1;
-			} else {
-				free(line);
-				return -1; /* errno is set */
+		pc->nrules++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Parse all policy lines in "buf" and set "rules" to a newly allocated array
+ * of "nrules" rules that point into "buf", in the same order as the lines.
+ *
+ * "buf" is split into "nthreads" newline aligned chunks that are parsed at the
+ * same time. The results, including errors and their line numbers, do not
+ * depend on the number of threads.
+ *
+ * Return 0 on success, "rules" must be free(3)d by the caller. Return -1 on
+ * error with errno set. If the policy contains an invalid line, errno is set to
+ * EINVAL and a descriptive error is set in "errstr", nul terminated and at
+ * most "errstrsize" bytes, including the terminating nul.
+ */
+int
+a2acl_parsepolicy(struct a2aclrule **rules, size_t *nrules, const char *buf,
+    size_t bufsize, int nthreads, char *errstr, size_t errstrsize)
+{
+	struct parsechunk *chunks, *pc;
+	pthread_t *threads;
+	const char *cp, *end;
+	size_t i, lineno, n, total;
+	int *started, r;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	*rules = NULL;
+	*nrules = 0;
+
+	if ((chunks = calloc(nthreads, sizeof(*chunks))) == NULL)
+		return -1;
+	if ((threads = calloc(nthreads, sizeof(*threads))) == NULL) {
+		free(chunks);
+		return -1;
+	}
+	if ((started = calloc(nthreads, sizeof(*started))) == NULL) {
+		free(threads);
+		free(chunks);
+		return -1;
+	}
+
+	/* let every chunk end just after a newline */
+	end = buf + bufsize;
+	cp = buf;
+	for (i = 0; i < (size_t)nthreads; i++) {
+		chunks[i].start = cp;
+		if (i == (size_t)nthreads - 1) {
+			cp = end;
+		} else {
+			cp = buf + bufsize / nthreads * (i + 1);
+			if (cp < chunks[i].start)
+				cp = chunks[i].start;
+			if (cp > buf && cp < end && cp[-1] != '\n') {
+				if ((cp = memchr(cp, '\n', end - cp)) == NULL)
+					cp = end;
+				else
+					cp++;
 			}
 		}
+		chunks[i].end = cp;
+	}
+
+	/* parse the first chunk in this thread, or all if threads fail */
+	for (i = 1; i < (size_t)nthreads; i++)
+		if (pthread_create(&threads[i], NULL, parsechunk,
+		    &chunks[i]) == 0)
+			started[i] = 1;
+	parsechunk(&chunks[0]);
+	for (i = 1; i < (size_t)nthreads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			parsechunk(&chunks[i]);
+	}
 
-		if (a2acl_putaclrule(aclrule, aclrulesize, remotesel,
-		    remoteselsize, localid, localidsize) == -1) {
-			if (errstr && errstrsize)
-				snprintf(errstr, errstrsize, "failed to save "
-				    "ACL rule #%zu: %s", i, line);
+	/* report the first error in the policy */
+	r = 0;
+	lineno = 1;
+	total = 0;
+	for (i = 0; i < (size_t)nthreads; i++) {
+		pc = &chunks[i];
+		if (pc->err == EINVAL) {
+			lineno += pc->errline;
+			if (errstrsize && pc->errpos == NULL)
+				snprintf(errstr, errstrsize, "illegal ACL rule "
+				    "at line %zu: %.*s", lineno,
+				    (int)pc->errlinesize, pc->errlinep);
+			else if (errstrsize)
+				snprintf(errstr, errstrsize, "illegal ACL "
+				    "policy line at #%zu,%lu: %.*s", lineno,
+				    pc->errpos - pc->errlinep,
+				    (int)pc->errlinesize, pc->errlinep);
 			errno = EINVAL;
-			free(line);
-			return -1;
+			r = -1;
+			break;
+		} else if (pc->err) {
+			errno = pc->err;
+			r = -1;
+			break;
+		}
+		lineno += pc->nrules;
+		total += pc->nrules;
+	}
+
+	/* merge the rules of all chunks in order */
+	if (r == 0 && total > 0) {
+		if (nthreads == 1) {
+			*rules = chunks[0].rules;
+			chunks[0].rules = NULL;
+		} else if ((*rules = malloc(total * sizeof(**rules))) == NULL) {
+			r = -1;
+		} else {
+			for (i = 0, n = 0; i < (size_t)nthreads; i++) {
+				if (chunks[i].nrules == 0)
+					continue;
+				memcpy(*rules + n, chunks[i].rules,
+				    chunks[i].nrules * sizeof(**rules));
+				n += chunks[i].nrules;
+			}
 		}
+		if (r == 0)
+			*nrules = total;
 	}
 
-	free(line);
-	if (ferror(fp)) {
-		fprintf(stderr, "%s: error while reading ACL file\n", __func__);
-		exit(1);
+	for (i = 0; i < (size_t)nthreads; i++)
+		free(chunks[i].rules);
+	free(started);
+	free(threads);
+	free(chunks);
+
+	return r;
+}
+
+/*
+ * Return the number of threads to parse a policy of "size" bytes with. Small
+ * policies are parsed in the calling thread.
+ */
+static int
+parsethreads(size_t size)
+{
+	long ncpu;
+	size_t n;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+
+	n = size / PARSECHUNKMIN;
+	if (n > (size_t)ncpu)
+		n = ncpu;
+	if (n > MAXPARSETHREADS)
+		n = MAXPARSETHREADS;
+	if (n < 1)
+		n = 1;
+
+	return n;
+}
+
+/*
+ * Load the ACL policy from descriptor "d" into "buf". If "d" refers to a
+ * regular file it is mapped into memory and "mapped" is set, otherwise it is
+ * read into an allocated buffer. Release with unloadpolicy.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+static int
+loadpolicy(int d, char **buf, size_t *bufsize, int *mapped)
+{
+	struct stat st;
+
+	*mapped = 0;
+	if (fstat(d, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (uintmax_t)st.st_size <= SIZE_MAX) {
+		*bufsize = st.st_size;
+		*buf = mmap(NULL, *bufsize, PROT_READ, MAP_PRIVATE, d, 0);
+		if (*buf != MAP_FAILED) {
+			*mapped = 1;
+			return 0;
+		}
 	}
 
-	return i;
+	return readall(d, buf, bufsize);
+}
+
+static void
+unloadpolicy(char *buf, size_t bufsize, int mapped)
+{
+	if (mapped)
+		munmap(buf, bufsize);
+	else
+		free(buf);
 }
 
 /*
- * Check if "subject" is newer than "reference" when looking at the last
- * modification times.
+ * Compile the ACL rules of all "nrules" rules in "rules", see
+ * a2acl_compilerule, and let the rules point to their compiled form in
+ * "compiled". "compiled" must be freed by the caller on success.
  *
- * Return 1 if "subject" is newer than "reference" or if "reference" does not
- * exist. Return 0 if subject is older or equal to "reference". Return -1 if an
- * error occurred with errno set (i.e. subject does not exist).
+ * Returns 0 on success, -1 on error with "failed" set to the index of the rule
+ * that is invalid, or to "nrules" if there is another error.
  */
-int
-a2acl_isnewer(const char *subject, const char *reference)
+static int
+compilerules(char **compiled, struct a2aclrule *rules, size_t nrules,
+    size_t *failed)
+{
+	struct a2aclrule *rp;
+	size_t i, size;
+	ssize_t r;
+	char *cp;
+
+	*failed = nrules;
+
+	/* room for the largest possible compiled rules, so one pass is enough */
+	size = 1;
+	for (i = 0; i < nrules; i++) {
+		if ((SIZE_MAX - size - RULEHDRSZ) / 3 <= rules[i].aclrulesize)
+			return -1;
+		size += 3 * rules[i].aclrulesize + RULEHDRSZ;
+	}
+
+	if ((*compiled = malloc(size)) == NULL)
+		return -1;
+
+	cp = *compiled;
+	for (i = 0; i < nrules; i++) {
+		rp = &rules[i];
+		r = a2acl_compilerule(cp, size, rp->aclrule, rp->aclrulesize);
+		if (r == -1 || (size_t)r > size) {
+			free(*compiled);
+			*failed = r == -1 ? i : nrules;
+			return -1;
+		}
+		rp->aclrule = cp;
+		rp->aclrulesize = r;
+		cp += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the line in the policy "buf" that "p" points into. Set "line" and
+ * "linesize" to the line, without the newline.
+ *
+ * Returns the line number, starting at 1.
+ */
+static size_t
+findline(const char **line, size_t *linesize, const char *buf,
+    size_t bufsize, const char *p)
+{
+	const char *cp, *eol;
+	size_t lineno;
+
+	lineno = 1;
+	for (cp = buf; cp < p; cp++)
+		if (*cp == '\n')
+			lineno++;
+
+	while (p > buf && p[-1] != '\n')
+		p--;
+	if ((eol = memchr(p, '\n', buf + bufsize - p)) == NULL)
+		eol = buf + bufsize;
+
+	*line = p;
+	*linesize = eol - p;
+	return lineno;
+}
+
+/*
+ * Parse the ACL policy in "buf" and either store all rules with
+ * a2acl_putaclrules or, if "sync" is set, make the database match the policy
+ * with a2acl_syncaclrules.
+ *
+ * Large policies are parsed by several threads, see a2acl_parsepolicy. All
+ * lines are parsed and all ACL rules are compiled, see a2acl_compilerule,
+ * before anything is stored, so that an invalid ACL rule is never stored.
+ *
+ * Returns the number of stored rules, or if "sync" is set the number of
+ * changed rules, on success. Returns -1 on error with errno set and a
+ * descriptive error in "errstr".
+ */
+static ssize_t
+importbuf(a2acl_ctx *ctx, const char *buf, size_t bufsize, int sync,
+    char *errstr, size_t errstrsize)
 {
-	struct stat rst, sst;
-	int r, refd, subd;
+	struct a2aclrule *rules;
+	const char *line;
+	char *compiled;
+	size_t nrules, changed, failed, lineno, linesize;
+	int saved;
+
+	if (errstrsize)
+		errstr[0] = '\0';
 
-	if (subject == NULL || reference == NULL)
+	if (a2acl_parsepolicy(&rules, &nrules, buf, bufsize,
+	    parsethreads(bufsize), errstr, errstrsize) == -1)
+		return -1; /* errno set */
+
+	if (compilerules(&compiled, rules, nrules, &failed) == -1) {
+		if (errstrsize && failed < nrules) {
+			lineno = findline(&line, &linesize, buf, bufsize,
+			    rules[failed].remotesel);
+			snprintf(errstr, errstrsize, "illegal ACL rule at line "
+			    "%zu: %.*s", lineno, (int)linesize, line);
+		} else if (errstrsize) {
+			snprintf(errstr, errstrsize, "failed to compile ACL "
+			    "rules");
+		}
+		free(rules);
+		errno = EINVAL;
 		return -1;
+	}
+
+	if (sync) {
+		saved = a2acl_syncaclrules(ctx, rules, nrules, &changed,
+		    &failed);
+	} else {
+		changed = nrules;
+		saved = 0;
+		if (nrules > 0)
+			saved = a2acl_putaclrules(ctx, rules, nrules, &failed);
+	}
 
-	if ((subd = open(subject, O_RDONLY|O_CLOEXEC)) == -1)
+	if (saved == -1) {
+		if (errstrsize && failed < nrules) {
+			findline(&line, &linesize, buf, bufsize,
+			    rules[failed].remotesel);
+			snprintf(errstr, errstrsize, "failed to save ACL rule "
+			    "#%zu: %.*s", failed + 1, (int)linesize, line);
+		} else if (errstrsize) {
+			snprintf(errstr, errstrsize, "failed to save ACL "
+			    "rules");
+		}
+		free(compiled);
+		free(rules);
+		errno = EINVAL;
 		return -1;
+	}
 
-	if ((refd = open(reference, O_RDONLY|O_CLOEXEC)) == -1)
-		return 1;
+	free(compiled);
+	free(rules);
+	return changed;
+}
 
-	r = 0;
+/*
+ * Read the ACL policy from descriptor "d" and import it with importbuf.
+ */
+static ssize_t
+importdes(a2acl_ctx *ctx, int d, int sync, char *errstr, size_t errstrsize)
+{
+	char *buf;
+	size_t bufsize;
+	ssize_t r;
+	int e, mapped;
 
-	/* compare mtimes */
-	if (fstat(refd, &rst) == -1)
-		goto out; /* errno set */
+	if (errstrsize)
+		errstr[0] = '\0';
 
-	if (fstat(subd, &sst) == -1)
-		goto out; /* errno set */
+	if (loadpolicy(d, &buf, &bufsize, &mapped) == -1)
+		return -1; /* errno set */
 
-	if (rst.st_mtime < sst.st_mtime)
-		r = 1;
+	r = importbuf(ctx, buf, bufsize, sync, errstr, errstrsize);
 
-out:
-	close(refd);
-	close(subd);
+	e = errno;
+	unloadpolicy(buf, bufsize, mapped);
+	errno = e;
+	return r;
+}
+
+/*
+ * Import an ACL policy from a readable descriptor yielding ACL rules into
+ * "ctx".
+ *
+ * Each line in the file must be of the format "remotesel localid aclrule".
+ * Extraneous blanks are ignored.
+ *
+ * All rules are stored at once with a2acl_putaclrules so that the backend can
+ * load them efficiently.
+ *
+ * Returns the number of imported ACL rules on success or -1 on error with errno
+ * set. If "errstr" is passed and -1 is returned a descriptive error is set in
+ * "errstr", nul terminated and at most "errstrsize" bytes, including the
+ * terminating nul.
+ */
+ssize_t
+a2acl_fromdes(a2acl_ctx *ctx, int d, char *errstr, size_t errstrsize)
+{
+	return importdes(ctx, d, 0, errstr, errstrsize);
+}
+
+/*
+ * Update "ctx" to the ACL policy read from descriptor "d", which is in the same
+ * format as for a2acl_fromdes. Only the rules that were added, changed or
+ * removed since the database was last imported are written, in one update
+ * with a2acl_syncaclrules. If there is an error the database is left as it
+ * was.
+ *
+ * Returns the number of added, changed and removed ACL rules on success or -1
+ * on error with errno set. If "errstr" is passed and -1 is returned a
+ * descriptive error is set in "errstr", nul terminated and at most
+ * "errstrsize" bytes, including the terminating nul.
+ */
+ssize_t
+a2acl_syncdes(a2acl_ctx *ctx, int d, char *errstr, size_t errstrsize)
+{
+	return importdes(ctx, d, 1, errstr, errstrsize);
+}
+
+/*
+ * Fingerprint of a policy file, stored in the metadata record of its database
+ * cache. If "mtime" and "mtimensec" are 0 the stat(2) information can't be
+ * trusted and the contents of the policy must be compared.
+ */
+struct fingerprint {
+	uint64_t hash;
+	uint64_t size;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime;
+	int64_t mtimensec;
+	uint32_t version;
+	uint32_t unused;
+};
+
+/*
+ * Version 2 caches have a Bloom filter, version 3 caches have compiled ACL
+ * rules. Older caches are updated once.
+ */
+#define FPVERSION 3
+
+/*
+ * Return a 64-bit hash of "buf". It is not cryptographic, but fast and good
+ * enough to notice that a policy changed. It does eight bytes per step and
+ * mixes the result like splitmix64.
+ */
+static uint64_t
+hashbuf(const char *buf, size_t bufsize)
+{
+	const uint64_t k1 = 0x9e3779b97f4a7c15ULL, k2 = 0xbf58476d1ce4e5b9ULL;
+	uint64_t h, w;
+	size_t i;
+
+	h = bufsize * k1;
+	for (i = 0; bufsize - i >= sizeof(w); i += sizeof(w)) {
+		memcpy(&w, &buf[i], sizeof(w));
+		h ^= w * k2;
+		h = ((h << 31) | (h >> 33)) * k1;
+	}
+
+	w = 0;
+	memcpy(&w, &buf[i], bufsize - i);
+	h ^= w * k2;
+	h = ((h << 31) | (h >> 33)) * k1;
+
+	return mix64(h);
+}
+
+/*
+ * Set the stat(2) information of the policy open at "d" in "fp", without a
+ * hash.
+ *
+ * A file that is modified in the same second as it is looked at might be
+ * modified again without a change of its modification time, so then the
+ * modification time is not used.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+static int
+statpolicy(int d, struct fingerprint *fp)
+{
+	struct stat st;
+	time_t now;
+
+	now = time(NULL);
+	if (fstat(d, &st) == -1)
+		return -1; /* errno set */
+
+	memset(fp, 0, sizeof(*fp));
+	fp->version = FPVERSION;
+	fp->size = st.st_size;
+	fp->dev = st.st_dev;
+	fp->ino = st.st_ino;
+	if (st.st_mtime < now) {
+		fp->mtime = st.st_mtim.tv_sec;
+		fp->mtimensec = st.st_mtim.tv_nsec;
+	}
+
+	return 0;
+}
+
+/*
+ * Set the hash of the policy in "buf" in "fp". If the size of the policy
+ * changed since statpolicy the stat(2) information is not used.
+ */
+static void
+hashpolicy(struct fingerprint *fp, const char *buf, size_t bufsize)
+{
+	if (fp->size != bufsize) {
+		fp->size = bufsize;
+		fp->mtime = fp->mtimensec = 0;
+	}
+
+	fp->hash = hashbuf(buf, bufsize);
+}
+
+/*
+ * Read the fingerprint of the policy in "ctx" in "fp". If there is none, or if
+ * it is of another version, "fp" is zeroed.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+getfingerprint(a2acl_ctx *ctx, struct fingerprint *fp)
+{
+	size_t size;
+
+	size = sizeof(*fp);
+	if (a2acl_getmeta(ctx, fp, &size) == -1)
+		return -1;
+
+	if (size != sizeof(*fp) || fp->version != FPVERSION)
+		memset(fp, 0, sizeof(*fp));
+
+	return 0;
+}
+
+/*
+ * Return 1 if the stat(2) information in "a" and "b" shows that the policy
+ * file did not change, 0 otherwise.
+ */
+static int
+samestat(const struct fingerprint *a, const struct fingerprint *b)
+{
+	if (a->version != FPVERSION || b->version != FPVERSION)
+		return 0;
+
+	if (a->mtime == 0 && a->mtimensec == 0)
+		return 0;
+
+	return a->size == b->size && a->dev == b->dev && a->ino == b->ino &&
+	    a->mtime == b->mtime && a->mtimensec == b->mtimensec;
+}
+
+/*
+ * Return 1 if "a" and "b" are of policies with the same contents, 0 otherwise.
+ */
+static int
+samecontents(const struct fingerprint *a, const struct fingerprint *b)
+{
+	if (a->version != FPVERSION || b->version != FPVERSION)
+		return 0;
+
+	return a->size == b->size && a->hash == b->hash;
+}
+
+/*
+ * Build a new database cache at "dbcache" from the ACL policy in "buf", with
+ * fingerprint "fp". The rules and the fingerprint are stored in a new database
+ * that is only installed at "dbcache" when all of them are stored, see
+ * a2acl_dbcreate.
+ *
+ * Returns the number of imported ACL rules on success with "ctx" set to the
+ * installed database. Returns -1 on error with errno set, to EEXIST if another
+ * database was installed at "dbcache" first.
+ */
+static ssize_t
+buildcache(a2acl_ctx **ctx, const char *dbcache, const char *buf,
+    size_t bufsize, const struct fingerprint *fp, char *errstr,
+    size_t errstrsize)
+{
+	ssize_t r;
+	int e;
+
+	if (a2acl_dbcreate(ctx, dbcache) == -1) {
+		if (errstrsize)
+			snprintf(errstr, errstrsize, "error creating database,"
+			    " param: %s\n", dbcache);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((r = importbuf(*ctx, buf, bufsize, 0, errstr, errstrsize)) < 0) {
+		a2acl_dbclose(*ctx);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (a2acl_putmeta(*ctx, fp, sizeof(*fp)) == -1) {
+		a2acl_dbclose(*ctx);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (a2acl_dbinstall(*ctx) == -1) {
+		e = errno;
+		a2acl_dbclose(*ctx);
+		errno = e;
+		return -1;
+	}
 
 	return r;
 }
@@ -650,9 +1738,18 @@ out:
 /*
  * Import an ACL policy from a text file specified by "filename" into an
  * internal database cache. If a database cache file does not exist, it is
- * created and if the cache is stale it is automatically recreated. The
- * currently supported database backends are "dbm" and "dblmdb" of which the
- * first is a simple memory based key-value store, and the latter is using LMDB.
+ * built in private and installed when complete. Otherwise the fingerprint of
+ * the policy that is stored in the cache is compared with the policy file: if
+ * the size, inode and modification time of the file are the same the cache is
+ * used as is, else the contents are hashed and if they are different the cache
+ * is updated. Only the rules that were added, changed or removed since the
+ * cache was last updated are written, see a2acl_syncdes, so that other
+ * processes using the cache keep seeing the previous policy until the update
+ * is complete and see the new policy with their next lookup. The currently
+ * supported database backends are "dbm", "dblmdb" and "dbmph". The first is a
+ * simple memory based key-value store, the second is using LMDB and the last
+ * maps an immutable image with a minimal perfect hash, see
+ * doc/design/a2aclimage.txt.
  *
  * Each line in "filename" must consist of exactly one ACL rule, which is a
  * triplet of the form: <remote selector, local ID, ACL segments>
@@ -663,21 +1760,27 @@ out:
  *
  * If "totrules" is not NULL, it will be updated with the total number of rules
  * in the database. If "updrules" is not NULL it will be updated with the number
- * of newly imported rules by this call.
+ * of rules that were added, changed or removed by this call.
  *
  * If there is an error and "errstr" is not NULL, then "errstr" is updated with
  * a descriptive error of at most "errstrsize" bytes, including the terminating
  * nul.
  *
+ * On success "ctx" is set to the opened database, which must be closed with
+ * a2acl_dbclose when done.
+ *
  * Returns 0 on success or -1 on error with errno set.
  */
 int
-a2acl_fromfile(const char *filename, size_t *totrules, size_t *updrules,
-    char *errstr, size_t errstrsize)
+a2acl_fromfile(a2acl_ctx **ctx, const char *filename, size_t *totrules,
+    size_t *updrules, char *errstr, size_t errstrsize)
 {
-	char dbcache[104];
-	size_t s;
-	int fd, r, recreate;
+	struct fingerprint fp, oldfp;
+	struct stat st;
+	char dbcache[104], *buf;
+	size_t bufsize, s;
+	ssize_t r;
+	int e, fd, mapped, ret;
 
 	if (errstrsize)
 		errstr[0] = '\0';
@@ -700,53 +1803,103 @@ a2acl_fromfile(const char *filename, size_t *totrules, size_t *updrules,
 		return -1;
 	}
 
-	/* remove stale db caches before opening/creating */
-        recreate = a2acl_isnewer(filename, dbcache);
-        if (recreate == -1)
-		return -1;
+	if (updrules)
+		*updrules = 0;
 
-        if (recreate != 0)
-		if (unlink(dbcache) == -1 && errno != ENOENT)
-			return -1; /* errno set */
+	if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) == -1)
+		return -1; /* errno set */
+
+	ret = -1;
+	buf = NULL;
+	bufsize = 0;
+	mapped = 0;
+
+	if (statpolicy(fd, &fp) == -1)
+		goto out; /* errno set */
 
-	if (a2acl_dbopen(dbcache) == -1) {
+	/*
+	 * A missing cache is built in private and only installed once it is
+	 * complete, so that no other process ever sees a partial cache. If
+	 * another process installed a cache in the meantime, use that one.
+	 */
+	if (stat(dbcache, &st) == -1 && errno == ENOENT) {
+		if (loadpolicy(fd, &buf, &bufsize, &mapped) == -1)
+			goto out; /* errno set */
+		hashpolicy(&fp, buf, bufsize);
+
+		if ((r = buildcache(ctx, dbcache, buf, bufsize, &fp, errstr,
+		    errstrsize)) >= 0) {
+			if (updrules)
+				*updrules = r;
+			goto count;
+		}
+		if (errno != EEXIST)
+			goto out; /* errno set */
+	}
+
+	if (a2acl_dbopen(ctx, dbcache) == -1) {
 		if (errstrsize)
 			snprintf(errstr, errstrsize, "error opening database,"
 			    " param: %s\n", dbcache);
 		errno = EINVAL;
-		return -1;
+		goto out;
 	}
 
-	if (updrules)
-		*updrules = 0;
+	if (getfingerprint(*ctx, &oldfp) == -1) {
+		errno = EINVAL;
+		goto closeout;
+	}
 
-        if (recreate) {
-		if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) == -1) {
-			a2acl_dbclose();
-			return -1; /* errno set */
-		}
+	/* the policy file was not touched since the cache was updated */
+	if (samestat(&oldfp, &fp))
+		goto count;
 
-		if ((r = a2acl_fromdes(fd, errstr, errstrsize)) < 0) {
-			a2acl_dbclose();
-			close(fd);
+	if (buf == NULL) {
+		if (loadpolicy(fd, &buf, &bufsize, &mapped) == -1)
+			goto closeout; /* errno set */
+		hashpolicy(&fp, buf, bufsize);
+	}
+
+	/*
+	 * Update an existing cache in place, in one transaction. If updating
+	 * fails the cache is left as it was, so the next call tries again.
+	 */
+	if (!samecontents(&oldfp, &fp)) {
+		if ((r = importbuf(*ctx, buf, bufsize, 1, errstr,
+		    errstrsize)) < 0) {
 			errno = EINVAL;
-			unlink(dbcache);
-			return -1;
+			goto closeout;
 		}
-
-		close(fd);
 		if (updrules)
 			*updrules = r;
 	}
 
+	/* remember the file, also if only its stat(2) information changed */
+	if (a2acl_putmeta(*ctx, &fp, sizeof(fp)) == -1) {
+		errno = EINVAL;
+		goto closeout;
+	}
 
+count:
 	if (totrules) {
-		if (a2acl_count(totrules) == -1) {
+		if (a2acl_count(*ctx, totrules) == -1) {
 			errno = EINVAL;
-			unlink(dbcache);
-			return -1;
+			goto closeout;
 		}
 	}
 
-	return 0;
+	ret = 0;
+	goto out;
+
+closeout:
+	e = errno;
+	a2acl_dbclose(*ctx);
+	errno = e;
+out:
+	e = errno;
+	if (buf != NULL)
+		unloadpolicy(buf, bufsize, mapped);
+	close(fd);
+	errno = e;
+	return ret;
 }
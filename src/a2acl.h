@@ -19,25 +19,91 @@
 
 #include <sys/types.h>
 
+#include <stdint.h>
+
 #include "a2id.h"
 
 #define A2ACL_MAXLEN 500
 
-int a2acl_whichlist(char *, a2id *, const a2id *);
-int a2acl_fromfile(const char *, size_t *, size_t *, char *, size_t);
+/*
+ * An open ACL database. The structure is defined by the database backend.
+ */
+typedef struct a2acl_ctx a2acl_ctx;
+
+int a2acl_whichlist(a2acl_ctx *, char *, a2id *, const a2id *);
+int a2acl_whichlist_const(a2acl_ctx *, char *, const a2id *, const a2id *);
+int a2acl_fromfile(a2acl_ctx **, const char *, size_t *, size_t *, char *,
+    size_t);
+
+/*
+ * Lookup statistics of a database, see a2acl_stats.
+ */
+struct a2aclstats {
+	size_t probes;		/* lookups of a remote selector and local ID */
+	size_t skipped;		/* lookups answered by the filter alone */
+	size_t falsepos;	/* lookups let through that found no rule */
+	double fprate;		/* falsepos / (skipped + falsepos) */
+};
 
 /*
- * When implementing a new database backend like "dbm" and "dblmdb", the
- * following five functions must be implemented:
- *    a2acl_dbopen: Initialize a database backend.
+ * One ACL rule with the remote selector and local ID it applies to.
+ */
+struct a2aclrule {
+	const char *aclrule;
+	size_t aclrulesize;
+	const char *remotesel;
+	size_t remoteselsize;
+	const char *localid;
+	size_t localidsize;
+};
+
+/*
+ * A remote selector and local ID to look up, see a2acl_viewaclrules.
+ */
+struct a2aclkey {
+	const char *remotesel;
+	size_t remoteselsize;
+	const char *localid;
+	size_t localidsize;
+};
+
+/*
+ * When implementing a new database backend like "dbm", "dblmdb" and "dbmph",
+ * the following sixteen functions must be implemented:
+ *    a2acl_dbopen: Initialize a database backend and allocate a new context
+ *	in "ctx".
+ *
+ *    a2acl_dbcreate: Create a new and empty database that will be available
+ *	at "path" once it is installed with a2acl_dbinstall, and allocate a new
+ *	context in "ctx". Until then no other process may see the database.
+ *
+ *    a2acl_dbinstall: Make a database that was created with a2acl_dbcreate
+ *	available at its path, at once. Must fail with errno set to EEXIST if
+ *	there already is a database at the path, and must never replace it.
+ *	"ctx" must stay usable.
  *
- *    a2acl_dbclose: Close a database backend.
+ *    a2acl_dbclose: Close a database backend and free "ctx". A database that
+ *	was created but not installed is removed.
  *
  *    a2acl_count: Update "count" to the total number of rules in the database.
  *
  *    a2acl_putaclrule: Store a communication ACL rule given a remote and local
  * 	ID. A copy of "aclrule", "remotesel" and "localid" must be made since
  *	these are being free(3)d after this functions returns.
+ *	"aclrule" is either in text form or compiled, see a2acl_ruletostr, and
+ *	must be stored as is. A compiled rule may contain nul bytes.
+ *
+ *    a2acl_putaclrules: Store "nrules" ACL rules at once, as if
+ *	a2acl_putaclrule was called for each of them. If storing fails,
+ *	"failed" is set to the index of the offending rule, or to "nrules" if
+ *	the error is not caused by a specific rule.
+ *
+ *    a2acl_syncaclrules: Make the database contain exactly the "nrules" ACL
+ *	rules, by storing new rules, replacing rules of which the ACL changed
+ *	and removing rules that are not in "rules". Rules that did not change
+ *	should not be rewritten. On success "changed" is set to the number of
+ *	stored, replaced and removed rules. On failure the database must be
+ *	left as it was and "failed" is set like a2acl_putaclrules does.
  *
  *    a2acl_getaclrule: Search for a communication ACL rule based on a remote
  *	selector and local ID. "aclrule" must be allocated by the caller.
@@ -45,17 +111,88 @@ int a2acl_fromfile(const char *, size_t *, size_t *, char *, size_t);
  *	then "aclrule" is left untouched, "aclrulesize" is set to 0 and 0 is
  *	returned.
  *
- * All five functions must return 0 on success, and -1 on failure.
+ *    a2acl_viewaclrule: Same as a2acl_getaclrule but instead of copying the
+ *	ACL rule, "aclrule" is set to point to it. Only called within a read,
+ *	see a2acl_beginread, and "aclrule" must stay valid until the read ends.
+ *
+ *    a2acl_viewaclrules: Look up the "nkeys" keys in "keys", which are in
+ *	most specific first order, and stop at the first key that has an ACL
+ *	rule. "idx" is set to its index and "aclrule" and "aclrulesize" are set
+ *	like a2acl_viewaclrule does. If none of the keys has an ACL rule "idx"
+ *	is set to "nkeys". Each key counts as one lookup in the statistics.
+ *	a2acl_whichlist looks up all generalizations of a remote ID with this
+ *	function, so that a backend can do so in one round trip. A backend that
+ *	can't do better may call a2acl_viewaclrule for each key.
+ *
+ *    a2acl_getmeta: Copy the metadata record of the database into "meta", which
+ *	is "metasize" bytes. "metasize" is a value/result parameter. If there
+ *	is no metadata record "metasize" is set to 0. The metadata record is
+ *	not an ACL rule and must not be counted by a2acl_count.
+ *
+ *    a2acl_putmeta: Replace the metadata record of the database with the
+ *	"metasize" bytes in "meta".
+ *
+ *    a2acl_beginread: Begin a read in the calling thread. All calls to
+ *	a2acl_getaclrule by this thread until the matching a2acl_endread must
+ *	see the same version of the database. Reads may be nested.
+ *
+ *    a2acl_endread: End a read that was started with a2acl_beginread.
+ *
+ *    a2acl_stats: Update "stats" with the lookup statistics of all threads
+ *	since the database was opened. A backend should keep a Bloom filter of
+ *	all keys, see a2acl_bloomsize, and check it before each lookup. Lookups
+ *	that the filter answers are counted in "skipped", lookups that the
+ *	filter lets through but that find no rule in "falsepos".
+ *
+ * All sixteen functions must return 0 on success, and -1 on failure.
+ *
+ * All state must be kept in the context, so that more than one database can be
+ * open at the same time. a2acl_getaclrule must be safe to call from several
+ * threads at the same time on the same context. The other functions are never
+ * called concurrently with any other function on the same context.
  */
 
-int a2acl_dbopen(const char *path);
-int a2acl_dbclose(void);
-int a2acl_count(size_t *count);
-int a2acl_putaclrule(const char *aclrule, size_t aclrulesize,
+int a2acl_dbopen(a2acl_ctx **ctx, const char *path);
+int a2acl_dbcreate(a2acl_ctx **ctx, const char *path);
+int a2acl_dbinstall(a2acl_ctx *ctx);
+int a2acl_dbclose(a2acl_ctx *ctx);
+int a2acl_count(a2acl_ctx *ctx, size_t *count);
+int a2acl_putaclrule(a2acl_ctx *ctx, const char *aclrule, size_t aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize);
+int a2acl_putaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *failed);
+int a2acl_syncaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *changed, size_t *failed);
+int a2acl_getaclrule(a2acl_ctx *ctx, char *aclrule, size_t *aclrulesize,
     const char *remotesel, size_t remoteselsize, const char *localid,
     size_t localidsize);
-int a2acl_getaclrule(char *aclrule, size_t *aclrulesize, const char *remotesel,
-    size_t remoteselsize, const char *localid, size_t localidsize);
+int a2acl_viewaclrule(a2acl_ctx *ctx, const char **aclrule,
+    size_t *aclrulesize, const char *remotesel, size_t remoteselsize,
+    const char *localid, size_t localidsize);
+int a2acl_viewaclrules(a2acl_ctx *ctx, size_t *idx, const char **aclrule,
+    size_t *aclrulesize, const struct a2aclkey *keys, size_t nkeys);
+int a2acl_getmeta(a2acl_ctx *ctx, void *meta, size_t *metasize);
+int a2acl_putmeta(a2acl_ctx *ctx, const void *meta, size_t metasize);
+int a2acl_beginread(a2acl_ctx *ctx);
+int a2acl_endread(a2acl_ctx *ctx);
+int a2acl_stats(a2acl_ctx *ctx, struct a2aclstats *stats);
+
+/*
+ * Bloom filter helpers for database backends. A filter of a2acl_bloomsize
+ * bytes must be zeroed before keys are added.
+ */
+uint64_t a2acl_keyhash(const char *remotesel, size_t remoteselsize,
+    const char *localid, size_t localidsize);
+size_t a2acl_bloomsize(size_t nkeys);
+void a2acl_bloomadd(uint8_t *filter, size_t filtersize, uint64_t hash);
+int a2acl_bloomhas(const uint8_t *filter, size_t filtersize, uint64_t hash);
+
+/*
+ * Text form of an ACL rule as stored in a database, which might be compiled.
+ */
+ssize_t a2acl_ruletostr(char *dst, size_t dstsize, const char *rule,
+    size_t rulesize);
 
 /*
  * What follows are private structures only made public for internal testing.
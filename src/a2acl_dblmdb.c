@@ -14,19 +14,104 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/stat.h>
+
+#include <errno.h>
 #include <limits.h>
 #include <lmdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "a2acl.h"
+
+#define BULKCHUNK 100000
 
 /*
  * LMDB database backend for ARPA2 ACL.
+ *
+ * Each thread that does lookups gets its own read-only transaction. The
+ * transaction is reset when a read ends and renewed when the next one begins,
+ * so that the reader slot and transaction are allocated only once per thread.
+ *
+ * A Bloom filter of all keys is stored in the database itself, so that it is
+ * always of the same version as the rules. Each read looks it up once and then
+ * checks it in the memory map before each lookup, which saves a search of the
+ * B-tree for most keys that are not in the database.
+ *
+ * The key of a rule is "localid\0lesremote", the local ID followed by the
+ * remote selector with the labels of its domain in reverse order and before
+ * its local part, see revselector. All rules of a local ID are stored next to
+ * each other, and within those the rules of a domain and its subdomains, so
+ * all generalizations of a remote ID that are looked up for one local ID are
+ * on the same few pages of the B-tree. Each thread keeps one cursor for its
+ * lookups, so that LMDB searches the page the cursor is on before it descends
+ * from the root again. Databases that were created before the layout was
+ * recorded, see layoutkey, have keys of the form "remotesel localid\0".
+ *
+ * The value of a rule is only the compiled ACL rule with a format byte and its
+ * size, see db_encodedata. Databases that were created before the format was
+ * recorded, see valueskey, keep values of the previous format, that also
+ * contain the remote selector and local ID, and rules in text form. Their
+ * values are read and written in that format, so that they are never
+ * converted and older versions can still read them.
+ */
+
+/*
+ * Read transaction of one thread. "depth" is the number of reads that began
+ * but did not end yet. "filter" points to the Bloom filter in the memory map
+ * during a read, or is NULL if there is none. The statistics are only updated
+ * by the thread itself.
+ */
+struct rdtxn {
+	a2acl_ctx *ctx;
+	MDB_txn *txn;
+	int depth;
+	MDB_cursor *cur;
+	const uint8_t *filter;
+	size_t filtersize;
+	atomic_size_t probes, skipped, falsepos;
+	struct rdtxn *prev, *next;
+};
+
+struct a2acl_ctx {
+	MDB_env *env;
+	MDB_dbi dbi;
+	int localfirst;		/* layout of the keys, see layoutkey */
+	int valformat;		/* format of the values, see valueskey */
+	pthread_key_t rdkey;
+	pthread_mutex_t rdlock;
+	struct rdtxn *rdtxns;	/* all read transactions, for dbclose */
+	char *tmppath;		/* private database, see a2acl_dbcreate */
+	char *path;		/* where to install the private database */
+	struct a2aclstats stats; /* of threads that exited */
+};
+
+/*
+ * Keys of the metadata record, the Bloom filter, the key layout and the format
+ * of the values. Keys of rules start with a local ID or remote selector, which
+ * never starts with a nul, so these can't be mistaken for rules. The layout
+ * record is written when a database is created and is absent in databases with
+ * the old layout. The values record is absent in databases with values of the
+ * previous format.
  */
+static const char metakey[] = "\0a2acl meta";
+static const char bloomkey[] = "\0a2acl bloom";
+static const char layoutkey[] = "\0a2acl layout";
+static const char valueskey[] = "\0a2acl values";
 
-static MDB_env *env;
-static MDB_txn *txn;
-static MDB_dbi dbi;
+#define LOCALFIRST 'L'
+#define OLDVALUES 0
+#define VALFORMAT 1
+
+/*
+ * Older versions read each size in a value of the previous format from a char.
+ */
+#define OLDMAXSIZE SCHAR_MAX
 
 struct dbentry {
 	char *remotesel;
@@ -40,34 +125,380 @@ struct dbentry {
 void
 printdbentry(FILE *fp, const struct dbentry *ep)
 {
-	fprintf(fp, "remotesel: %zu %.*s\nlocalid: %zu %.*s\naclrule: %zu %.*s\n",
+	char aclrule[A2ACL_MAXLEN + 1];
+
+	/* the ACL rule is stored compiled */
+	if (a2acl_ruletostr(aclrule, sizeof(aclrule), ep->aclrule,
+	    ep->aclrulesize) == -1)
+		snprintf(aclrule, sizeof(aclrule), "(invalid)");
+
+	fprintf(fp, "remotesel: %zu %.*s\nlocalid: %zu %.*s\naclrule: %zu %s\n",
 	    ep->remoteselsize, (int)ep->remoteselsize, ep->remotesel,
 	    ep->localidsize, (int)ep->localidsize, ep->localid, ep->aclrulesize,
-	    (int)ep->aclrulesize, ep->aclrule);
+	    aclrule);
 }
 
-/* Let "de" point into the right spots of "data". */
-void
-db_datatodbentry(struct dbentry *de, const MDB_val *data)
+/*
+ * Return 1 if "key" is the key of a record that is not a rule, 0 otherwise.
+ */
+static int
+ismetakey(const MDB_val *key)
 {
-	char *cp;
+	return key->mv_size > 0 && *(const char *)key->mv_data == '\0';
+}
+
+/*
+ * Write the dot separated labels of "src" to "dst" in reverse order. Doing so
+ * twice gives the original labels. "dst" must have room for "srcsize" bytes.
+ */
+static void
+revlabels(char *dst, const char *src, size_t srcsize)
+{
+	const char *end, *label;
+
+	end = src + srcsize;
+	while (end > src) {
+		label = end;
+		while (label > src && label[-1] != '.')
+			label--;
+
+		memcpy(dst, label, end - label);
+		dst += end - label;
+
+		if (label == src)
+			break;
+
+		/* the label before the dot might be empty */
+		*dst++ = '.';
+		end = label - 1;
+	}
+}
+
+/*
+ * Write "remotesel" to "dst" with the labels of its domain in reverse order,
+ * followed by an '@' and its local part. "foo@mail.example.com" becomes
+ * "com.example.mail@foo" and "@.example.com" becomes "com.example.@", so that
+ * a domain sorts right before its subdomains. The domain starts after the last
+ * '@', a selector without an '@' is copied as is. "dst" must have room for
+ * "remoteselsize" bytes.
+ */
+static void
+revselector(char *dst, const char *remotesel, size_t remoteselsize)
+{
+	const char *domain;
+
+	domain = remotesel + remoteselsize;
+	while (domain > remotesel && domain[-1] != '@')
+		domain--;
+
+	if (domain == remotesel) {
+		memcpy(dst, remotesel, remoteselsize);
+		return;
+	}
+
+	revlabels(dst, domain, remotesel + remoteselsize - domain);
+	dst += remotesel + remoteselsize - domain;
+	*dst++ = '@';
+	memcpy(dst, remotesel, domain - 1 - remotesel);
+}
+
+/*
+ * Undo revselector. The reversed domain ends at the first '@' of "rev".
+ */
+static void
+unrevselector(char *dst, const char *rev, size_t revsize)
+{
+	const char *at;
+
+	if ((at = memchr(rev, '@', revsize)) == NULL) {
+		memcpy(dst, rev, revsize);
+		return;
+	}
+
+	memcpy(dst, at + 1, rev + revsize - at - 1);
+	dst += rev + revsize - at - 1;
+	*dst++ = '@';
+	revlabels(dst, rev, at - rev);
+}
+
+/*
+ * Return the size of the key of a rule in the database of "ctx", see
+ * writekey. The sizes must be less than INT_MAX / 4.
+ */
+static size_t
+keysize(const a2acl_ctx *ctx, size_t remoteselsize, size_t localidsize)
+{
+	if (ctx->localfirst)
+		return localidsize + 1 + remoteselsize;
+
+	return remoteselsize + localidsize + 2;
+}
+
+/*
+ * Write the key of a rule in the database of "ctx" to "dst", which must have
+ * room for keysize bytes. The key is "localid\0lesremote" or, in the old
+ * layout, "remotesel localid\0".
+ */
+static void
+writekey(const a2acl_ctx *ctx, char *dst, const char *remotesel,
+    size_t remoteselsize, const char *localid, size_t localidsize)
+{
+	if (ctx->localfirst) {
+		memcpy(dst, localid, localidsize);
+		dst += localidsize;
+		*dst++ = '\0';
+		revselector(dst, remotesel, remoteselsize);
+		return;
+	}
+
+	memcpy(dst, remotesel, remoteselsize);
+	dst += remoteselsize;
+	*dst++ = ' ';
+	memcpy(dst, localid, localidsize);
+	dst += localidsize;
+	*dst = '\0';
+}
+
+/*
+ * Let "remotesel" and "localid" point to the remote selector and local ID in
+ * "key", the key of a rule in the database of "ctx". The remote selector is
+ * in the form of revselector if the local ID comes first.
+ *
+ * Return 0 on success, -1 if "key" is not the key of a rule.
+ */
+static int
+splitkey(const a2acl_ctx *ctx, const MDB_val *key, const char **remotesel,
+    size_t *remoteselsize, const char **localid, size_t *localidsize)
+{
+	const char *cp, *sp;
+
+	cp = key->mv_data;
+
+	if (ctx->localfirst) {
+		if ((sp = memchr(cp, '\0', key->mv_size)) == NULL)
+			return -1;
+		*localid = cp;
+		*localidsize = sp - cp;
+		*remotesel = sp + 1;
+		*remoteselsize = key->mv_size - (sp - cp) - 1;
+		return 0;
+	}
+
+	if (key->mv_size < 2 || (sp = memchr(cp, ' ', key->mv_size)) == NULL)
+		return -1;
+	*remotesel = cp;
+	*remoteselsize = sp - cp;
+	*localid = sp + 1;
+	*localidsize = key->mv_size - (sp - cp) - 2;
+	return 0;
+}
+
+/*
+ * Return the hash of "key", the key of a rule in the database of "ctx", for the
+ * Bloom filter. Both parts of the key are hashed as they are stored.
+ */
+static uint64_t
+keyhash(const a2acl_ctx *ctx, const MDB_val *key)
+{
+	const char *remotesel, *localid;
+	size_t remoteselsize, localidsize;
+
+	if (splitkey(ctx, key, &remotesel, &remoteselsize, &localid,
+	    &localidsize) == -1)
+		return a2acl_keyhash(key->mv_data, key->mv_size, NULL, 0);
+
+	if (ctx->localfirst)
+		return a2acl_keyhash(localid, localidsize, remotesel,
+		    remoteselsize);
+
+	return a2acl_keyhash(remotesel, remoteselsize, localid, localidsize);
+}
+
+/*
+ * Let "aclrule" point to the ACL rule of "rp" in the form in which it is stored
+ * in the database of "ctx". A database with values of the previous format only
+ * holds rules in text form, so a compiled rule is written as text to "buf",
+ * which must have room for A2ACL_MAXLEN + 1 bytes.
+ *
+ * Return 0 on success, -1 if the rule can't be stored in the format of the
+ * database.
+ */
+static int
+storedrule(const a2acl_ctx *ctx, const char **aclrule, size_t *aclrulesize,
+    char *buf, const struct a2aclrule *rp)
+{
+	ssize_t len;
+
+	if (ctx->valformat != OLDVALUES) {
+		*aclrule = rp->aclrule;
+		*aclrulesize = rp->aclrulesize;
+		return 0;
+	}
+
+	if (rp->remoteselsize > OLDMAXSIZE || rp->localidsize > OLDMAXSIZE)
+		return -1;
+
+	len = a2acl_ruletostr(buf, A2ACL_MAXLEN + 1, rp->aclrule,
+	    rp->aclrulesize);
+	if (len == -1 || len > OLDMAXSIZE)
+		return -1;
+
+	*aclrule = buf;
+	*aclrulesize = len;
+	return 0;
+}
+
+/*
+ * Return the size of the value of rule "rp" in the database of "ctx", with
+ * "aclrule" as returned by storedrule, see db_encodedata.
+ */
+static size_t
+valsize(const a2acl_ctx *ctx, const struct a2aclrule *rp, size_t aclrulesize)
+{
+	size_t n, size;
+
+	if (ctx->valformat == OLDVALUES)
+		return 3 * sizeof(size_t) + rp->remoteselsize +
+		    rp->localidsize + aclrulesize;
+
+	for (n = 1, size = aclrulesize; size >= 0x80; size >>= 7)
+		n++;
+
+	return 1 + n + aclrulesize;
+}
+
+/*
+ * Write the value of rule "rp" in the database of "ctx" to "cp", which must
+ * have room for valsize bytes, with "aclrule" as returned by storedrule. The
+ * value is the format byte VALFORMAT, the size of the ACL rule as a varint of
+ * seven bits per byte, least significant first, and the ACL rule. The remote
+ * selector and local ID are in the key.
+ *
+ * A value of the previous format is the size of the remote selector, the
+ * remote selector, the size of the local ID, the local ID, the size of the ACL
+ * rule and the ACL rule, with each size in the first byte of a size_t that is
+ * otherwise zero.
+ */
+static void
+db_encodedata(const a2acl_ctx *ctx, char *cp, const struct a2aclrule *rp,
+    const char *aclrule, size_t aclrulesize)
+{
+	size_t size;
+
+	if (ctx->valformat == OLDVALUES) {
+		memset(cp, 0, valsize(ctx, rp, aclrulesize));
+
+		*cp = rp->remoteselsize;
+		cp += sizeof(size_t);
+		memcpy(cp, rp->remotesel, rp->remoteselsize);
+		cp += rp->remoteselsize;
+
+		*cp = rp->localidsize;
+		cp += sizeof(size_t);
+		memcpy(cp, rp->localid, rp->localidsize);
+		cp += rp->localidsize;
+
+		*cp = aclrulesize;
+		cp += sizeof(size_t);
+		memcpy(cp, aclrule, aclrulesize);
+		return;
+	}
+
+	*cp++ = VALFORMAT;
+
+	for (size = aclrulesize; size >= 0x80; size >>= 7)
+		*cp++ = (size & 0x7f) | 0x80;
+	*cp++ = size;
+
+	memcpy(cp, aclrule, aclrulesize);
+}
+
+/*
+ * Let "aclrule" point to the ACL rule in "data", the value of the rule with
+ * "key" in the database of "ctx", see db_encodedata. The sizes of the remote
+ * selector and local ID in a value of the previous format are taken from the
+ * key, because older versions did not always write them correctly, and the ACL
+ * rule is the rest of the value.
+ *
+ * Return 0 on success, -1 if "data" is not a valid value.
+ */
+static int
+db_decodedata(const a2acl_ctx *ctx, const char **aclrule,
+    size_t *aclrulesize, const MDB_val *key, const MDB_val *data)
+{
+	const unsigned char *cp, *end;
+	const char *remotesel, *localid;
+	size_t remoteselsize, localidsize, size;
+	int shift;
+
+	if (ctx->valformat == OLDVALUES) {
+		if (splitkey(ctx, key, &remotesel, &remoteselsize, &localid,
+		    &localidsize) == -1)
+			return -1;
+
+		size = 3 * sizeof(size_t) + remoteselsize + localidsize;
+		if (data->mv_size < size)
+			return -1;
+
+		*aclrule = (const char *)data->mv_data + size;
+		*aclrulesize = data->mv_size - size;
+		return 0;
+	}
 
 	cp = data->mv_data;
+	end = cp + data->mv_size;
+
+	if (cp == end || *cp++ != VALFORMAT)
+		return -1;
+
+	size = 0;
+	for (shift = 0; ; shift += 7) {
+		if (cp == end || shift > 28)
+			return -1;
+		size |= (size_t)(*cp & 0x7f) << shift;
+		if ((*cp++ & 0x80) == 0)
+			break;
+	}
+
+	if (size != (size_t)(end - cp))
+		return -1;
+
+	*aclrule = (const char *)cp;
+	*aclrulesize = size;
+	return 0;
+}
+
+/*
+ * Let "de" point to the parts of the rule with "key" and "data". A remote
+ * selector in the form of revselector is written to "buf", which must have
+ * room for the size of "key".
+ *
+ * Return 0 on success, -1 if the record is not a valid rule.
+ */
+static int
+db_todbentry(const a2acl_ctx *ctx, struct dbentry *de, char *buf,
+    const MDB_val *key, const MDB_val *data)
+{
+	const char *remotesel, *localid, *aclrule;
+	size_t remoteselsize, localidsize, aclrulesize;
 
-	de->remoteselsize = *cp;
-	cp += sizeof(size_t);
-	de->remotesel = cp;
-	cp += de->remoteselsize;
+	if (splitkey(ctx, key, &remotesel, &remoteselsize, &localid,
+	    &localidsize) == -1 ||
+	    db_decodedata(ctx, &aclrule, &aclrulesize, key, data) == -1)
+		return -1;
 
-	de->localidsize = *cp;
-	cp += sizeof(size_t);
-	de->localid = cp;
-	cp += de->localidsize;
+	if (ctx->localfirst) {
+		unrevselector(buf, remotesel, remoteselsize);
+		remotesel = buf;
+	}
 
-	de->aclrulesize = *cp;
-	cp += sizeof(size_t);
-	de->aclrule = cp;
-	cp += de->aclrulesize;
+	de->remotesel = (char *)remotesel;
+	de->remoteselsize = remoteselsize;
+	de->localid = (char *)localid;
+	de->localidsize = localidsize;
+	de->aclrule = (char *)aclrule;
+	de->aclrulesize = aclrulesize;
+	return 0;
 }
 
 /*
@@ -96,34 +527,58 @@ printkey(FILE *fp, MDB_val *key)
 	    (char *)key->mv_data);
 }
 
+/*
+ * Print the key and the parts of the rule with "key" and "data".
+ */
+static void
+printrule(FILE *fp, const a2acl_ctx *ctx, MDB_val *key, const MDB_val *data)
+{
+	struct dbentry de;
+	char *buf;
+
+	printkey(fp, key);
+
+	if ((buf = malloc(key->mv_size)) == NULL) {
+		fprintf(fp, "%s\n", strerror(errno));
+		return;
+	}
+
+	if (db_todbentry(ctx, &de, buf, key, data) == 0)
+		printdbentry(fp, &de);
+	else
+		fprintf(fp, "(invalid)\n");
+
+	free(buf);
+}
+
 /*
  * Print all keys and values in the database.
  */
 void
-printdb(FILE *fp)
+printdb(FILE *fp, a2acl_ctx *ctx)
 {
-	struct dbentry de;
 	MDB_val key, data;
 	MDB_cursor *cursor;
+	MDB_txn *txn;
 	int r;
 
-	if ((r = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn)) != 0)
+	if ((r = mdb_txn_begin(ctx->env, NULL, MDB_RDONLY, &txn)) != 0)
 		printerrx(fp, r, 1);
 
-	if ((r = mdb_cursor_open(txn, dbi, &cursor)) != 0)
+	if ((r = mdb_cursor_open(txn, ctx->dbi, &cursor)) != 0)
 		printerrx(fp, r, 1);
 
 	if ((r = mdb_cursor_get(cursor, &key, &data, MDB_FIRST)) != 0)
 		printerrx(fp, r, 1);
 
 	do {
+		if (ismetakey(&key))
+			continue;
 		if (key.mv_size > INT_MAX)
 			continue;
 		if (data.mv_size > INT_MAX)
 			continue;
-		printkey(fp, &key);
-		db_datatodbentry(&de, &data);
-		printdbentry(fp, &de);
+		printrule(fp, ctx, &key, &data);
 	} while ((r = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0);
 	if (r != MDB_NOTFOUND)
 		printerrx(fp, r, 1);
@@ -133,177 +588,608 @@ printdb(FILE *fp)
 }
 
 /*
- * Initialize a database path.
- *
- * Must return 0 on success, -1 on failure.
+ * Print all keys and values of the rules of "localid". The rules of a local ID
+ * are stored next to each other, so only those are read. In the old layout all
+ * rules are read.
  */
-int
-a2acl_dbopen(const char *path)
+void
+printlocalid(FILE *fp, a2acl_ctx *ctx, const char *localid)
 {
+	MDB_val key, data;
+	MDB_cursor *cursor;
+	MDB_cursor_op op;
+	MDB_txn *txn;
+	const char *cp;
+	size_t localidsize;
 	int r;
 
-	if (path == NULL)
-		return -1;
+	localidsize = strlen(localid);
 
-	if ((r = mdb_env_create(&env)) != 0)
-		printerrx(stderr, 1, r);
+	if ((r = mdb_txn_begin(ctx->env, NULL, MDB_RDONLY, &txn)) != 0)
+		printerrx(fp, r, 1);
 
-	if ((r = mdb_env_open(env, path, MDB_NOSUBDIR, 0640)) != 0)
-		printerrx(stderr, 1, r);
+	if ((r = mdb_cursor_open(txn, ctx->dbi, &cursor)) != 0)
+		printerrx(fp, r, 1);
 
-	/*
-	 * Open a new database handle and commit the transaction so that the
-	 * handle becomes available in the shared environment where subsequent
-	 * transactions can use it.
-	 */
-	if ((r = mdb_txn_begin(env, NULL, 0, &txn)) != 0)
-		printerrx(stderr, 1, r);
+	/* "localid\0lesremote" or "remotesel localid\0", see writekey */
+	op = MDB_FIRST;
+	if (ctx->localfirst) {
+		key.mv_data = (void *)localid;
+		key.mv_size = localidsize + 1;
+		op = MDB_SET_RANGE;
+	}
 
-	if ((r = mdb_dbi_open(txn, NULL, 0, &dbi)) != 0)
-		printerrx(stderr, 1, r);
+	r = mdb_cursor_get(cursor, &key, &data, op);
+	for (; r == 0; r = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+		if (ismetakey(&key))
+			continue;
 
-	if ((r = mdb_txn_commit(txn)) != 0)
-		printerrx(stderr, 1, r);
+		cp = key.mv_data;
+		if (ctx->localfirst) {
+			if (key.mv_size <= localidsize ||
+			    memcmp(cp, localid, localidsize + 1) != 0)
+				break;
+		} else if (key.mv_size < localidsize + 2 ||
+		    cp[key.mv_size - localidsize - 2] != ' ' ||
+		    memcmp(&cp[key.mv_size - localidsize - 1], localid,
+		    localidsize) != 0) {
+			continue;
+		}
 
-	return 0;
+		if (key.mv_size > INT_MAX || data.mv_size > INT_MAX)
+			continue;
+		printrule(fp, ctx, &key, &data);
+	}
+	if (r != 0 && r != MDB_NOTFOUND)
+		printerrx(fp, r, 1);
+
+	mdb_cursor_close(cursor);
+	mdb_txn_abort(txn);
 }
 
 /*
- * Close a database backend by purging everything from memory.
- *
- * Must return 0 on success, -1 on failure.
+ * Unlink the read transaction "arg" from its context and free it. Called when
+ * a thread exits.
  */
-int
-a2acl_dbclose(void)
+static void
+freerdtxn(void *arg)
 {
-	mdb_dbi_close(env, dbi);
-	mdb_env_close(env);
-	return 0;
+	struct rdtxn *rt = arg;
+	a2acl_ctx *ctx = rt->ctx;
+
+	pthread_mutex_lock(&ctx->rdlock);
+	if (rt->prev)
+		rt->prev->next = rt->next;
+	else
+		ctx->rdtxns = rt->next;
+	if (rt->next)
+		rt->next->prev = rt->prev;
+	ctx->stats.probes += rt->probes;
+	ctx->stats.skipped += rt->skipped;
+	ctx->stats.falsepos += rt->falsepos;
+	pthread_mutex_unlock(&ctx->rdlock);
+
+	if (rt->cur != NULL)
+		mdb_cursor_close(rt->cur);
+	mdb_txn_abort(rt->txn);
+	free(rt);
 }
 
 /*
- * Update "count" to the total number of rules in the database.
+ * Allocate a new context without an environment.
  *
- * Return 0 on success, -1 on failure.
+ * Return the new context on success, NULL on failure.
  */
-int
-a2acl_count(size_t *count)
+static a2acl_ctx *
+newctx(void)
 {
-	MDB_stat st;
+	a2acl_ctx *ctx;
 
-	if (mdb_txn_begin(env, NULL, MDB_RDONLY, &txn) != 0)
-		return -1;
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
 
-	if (mdb_stat(txn, dbi, &st) != 0)
-		return -1;
-	*count = st.ms_entries;
+	if (pthread_key_create(&ctx->rdkey, freerdtxn) != 0) {
+		free(ctx);
+		return NULL;
+	}
 
-	mdb_txn_abort(txn);
+	if (pthread_mutex_init(&ctx->rdlock, NULL) != 0) {
+		pthread_key_delete(ctx->rdkey);
+		free(ctx);
+		return NULL;
+	}
 
-	return 0;
+	return ctx;
 }
 
 /*
- * Free "val".
+ * Double the size of the memory map.
+ *
+ * Return 0 on success, an LMDB error code on failure.
  */
-void
-db_freeval(MDB_val *val)
+static int
+growmap(MDB_env *env)
 {
-	if (val == NULL)
-		return;
+	MDB_envinfo info;
+	int r;
 
-	free(val->mv_data);
-	val->mv_data = NULL;
+	if ((r = mdb_env_info(env, &info)) != 0)
+		return r;
 
-	free(val);
-	val = NULL;
+	return mdb_env_set_mapsize(env, info.me_mapsize * 2);
 }
 
 /*
- * Return a new key on success, NULL on failure.
+ * Determine the layout of the keys and the format of the values in the
+ * database of "txn". A database without any records is new and gets the layout
+ * and values records. A database without a values record is left as it is and
+ * keeps values of the previous format, see db_encodedata.
+ *
+ * Return 0 on success, an LMDB error code on failure.
  */
-MDB_val *
-db_newkey(const char *remotesel, size_t remoteselsize, const char *localid,
-    size_t localidsize)
+static int
+getformat(a2acl_ctx *ctx, MDB_txn *txn)
 {
-	MDB_val *key;
-	int r;
-
-	if (INT_MAX <= localidsize)
-		return NULL;
-	if (INT_MAX - localidsize - 2 < remoteselsize)
-		return NULL;
-
-	if ((key = malloc(sizeof(*key))) == NULL)
-		return NULL;
-
-	key->mv_size = remoteselsize + localidsize + 2;
-	if ((key->mv_data = malloc(key->mv_size)) == NULL) {
-		db_freeval(key);
-		return NULL;
+	MDB_val key, data;
+	MDB_stat st;
+	char layout, format;
+	int isnew, r;
+
+	if ((r = mdb_stat(txn, ctx->dbi, &st)) != 0)
+		return r;
+	isnew = st.ms_entries == 0;
+
+	key.mv_data = (void *)layoutkey;
+	key.mv_size = sizeof(layoutkey);
+
+	ctx->localfirst = 0;
+	if ((r = mdb_get(txn, ctx->dbi, &key, &data)) == 0) {
+		if (data.mv_size != 1 || *(char *)data.mv_data != LOCALFIRST)
+			return MDB_INCOMPATIBLE;
+		ctx->localfirst = 1;
+	} else if (r != MDB_NOTFOUND) {
+		return r;
+	} else if (isnew) {
+		layout = LOCALFIRST;
+		data.mv_data = &layout;
+		data.mv_size = 1;
+		if ((r = mdb_put(txn, ctx->dbi, &key, &data, 0)) != 0)
+			return r;
+		ctx->localfirst = 1;
 	}
 
-	r = snprintf(key->mv_data, key->mv_size, "%.*s %.*s",
-	    (int)remoteselsize, remotesel, (int)localidsize, localid);
+	key.mv_data = (void *)valueskey;
+	key.mv_size = sizeof(valueskey);
 
-	if (r <= 0 || r >= (int)key->mv_size) {
-		db_freeval(key);
-		return NULL;
+	ctx->valformat = OLDVALUES;
+	if ((r = mdb_get(txn, ctx->dbi, &key, &data)) == 0) {
+		if (data.mv_size != 1 || *(char *)data.mv_data != VALFORMAT)
+			return MDB_INCOMPATIBLE;
+		ctx->valformat = VALFORMAT;
+		return 0;
 	}
-
-	return key;
+	if (r != MDB_NOTFOUND)
+		return r;
+	if (!isnew)
+		return 0;
+
+	format = VALFORMAT;
+	data.mv_data = &format;
+	data.mv_size = 1;
+	if ((r = mdb_put(txn, ctx->dbi, &key, &data, 0)) != 0)
+		return r;
+	ctx->valformat = VALFORMAT;
+	return 0;
 }
 
 /*
- * Return a new data value on success, NULL on failure.
+ * Open the environment at "path" and the database handle of "ctx". "flags" are
+ * passed to mdb_env_open.
  *
- * Each dbvalue consists of three serial length + value combinations.
+ * Return 0 on success, an LMDB error code on failure.
  */
-MDB_val *
-db_newdata(const char *aclrule, size_t aclrulesize, const char *remotesel,
-    size_t remoteselsize, const char *localid, size_t localidsize)
+static int
+openenv(a2acl_ctx *ctx, const char *path, unsigned int flags)
 {
-	const size_t sizesz = sizeof(size_t);
-	MDB_val *data;
-	char *cp;
+	MDB_txn *txn;
+	int r;
 
-	if (INT_MAX <= 3 * sizesz)
-		return NULL;
-	if (INT_MAX - 3 * sizesz <= localidsize)
-		return NULL;
-	if (INT_MAX - 3 * sizesz - localidsize < remoteselsize)
-		return NULL;
-	if (INT_MAX - 3 * sizesz - localidsize - remoteselsize < aclrulesize)
-		return NULL;
+	if ((r = mdb_env_create(&ctx->env)) != 0)
+		return r;
+
+	if ((r = mdb_env_open(ctx->env, path, MDB_NOSUBDIR | flags,
+	    0640)) != 0)
+		goto err;
+
+	/*
+	 * Open a new database handle and commit the transaction so that the
+	 * handle becomes available in the shared environment where subsequent
+	 * transactions can use it. If the map is full, it is grown and the
+	 * transaction is retried.
+	 */
+	do {
+		if ((r = mdb_txn_begin(ctx->env, NULL, 0, &txn)) != 0)
+			goto err;
+
+		if ((r = mdb_dbi_open(txn, NULL, 0, &ctx->dbi)) == 0 &&
+		    (r = getformat(ctx, txn)) == 0)
+			r = mdb_txn_commit(txn);
+		else
+			mdb_txn_abort(txn);
+	} while (r == MDB_MAP_FULL && (r = growmap(ctx->env)) == 0);
+
+	if (r != 0)
+		goto err;
+
+	return 0;
+
+err:
+	mdb_env_close(ctx->env);
+	ctx->env = NULL;
+	return r;
+}
+
+/*
+ * Close the environment of "ctx" and the read transactions of all threads. A
+ * thread that begins a new read creates a new read transaction.
+ */
+static void
+closeenv(a2acl_ctx *ctx)
+{
+	struct rdtxn *rt;
+
+	for (rt = ctx->rdtxns; rt != NULL; rt = rt->next) {
+		if (rt->cur != NULL)
+			mdb_cursor_close(rt->cur);
+		mdb_txn_abort(rt->txn);
+		rt->cur = NULL;
+		rt->txn = NULL;
+		rt->filter = NULL;
+	}
+
+	if (ctx->env == NULL)
+		return;
+
+	mdb_dbi_close(ctx->env, ctx->dbi);
+	mdb_env_close(ctx->env);
+	ctx->env = NULL;
+}
+
+/*
+ * Initialize a database path and allocate a new context in "ctx".
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbopen(a2acl_ctx **ctx, const char *path)
+{
+	int r;
+
+	if (path == NULL)
+		return -1;
+
+	if ((*ctx = newctx()) == NULL)
+		return -1;
+
+	if ((r = openenv(*ctx, path, 0)) != 0) {
+		printerr(stderr, r);
+		a2acl_dbclose(*ctx);
+		*ctx = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a new and empty database in a temporary file next to "path" and
+ * allocate a new context for it in "ctx". No other process knows about the
+ * temporary file, so it is opened without a lock file.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbcreate(a2acl_ctx **ctx, const char *path)
+{
+	size_t tmppathsize;
+	int fd, r;
+
+	if (path == NULL)
+		return -1;
+
+	if ((*ctx = newctx()) == NULL)
+		return -1;
+
+	tmppathsize = strlen(path) + sizeof(".XXXXXX");
+	if (((*ctx)->path = strdup(path)) == NULL ||
+	    ((*ctx)->tmppath = malloc(tmppathsize)) == NULL)
+		goto err;
+
+	snprintf((*ctx)->tmppath, tmppathsize, "%s.XXXXXX", path);
+	if ((fd = mkstemp((*ctx)->tmppath)) == -1) {
+		free((*ctx)->tmppath);
+		(*ctx)->tmppath = NULL;
+		goto err;
+	}
+
+	/* the same mode as a database created by a2acl_dbopen */
+	if (fchmod(fd, 0640) == -1) {
+		close(fd);
+		goto err;
+	}
+	close(fd);
+
+	if ((r = openenv(*ctx, (*ctx)->tmppath, MDB_NOLOCK)) != 0) {
+		printerr(stderr, r);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	a2acl_dbclose(*ctx);
+	*ctx = NULL;
+	return -1;
+}
+
+/*
+ * Make the database of "ctx", that was created with a2acl_dbcreate, available
+ * at its path. The temporary file is hard linked to the path, which fails if
+ * the path exists, so a database that might be in use by another process is
+ * never replaced. Then the database is opened again at its path, with a lock
+ * file, so that other processes can use it at the same time.
+ *
+ * Must return 0 on success, -1 on failure with errno set to EEXIST if there
+ * already is a database at the path.
+ */
+int
+a2acl_dbinstall(a2acl_ctx *ctx)
+{
+	int r;
+
+	if (ctx->tmppath == NULL)
+		return 0;
+
+	if (link(ctx->tmppath, ctx->path) == -1)
+		return -1; /* errno set */
+
+	unlink(ctx->tmppath);
+	free(ctx->tmppath);
+	ctx->tmppath = NULL;
+
+	closeenv(ctx);
+	if ((r = openenv(ctx, ctx->path, 0)) != 0) {
+		printerr(stderr, r);
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Close a database backend and free "ctx", including the read transactions of
+ * all threads. A database that was created but not installed is removed.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbclose(a2acl_ctx *ctx)
+{
+	struct rdtxn *rt;
+
+	if (ctx == NULL)
+		return 0;
+
+	pthread_key_delete(ctx->rdkey);
+	closeenv(ctx);
+	while ((rt = ctx->rdtxns) != NULL) {
+		ctx->rdtxns = rt->next;
+		free(rt);
+	}
+	pthread_mutex_destroy(&ctx->rdlock);
+
+	if (ctx->tmppath != NULL)
+		unlink(ctx->tmppath);
+	free(ctx->tmppath);
+	free(ctx->path);
+	free(ctx);
+	return 0;
+}
+
+/*
+ * Count the records in the database of "txn" that are not rules in "n". These
+ * sort before all rules.
+ *
+ * Return 0 on success, an LMDB error code on failure.
+ */
+static int
+countmeta(MDB_txn *txn, MDB_dbi dbi, size_t *n)
+{
+	MDB_cursor *cur;
+	MDB_val key, data;
+	int r;
+
+	*n = 0;
+
+	if ((r = mdb_cursor_open(txn, dbi, &cur)) != 0)
+		return r;
+
+	r = mdb_cursor_get(cur, &key, &data, MDB_FIRST);
+	while (r == 0 && ismetakey(&key)) {
+		(*n)++;
+		r = mdb_cursor_get(cur, &key, &data, MDB_NEXT);
+	}
+	mdb_cursor_close(cur);
+
+	return r == MDB_NOTFOUND ? 0 : r;
+}
+
+/*
+ * Update "count" to the total number of rules in the database, which does not
+ * include the metadata record and the Bloom filter.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+a2acl_count(a2acl_ctx *ctx, size_t *count)
+{
+	MDB_stat st;
+	MDB_txn *txn;
+	size_t nmeta;
+
+	if (mdb_txn_begin(ctx->env, NULL, MDB_RDONLY, &txn) != 0)
+		return -1;
+
+	if (mdb_stat(txn, ctx->dbi, &st) != 0 ||
+	    countmeta(txn, ctx->dbi, &nmeta) != 0) {
+		mdb_txn_abort(txn);
+		return -1;
+	}
+	*count = st.ms_entries - nmeta;
+
+	mdb_txn_abort(txn);
+
+	return 0;
+}
+
+/*
+ * Free "val".
+ */
+void
+db_freeval(MDB_val *val)
+{
+	if (val == NULL)
+		return;
+
+	free(val->mv_data);
+	val->mv_data = NULL;
+
+	free(val);
+	val = NULL;
+}
+
+/*
+ * Return a new key on success, NULL on failure.
+ */
+MDB_val *
+db_newkey(const a2acl_ctx *ctx, const char *remotesel, size_t remoteselsize,
+    const char *localid, size_t localidsize)
+{
+	MDB_val *key;
+
+	if (remoteselsize >= INT_MAX / 4 || localidsize >= INT_MAX / 4)
+		return NULL;
+
+	if ((key = malloc(sizeof(*key))) == NULL)
+		return NULL;
+
+	key->mv_size = keysize(ctx, remoteselsize, localidsize);
+	if ((key->mv_data = malloc(key->mv_size)) == NULL) {
+		db_freeval(key);
+		return NULL;
+	}
+
+	writekey(ctx, key->mv_data, remotesel, remoteselsize, localid,
+	    localidsize);
+
+	return key;
+}
+
+/*
+ * Return a new data value of rule "rp" in the database of "ctx" on success,
+ * NULL on failure.
+ */
+MDB_val *
+db_newdata(const a2acl_ctx *ctx, const struct a2aclrule *rp)
+{
+	MDB_val *data;
+	const char *aclrule;
+	size_t aclrulesize;
+	char buf[A2ACL_MAXLEN + 1];
+
+	if (rp->aclrulesize >= INT_MAX / 4)
+		return NULL;
+
+	if (storedrule(ctx, &aclrule, &aclrulesize, buf, rp) == -1)
+		return NULL;
 
 	if ((data = malloc(sizeof(*data))) == NULL)
 		return NULL;
 
-	data->mv_size = 3 * sizesz + localidsize + remoteselsize + aclrulesize;
+	data->mv_size = valsize(ctx, rp, aclrulesize);
 
 	if ((data->mv_data = malloc(data->mv_size)) == NULL) {
 		db_freeval(data);
 		return NULL;
 	}
 
-	cp = data->mv_data;
+	db_encodedata(ctx, data->mv_data, rp, aclrule, aclrulesize);
 
-	*cp = remoteselsize;
-	cp += sizesz;
-	memcpy(cp, remotesel, remoteselsize);
-	cp += remoteselsize;
+	return data;
+}
 
-	*cp = localidsize;
-	cp += sizesz;
-	memcpy(cp, localid, localidsize);
-	cp += localidsize;
+/*
+ * Remove the Bloom filter in "txn", so that lookups don't use it.
+ *
+ * Return 0 on success, an LMDB error code on failure.
+ */
+static int
+delfilter(MDB_txn *txn, MDB_dbi dbi)
+{
+	MDB_val key;
+	int r;
 
-	*cp = aclrulesize;
-	cp += sizesz;
-	memcpy(cp, aclrule, aclrulesize);
-	cp += aclrulesize;
+	key.mv_data = (void *)bloomkey;
+	key.mv_size = sizeof(bloomkey);
 
-	return data;
+	r = mdb_del(txn, dbi, &key, NULL);
+	return r == MDB_NOTFOUND ? 0 : r;
+}
+
+/*
+ * Replace the Bloom filter in "txn" with one of all rules in the database of
+ * "txn". The filter is written in place in the database.
+ *
+ * Return 0 on success, an LMDB error code on failure.
+ */
+static int
+putfilter(const a2acl_ctx *ctx, MDB_txn *txn)
+{
+	MDB_cursor *cur;
+	MDB_val key, data, filter;
+	MDB_stat st;
+	MDB_dbi dbi = ctx->dbi;
+	int r;
+
+	if ((r = mdb_stat(txn, dbi, &st)) != 0)
+		return r;
+
+	key.mv_data = (void *)bloomkey;
+	key.mv_size = sizeof(bloomkey);
+
+	/* too many keys, go without a filter */
+	if ((filter.mv_size = a2acl_bloomsize(st.ms_entries)) == 0)
+		return delfilter(txn, dbi);
+
+	if ((r = mdb_put(txn, dbi, &key, &filter, MDB_RESERVE)) != 0)
+		return r;
+	memset(filter.mv_data, 0, filter.mv_size);
+
+	if ((r = mdb_cursor_open(txn, dbi, &cur)) != 0)
+		return r;
+
+	r = mdb_cursor_get(cur, &key, &data, MDB_FIRST);
+	for (; r == 0; r = mdb_cursor_get(cur, &key, &data, MDB_NEXT)) {
+		if (ismetakey(&key))
+			continue;
+
+		a2acl_bloomadd(filter.mv_data, filter.mv_size,
+		    keyhash(ctx, &key));
+	}
+	mdb_cursor_close(cur);
+
+	return r == MDB_NOTFOUND ? 0 : r;
 }
 
 /*
@@ -314,10 +1200,13 @@ db_newdata(const char *aclrule, size_t aclrulesize, const char *remotesel,
  * Must return 0 on success, -1 on failure.
  */
 int
-a2acl_putaclrule(const char *aclrule, size_t aclrulesize, const char *remotesel,
-    size_t remoteselsize, const char *localid, size_t localidsize)
+a2acl_putaclrule(a2acl_ctx *ctx, const char *aclrule, size_t aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
 {
+	struct a2aclrule rule;
 	MDB_val *key, *data, *d2;
+	MDB_txn *txn;
 	int r;
 
 	key = data = NULL;
@@ -326,22 +1215,30 @@ a2acl_putaclrule(const char *aclrule, size_t aclrulesize, const char *remotesel,
 	    remoteselsize == 0 || localid == NULL || localidsize == 0)
 		return -1;
 
-	key = db_newkey(remotesel, remoteselsize, localid, localidsize);
+	key = db_newkey(ctx, remotesel, remoteselsize, localid, localidsize);
 	if (key == NULL)
 		return -1;
 
-	data = db_newdata(aclrule, aclrulesize, remotesel, remoteselsize,
-	    localid, localidsize);
+	rule.aclrule = aclrule;
+	rule.aclrulesize = aclrulesize;
+	rule.remotesel = remotesel;
+	rule.remoteselsize = remoteselsize;
+	rule.localid = localid;
+	rule.localidsize = localidsize;
+
+	data = db_newdata(ctx, &rule);
 	if (data == NULL) {
 		db_freeval(key);
 		return -1;
 	}
 
-	if ((r = mdb_txn_begin(env, NULL, 0, &txn)) != 0)
+	if ((r = mdb_txn_begin(ctx->env, NULL, 0, &txn)) != 0)
 		printerrx(stderr, r, 1);
 
+	/* the filter is not updated, it is built again by the next bulk import */
 	d2 = data;
-	if ((r = mdb_put(txn, dbi, key, d2, MDB_NOOVERWRITE)) != 0) {
+	if ((r = mdb_put(txn, ctx->dbi, key, d2, MDB_NOOVERWRITE)) != 0 ||
+	    (r = delfilter(txn, ctx->dbi)) != 0) {
 		mdb_txn_abort(txn);
 		db_freeval(key);
 		/*
@@ -362,6 +1259,770 @@ a2acl_putaclrule(const char *aclrule, size_t aclrulesize, const char *remotesel,
 	return 0;
 }
 
+/*
+ * Key of a rule in a bulk import, and the index of the rule.
+ */
+struct bulkkey {
+	MDB_val key;
+	size_t idx;
+};
+
+/*
+ * Compare two keys the same way as LMDB does by default, so that the keys can
+ * be appended in order.
+ */
+static int
+cmpkey(const MDB_val *ka, const MDB_val *kb)
+{
+	int r;
+
+	r = memcmp(ka->mv_data, kb->mv_data, ka->mv_size < kb->mv_size ?
+	    ka->mv_size : kb->mv_size);
+	if (r != 0)
+		return r;
+
+	return (ka->mv_size > kb->mv_size) - (ka->mv_size < kb->mv_size);
+}
+
+static int
+cmpbulkkey(const void *a, const void *b)
+{
+	return cmpkey(&((const struct bulkkey *)a)->key,
+	    &((const struct bulkkey *)b)->key);
+}
+
+/*
+ * Sort keys like cmpbulkkey, and equal keys by their index so that the order
+ * does not depend on the sort algorithm.
+ */
+static int
+sortbulkkey(const void *a, const void *b)
+{
+	const struct bulkkey *ka = a, *kb = b;
+	int r;
+
+	if ((r = cmpbulkkey(a, b)) != 0)
+		return r;
+
+	return (ka->idx > kb->idx) - (ka->idx < kb->idx);
+}
+
+/*
+ * Create the keys of "nrules" rules in "keybuf" and sort them in "keys". Both
+ * must be freed by the caller on success.
+ *
+ * Return 0 on success. Return MDB_KEYEXIST if a key is repeated, with "failed"
+ * set to the index of the first rule that repeats the key of an earlier rule.
+ * Return -1 on any other failure, with "failed" set to the index of the rule
+ * that is invalid, if any.
+ */
+static int
+newbulkkeys(const a2acl_ctx *ctx, struct bulkkey **keys, char **keybuf,
+    const struct a2aclrule *rules, size_t nrules, size_t *failed)
+{
+	const struct a2aclrule *rp;
+	struct bulkkey *kp;
+	size_t i, keybufsize;
+	char *cp;
+	int r;
+
+	/* one spare byte and key so that nothing is of size 0 */
+	keybufsize = 1;
+	for (i = 0; i < nrules; i++) {
+		rp = &rules[i];
+		if (rp->aclrule == NULL || rp->aclrulesize == 0 ||
+		    rp->remotesel == NULL || rp->remoteselsize == 0 ||
+		    rp->localid == NULL || rp->localidsize == 0 ||
+		    rp->remoteselsize >= INT_MAX / 4 ||
+		    rp->localidsize >= INT_MAX / 4 ||
+		    rp->aclrulesize >= INT_MAX / 4) {
+			*failed = i;
+			return -1;
+		}
+
+		if (SIZE_MAX - keybufsize < keysize(ctx, rp->remoteselsize,
+		    rp->localidsize))
+			return -1;
+		keybufsize += keysize(ctx, rp->remoteselsize, rp->localidsize);
+	}
+
+	if ((kp = calloc(nrules + 1, sizeof(*kp))) == NULL)
+		return -1;
+
+	if ((cp = malloc(keybufsize)) == NULL) {
+		free(kp);
+		return -1;
+	}
+
+	*keys = kp;
+	*keybuf = cp;
+
+	for (i = 0; i < nrules; i++) {
+		rp = &rules[i];
+		kp[i].idx = i;
+		kp[i].key.mv_data = cp;
+		kp[i].key.mv_size = keysize(ctx, rp->remoteselsize,
+		    rp->localidsize);
+		writekey(ctx, cp, rp->remotesel, rp->remoteselsize,
+		    rp->localid, rp->localidsize);
+		cp += kp[i].key.mv_size;
+	}
+
+	qsort(kp, nrules, sizeof(*kp), sortbulkkey);
+
+	/*
+	 * Report the first rule that repeats the key of an earlier rule, like
+	 * storing the rules one by one would.
+	 */
+	r = 0;
+	for (i = 1; i < nrules; i++) {
+		if (cmpbulkkey(&kp[i - 1], &kp[i]) == 0 &&
+		    kp[i].idx < *failed) {
+			*failed = kp[i].idx;
+			r = MDB_KEYEXIST;
+		}
+	}
+
+	if (r != 0) {
+		free(*keybuf);
+		free(*keys);
+	}
+
+	return r;
+}
+
+/*
+ * Replace the Bloom filter with one of all rules, in its own transaction. If
+ * the map is full it is grown and the filter is built again.
+ *
+ * Return 0 on success, an LMDB error code on failure.
+ */
+static int
+updatefilter(a2acl_ctx *ctx)
+{
+	MDB_txn *txn;
+	int r;
+
+	do {
+		if ((r = mdb_txn_begin(ctx->env, NULL, 0, &txn)) != 0)
+			break;
+
+		if ((r = putfilter(ctx, txn)) == 0)
+			r = mdb_txn_commit(txn);
+		else
+			mdb_txn_abort(txn);
+	} while (r == MDB_MAP_FULL && (r = growmap(ctx->env)) == 0);
+
+	return r;
+}
+
+/*
+ * Store "nrules" ACL rules.
+ *
+ * The keys are sorted first. If the database is empty they are appended, which
+ * lets LMDB fill its pages sequentially instead of searching and splitting
+ * them. The rules are committed in chunks of BULKCHUNK rules so that a large
+ * import doesn't need one huge transaction, and if the map is full it is grown
+ * and the chunk is retried. The Bloom filter is removed with the first chunk
+ * and built again once all rules are stored, so that readers never use a
+ * filter that misses rules.
+ *
+ * Must return 0 on success, -1 on failure with "failed" set to the index of the
+ * rule that could not be stored, or to "nrules".
+ */
+int
+a2acl_putaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *failed)
+{
+	const struct a2aclrule *rp;
+	struct bulkkey *keys;
+	MDB_val data;
+	MDB_stat st;
+	MDB_txn *txn;
+	const char *aclrule;
+	char *keybuf, buf[A2ACL_MAXLEN + 1];
+	size_t i, j, nmeta, aclrulesize;
+	unsigned int flags;
+	int r;
+
+	*failed = nrules;
+
+	if (nrules == 0)
+		return 0;
+
+	if ((r = newbulkkeys(ctx, &keys, &keybuf, rules, nrules, failed)) == -1)
+		return -1;
+	if (r != 0) {
+		printerr(stderr, r);
+		return -1;
+	}
+
+	/*
+	 * Only append if there are no existing rules to interleave with, the
+	 * records that are not rules sort before all rules.
+	 */
+	if ((r = mdb_txn_begin(ctx->env, NULL, MDB_RDONLY, &txn)) != 0)
+		goto out;
+	if ((r = mdb_stat(txn, ctx->dbi, &st)) == 0)
+		r = countmeta(txn, ctx->dbi, &nmeta);
+	mdb_txn_abort(txn);
+	if (r != 0)
+		goto out;
+	flags = MDB_NOOVERWRITE | MDB_RESERVE;
+	if (st.ms_entries == nmeta)
+		flags |= MDB_APPEND;
+
+	for (i = 0; i < nrules; i = j) {
+		if ((r = mdb_txn_begin(ctx->env, NULL, 0, &txn)) != 0)
+			goto out;
+
+		if (i == 0 && (r = delfilter(txn, ctx->dbi)) != 0) {
+			mdb_txn_abort(txn);
+			goto out;
+		}
+
+		for (j = i; j < nrules && j - i < BULKCHUNK; j++) {
+			rp = &rules[keys[j].idx];
+			if (storedrule(ctx, &aclrule, &aclrulesize, buf,
+			    rp) == -1) {
+				r = EINVAL;
+				break;
+			}
+			data.mv_size = valsize(ctx, rp, aclrulesize);
+			if ((r = mdb_put(txn, ctx->dbi, &keys[j].key, &data,
+			    flags)) != 0)
+				break;
+			db_encodedata(ctx, data.mv_data, rp, aclrule,
+			    aclrulesize);
+		}
+
+		if (r == 0) {
+			r = mdb_txn_commit(txn);
+		} else {
+			mdb_txn_abort(txn);
+			if (r == MDB_KEYEXIST || r == EINVAL)
+				*failed = keys[j].idx;
+		}
+
+		if (r == MDB_MAP_FULL) {
+			if ((r = growmap(ctx->env)) != 0)
+				goto out;
+			j = i;	/* retry this chunk */
+			continue;
+		}
+
+		if (r != 0)
+			goto out;
+	}
+
+	r = updatefilter(ctx);
+
+out:
+	if (r != 0)
+		printerr(stderr, r);
+	free(keybuf);
+	free(keys);
+	return r == 0 ? 0 : -1;
+}
+
+/*
+ * Walk the sorted "keys" of "rules" and the rules in the database side by side
+ * in one write transaction. Rules that are only in the database are removed,
+ * rules that are new or of which the stored ACL rule differs are stored. Only
+ * the ACL rules are compared, not the values, because the unused bytes in
+ * values of the previous format were never initialized. If any rule changed,
+ * or if there is no Bloom filter yet, the filter is built again in the same
+ * transaction.
+ *
+ * Return 0 on success, an LMDB error code or EINVAL on failure.
+ */
+static int
+syncrules(a2acl_ctx *ctx, struct bulkkey *keys,
+    const struct a2aclrule *rules, size_t nrules, size_t *changed,
+    size_t *failed)
+{
+	const struct a2aclrule *rp;
+	MDB_cursor *cur;
+	MDB_val key, data, newdata;
+	MDB_txn *txn;
+	const char *aclrule, *oldrule;
+	char buf[A2ACL_MAXLEN + 1];
+	size_t i, aclrulesize, oldrulesize;
+	unsigned int flags;
+	int c, r;
+
+	*changed = 0;
+
+	if ((r = mdb_txn_begin(ctx->env, NULL, 0, &txn)) != 0)
+		return r;
+
+	if ((r = mdb_cursor_open(txn, ctx->dbi, &cur)) != 0) {
+		mdb_txn_abort(txn);
+		return r;
+	}
+
+	i = 0;
+	r = mdb_cursor_get(cur, &key, &data, MDB_FIRST);
+	while (r == 0 || (r == MDB_NOTFOUND && i < nrules)) {
+		if (r == 0 && ismetakey(&key)) {
+			r = mdb_cursor_get(cur, &key, &data, MDB_NEXT);
+			continue;
+		}
+
+		if (r == MDB_NOTFOUND)
+			c = 1;
+		else if (i == nrules)
+			c = -1;
+		else
+			c = cmpkey(&key, &keys[i].key);
+
+		if (c < 0) {
+			/* no longer in the policy */
+			if ((r = mdb_cursor_del(cur, 0)) != 0)
+				break;
+			(*changed)++;
+			r = mdb_cursor_get(cur, &key, &data, MDB_NEXT);
+			continue;
+		}
+
+		rp = &rules[keys[i].idx];
+		if (storedrule(ctx, &aclrule, &aclrulesize, buf, rp) == -1) {
+			*failed = keys[i].idx;
+			r = EINVAL;
+			break;
+		}
+
+		if (c > 0 || db_decodedata(ctx, &oldrule, &oldrulesize, &key,
+		    &data) == -1 || oldrulesize != aclrulesize ||
+		    memcmp(oldrule, aclrule, aclrulesize) != 0) {
+			/* past the last existing key new keys can be appended */
+			flags = MDB_RESERVE;
+			if (r == MDB_NOTFOUND)
+				flags |= MDB_APPEND;
+			newdata.mv_size = valsize(ctx, rp, aclrulesize);
+			if ((r = mdb_cursor_put(cur, &keys[i].key, &newdata,
+			    flags)) != 0) {
+				if (r == MDB_KEYEXIST)
+					*failed = keys[i].idx;
+				break;
+			}
+			db_encodedata(ctx, newdata.mv_data, rp, aclrule,
+			    aclrulesize);
+			(*changed)++;
+		}
+
+		i++;
+		r = mdb_cursor_get(cur, &key, &data, MDB_NEXT);
+	}
+
+	if (r == MDB_NOTFOUND)
+		r = 0;
+
+	mdb_cursor_close(cur);
+
+	if (r == 0 && *changed == 0) {
+		key.mv_data = (void *)bloomkey;
+		key.mv_size = sizeof(bloomkey);
+		if ((r = mdb_get(txn, ctx->dbi, &key, &data)) == MDB_NOTFOUND)
+			r = putfilter(ctx, txn);
+	} else if (r == 0) {
+		r = putfilter(ctx, txn);
+	}
+
+	if (r == 0)
+		r = mdb_txn_commit(txn);
+	else
+		mdb_txn_abort(txn);
+
+	return r;
+}
+
+/*
+ * Make the database contain exactly the "nrules" ACL rules in "rules". Rules
+ * that are new are stored, rules of which the ACL changed are replaced and
+ * rules that are not in "rules" anymore are removed, all in one transaction.
+ * Rules that did not change are not written. Readers see the previous version
+ * of the database until the transaction is committed. If the map is full it
+ * is grown and the transaction is retried.
+ *
+ * Must return 0 on success with "changed" set to the number of stored,
+ * replaced and removed rules. Must return -1 on failure with "failed" set to
+ * the index of the rule that could not be stored, or to "nrules".
+ */
+int
+a2acl_syncaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *changed, size_t *failed)
+{
+	struct bulkkey *keys;
+	char *keybuf;
+	int r;
+
+	*changed = 0;
+	*failed = nrules;
+
+	if ((r = newbulkkeys(ctx, &keys, &keybuf, rules, nrules, failed)) == -1)
+		return -1;
+	if (r != 0) {
+		printerr(stderr, r);
+		return -1;
+	}
+
+	while ((r = syncrules(ctx, keys, rules, nrules, changed,
+	    failed)) == MDB_MAP_FULL) {
+		if ((r = growmap(ctx->env)) != 0)
+			break;
+	}
+
+	if (r != 0) {
+		printerr(stderr, r);
+		*changed = 0;
+	}
+	free(keybuf);
+	free(keys);
+	return r == 0 ? 0 : -1;
+}
+
+/*
+ * Copy the metadata record into "meta". "metasize" is a value/result
+ * parameter and is set to 0 if there is no metadata record.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_getmeta(a2acl_ctx *ctx, void *meta, size_t *metasize)
+{
+	MDB_val key, data;
+	MDB_txn *txn;
+	int r;
+
+	key.mv_data = (void *)metakey;
+	key.mv_size = sizeof(metakey);
+
+	if ((r = mdb_txn_begin(ctx->env, NULL, MDB_RDONLY, &txn)) != 0) {
+		printerr(stderr, r);
+		return -1;
+	}
+
+	r = mdb_get(txn, ctx->dbi, &key, &data);
+	if (r == MDB_NOTFOUND) {
+		*metasize = 0;
+		r = 0;
+	} else if (r == 0 && data.mv_size <= *metasize) {
+		memcpy(meta, data.mv_data, data.mv_size);
+		*metasize = data.mv_size;
+	} else if (r == 0) {
+		r = -1;
+	} else {
+		printerr(stderr, r);
+	}
+
+	mdb_txn_abort(txn);
+	return r == 0 ? 0 : -1;
+}
+
+/*
+ * Replace the metadata record with "meta". If the map is full it is grown and
+ * the record is stored again.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_putmeta(a2acl_ctx *ctx, const void *meta, size_t metasize)
+{
+	MDB_val key, data;
+	MDB_txn *txn;
+	int r;
+
+	key.mv_data = (void *)metakey;
+	key.mv_size = sizeof(metakey);
+
+	do {
+		data.mv_data = (void *)meta;
+		data.mv_size = metasize;
+
+		if ((r = mdb_txn_begin(ctx->env, NULL, 0, &txn)) != 0)
+			break;
+
+		if ((r = mdb_put(txn, ctx->dbi, &key, &data, 0)) == 0)
+			r = mdb_txn_commit(txn);
+		else
+			mdb_txn_abort(txn);
+	} while (r == MDB_MAP_FULL && (r = growmap(ctx->env)) == 0);
+
+	if (r != 0) {
+		printerr(stderr, r);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Let the read transaction "rt" point to the Bloom filter in its snapshot of
+ * the database, if there is one.
+ */
+static void
+getfilter(a2acl_ctx *ctx, struct rdtxn *rt)
+{
+	MDB_val key, data;
+
+	rt->filter = NULL;
+	rt->filtersize = 0;
+
+	key.mv_data = (void *)bloomkey;
+	key.mv_size = sizeof(bloomkey);
+	if (mdb_get(rt->txn, ctx->dbi, &key, &data) == 0) {
+		rt->filter = data.mv_data;
+		rt->filtersize = data.mv_size;
+	}
+}
+
+/*
+ * Increment a statistic of the calling thread. Only the thread itself writes
+ * its statistics, so no atomic read-modify-write is needed.
+ */
+static void
+countstat(atomic_size_t *n)
+{
+	atomic_store_explicit(n, atomic_load_explicit(n, memory_order_relaxed) +
+	    1, memory_order_relaxed);
+}
+
+/*
+ * Begin a read in the calling thread. All lookups until the matching
+ * a2acl_endread see the same snapshot of the database.
+ *
+ * The read transaction and cursor of the thread are created on the first call
+ * and renewed on subsequent calls. Reads may be nested, only the outermost read
+ * renews and resets the transaction.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_beginread(a2acl_ctx *ctx)
+{
+	struct rdtxn *rt;
+	int r;
+
+	if ((rt = pthread_getspecific(ctx->rdkey)) == NULL) {
+		if ((rt = calloc(1, sizeof(*rt))) == NULL)
+			return -1;
+
+		if ((r = mdb_txn_begin(ctx->env, NULL, MDB_RDONLY,
+		    &rt->txn)) != 0) {
+			printerr(stderr, r);
+			free(rt);
+			return -1;
+		}
+
+		if ((r = mdb_cursor_open(rt->txn, ctx->dbi, &rt->cur)) != 0) {
+			printerr(stderr, r);
+			mdb_txn_abort(rt->txn);
+			free(rt);
+			return -1;
+		}
+
+		if (pthread_setspecific(ctx->rdkey, rt) != 0) {
+			mdb_cursor_close(rt->cur);
+			mdb_txn_abort(rt->txn);
+			free(rt);
+			return -1;
+		}
+
+		rt->ctx = ctx;
+		pthread_mutex_lock(&ctx->rdlock);
+		rt->next = ctx->rdtxns;
+		if (rt->next)
+			rt->next->prev = rt;
+		ctx->rdtxns = rt;
+		pthread_mutex_unlock(&ctx->rdlock);
+	} else if (rt->depth == 0 && rt->txn == NULL) {
+		/* the environment was opened again, see a2acl_dbinstall */
+		if ((r = mdb_txn_begin(ctx->env, NULL, MDB_RDONLY,
+		    &rt->txn)) != 0) {
+			printerr(stderr, r);
+			return -1;
+		}
+		if ((r = mdb_cursor_open(rt->txn, ctx->dbi, &rt->cur)) != 0) {
+			printerr(stderr, r);
+			mdb_txn_abort(rt->txn);
+			rt->txn = NULL;
+			return -1;
+		}
+	} else if (rt->depth == 0) {
+		if ((r = mdb_txn_renew(rt->txn)) != 0 ||
+		    (r = mdb_cursor_renew(rt->txn, rt->cur)) != 0) {
+			printerr(stderr, r);
+			return -1;
+		}
+	}
+
+	if (rt->depth == 0)
+		getfilter(ctx, rt);
+
+	rt->depth++;
+	return 0;
+}
+
+/*
+ * End a read that was started with a2acl_beginread. If this is the outermost
+ * read, the read transaction of the calling thread is reset so that it doesn't
+ * hold on to old pages of the database.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_endread(a2acl_ctx *ctx)
+{
+	struct rdtxn *rt;
+
+	if ((rt = pthread_getspecific(ctx->rdkey)) == NULL || rt->depth == 0)
+		return -1;
+
+	if (--rt->depth == 0)
+		mdb_txn_reset(rt->txn);
+
+	return 0;
+}
+
+/*
+ * Search for the ACL rule of a remote selector and local ID with the read
+ * transaction "rt" of the calling thread, see a2acl_viewaclrule.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+viewrule(a2acl_ctx *ctx, struct rdtxn *rt, const char **aclrule,
+    size_t *aclrulesize, const char *remotesel, size_t remoteselsize,
+    const char *localid, size_t localidsize)
+{
+	MDB_val key, data, *newkey;
+	char keybuf[2 * A2ID_MAXSZ + 2];
+	int r;
+
+	if (remotesel == NULL || remoteselsize == 0 || localid == NULL ||
+	    localidsize == 0)
+		return -1;
+
+	/* keys of ids are small enough for the stack */
+	newkey = NULL;
+	if (remoteselsize < A2ID_MAXSZ && localidsize < A2ID_MAXSZ) {
+		key.mv_data = keybuf;
+		key.mv_size = keysize(ctx, remoteselsize, localidsize);
+		writekey(ctx, keybuf, remotesel, remoteselsize, localid,
+		    localidsize);
+	} else {
+		if ((newkey = db_newkey(ctx, remotesel, remoteselsize, localid,
+		    localidsize)) == NULL)
+			return -1;
+		key = *newkey;
+	}
+
+	countstat(&rt->probes);
+	if (rt->filter != NULL && !a2acl_bloomhas(rt->filter, rt->filtersize,
+	    keyhash(ctx, &key))) {
+		countstat(&rt->skipped);
+		db_freeval(newkey);
+		*aclrule = NULL;
+		*aclrulesize = 0;
+		return 0;
+	}
+
+	r = mdb_cursor_get(rt->cur, &key, &data, MDB_SET_KEY);
+	db_freeval(newkey);
+
+	if (r == MDB_NOTFOUND) {
+		if (rt->filter != NULL)
+			countstat(&rt->falsepos);
+		*aclrule = NULL;
+		*aclrulesize = 0;
+		return 0;
+	} else if (r != 0) {
+		printerr(stderr, r);
+		return -1;
+	}
+
+	if (db_decodedata(ctx, aclrule, aclrulesize, &key, &data) == -1) {
+		printerr(stderr, MDB_CORRUPTED);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Search for a communication ACL rule based on a remote selector and local ID.
+ *
+ * "aclrule" is set to point to the ACL rule in the memory map of the database,
+ * which stays valid until the read of the calling thread ends. If no ACL rule
+ * is found then "aclrule" is set to NULL and "aclrulesize" is set to 0. The
+ * database is only searched if the key might be in the Bloom filter, with the
+ * cursor of the calling thread, which is usually still on the page of the
+ * previous lookup of the same local ID.
+ *
+ * Must be called within a read, see a2acl_beginread.
+ *
+ * Must return 0 on success, -1 on error. If no "aclrule" is found, 0 is
+ * returned and *aclrulesize is set to 0.
+ */
+int
+a2acl_viewaclrule(a2acl_ctx *ctx, const char **aclrule, size_t *aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
+{
+	struct rdtxn *rt;
+
+	rt = pthread_getspecific(ctx->rdkey);
+	if (rt == NULL || rt->depth == 0)
+		return -1;
+
+	if (aclrule == NULL || aclrulesize == NULL)
+		return -1;
+
+	return viewrule(ctx, rt, aclrule, aclrulesize, remotesel,
+	    remoteselsize, localid, localidsize);
+}
+
+/*
+ * Search for the ACL rules of the "nkeys" keys in "keys", most specific first,
+ * and stop at the first one that is found. All keys are looked up in the
+ * snapshot of the current read with the same cursor, see a2acl_viewaclrule.
+ *
+ * Must be called within a read, see a2acl_beginread.
+ *
+ * Must return 0 on success with "idx" set to the index of the key of which the
+ * ACL rule is found, or to "nkeys" if none is found. Must return -1 on error.
+ */
+int
+a2acl_viewaclrules(a2acl_ctx *ctx, size_t *idx, const char **aclrule,
+    size_t *aclrulesize, const struct a2aclkey *keys, size_t nkeys)
+{
+	struct rdtxn *rt;
+	size_t i;
+
+	rt = pthread_getspecific(ctx->rdkey);
+	if (rt == NULL || rt->depth == 0)
+		return -1;
+
+	if (idx == NULL || aclrule == NULL || aclrulesize == NULL)
+		return -1;
+
+	*aclrule = NULL;
+	*aclrulesize = 0;
+
+	for (i = 0; i < nkeys; i++) {
+		if (viewrule(ctx, rt, aclrule, aclrulesize, keys[i].remotesel,
+		    keys[i].remoteselsize, keys[i].localid,
+		    keys[i].localidsize) == -1)
+			return -1;
+		if (*aclrulesize > 0)
+			break;
+	}
+
+	*idx = i;
+	return 0;
+}
+
 /*
  * Search for a communication ACL rule based on a remote selector and local ID.
  *
@@ -369,51 +2030,70 @@ a2acl_putaclrule(const char *aclrule, size_t aclrulesize, const char *remotesel,
  * parameter. If no ACL rule is found then "aclrule" is left untouched and
  * "aclrulesize" is set to 0.
  *
+ * If the calling thread is not in a read, a read is done for just this lookup.
+ *
  * Must return 0 on success, -1 on error. If no "aclrule" is found, 0 is
  * returned and *aclrulesize is set to 0.
  */
 int
-a2acl_getaclrule(char *aclrule, size_t *aclrulesize, const char *remotesel,
-    size_t remoteselsize, const char *localid, size_t localidsize)
+a2acl_getaclrule(a2acl_ctx *ctx, char *aclrule, size_t *aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
 {
-	struct dbentry de;
-	MDB_val *key, data;
+	const char *rule;
+	size_t rulesize;
 	int r;
 
-	if (aclrule == NULL || aclrulesize == NULL || remotesel == NULL ||
-	    remoteselsize == 0 || localid == NULL || localidsize == 0)
+	if (aclrule == NULL || aclrulesize == NULL)
 		return -1;
 
-	key = db_newkey(remotesel, remoteselsize, localid, localidsize);
-	if (key == NULL)
+	if (a2acl_beginread(ctx) == -1)
 		return -1;
 
-	if ((r = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn)) != 0)
-		printerrx(stderr, r, 1);
+	r = a2acl_viewaclrule(ctx, &rule, &rulesize, remotesel, remoteselsize,
+	    localid, localidsize);
 
-	r = mdb_get(txn, dbi, key, &data);
-	db_freeval(key);
+	if (r == 0 && rulesize > *aclrulesize)
+		r = -1;
 
-	if (r != 0) {
-		mdb_txn_abort(txn);
-		if (r == MDB_NOTFOUND) {
-			*aclrulesize = 0;
-			return 0;
-		} else
-			printerrx(stderr, r, 1);
+	if (r == 0) {
+		if (rulesize > 0)
+			memcpy(aclrule, rule, rulesize);
+		*aclrulesize = rulesize;
 	}
 
-	db_datatodbentry(&de, &data);
+	a2acl_endread(ctx);
 
-	if (de.aclrulesize > *aclrulesize) {
-		mdb_txn_abort(txn);
-		return -1;
-	}
+	return r;
+}
 
-	memcpy(aclrule, de.aclrule, de.aclrulesize);
-	*aclrulesize = de.aclrulesize;
+/*
+ * Update "stats" with the lookup statistics of all threads, including threads
+ * that exited. Lookups that are done at the same time might not be counted yet.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_stats(a2acl_ctx *ctx, struct a2aclstats *stats)
+{
+	struct rdtxn *rt;
+
+	pthread_mutex_lock(&ctx->rdlock);
+	*stats = ctx->stats;
+	for (rt = ctx->rdtxns; rt != NULL; rt = rt->next) {
+		stats->probes += atomic_load_explicit(&rt->probes,
+		    memory_order_relaxed);
+		stats->skipped += atomic_load_explicit(&rt->skipped,
+		    memory_order_relaxed);
+		stats->falsepos += atomic_load_explicit(&rt->falsepos,
+		    memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&ctx->rdlock);
 
-	mdb_txn_abort(txn);
+	stats->fprate = 0;
+	if (stats->skipped + stats->falsepos > 0)
+		stats->fprate = (double)stats->falsepos /
+		    (stats->skipped + stats->falsepos);
 
 	return 0;
 }
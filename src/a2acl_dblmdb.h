@@ -23,4 +23,5 @@ struct dbentry {
 	size_t aclrulesize;
 };
 
-void printdb(FILE *);
+void printdb(FILE *, a2acl_ctx *);
+void printlocalid(FILE *, a2acl_ctx *, const char *);
@@ -14,61 +14,485 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#include "a2acl.h"
 
 /*
  * Extremely simple memory-only database implementation for ARPA2 ACL.
  *
  * Time complexity:
- *   find: O(n)
- *   insert/delete: O(n)
+ *   find: O(1)
+ *   insert: amortized O(1)
+ *   delete: O(n), only by replacing all rules with a2acl_syncaclrules
  *
  * Space complexity:
  *   O(n)
+ *
+ * Rules are kept in an array of entries that is indexed by an open addressing
+ * hash table with linear probing on the hash of the remote selector and local
+ * ID. Both grow geometrically. The bytes of all rules are copied into an arena
+ * of large blocks that is only freed as a whole, so the ACL rule of a replaced
+ * rule takes up space until the database is closed or synced.
+ *
+ * The table is only modified while importing, so lookups may be done by
+ * several threads at the same time.
+ *
+ * A Bloom filter of all keys is checked before the table is searched, so that
+ * most lookups of keys that are not in the table don't have to search it.
+ *
+ * Each thread counts its lookups in its own statistics, a2acl_stats adds them
+ * up.
  */
 
+#define ARENAMIN (64 * 1024)	/* minimum size of an arena block */
+#define MINENTRIES 16
+#define CACHELINE 64
+
 struct dbmentry {
-	void *remotesel;
+	const char *remotesel;
 	size_t remoteselsize;
-	void *localid;
+	const char *localid;
 	size_t localidsize;
-	void *aclrule;
+	const char *aclrule;
 	size_t aclrulesize;
+	uint64_t hash;		/* a2acl_keyhash of remotesel and localid */
+};
+
+struct dbmarena {
+	struct dbmarena *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct dbmtable {
+	struct dbmentry *entries;
+	size_t nentries;
+	size_t maxentries;
+	size_t *slots;		/* index in entries + 1, or 0 if empty */
+	size_t nslots;		/* 0 or a power of two */
+	struct dbmarena *arena;
 };
 
 void
 printdbmentry(FILE *fp, const struct dbmentry *ep)
 {
 	fprintf(fp, "remotesel: %zu %.*s\nlocalid: %zu %.*s\naclrule: %zu %.*s\n",
-	    ep->remoteselsize, (int)ep->remoteselsize, (char*)ep->remotesel,
-	    ep->localidsize, (int)ep->localidsize, (char*)ep->localid, ep->aclrulesize,
-	    (int)ep->aclrulesize, (char*)ep->aclrule);
+	    ep->remoteselsize, (int)ep->remoteselsize, ep->remotesel,
+	    ep->localidsize, (int)ep->localidsize, ep->localid, ep->aclrulesize,
+	    (int)ep->aclrulesize, ep->aclrule);
 }
 
-struct dbmentry *dbm_alloc(const void *, size_t, const void *, size_t,
-    const void *, size_t);
-void dbm_free(struct dbmentry *);
+/*
+ * Lookup statistics of one thread. Only the thread itself writes them, and
+ * each is on its own cache line, so lookups of different threads never write
+ * to the same cache line.
+ */
+struct dbmstats {
+	a2acl_ctx *ctx;
+	atomic_size_t probes, skipped, falsepos;
+	struct dbmstats *prev, *next;
+};
 
-static struct dbmentry **list = NULL;
-static size_t listsize = 0;
+struct a2acl_ctx {
+	struct dbmtable tab;
+	void *meta;
+	size_t metasize;
+	uint8_t *filter;	/* Bloom filter of all keys, or NULL */
+	size_t filtersize;
+	size_t filterkeys;	/* number of keys the filter is sized for */
+	pthread_key_t statskey;
+	pthread_mutex_t statslock;
+	struct dbmstats *threads;	/* statistics of all threads */
+	struct a2aclstats stats;	/* of threads that exited */
+};
 
 /*
- * Initialize a database backend.
+ * Free all entries, the hash table and the arena of "tab".
+ */
+static void
+dbm_freetable(struct dbmtable *tab)
+{
+	struct dbmarena *ap;
+
+	while ((ap = tab->arena) != NULL) {
+		tab->arena = ap->next;
+		free(ap);
+	}
+
+	free(tab->slots);
+	tab->slots = NULL;
+	tab->nslots = 0;
+
+	free(tab->entries);
+	tab->entries = NULL;
+	tab->nentries = tab->maxentries = 0;
+}
+
+/*
+ * Make sure the arena of "tab" has room for "size" more bytes in its current
+ * block. Each new block is at least twice as large as the previous one.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+dbm_arenareserve(struct dbmtable *tab, size_t size)
+{
+	struct dbmarena *ap;
+	size_t blocksize;
+
+	if (tab->arena != NULL && tab->arena->size - tab->arena->used >= size)
+		return 0;
+
+	blocksize = ARENAMIN;
+	if (tab->arena != NULL && tab->arena->size <= SIZE_MAX / 2)
+		blocksize = 2 * tab->arena->size;
+	if (blocksize < size)
+		blocksize = size;
+
+	if (blocksize > SIZE_MAX - sizeof(*ap))
+		return -1; /* overflow */
+
+	if ((ap = malloc(sizeof(*ap) + blocksize)) == NULL)
+		return -1; /* errno set */
+
+	ap->next = tab->arena;
+	ap->size = blocksize;
+	ap->used = 0;
+	tab->arena = ap;
+	return 0;
+}
+
+/*
+ * Copy "size" bytes from "src" into the arena of "tab".
+ *
+ * Return a pointer to the copy on success, NULL on failure with errno set.
+ */
+static const char *
+dbm_arenacopy(struct dbmtable *tab, const void *src, size_t size)
+{
+	char *cp;
+
+	if (dbm_arenareserve(tab, size) == -1)
+		return NULL;
+
+	cp = &tab->arena->data[tab->arena->used];
+	tab->arena->used += size;
+	memcpy(cp, src, size);
+	return cp;
+}
+
+/*
+ * Return the slot in the hash table of "tab" of the rule with the given remote
+ * selector and local ID, or the empty slot where it should be added if it is
+ * not in the table. The table must have at least one empty slot.
+ */
+static size_t *
+dbm_slot(const struct dbmtable *tab, uint64_t hash, const char *remotesel,
+    size_t remoteselsize, const char *localid, size_t localidsize)
+{
+	const struct dbmentry *ep;
+	size_t i, mask;
+
+	mask = tab->nslots - 1;
+	for (i = hash & mask; tab->slots[i] != 0; i = (i + 1) & mask) {
+		ep = &tab->entries[tab->slots[i] - 1];
+		if (ep->hash == hash && ep->remoteselsize == remoteselsize &&
+		    ep->localidsize == localidsize &&
+		    memcmp(ep->remotesel, remotesel, remoteselsize) == 0 &&
+		    memcmp(ep->localid, localid, localidsize) == 0)
+			break;
+	}
+
+	return &tab->slots[i];
+}
+
+/*
+ * Return the entry in "tab" with the given remote selector and local ID, or
+ * NULL if there is no such entry.
+ */
+static const struct dbmentry *
+dbm_find(const struct dbmtable *tab, uint64_t hash, const char *remotesel,
+    size_t remoteselsize, const char *localid, size_t localidsize)
+{
+	size_t *slot;
+
+	if (tab->nslots == 0)
+		return NULL;
+
+	slot = dbm_slot(tab, hash, remotesel, remoteselsize, localid,
+	    localidsize);
+	if (*slot == 0)
+		return NULL;
+
+	return &tab->entries[*slot - 1];
+}
+
+/*
+ * Make sure "tab" has room for "nentries" entries, while at least half of the
+ * slots in the hash table stay empty, and that its arena has room for "size"
+ * more bytes. The entries and the hash table grow to at least twice their size
+ * so that adding entries one by one costs amortized O(1).
+ *
+ * Return 0 on success, -1 on failure with errno set. On failure "tab" is still
+ * usable.
+ */
+static int
+dbm_reserve(struct dbmtable *tab, size_t nentries, size_t size)
+{
+	struct dbmentry *entries;
+	size_t *slots, *slot, i, n, mask;
+
+	if (nentries > tab->maxentries) {
+		n = MINENTRIES;
+		if (tab->maxentries > n)
+			n = tab->maxentries;
+		while (n < nentries && n <= SIZE_MAX / sizeof(*entries) / 2)
+			n *= 2;
+		if (n < nentries)
+			return -1; /* overflow */
+
+		if ((entries = realloc(tab->entries, n * sizeof(*entries))) ==
+		    NULL)
+			return -1; /* errno set */
+
+		tab->entries = entries;
+		tab->maxentries = n;
+	}
+
+	if (nentries >= tab->nslots / 2) {
+		n = 2 * MINENTRIES;
+		if (tab->nslots > n)
+			n = tab->nslots;
+		while (nentries >= n / 2 && n <= SIZE_MAX / sizeof(*slots) / 2)
+			n *= 2;
+		if (nentries >= n / 2)
+			return -1; /* overflow */
+
+		if ((slots = calloc(n, sizeof(*slots))) == NULL)
+			return -1; /* errno set */
+
+		mask = n - 1;
+		for (i = 0; i < tab->nentries; i++) {
+			slot = &slots[tab->entries[i].hash & mask];
+			while (*slot != 0)
+				slot = &slots[(slot - slots + 1) & mask];
+			*slot = i + 1;
+		}
+
+		free(tab->slots);
+		tab->slots = slots;
+		tab->nslots = n;
+	}
+
+	if (size > 0 && dbm_arenareserve(tab, size) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Return the number of arena bytes needed for "nrules" rules in "rules", or
+ * SIZE_MAX on overflow.
+ */
+static size_t
+dbm_rulesbytes(const struct a2aclrule *rules, size_t nrules)
+{
+	size_t i, n, size;
+
+	size = 0;
+	for (i = 0; i < nrules; i++) {
+		n = rules[i].remoteselsize + rules[i].localidsize;
+		if (n < rules[i].remoteselsize ||
+		    n + rules[i].aclrulesize < n ||
+		    SIZE_MAX - size <= n + rules[i].aclrulesize)
+			return SIZE_MAX;
+		size += n + rules[i].aclrulesize;
+	}
+
+	return size;
+}
+
+/*
+ * Store a copy of a rule in "tab". "hash" must be the a2acl_keyhash of the
+ * remote selector and local ID. Like the LMDB backend a rule is never replaced,
+ * a rule with the same remote selector and local ID as a rule in "tab" fails
+ * with errno set to EEXIST.
+ *
+ * Return 0 on success and -1 on failure with errno set. On failure "tab" is
+ * left as it was.
+ */
+static int
+dbm_put(struct dbmtable *tab, const char *aclrule, size_t aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize, uint64_t hash)
+{
+	struct dbmentry *ep;
+	size_t *slot, keysize;
+
+	if (SIZE_MAX - remoteselsize < localidsize ||
+	    SIZE_MAX - remoteselsize - localidsize < aclrulesize)
+		return -1; /* overflow */
+
+	if (dbm_reserve(tab, tab->nentries + 1, 0) == -1)
+		return -1; /* errno set */
+
+	slot = dbm_slot(tab, hash, remotesel, remoteselsize, localid,
+	    localidsize);
+	if (*slot != 0) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	/* keep all parts of the rule together */
+	keysize = remoteselsize + localidsize;
+	if (dbm_arenareserve(tab, keysize + aclrulesize) == -1)
+		return -1; /* errno set */
+
+	ep = &tab->entries[tab->nentries];
+	ep->remotesel = dbm_arenacopy(tab, remotesel, remoteselsize);
+	ep->remoteselsize = remoteselsize;
+	ep->localid = dbm_arenacopy(tab, localid, localidsize);
+	ep->localidsize = localidsize;
+	ep->aclrule = dbm_arenacopy(tab, aclrule, aclrulesize);
+	ep->aclrulesize = aclrulesize;
+	ep->hash = hash;
+
+	*slot = ++tab->nentries;
+	return 0;
+}
+
+/*
+ * Unlink the statistics "arg" of a thread from its context, add them to those
+ * of the threads that exited and free them. Called when a thread exits.
+ */
+static void
+freestats(void *arg)
+{
+	struct dbmstats *st = arg;
+	a2acl_ctx *ctx = st->ctx;
+
+	pthread_mutex_lock(&ctx->statslock);
+	if (st->prev)
+		st->prev->next = st->next;
+	else
+		ctx->threads = st->next;
+	if (st->next)
+		st->next->prev = st->prev;
+	ctx->stats.probes += st->probes;
+	ctx->stats.skipped += st->skipped;
+	ctx->stats.falsepos += st->falsepos;
+	pthread_mutex_unlock(&ctx->statslock);
+
+	free(st);
+}
+
+/*
+ * Return the statistics of the calling thread, allocate them on first use.
+ *
+ * Return NULL on failure.
+ */
+static struct dbmstats *
+threadstats(a2acl_ctx *ctx)
+{
+	struct dbmstats *st;
+	size_t size;
+
+	if ((st = pthread_getspecific(ctx->statskey)) != NULL)
+		return st;
+
+	size = (sizeof(*st) + CACHELINE - 1) & ~(size_t)(CACHELINE - 1);
+	if ((st = aligned_alloc(CACHELINE, size)) == NULL)
+		return NULL;
+	memset(st, 0, size);
+
+	if (pthread_setspecific(ctx->statskey, st) != 0) {
+		free(st);
+		return NULL;
+	}
+
+	st->ctx = ctx;
+	pthread_mutex_lock(&ctx->statslock);
+	st->next = ctx->threads;
+	if (st->next)
+		st->next->prev = st;
+	ctx->threads = st;
+	pthread_mutex_unlock(&ctx->statslock);
+
+	return st;
+}
+
+/*
+ * Increment a statistic of the calling thread. Only the thread itself writes
+ * its statistics, so no atomic read-modify-write is needed.
+ */
+static void
+countstat(atomic_size_t *n)
+{
+	atomic_store_explicit(n, atomic_load_explicit(n, memory_order_relaxed) +
+	    1, memory_order_relaxed);
+}
+
+/*
+ * Initialize a database backend. "path" is not used, every context starts with
+ * an empty table.
  *
  * Must return 0 on success, -1 on failure.
  */
 int
-a2acl_dbopen(const char *path)
+a2acl_dbopen(a2acl_ctx **ctx, const char *path)
 {
 	/* silence compiler */
 	path = NULL;
 
-	if (list != NULL)
+	if ((*ctx = calloc(1, sizeof(**ctx))) == NULL)
+		return -1;
+
+	if (pthread_key_create(&(*ctx)->statskey, freestats) != 0) {
+		free(*ctx);
+		*ctx = NULL;
+		return -1;
+	}
+
+	if (pthread_mutex_init(&(*ctx)->statslock, NULL) != 0) {
+		pthread_key_delete((*ctx)->statskey);
+		free(*ctx);
+		*ctx = NULL;
 		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a new database. The table is only in memory, so this is the same as
+ * a2acl_dbopen.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbcreate(a2acl_ctx **ctx, const char *path)
+{
+	return a2acl_dbopen(ctx, path);
+}
+
+/*
+ * Install a database that was created with a2acl_dbcreate. Nothing is stored
+ * on disk, so there is nothing to do.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbinstall(a2acl_ctx *ctx)
+{
+	(void)ctx;
 
 	return 0;
 }
@@ -79,21 +503,29 @@ a2acl_dbopen(const char *path)
  * Must return 0 on success, -1 on failure.
  */
 int
-a2acl_dbclose(void)
+a2acl_dbclose(a2acl_ctx *ctx)
 {
-	if (list == NULL)
+	struct dbmstats *st;
+
+	if (ctx == NULL)
 		return 0;
 
-	while (listsize-- > 0) {
-		dbm_free(list[listsize]);
-		list[listsize] = NULL;
+	pthread_key_delete(ctx->statskey);
+	while ((st = ctx->threads) != NULL) {
+		ctx->threads = st->next;
+		free(st);
 	}
+	pthread_mutex_destroy(&ctx->statslock);
 
-	if (listsize > 0)
-		return -1;
+	dbm_freetable(&ctx->tab);
+
+	free(ctx->meta);
+	ctx->meta = NULL;
 
-	free(list);
-	list = NULL;
+	free(ctx->filter);
+	ctx->filter = NULL;
+
+	free(ctx);
 
 	return 0;
 }
@@ -103,144 +535,408 @@ a2acl_dbclose(void)
  *
  * Return 0 on success, -1 on failure.
  */
-int a2acl_count(size_t *count)
+int a2acl_count(a2acl_ctx *ctx, size_t *count)
 {
-	*count = listsize;
+	*count = ctx->tab.nentries;
 	return 0;
 }
 
+/*
+ * Replace the Bloom filter with one of all keys in the table that has room for
+ * "nkeys" keys. If there is not enough memory there is no filter, so that all
+ * lookups search the table.
+ */
+static void
+dbm_buildfilter(a2acl_ctx *ctx, size_t nkeys)
+{
+	size_t i;
+
+	free(ctx->filter);
+	ctx->filter = NULL;
+	ctx->filtersize = ctx->filterkeys = 0;
+
+	if ((ctx->filtersize = a2acl_bloomsize(nkeys)) == 0)
+		return;
+
+	if ((ctx->filter = calloc(1, ctx->filtersize)) == NULL) {
+		ctx->filtersize = 0;
+		return;
+	}
+	ctx->filterkeys = nkeys;
+
+	for (i = 0; i < ctx->tab.nentries; i++)
+		a2acl_bloomadd(ctx->filter, ctx->filtersize,
+		    ctx->tab.entries[i].hash);
+}
+
 /*
  * Store a communication ACL rule given a remote and local ID. A copy of
  * "aclrule", "remotesel" and "localid" must be made since these are being
- * free(3)d after this functions returns.
+ * free(3)d after this functions returns. Fails if a rule with the same remote
+ * selector and local ID is stored already.
  *
  * Must return 0 on success, -1 on failure.
  */
 int
-a2acl_putaclrule(const char *aclrule, size_t aclrulesize, const char *remotesel,
-    size_t remoteselsize, const char *localid, size_t localidsize)
+a2acl_putaclrule(a2acl_ctx *ctx, const char *aclrule, size_t aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
 {
-	struct dbmentry *ep;
+	uint64_t hash;
 
 	if (aclrule == NULL || aclrulesize == 0 || remotesel == NULL ||
 	    remoteselsize == 0 || localid == NULL || localidsize == 0)
 		return -1;
 
-	if ((listsize * sizeof(ep)) > ((listsize + 1) * sizeof(ep)))
-		return -1; /* overflow */
+	hash = a2acl_keyhash(remotesel, remoteselsize, localid, localidsize);
 
-	if ((ep = dbm_alloc(aclrule, aclrulesize, remotesel, remoteselsize, localid,
-	    localidsize)) == NULL)
+	if (dbm_put(&ctx->tab, aclrule, aclrulesize, remotesel, remoteselsize,
+	    localid, localidsize, hash) == -1)
 		return -1;
 
-	if ((list = realloc(list, (listsize + 1) * sizeof(ep))) == NULL) {
-		dbm_free(ep);
-		ep = NULL;
+	/* grow the filter like a vector, so that adding n keys costs O(n) */
+	if (ctx->filter != NULL && ctx->tab.nentries <= ctx->filterkeys)
+		a2acl_bloomadd(ctx->filter, ctx->filtersize, hash);
+	else
+		dbm_buildfilter(ctx, 2 * ctx->tab.nentries);
+
+	return 0;
+}
+
+/*
+ * Store "nrules" ACL rules. The table and the arena are grown once for all
+ * rules.
+ *
+ * Must return 0 on success, -1 on failure with "failed" set to the index of the
+ * rule that could not be stored, or to "nrules".
+ */
+int
+a2acl_putaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *failed)
+{
+	const struct a2aclrule *rp;
+	size_t i, size;
+
+	*failed = nrules;
+
+	if (SIZE_MAX - ctx->tab.nentries < nrules)
+		return -1; /* overflow */
+
+	if ((size = dbm_rulesbytes(rules, nrules)) == SIZE_MAX)
+		return -1; /* overflow */
+
+	if (dbm_reserve(&ctx->tab, ctx->tab.nentries + nrules, size) == -1)
 		return -1;
+
+	for (i = 0; i < nrules; i++) {
+		rp = &rules[i];
+		if (rp->aclrule == NULL || rp->aclrulesize == 0 ||
+		    rp->remotesel == NULL || rp->remoteselsize == 0 ||
+		    rp->localid == NULL || rp->localidsize == 0 ||
+		    dbm_put(&ctx->tab, rp->aclrule, rp->aclrulesize,
+		    rp->remotesel, rp->remoteselsize, rp->localid,
+		    rp->localidsize, a2acl_keyhash(rp->remotesel,
+		    rp->remoteselsize, rp->localid, rp->localidsize)) == -1) {
+			*failed = i;
+			dbm_buildfilter(ctx, ctx->tab.nentries);
+			return -1;
+		}
+	}
+
+	dbm_buildfilter(ctx, ctx->tab.nentries);
+	return 0;
+}
+
+/*
+ * Make the table contain exactly the "nrules" ACL rules in "rules". A new table
+ * is built next to the current one, each rule is looked up in the current
+ * table to count the changes. Copying the rules that did not change costs
+ * about as much as looking them up, so all rules are copied. The table is only
+ * replaced once all rules are stored, so on failure the table is left as it
+ * was.
+ *
+ * Must return 0 on success with "changed" set to the number of stored,
+ * replaced and removed rules. Must return -1 on failure with "failed" set to
+ * the index of the rule that could not be stored, or to "nrules".
+ */
+int
+a2acl_syncaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *changed, size_t *failed)
+{
+	struct dbmtable tab;
+	const struct dbmentry *ep;
+	const struct a2aclrule *rp;
+	uint64_t hash;
+	size_t i, nkept, size;
+
+	*changed = 0;
+	*failed = nrules;
+
+	memset(&tab, 0, sizeof(tab));
+
+	if ((size = dbm_rulesbytes(rules, nrules)) == SIZE_MAX)
+		return -1; /* overflow */
+
+	if (dbm_reserve(&tab, nrules, size) == -1)
+		goto err;
+
+	nkept = 0;
+	for (i = 0; i < nrules; i++) {
+		rp = &rules[i];
+		if (rp->aclrule == NULL || rp->aclrulesize == 0 ||
+		    rp->remotesel == NULL || rp->remoteselsize == 0 ||
+		    rp->localid == NULL || rp->localidsize == 0) {
+			*failed = i;
+			goto err;
+		}
+
+		hash = a2acl_keyhash(rp->remotesel, rp->remoteselsize,
+		    rp->localid, rp->localidsize);
+
+		if (dbm_put(&tab, rp->aclrule, rp->aclrulesize, rp->remotesel,
+		    rp->remoteselsize, rp->localid, rp->localidsize,
+		    hash) == -1) {
+			*failed = i;
+			goto err;
+		}
+
+		ep = dbm_find(&ctx->tab, hash, rp->remotesel,
+		    rp->remoteselsize, rp->localid, rp->localidsize);
+		if (ep == NULL) {
+			(*changed)++;
+			continue;
+		}
+
+		nkept++;
+		if (ep->aclrulesize != rp->aclrulesize ||
+		    memcmp(ep->aclrule, rp->aclrule, rp->aclrulesize) != 0)
+			(*changed)++;
 	}
 
-	list[listsize] = ep;
-	listsize++;
+	/* every old rule that is not in the new table is removed */
+	*changed += ctx->tab.nentries - nkept;
 
+	dbm_freetable(&ctx->tab);
+	ctx->tab = tab;
+
+	dbm_buildfilter(ctx, ctx->tab.nentries);
 	return 0;
+
+err:
+	dbm_freetable(&tab);
+	*changed = 0;
+	return -1;
 }
 
 /*
  * Search for a communication ACL rule based on a remote selector and local ID.
  *
- * "aclrule" must be allocated by the caller. "aclrulesize" is a value/result
- * parameter. If no ACL rule is found then "aclrule" is left untouched and
- * "aclrulesize" is set to 0.
+ * "aclrule" is set to point to the ACL rule in the arena, which stays valid
+ * until the database is closed or synced. If no ACL rule is found then
+ * "aclrule" is set to NULL and "aclrulesize" is set to 0.
+ *
+ * The table is only searched if the key might be in the Bloom filter. The
+ * remote selector and local ID must match exactly, like they would with a key
+ * in any other database.
  *
  * Must return 0 on success, -1 on error. If no "aclrule" is found, 0 is
  * returned and *aclrulesize is set to 0.
  */
 int
-a2acl_getaclrule(char *aclrule, size_t *aclrulesize, const char *remotesel,
-    size_t remoteselsize, const char *localid, size_t localidsize)
+a2acl_viewaclrule(a2acl_ctx *ctx, const char **aclrule, size_t *aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
 {
+	const struct dbmentry *ep;
+	struct dbmstats *st;
+	uint64_t hash;
+
 	if (aclrule == NULL || aclrulesize == NULL || remotesel == NULL ||
 	    remoteselsize == 0 || localid == NULL || localidsize == 0)
 		return -1;
 
-	for (size_t i = 0; i < listsize; i++) {
-		if (memcmp(list[i]->remotesel, remotesel, MIN(list[i]->remoteselsize,
-		    remoteselsize)) != 0)
-			continue;
+	*aclrule = NULL;
+	*aclrulesize = 0;
 
-		if (memcmp(list[i]->localid, localid, MIN(list[i]->localidsize,
-		    localidsize)) != 0)
-			continue;
+	if ((st = threadstats(ctx)) == NULL)
+		return -1;
 
-		if (list[i]->aclrulesize > *aclrulesize)
-			return -1;
+	hash = a2acl_keyhash(remotesel, remoteselsize, localid, localidsize);
 
-		memcpy(aclrule, list[i]->aclrule, list[i]->aclrulesize);
-		*aclrulesize = list[i]->aclrulesize;
+	countstat(&st->probes);
+	if (ctx->filter != NULL && !a2acl_bloomhas(ctx->filter,
+	    ctx->filtersize, hash)) {
+		countstat(&st->skipped);
 		return 0;
 	}
 
+	if ((ep = dbm_find(&ctx->tab, hash, remotesel, remoteselsize, localid,
+	    localidsize)) != NULL) {
+		*aclrule = ep->aclrule;
+		*aclrulesize = ep->aclrulesize;
+		return 0;
+	}
+
+	if (ctx->filter != NULL)
+		countstat(&st->falsepos);
+	return 0;
+}
+
+/*
+ * Search for the ACL rules of the "nkeys" keys in "keys" in turn and stop at
+ * the first one that is found, see a2acl_viewaclrule.
+ *
+ * Must return 0 on success with "idx" set to the index of the key of which the
+ * ACL rule is found, or to "nkeys" if none is found. Must return -1 on error.
+ */
+int
+a2acl_viewaclrules(a2acl_ctx *ctx, size_t *idx, const char **aclrule,
+    size_t *aclrulesize, const struct a2aclkey *keys, size_t nkeys)
+{
+	size_t i;
+
+	*aclrule = NULL;
 	*aclrulesize = 0;
+
+	for (i = 0; i < nkeys; i++) {
+		if (a2acl_viewaclrule(ctx, aclrule, aclrulesize,
+		    keys[i].remotesel, keys[i].remoteselsize, keys[i].localid,
+		    keys[i].localidsize) == -1)
+			return -1;
+		if (*aclrulesize > 0)
+			break;
+	}
+
+	*idx = i;
 	return 0;
 }
 
 /*
- * Allocate a new dbmentry structure.
+ * Search for a communication ACL rule based on a remote selector and local ID.
  *
- * Return a newly allocated structure on success that should be freed with
- * dbm_free by the caller when done. Return NULL on error with errno set.
+ * "aclrule" must be allocated by the caller. "aclrulesize" is a value/result
+ * parameter. If no ACL rule is found then "aclrule" is left untouched and
+ * "aclrulesize" is set to 0.
+ *
+ * Must return 0 on success, -1 on error. If no "aclrule" is found, 0 is
+ * returned and *aclrulesize is set to 0.
  */
-struct dbmentry *
-dbm_alloc(const void *aclrule, size_t aclrulesize, const void *remotesel,
-    size_t remoteselsize, const void *localid, size_t localidsize)
+int
+a2acl_getaclrule(a2acl_ctx *ctx, char *aclrule, size_t *aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
 {
-	struct dbmentry *ep = NULL;
+	const char *rule;
+	size_t rulesize;
 
-	if ((ep = calloc(1, sizeof(*ep))) == NULL)
-		goto err; /* errno set */
+	if (aclrule == NULL || aclrulesize == NULL)
+		return -1;
 
-	if ((ep->aclrule = malloc(aclrulesize)) == NULL)
-		goto err; /* errno set */
+	if (a2acl_viewaclrule(ctx, &rule, &rulesize, remotesel, remoteselsize,
+	    localid, localidsize) == -1)
+		return -1;
 
-	if ((ep->remotesel = malloc(remoteselsize)) == NULL)
-		goto err; /* errno set */
+	if (rulesize > *aclrulesize)
+		return -1;
 
-	if ((ep->localid = malloc(localidsize)) == NULL)
-		goto err; /* errno set */
+	if (rulesize > 0)
+		memcpy(aclrule, rule, rulesize);
+	*aclrulesize = rulesize;
+	return 0;
+}
 
-	memcpy(ep->aclrule, aclrule, aclrulesize);
-	memcpy(ep->remotesel, remotesel, remoteselsize);
-	memcpy(ep->localid, localid, localidsize);
+/*
+ * Copy the metadata record into "meta". "metasize" is a value/result
+ * parameter and is set to 0 if there is no metadata record.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_getmeta(a2acl_ctx *ctx, void *meta, size_t *metasize)
+{
+	if (ctx->metasize > *metasize)
+		return -1;
 
-	ep->aclrulesize = aclrulesize;
-	ep->remoteselsize = remoteselsize;
-	ep->localidsize = localidsize;
+	if (ctx->metasize > 0)
+		memcpy(meta, ctx->meta, ctx->metasize);
+	*metasize = ctx->metasize;
+	return 0;
+}
 
-	return ep;
+/*
+ * Replace the metadata record with a copy of "meta".
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_putmeta(a2acl_ctx *ctx, const void *meta, size_t metasize)
+{
+	void *cp;
 
-err:
-	dbm_free(ep);
-	return NULL;
+	if ((cp = malloc(metasize + 1)) == NULL)
+		return -1;
+	memcpy(cp, meta, metasize);
+
+	free(ctx->meta);
+	ctx->meta = cp;
+	ctx->metasize = metasize;
+	return 0;
 }
 
 /*
- * Free dbmentry structure.
+ * Begin a read. The table doesn't change during lookups, so there is nothing to
+ * do.
+ *
+ * Must return 0 on success, -1 on failure.
  */
-void
-dbm_free(struct dbmentry *ep)
+int
+a2acl_beginread(a2acl_ctx *ctx)
 {
-	if (ep == NULL)
-		return;
+	(void)ctx;
+
+	return 0;
+}
 
-	free(ep->aclrule);
-	ep->aclrule = NULL;
+/*
+ * End a read.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_endread(a2acl_ctx *ctx)
+{
+	(void)ctx;
+
+	return 0;
+}
 
-	free(ep->remotesel);
-	ep->remotesel = NULL;
+/*
+ * Update "stats" with the lookup statistics of all threads. Lookups that are
+ * done at the same time might not be counted yet.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_stats(a2acl_ctx *ctx, struct a2aclstats *stats)
+{
+	struct dbmstats *st;
+
+	pthread_mutex_lock(&ctx->statslock);
+	*stats = ctx->stats;
+	for (st = ctx->threads; st != NULL; st = st->next) {
+		stats->probes += atomic_load_explicit(&st->probes,
+		    memory_order_relaxed);
+		stats->skipped += atomic_load_explicit(&st->skipped,
+		    memory_order_relaxed);
+		stats->falsepos += atomic_load_explicit(&st->falsepos,
+		    memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&ctx->statslock);
 
-	free(ep->localid);
-	ep->localid = NULL;
+	stats->fprate = 0;
+	if (stats->skipped + stats->falsepos > 0)
+		stats->fprate = (double)stats->falsepos /
+		    (stats->skipped + stats->falsepos);
 
-	free(ep);
-	ep = NULL;
+	return 0;
 }
@@ -0,0 +1,1905 @@
+/*
+ * Copyright (c) 2019 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a2acl.h"
+
+/*
+ * Read-only database implementation for ARPA2 ACL that keeps all rules in one
+ * immutable file, an image, that is mapped in memory by every process that
+ * uses it. Opening a database is one mmap(2) and a lookup needs no locks, no
+ * reader table and no tree: a Bloom filter, a minimal perfect hash and one
+ * comparison of the key. The image format is described in
+ * doc/design/a2aclimage.txt.
+ *
+ * Time complexity:
+ *   find: O(1)
+ *   insert/delete: O(n), every change builds a new image
+ *
+ * Space complexity:
+ *   O(n)
+ *
+ * Changes are collected in memory and a new image is built when the database
+ * is read or counted again, so storing many rules one by one costs O(n). The
+ * new image is written to a temporary file next to the database, which is then
+ * renamed over it, or hard linked by a2acl_dbinstall. Contexts in this and
+ * other processes that use the previous image keep using it during a read.
+ * Each thread checks for a new image at the start of a read at most once every
+ * CHECKINTERVAL seconds, so that lookups don't make a system call, and maps it
+ * if there is one, see pin.
+ *
+ * Like with the dbm backend, the database may only be changed while no other
+ * thread uses the same context.
+ */
+
+#define IMGMAGIC "A2ACLMPH"
+#define IMGBYTEORDER 0x01020304
+#define IMGVERSION 1
+#define HDRSZ 64
+#define RECHDRSZ 12
+#define DIRECT 0x80000000U	/* displacement is a slot */
+#define MAXRULES 0x7fffffffU
+#define KEYSPERBUCKET 2
+#define MAXDISP (1U << 24)	/* tries per bucket before another seed */
+#define MAXSEEDS 16
+#define CACHELINE 64
+#define CHECKINTERVAL 1	/* seconds between checks for a new image */
+
+/* a clock that is cheap to read is precise enough for CHECKINTERVAL */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define CHECKCLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define CHECKCLOCK CLOCK_MONOTONIC
+#endif
+
+struct imghdr {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t version;
+	uint64_t size;
+	uint64_t nrules;
+	uint64_t nbuckets;
+	uint64_t filtersize;
+	uint64_t metasize;
+	uint32_t seed;
+	uint32_t unused;
+};
+
+/*
+ * A parsed image, either mapped from a file or in allocated memory.
+ */
+struct image {
+	char *base;
+	size_t size;
+	int mapped;
+	uint32_t seed;
+	size_t nrules;
+	size_t nbuckets;
+	const uint8_t *filter;
+	size_t filtersize;
+	const uint32_t *disp;
+	const uint64_t *slots;
+	size_t recoff;		/* start of the rules */
+	size_t recend;		/* end of the rules and start of the meta */
+	size_t metasize;
+	dev_t dev;		/* of the mapped file */
+	ino_t ino;
+};
+
+/*
+ * A generation of the database, the image that the context uses or that is
+ * still used by the readers of threads that did not begin a read since it was
+ * replaced. It is freed when the last of them lets go of it.
+ */
+struct gen {
+	struct image img;
+	size_t refs;		/* under "rdlock" */
+};
+
+/*
+ * Rules that are stored in the context but are not in an image yet. Like in an
+ * image each key is stored once, "slots" is an open addressing hash table with
+ * the index + 1 of the rule of each key, or 0 for a free slot.
+ */
+struct bldrule {
+	uint64_t hash;
+	size_t off;		/* in arena */
+	uint32_t remoteselsize;
+	uint32_t localidsize;
+	uint32_t aclrulesize;
+};
+
+struct builder {
+	struct bldrule *rules;
+	size_t nrules;
+	size_t maxrules;
+	char *arena;
+	size_t arenaused;
+	size_t arenasize;
+	size_t *slots;
+	size_t nslots;		/* a power of two, or 0 if not indexed */
+};
+
+/*
+ * Lookup state of one thread. Only the thread itself writes its statistics, and
+ * each reader is allocated on its own cache lines, so that threads don't write
+ * to a shared cache line on every lookup.
+ */
+struct reader {
+	a2acl_ctx *ctx;
+	struct gen *gen;	/* in use by lookups of the thread */
+	size_t genno;		/* of "gen" */
+	int depth;		/* of nested reads */
+	struct timespec nextcheck; /* for a new image, see pin */
+	atomic_size_t probes, skipped, falsepos;
+	struct reader *prev, *next;
+};
+
+struct a2acl_ctx {
+	char *path;
+	int created;		/* see a2acl_dbcreate, not installed yet */
+	int active;		/* "bld" has all rules of "img" and more */
+	int dirty;		/* "bld" or "meta" has changes not in "img" */
+	int unsaved;		/* "img" is not written to "path" yet */
+	struct gen *gen;	/* with "img", replaced by pin */
+	atomic_size_t genno;	/* incremented when "gen" is replaced */
+	struct builder bld;
+	char *meta;
+	size_t metasize;
+	pthread_key_t rdkey;
+	pthread_mutex_t rdlock;
+	struct reader *readers;	/* of all threads */
+	struct a2aclstats stats; /* of threads that exited */
+};
+
+/*
+ * Mix the bits of "h" like the finalizer of splitmix64.
+ */
+static uint64_t
+mix64(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+/*
+ * Return the hash of the key "remotesel localid" with "seed". It is the same as
+ * a2acl_keyhash if "seed" is 0, but another seed can be used if two keys of a
+ * policy have the same hash.
+ */
+static uint64_t
+imghash(uint32_t seed, const char *remotesel, size_t remoteselsize,
+    const char *localid, size_t localidsize)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t h;
+	size_t i;
+
+	h = 0xcbf29ce484222325ULL ^ seed;
+	for (i = 0; i < remoteselsize; i++)
+		h = (h ^ (unsigned char)remotesel[i]) * prime;
+	h = (h ^ ' ') * prime;
+	for (i = 0; i < localidsize; i++)
+		h = (h ^ (unsigned char)localid[i]) * prime;
+
+	return mix64(h);
+}
+
+/*
+ * Return the bucket of the key with hash "hash".
+ */
+static size_t
+bucket(uint64_t hash, size_t nbuckets)
+{
+	return ((hash & 0xffffffff) * nbuckets) >> 32;
+}
+
+/*
+ * Return the slot of the key with hash "hash" in a bucket with displacement
+ * "d".
+ */
+static size_t
+dispslot(uint64_t hash, uint32_t d, size_t nrules)
+{
+	if (d & DIRECT)
+		return d & ~DIRECT;
+
+	return (mix64(hash + d * 0x9e3779b97f4a7c15ULL) >> 32) * nrules >> 32;
+}
+
+/*
+ * Parse the image of "size" bytes at "base" into "img".
+ *
+ * Return 0 on success, -1 if it is not a valid image with errno set.
+ */
+static int
+imgparse(struct image *img, char *base, size_t size)
+{
+	struct imghdr hdr;
+	size_t off;
+
+	if (size < HDRSZ)
+		goto invalid;
+
+	memcpy(&hdr, base, sizeof(hdr));
+	if (memcmp(hdr.magic, IMGMAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.byteorder != IMGBYTEORDER || hdr.version != IMGVERSION ||
+	    hdr.size != size || hdr.nrules > MAXRULES ||
+	    hdr.nbuckets > MAXRULES || (hdr.nrules > 0) != (hdr.nbuckets > 0) ||
+	    hdr.filtersize % 64 != 0)
+		goto invalid;
+
+	/* each section must fit in what is left of the image */
+	off = HDRSZ;
+	if (hdr.filtersize > size - off)
+		goto invalid;
+	img->filter = (uint8_t *)&base[off];
+	img->filtersize = hdr.filtersize;
+	off += hdr.filtersize;
+
+	if (hdr.nbuckets * 4 > size - off)
+		goto invalid;
+	img->disp = (uint32_t *)&base[off];
+	off += hdr.nbuckets * 4;
+	off += (8 - off % 8) % 8;
+
+	if (off > size || hdr.nrules * 8 > size - off)
+		goto invalid;
+	img->slots = (uint64_t *)&base[off];
+	off += hdr.nrules * 8;
+
+	if (hdr.metasize > size - off)
+		goto invalid;
+
+	img->base = base;
+	img->size = size;
+	img->seed = hdr.seed;
+	img->nrules = hdr.nrules;
+	img->nbuckets = hdr.nbuckets;
+	img->recoff = off;
+	img->recend = size - hdr.metasize;
+	img->metasize = hdr.metasize;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Release the memory of "img", if any, and make it empty.
+ */
+static void
+imgfree(struct image *img)
+{
+	if (img->mapped)
+		munmap(img->base, img->size);
+	else
+		free(img->base);
+
+	memset(img, 0, sizeof(*img));
+}
+
+/*
+ * Set "rule" to the rule in slot "slot" of "img".
+ *
+ * Return 0 on success, -1 if the slot does not point to a rule in the image.
+ */
+static int
+imgrule(struct a2aclrule *rule, const struct image *img, size_t slot)
+{
+	uint32_t sizes[3];
+	uint64_t off, n;
+
+	if (slot >= img->nrules)
+		return -1;
+
+	off = img->slots[slot];
+	if (off < img->recoff || off > img->recend ||
+	    img->recend - off < RECHDRSZ)
+		return -1;
+
+	memcpy(sizes, &img->base[off], sizeof(sizes));
+	off += RECHDRSZ;
+
+	n = (uint64_t)sizes[0] + sizes[1] + sizes[2];
+	if (n > img->recend - off)
+		return -1;
+
+	rule->remotesel = &img->base[off];
+	rule->remoteselsize = sizes[0];
+	rule->localid = &img->base[off + sizes[0]];
+	rule->localidsize = sizes[1];
+	rule->aclrule = &img->base[off + sizes[0] + sizes[1]];
+	rule->aclrulesize = sizes[2];
+	return 0;
+}
+
+/*
+ * Find the rule with the given key and "hash" in "img".
+ *
+ * Return the rule, or NULL if it is not in the image.
+ */
+static const struct a2aclrule *
+imgfind(struct a2aclrule *rule, const struct image *img, uint64_t hash,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
+{
+	size_t slot;
+
+	if (img->nrules == 0)
+		return NULL;
+
+	slot = dispslot(hash, img->disp[bucket(hash, img->nbuckets)],
+	    img->nrules);
+
+	if (imgrule(rule, img, slot) == -1)
+		return NULL;
+
+	if (rule->remoteselsize != remoteselsize ||
+	    rule->localidsize != localidsize ||
+	    memcmp(rule->remotesel, remotesel, remoteselsize) != 0 ||
+	    memcmp(rule->localid, localid, localidsize) != 0)
+		return NULL;
+
+	return rule;
+}
+
+/*
+ * Free all rules of "bld".
+ */
+static void
+bldfree(struct builder *bld)
+{
+	free(bld->rules);
+	free(bld->arena);
+	free(bld->slots);
+	memset(bld, 0, sizeof(*bld));
+}
+
+/*
+ * Return the slot of the rule with the given key and "hash" in the index of
+ * "bld", or the free slot where it can be added. The index must have at least
+ * one free slot.
+ */
+static size_t *
+bldslot(const struct builder *bld, uint64_t hash, const char *remotesel,
+    size_t remoteselsize, const char *localid, size_t localidsize)
+{
+	const struct bldrule *rp;
+	size_t i, mask;
+
+	mask = bld->nslots - 1;
+	for (i = hash & mask; bld->slots[i] != 0; i = (i + 1) & mask) {
+		rp = &bld->rules[bld->slots[i] - 1];
+		if (rp->remoteselsize == remoteselsize &&
+		    rp->localidsize == localidsize &&
+		    memcmp(&bld->arena[rp->off], remotesel,
+		    remoteselsize) == 0 &&
+		    memcmp(&bld->arena[rp->off + remoteselsize], localid,
+		    localidsize) == 0)
+			break;
+	}
+
+	return &bld->slots[i];
+}
+
+/*
+ * Index the keys of all rules in "bld" in a table of at least twice "n" slots.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+bldindex(struct builder *bld, size_t n)
+{
+	const struct bldrule *rp;
+	size_t *slots, i, nslots;
+
+	nslots = 1024;
+	while (nslots / 2 < n) {
+		if (nslots > SIZE_MAX / sizeof(*slots) / 2) {
+			errno = ENOMEM;
+			return -1;
+		}
+		nslots *= 2;
+	}
+
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		return -1; /* errno set */
+
+	free(bld->slots);
+	bld->slots = slots;
+	bld->nslots = nslots;
+
+	for (i = 0; i < bld->nrules; i++) {
+		rp = &bld->rules[i];
+		*bldslot(bld, imghash(0, &bld->arena[rp->off],
+		    rp->remoteselsize, &bld->arena[rp->off +
+		    rp->remoteselsize], rp->localidsize),
+		    &bld->arena[rp->off], rp->remoteselsize,
+		    &bld->arena[rp->off + rp->remoteselsize],
+		    rp->localidsize) = i + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Add a copy of a rule to "bld". A rule with a key that is in "bld" already is
+ * not added, the same as the LMDB backend does.
+ *
+ * Return 0 on success, -1 on failure with errno set, to EEXIST if the key is
+ * in "bld" already.
+ */
+static int
+bldadd(struct builder *bld, const char *aclrule, size_t aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
+{
+	struct bldrule *rules, *rp;
+	size_t *slot, n, size;
+	uint64_t hash;
+	char *arena;
+
+	if (aclrulesize > UINT32_MAX || remoteselsize > UINT32_MAX ||
+	    localidsize > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (bld->nslots / 2 < bld->nrules + 1 &&
+	    bldindex(bld, 2 * (bld->nrules + 1)) == -1)
+		return -1; /* errno set */
+
+	hash = imghash(0, remotesel, remoteselsize, localid, localidsize);
+	slot = bldslot(bld, hash, remotesel, remoteselsize, localid,
+	    localidsize);
+	if (*slot != 0) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (bld->nrules == bld->maxrules) {
+		n = bld->maxrules ? bld->maxrules : 1024;
+		if (n > SIZE_MAX / sizeof(*rules) / 2) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if ((rules = realloc(bld->rules, 2 * n * sizeof(*rules))) ==
+		    NULL)
+			return -1; /* errno set */
+		bld->rules = rules;
+		bld->maxrules = 2 * n;
+	}
+
+	size = remoteselsize + localidsize + aclrulesize;
+	if (size > bld->arenasize - bld->arenaused) {
+		n = bld->arenasize ? bld->arenasize : 64 * 1024;
+		while (n - bld->arenaused < size) {
+			if (n > SIZE_MAX / 2) {
+				errno = ENOMEM;
+				return -1;
+			}
+			n *= 2;
+		}
+		if ((arena = realloc(bld->arena, n)) == NULL)
+			return -1; /* errno set */
+		bld->arena = arena;
+		bld->arenasize = n;
+	}
+
+	rp = &bld->rules[bld->nrules++];
+	rp->off = bld->arenaused;
+	rp->remoteselsize = remoteselsize;
+	rp->localidsize = localidsize;
+	rp->aclrulesize = aclrulesize;
+
+	memcpy(&bld->arena[rp->off], remotesel, remoteselsize);
+	memcpy(&bld->arena[rp->off + remoteselsize], localid, localidsize);
+	memcpy(&bld->arena[rp->off + remoteselsize + localidsize], aclrule,
+	    aclrulesize);
+	bld->arenaused += size;
+
+	*slot = bld->nrules;
+	return 0;
+}
+
+/*
+ * Compare two rules by hash and then by the order in which they were added.
+ */
+static int
+cmprules(const void *a, const void *b)
+{
+	const struct bldrule *ra = a, *rb = b;
+
+	if (ra->hash != rb->hash)
+		return ra->hash < rb->hash ? -1 : 1;
+
+	if (ra->off != rb->off)
+		return ra->off < rb->off ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Hash all rules in "bld" with "seed" and sort them by hash. The index of the
+ * keys is dropped, since it refers to the rules in the order they were added.
+ *
+ * Return 0 on success, -1 if two keys have the same hash.
+ */
+static int
+bldsort(struct builder *bld, uint32_t seed)
+{
+	struct bldrule *rp;
+	size_t i;
+
+	free(bld->slots);
+	bld->slots = NULL;
+	bld->nslots = 0;
+
+	for (i = 0; i < bld->nrules; i++) {
+		rp = &bld->rules[i];
+		rp->hash = imghash(seed, &bld->arena[rp->off],
+		    rp->remoteselsize, &bld->arena[rp->off +
+		    rp->remoteselsize], rp->localidsize);
+	}
+
+	qsort(bld->rules, bld->nrules, sizeof(*bld->rules), cmprules);
+
+	for (i = 1; i < bld->nrules; i++)
+		if (bld->rules[i - 1].hash == bld->rules[i].hash)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Find a displacement for every bucket of the "nrules" sorted rules in "bld"
+ * and set "slotrules" to the index in "bld" of the rule of each slot.
+ *
+ * Return 0 on success, -1 if a displacement was not found with errno set to
+ * EAGAIN, or on another failure with errno set.
+ */
+static int
+placerules(uint32_t *disp, size_t nbuckets, size_t *slotrules,
+    const struct builder *bld)
+{
+	size_t *count, *start, *items, *order, *slots, i, j, k, b, m, n, max;
+	size_t norder;
+	uint8_t *taken;
+	uint32_t d;
+	int ret;
+
+	n = bld->nrules;
+	ret = -1;
+	items = order = slots = NULL;
+	taken = NULL;
+
+	count = calloc(nbuckets + 1, sizeof(*count));
+	start = calloc(nbuckets + 1, sizeof(*start));
+	if (count == NULL || start == NULL)
+		goto out;
+
+	for (i = 0; i < n; i++)
+		count[bucket(bld->rules[i].hash, nbuckets)]++;
+
+	max = 0;
+	for (b = 0; b < nbuckets; b++) {
+		start[b + 1] = start[b] + count[b];
+		if (count[b] > max)
+			max = count[b];
+	}
+
+	items = malloc(n * sizeof(*items));
+	order = malloc(nbuckets * sizeof(*order));
+	slots = malloc((max + 1) * sizeof(*slots));
+	taken = calloc(n, 1);
+	if (items == NULL || order == NULL || slots == NULL || taken == NULL)
+		goto out;
+
+	/* the rules of each bucket, reuse "count" to fill them in */
+	for (b = 0; b < nbuckets; b++)
+		count[b] = 0;
+	for (i = 0; i < n; i++) {
+		b = bucket(bld->rules[i].hash, nbuckets);
+		items[start[b] + count[b]++] = i;
+	}
+
+	/* the buckets that are not empty by decreasing size */
+	norder = 0;
+	for (m = max; m > 0; m--)
+		for (b = 0; b < nbuckets; b++)
+			if (count[b] == m)
+				order[norder++] = b;
+
+	for (i = 0; i < nbuckets; i++)
+		disp[i] = 0;
+
+	for (k = 0; k < norder && count[order[k]] > 1; k++) {
+		b = order[k];
+		m = count[b];
+		for (d = 1; d < MAXDISP; d++) {
+			for (i = 0; i < m; i++) {
+				slots[i] = dispslot(bld->rules[items[start[b] +
+				    i]].hash, d, n);
+				if (taken[slots[i]])
+					break;
+				for (j = 0; j < i && slots[j] != slots[i]; j++)
+					continue;
+				if (j < i)
+					break;
+			}
+			if (i == m)
+				break;
+		}
+		if (d == MAXDISP) {
+			errno = EAGAIN;
+			goto out;
+		}
+
+		disp[b] = d;
+		for (i = 0; i < m; i++) {
+			taken[slots[i]] = 1;
+			slotrules[slots[i]] = items[start[b] + i];
+		}
+	}
+
+	/* put each rule of a bucket with one rule in a free slot */
+	for (j = 0; k < norder; k++) {
+		b = order[k];
+		while (taken[j])
+			j++;
+		taken[j] = 1;
+		disp[b] = DIRECT | j;
+		slotrules[j] = items[start[b]];
+	}
+
+	ret = 0;
+out:
+	free(taken);
+	free(slots);
+	free(order);
+	free(items);
+	free(start);
+	free(count);
+	return ret;
+}
+
+/*
+ * Build an image of all rules in "bld" and the metadata record "meta" of
+ * "metasize" bytes in allocated memory and parse it into "img". The rules in
+ * "bld" are sorted, see bldsort.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+buildimage(struct image *img, struct builder *bld, const char *meta,
+    size_t metasize)
+{
+	struct imghdr hdr;
+	struct bldrule *rp;
+	uint32_t *disp, sizes[3];
+	uint64_t *slots;
+	size_t *slotrules, i, size, off, nbuckets, filtersize;
+	uint32_t seed;
+	char *base;
+
+	if (bld->nrules > MAXRULES) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	base = NULL;
+	slotrules = NULL;
+	disp = NULL;
+	nbuckets = 0;
+	filtersize = 0;
+	seed = 0;
+
+	if (bld->nrules > 0) {
+		nbuckets = bld->nrules / KEYSPERBUCKET + 1;
+		if ((slotrules = malloc(bld->nrules * sizeof(*slotrules))) ==
+		    NULL || (disp = malloc(nbuckets * sizeof(*disp))) == NULL)
+			goto err;
+
+		for (seed = 0; seed < MAXSEEDS; seed++) {
+			if (bldsort(bld, seed) == -1)
+				continue;
+			if (placerules(disp, nbuckets, slotrules, bld) == 0)
+				break;
+			if (errno != EAGAIN)
+				goto err;
+		}
+		if (seed == MAXSEEDS) {
+			errno = EAGAIN;
+			goto err;
+		}
+
+		filtersize = a2acl_bloomsize(bld->nrules);
+	}
+
+	/* same layout as imgparse expects */
+	size = HDRSZ + filtersize + nbuckets * 4;
+	size += (8 - size % 8) % 8;
+	size += bld->nrules * 8;
+	for (i = 0; i < bld->nrules; i++) {
+		rp = &bld->rules[i];
+		size += RECHDRSZ + rp->remoteselsize + rp->localidsize +
+		    rp->aclrulesize;
+	}
+	size += metasize;
+
+	if ((base = calloc(1, size)) == NULL)
+		goto err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IMGMAGIC, sizeof(hdr.magic));
+	hdr.byteorder = IMGBYTEORDER;
+	hdr.version = IMGVERSION;
+	hdr.size = size;
+	hdr.nrules = bld->nrules;
+	hdr.nbuckets = nbuckets;
+	hdr.filtersize = filtersize;
+	hdr.metasize = metasize;
+	hdr.seed = seed;
+	memcpy(base, &hdr, sizeof(hdr));
+
+	if (imgparse(img, base, size) == -1)
+		goto err;
+
+	for (i = 0; i < bld->nrules; i++)
+		a2acl_bloomadd((uint8_t *)img->filter, filtersize,
+		    bld->rules[i].hash);
+
+	if (nbuckets > 0)
+		memcpy((uint32_t *)img->disp, disp, nbuckets * sizeof(*disp));
+
+	slots = (uint64_t *)img->slots;
+	off = img->recoff;
+	for (i = 0; i < bld->nrules; i++) {
+		rp = &bld->rules[slotrules[i]];
+		slots[i] = off;
+		sizes[0] = rp->remoteselsize;
+		sizes[1] = rp->localidsize;
+		sizes[2] = rp->aclrulesize;
+		memcpy(&base[off], sizes, sizeof(sizes));
+		off += RECHDRSZ;
+		memcpy(&base[off], &bld->arena[rp->off], sizes[0] + sizes[1] +
+		    sizes[2]);
+		off += sizes[0] + sizes[1] + sizes[2];
+	}
+
+	if (metasize > 0)
+		memcpy(&base[off], meta, metasize);
+
+	free(disp);
+	free(slotrules);
+	return 0;
+
+err:
+	free(disp);
+	free(slotrules);
+	free(base);
+	return -1;
+}
+
+/*
+ * Make a copy of "old" in allocated memory with the metadata record "meta" of
+ * "metasize" bytes and parse it into "img". The rules are copied as they are.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+copyimage(struct image *img, const struct image *old, const char *meta,
+    size_t metasize)
+{
+	struct imghdr hdr;
+	size_t size;
+	char *base;
+
+	if (metasize > SIZE_MAX - old->recend) {
+		errno = ENOMEM;
+		return -1;
+	}
+	size = old->recend + metasize;
+
+	if ((base = malloc(size)) == NULL)
+		return -1; /* errno set */
+
+	memcpy(base, old->base, old->recend);
+	if (metasize > 0)
+		memcpy(&base[old->recend], meta, metasize);
+
+	memcpy(&hdr, base, sizeof(hdr));
+	hdr.size = size;
+	hdr.metasize = metasize;
+	memcpy(base, &hdr, sizeof(hdr));
+
+	if (imgparse(img, base, size) == -1) {
+		free(base);
+		return -1; /* errno set */
+	}
+
+	return 0;
+}
+
+/*
+ * Copy all rules of "img" to "bld".
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+bldload(struct builder *bld, const struct image *img)
+{
+	struct a2aclrule rule;
+	size_t i;
+
+	for (i = 0; i < img->nrules; i++) {
+		if (imgrule(&rule, img, i) == -1) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (bldadd(bld, rule.aclrule, rule.aclrulesize, rule.remotesel,
+		    rule.remoteselsize, rule.localid, rule.localidsize) == -1)
+			return -1; /* errno set */
+	}
+
+	return 0;
+}
+
+/*
+ * Map the image of the file open at "fd" into "img".
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+imgmap(struct image *img, int fd)
+{
+	struct stat st;
+	void *base;
+	int e;
+
+	if (fstat(fd, &st) == -1)
+		return -1; /* errno set */
+
+	if (st.st_size < HDRSZ || (uintmax_t)st.st_size > SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return -1; /* errno set */
+
+	if (imgparse(img, base, st.st_size) == -1) {
+		e = errno;
+		munmap(base, st.st_size);
+		errno = e;
+		return -1;
+	}
+	img->mapped = 1;
+	img->dev = st.st_dev;
+	img->ino = st.st_ino;
+
+	return 0;
+}
+
+/*
+ * Write "img" to a temporary file next to "path" and move it to "path", by
+ * renaming it if "replace" is set or else by hard linking it, which fails if
+ * "path" exists. Then map the file into "img".
+ *
+ * Return 0 on success, -1 on failure with errno set, to EEXIST if "replace" is
+ * not set and "path" exists. On failure "img" is left as it was.
+ */
+static int
+imgsave(struct image *img, const char *path, int replace)
+{
+	struct image newimg;
+	char *tmppath;
+	size_t n, tmppathsize;
+	ssize_t r;
+	int e, fd;
+
+	tmppathsize = strlen(path) + sizeof(".XXXXXX");
+	if ((tmppath = malloc(tmppathsize)) == NULL)
+		return -1; /* errno set */
+
+	snprintf(tmppath, tmppathsize, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmppath)) == -1) {
+		free(tmppath);
+		return -1; /* errno set */
+	}
+
+	/* the same mode as the databases of the LMDB backend */
+	if (fchmod(fd, 0640) == -1)
+		goto err;
+
+	for (n = 0; n < img->size; n += r)
+		if ((r = write(fd, &img->base[n], img->size - n)) == -1)
+			goto err;
+
+	if (fsync(fd) == -1)
+		goto err;
+
+	if (replace) {
+		if (rename(tmppath, path) == -1)
+			goto err;
+	} else {
+		if (link(tmppath, path) == -1)
+			goto err;
+		unlink(tmppath);
+	}
+
+	memset(&newimg, 0, sizeof(newimg));
+	if (imgmap(&newimg, fd) == 0) {
+		imgfree(img);
+		*img = newimg;
+	}
+	/* else keep using the image in memory, it is the same */
+
+	close(fd);
+	free(tmppath);
+	return 0;
+
+err:
+	e = errno;
+	close(fd);
+	unlink(tmppath);
+	free(tmppath);
+	errno = e;
+	return -1;
+}
+
+/*
+ * Make "img" contain all changes that were made to the database. If a new image
+ * is built, the rules in "bld" are no longer needed and freed. If only the
+ * metadata record changed, the rest of the image is copied as is.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+settle(a2acl_ctx *ctx)
+{
+	struct image img;
+	int r;
+
+	if (!ctx->dirty)
+		return 0;
+
+	memset(&img, 0, sizeof(img));
+	if (ctx->active || ctx->gen->img.base == NULL)
+		r = buildimage(&img, &ctx->bld, ctx->meta, ctx->metasize);
+	else
+		r = copyimage(&img, &ctx->gen->img, ctx->meta, ctx->metasize);
+	if (r == -1)
+		return -1; /* errno set */
+
+	imgfree(&ctx->gen->img);
+	ctx->gen->img = img;
+	bldfree(&ctx->bld);
+	ctx->active = 0;
+	ctx->dirty = 0;
+	ctx->unsaved = !ctx->created;
+
+	return 0;
+}
+
+/*
+ * Make sure the database is up to date, see settle, and write a new image to
+ * the path of the database, unless it was created and not installed yet.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+save(a2acl_ctx *ctx)
+{
+	if (settle(ctx) == -1)
+		return -1; /* errno set */
+
+	if (!ctx->unsaved)
+		return 0;
+
+	if (imgsave(&ctx->gen->img, ctx->path, 1) == -1)
+		return -1; /* errno set */
+
+	ctx->unsaved = 0;
+	return 0;
+}
+
+/*
+ * Make sure "bld" has all rules of the image, so that rules can be added.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+activate(a2acl_ctx *ctx)
+{
+	if (ctx->active)
+		return 0;
+
+	if (bldload(&ctx->bld, &ctx->gen->img) == -1) {
+		bldfree(&ctx->bld);
+		return -1; /* errno set */
+	}
+
+	ctx->active = 1;
+	return 0;
+}
+
+/*
+ * Let go of "gen", free it if nothing else uses it. Must be called with
+ * "rdlock" held.
+ */
+static void
+genrelease(struct gen *gen)
+{
+	if (gen == NULL || --gen->refs > 0)
+		return;
+
+	imgfree(&gen->img);
+	free(gen);
+}
+
+/*
+ * Unlink the reader "arg" from its context and add its statistics to those of
+ * the threads that exited. Called when a thread exits.
+ */
+static void
+freereader(void *arg)
+{
+	struct reader *rd = arg;
+	a2acl_ctx *ctx = rd->ctx;
+
+	pthread_mutex_lock(&ctx->rdlock);
+	if (rd->prev)
+		rd->prev->next = rd->next;
+	else
+		ctx->readers = rd->next;
+	if (rd->next)
+		rd->next->prev = rd->prev;
+	ctx->stats.probes += rd->probes;
+	ctx->stats.skipped += rd->skipped;
+	ctx->stats.falsepos += rd->falsepos;
+	genrelease(rd->gen);
+	pthread_mutex_unlock(&ctx->rdlock);
+
+	free(rd);
+}
+
+/*
+ * Return the reader of the calling thread, allocate it on first use.
+ *
+ * Return NULL on failure.
+ */
+static struct reader *
+getreader(a2acl_ctx *ctx)
+{
+	struct reader *rd;
+	size_t size;
+
+	if ((rd = pthread_getspecific(ctx->rdkey)) != NULL)
+		return rd;
+
+	size = (sizeof(*rd) + CACHELINE - 1) & ~(size_t)(CACHELINE - 1);
+	if ((rd = aligned_alloc(CACHELINE, size)) == NULL)
+		return NULL;
+	memset(rd, 0, size);
+
+	if (pthread_setspecific(ctx->rdkey, rd) != 0) {
+		free(rd);
+		return NULL;
+	}
+
+	rd->ctx = ctx;
+	pthread_mutex_lock(&ctx->rdlock);
+	rd->next = ctx->readers;
+	if (rd->next)
+		rd->next->prev = rd;
+	ctx->readers = rd;
+	pthread_mutex_unlock(&ctx->rdlock);
+
+	return rd;
+}
+
+/*
+ * Increment a statistic of the calling thread. Only the thread itself writes
+ * it, a plain load and store is enough.
+ */
+static void
+countstat(atomic_size_t *n)
+{
+	atomic_store_explicit(n, atomic_load_explicit(n, memory_order_relaxed) +
+	    1, memory_order_relaxed);
+}
+
+/*
+ * Return 1 if "img" is mapped from the file "ino" on device "dev", 0 otherwise.
+ */
+static int
+samefile(const struct image *img, dev_t dev, ino_t ino)
+{
+	return img->mapped && img->dev == dev && img->ino == ino;
+}
+
+/*
+ * Map the image of the file open at "fd" into a new generation and set "meta"
+ * to a copy of its metadata record, or to NULL if there is none.
+ *
+ * Return the new generation on success, NULL on failure with errno set.
+ */
+static struct gen *
+genmap(int fd, char **meta)
+{
+	struct gen *gen;
+	const struct image *img;
+	int e;
+
+	*meta = NULL;
+
+	if ((gen = calloc(1, sizeof(*gen))) == NULL)
+		return NULL; /* errno set */
+
+	if (imgmap(&gen->img, fd) == -1) {
+		free(gen);
+		return NULL; /* errno set */
+	}
+
+	img = &gen->img;
+	if (img->metasize > 0) {
+		if ((*meta = malloc(img->metasize)) == NULL) {
+			e = errno;
+			imgfree(&gen->img);
+			free(gen);
+			errno = e;
+			return NULL;
+		}
+		memcpy(*meta, &img->base[img->recend], img->metasize);
+	}
+
+	gen->refs = 1;
+	return gen;
+}
+
+/*
+ * Return 1 if the reader "rd" should check for a new image, which is the case
+ * once every CHECKINTERVAL seconds, 0 otherwise.
+ */
+static int
+checkdue(struct reader *rd)
+{
+	struct timespec now;
+
+	if (clock_gettime(CHECKCLOCK, &now) == -1)
+		return 1;
+
+	if (now.tv_sec < rd->nextcheck.tv_sec || (now.tv_sec ==
+	    rd->nextcheck.tv_sec && now.tv_nsec < rd->nextcheck.tv_nsec))
+		return 0;
+
+	rd->nextcheck = now;
+	rd->nextcheck.tv_sec += CHECKINTERVAL;
+	return 1;
+}
+
+/*
+ * Make the reader "rd" use the current generation of the database. If another
+ * image was moved to the path of the database since, by another context or
+ * process, it is mapped and becomes the current generation. It is mapped before
+ * the lock is taken, so that readers of other threads don't wait for it, and if
+ * it can't be mapped the current generation is kept. Changes made with this
+ * context are in the current generation already, and a generation that a
+ * reader of another thread mapped is used right away, so the path is only
+ * checked once every CHECKINTERVAL seconds, see checkdue.
+ *
+ * The generation that the reader used before is freed if neither the context
+ * nor another reader uses it anymore.
+ */
+static void
+pin(a2acl_ctx *ctx, struct reader *rd)
+{
+	struct gen *gen, *old;
+	struct stat st;
+	char *meta;
+	int due, fd, found;
+
+	/* the common case, no system call and no lock */
+	due = checkdue(rd);
+	if (!due && rd->gen != NULL && rd->genno ==
+	    atomic_load_explicit(&ctx->genno, memory_order_acquire))
+		return;
+
+	/* a created database is not installed yet, another one is not used */
+	found = !ctx->created && stat(ctx->path, &st) == 0;
+
+	/* nothing changed */
+	if (found && rd->gen != NULL &&
+	    samefile(&rd->gen->img, st.st_dev, st.st_ino))
+		return;
+
+	if (found) {
+		pthread_mutex_lock(&ctx->rdlock);
+		found = !samefile(&ctx->gen->img, st.st_dev, st.st_ino);
+		pthread_mutex_unlock(&ctx->rdlock);
+	}
+
+	gen = NULL;
+	meta = NULL;
+	if (found && (fd = open(ctx->path, O_RDONLY|O_CLOEXEC)) != -1) {
+		gen = genmap(fd, &meta);
+		close(fd);
+	}
+
+	pthread_mutex_lock(&ctx->rdlock);
+	/* another reader might have been first */
+	if (gen != NULL && !samefile(&ctx->gen->img, gen->img.dev,
+	    gen->img.ino)) {
+		old = ctx->gen;
+		ctx->gen = gen;
+		gen = old;
+		atomic_fetch_add_explicit(&ctx->genno, 1,
+		    memory_order_release);
+
+		free(ctx->meta);
+		ctx->meta = meta;
+		ctx->metasize = ctx->gen->img.metasize;
+		meta = NULL;
+
+		/* the rules of the previous generation */
+		if (ctx->active) {
+			bldfree(&ctx->bld);
+			ctx->active = 0;
+		}
+	}
+	genrelease(gen);
+
+	if (rd->gen != ctx->gen) {
+		genrelease(rd->gen);
+		rd->gen = ctx->gen;
+		rd->gen->refs++;
+	}
+	rd->genno = atomic_load_explicit(&ctx->genno, memory_order_relaxed);
+	pthread_mutex_unlock(&ctx->rdlock);
+
+	free(meta);
+}
+
+/*
+ * Allocate a new context for the database at "path".
+ */
+static a2acl_ctx *
+newctx(const char *path)
+{
+	a2acl_ctx *ctx;
+
+	if (path == NULL)
+		return NULL;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+
+	if ((ctx->path = strdup(path)) == NULL) {
+		free(ctx);
+		return NULL;
+	}
+
+	/* an empty image until one is mapped or built */
+	if ((ctx->gen = calloc(1, sizeof(*ctx->gen))) == NULL) {
+		free(ctx->path);
+		free(ctx);
+		return NULL;
+	}
+	ctx->gen->refs = 1;
+
+	if (pthread_key_create(&ctx->rdkey, freereader) != 0) {
+		free(ctx->gen);
+		free(ctx->path);
+		free(ctx);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&ctx->rdlock, NULL) != 0) {
+		pthread_key_delete(ctx->rdkey);
+		free(ctx->gen);
+		free(ctx->path);
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/*
+ * Open the image at "path". A missing image is an empty database, an image is
+ * written as soon as rules are stored.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbopen(a2acl_ctx **ctx, const char *path)
+{
+	struct gen *gen;
+	int fd;
+
+	if ((*ctx = newctx(path)) == NULL)
+		return -1;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+		if (errno == ENOENT)
+			return 0;
+		goto err;
+	}
+
+	if ((gen = genmap(fd, &(*ctx)->meta)) == NULL) {
+		close(fd);
+		goto err;
+	}
+	close(fd);
+
+	free((*ctx)->gen);
+	(*ctx)->gen = gen;
+	(*ctx)->metasize = gen->img.metasize;
+
+	return 0;
+
+err:
+	a2acl_dbclose(*ctx);
+	*ctx = NULL;
+	return -1;
+}
+
+/*
+ * Create a new and empty database in memory for "path". Nothing is written
+ * until it is installed with a2acl_dbinstall.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbcreate(a2acl_ctx **ctx, const char *path)
+{
+	if ((*ctx = newctx(path)) == NULL)
+		return -1;
+
+	/* an empty image is built even if nothing is stored */
+	(*ctx)->created = 1;
+	(*ctx)->dirty = 1;
+	return 0;
+}
+
+/*
+ * Write the image of a database that was created with a2acl_dbcreate to a
+ * temporary file and hard link it to its path, which fails if the path exists,
+ * so an image that might be in use by another process is never replaced.
+ *
+ * Must return 0 on success, -1 on failure with errno set to EEXIST if there
+ * already is a database at the path.
+ */
+int
+a2acl_dbinstall(a2acl_ctx *ctx)
+{
+	if (!ctx->created)
+		return 0;
+
+	if (settle(ctx) == -1)
+		return -1; /* errno set */
+
+	if (imgsave(&ctx->gen->img, ctx->path, 0) == -1)
+		return -1; /* errno set */
+
+	ctx->created = 0;
+	return 0;
+}
+
+/*
+ * Write any changes and free "ctx". A database that was created but not
+ * installed is discarded.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_dbclose(a2acl_ctx *ctx)
+{
+	struct reader *rd;
+	int r;
+
+	if (ctx == NULL)
+		return 0;
+
+	r = 0;
+	if (!ctx->created && save(ctx) == -1)
+		r = -1;
+
+	pthread_key_delete(ctx->rdkey);
+	while ((rd = ctx->readers) != NULL) {
+		ctx->readers = rd->next;
+		genrelease(rd->gen);
+		free(rd);
+	}
+	genrelease(ctx->gen);
+	pthread_mutex_destroy(&ctx->rdlock);
+
+	bldfree(&ctx->bld);
+	free(ctx->meta);
+	free(ctx->path);
+	free(ctx);
+
+	return r;
+}
+
+/*
+ * Update "count" to the total number of rules in the database.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+a2acl_count(a2acl_ctx *ctx, size_t *count)
+{
+	if (save(ctx) == -1)
+		return -1;
+
+	*count = ctx->gen->img.nrules;
+	return 0;
+}
+
+/*
+ * Store a communication ACL rule given a remote and local ID. The rule is
+ * copied and only written with the next image. Fails if a rule with the same
+ * remote selector and local ID is stored already.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_putaclrule(a2acl_ctx *ctx, const char *aclrule, size_t aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
+{
+	if (aclrule == NULL || aclrulesize == 0 || remotesel == NULL ||
+	    remoteselsize == 0 || localid == NULL || localidsize == 0)
+		return -1;
+
+	if (activate(ctx) == -1)
+		return -1;
+
+	if (bldadd(&ctx->bld, aclrule, aclrulesize, remotesel, remoteselsize,
+	    localid, localidsize) == -1)
+		return -1;
+
+	ctx->dirty = 1;
+	return 0;
+}
+
+/*
+ * Store "nrules" ACL rules.
+ *
+ * Must return 0 on success, -1 on failure with "failed" set to the index of the
+ * rule that could not be stored, or to "nrules".
+ */
+int
+a2acl_putaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *failed)
+{
+	const struct a2aclrule *rp;
+	size_t i;
+
+	*failed = nrules;
+
+	if (activate(ctx) == -1)
+		return -1;
+
+	for (i = 0; i < nrules; i++) {
+		rp = &rules[i];
+		if (rp->aclrule == NULL || rp->aclrulesize == 0 ||
+		    rp->remotesel == NULL || rp->remoteselsize == 0 ||
+		    rp->localid == NULL || rp->localidsize == 0 ||
+		    bldadd(&ctx->bld, rp->aclrule, rp->aclrulesize,
+		    rp->remotesel, rp->remoteselsize, rp->localid,
+		    rp->localidsize) == -1) {
+			*failed = i;
+			ctx->dirty = 1;
+			return -1;
+		}
+	}
+
+	ctx->dirty = 1;
+	return 0;
+}
+
+/*
+ * Make the database contain exactly the "nrules" ACL rules in "rules". A new
+ * image of the rules is built and every rule in it is looked up in the current
+ * image to count the changes. The new image replaces the current one only if
+ * it is complete, so on failure the database is left as it was.
+ *
+ * Must return 0 on success with "changed" set to the number of stored,
+ * replaced and removed rules. Must return -1 on failure with "failed" set to
+ * the index of the rule that could not be stored, or to "nrules".
+ */
+int
+a2acl_syncaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *changed, size_t *failed)
+{
+	struct builder bld;
+	struct image img;
+	struct a2aclrule rule, old;
+	const struct a2aclrule *rp;
+	size_t i, nkept;
+
+	*changed = 0;
+	*failed = nrules;
+
+	if (settle(ctx) == -1)
+		return -1;
+
+	memset(&bld, 0, sizeof(bld));
+	memset(&img, 0, sizeof(img));
+
+	for (i = 0; i < nrules; i++) {
+		rp = &rules[i];
+		if (rp->aclrule == NULL || rp->aclrulesize == 0 ||
+		    rp->remotesel == NULL || rp->remoteselsize == 0 ||
+		    rp->localid == NULL || rp->localidsize == 0 ||
+		    bldadd(&bld, rp->aclrule, rp->aclrulesize, rp->remotesel,
+		    rp->remoteselsize, rp->localid, rp->localidsize) == -1) {
+			*failed = i;
+			bldfree(&bld);
+			return -1;
+		}
+	}
+
+	if (buildimage(&img, &bld, ctx->meta, ctx->metasize) == -1) {
+		bldfree(&bld);
+		return -1;
+	}
+	bldfree(&bld);
+
+	nkept = 0;
+	for (i = 0; i < img.nrules; i++) {
+		if (imgrule(&rule, &img, i) == -1)
+			continue;
+
+		if (imgfind(&old, &ctx->gen->img, imghash(ctx->gen->img.seed,
+		    rule.remotesel, rule.remoteselsize, rule.localid,
+		    rule.localidsize), rule.remotesel, rule.remoteselsize,
+		    rule.localid, rule.localidsize) == NULL) {
+			(*changed)++;
+			continue;
+		}
+
+		nkept++;
+		if (old.aclrulesize != rule.aclrulesize ||
+		    memcmp(old.aclrule, rule.aclrule, rule.aclrulesize) != 0)
+			(*changed)++;
+	}
+
+	/* every old rule that is not in the new image is removed */
+	*changed += ctx->gen->img.nrules - nkept;
+
+	if (*changed == 0) {
+		imgfree(&img);
+		return 0;
+	}
+
+	imgfree(&ctx->gen->img);
+	ctx->gen->img = img;
+	ctx->unsaved = !ctx->created;
+	return 0;
+}
+
+/*
+ * Search for the ACL rule of a remote selector and local ID in the image of the
+ * reader "rd", see a2acl_viewaclrule.
+ */
+static void
+findrule(struct reader *rd, const char **aclrule, size_t *aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
+{
+	struct a2aclrule rule;
+	const struct image *img;
+	uint64_t hash;
+
+	*aclrule = NULL;
+	*aclrulesize = 0;
+
+	img = &rd->gen->img;
+	hash = imghash(img->seed, remotesel, remoteselsize, localid,
+	    localidsize);
+
+	countstat(&rd->probes);
+	if (img->filtersize > 0 && !a2acl_bloomhas(img->filter,
+	    img->filtersize, hash)) {
+		countstat(&rd->skipped);
+		return;
+	}
+
+	if (imgfind(&rule, img, hash, remotesel, remoteselsize, localid,
+	    localidsize) != NULL) {
+		*aclrule = rule.aclrule;
+		*aclrulesize = rule.aclrulesize;
+		return;
+	}
+
+	if (img->filtersize > 0)
+		countstat(&rd->falsepos);
+}
+
+/*
+ * Search for a communication ACL rule based on a remote selector and local ID.
+ *
+ * "aclrule" is set to point to the ACL rule in the image, which stays valid
+ * until the database is changed or closed, or until the next read of the
+ * calling thread if a new image was installed since. If no ACL rule is found
+ * then "aclrule" is set to NULL and "aclrulesize" is set to 0.
+ *
+ * Must return 0 on success, -1 on error. If no "aclrule" is found, 0 is
+ * returned and *aclrulesize is set to 0.
+ */
+int
+a2acl_viewaclrule(a2acl_ctx *ctx, const char **aclrule, size_t *aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
+{
+	struct reader *rd;
+
+	if (aclrule == NULL || aclrulesize == NULL || remotesel == NULL ||
+	    remoteselsize == 0 || localid == NULL || localidsize == 0)
+		return -1;
+
+	*aclrule = NULL;
+	*aclrulesize = 0;
+
+	if ((ctx->dirty || ctx->unsaved) && save(ctx) == -1)
+		return -1;
+
+	if ((rd = getreader(ctx)) == NULL)
+		return -1;
+
+	/* a lookup outside a read is a read of its own */
+	if (rd->depth == 0)
+		pin(ctx, rd);
+
+	findrule(rd, aclrule, aclrulesize, remotesel, remoteselsize, localid,
+	    localidsize);
+	return 0;
+}
+
+/*
+ * Search for the ACL rules of the "nkeys" keys in "keys" in turn and stop at
+ * the first one that is found, see a2acl_viewaclrule. All keys are looked up in
+ * the same image. Each key costs one probe of the minimal perfect hash at most.
+ *
+ * Must return 0 on success with "idx" set to the index of the key of which the
+ * ACL rule is found, or to "nkeys" if none is found. Must return -1 on error.
+ */
+int
+a2acl_viewaclrules(a2acl_ctx *ctx, size_t *idx, const char **aclrule,
+    size_t *aclrulesize, const struct a2aclkey *keys, size_t nkeys)
+{
+	struct reader *rd;
+	size_t i;
+
+	if (idx == NULL || aclrule == NULL || aclrulesize == NULL)
+		return -1;
+
+	*aclrule = NULL;
+	*aclrulesize = 0;
+
+	for (i = 0; i < nkeys; i++)
+		if (keys[i].remotesel == NULL || keys[i].remoteselsize == 0 ||
+		    keys[i].localid == NULL || keys[i].localidsize == 0)
+			return -1;
+
+	if ((ctx->dirty || ctx->unsaved) && save(ctx) == -1)
+		return -1;
+
+	if ((rd = getreader(ctx)) == NULL)
+		return -1;
+
+	/* like a read of its own if the thread is not in a read */
+	if (rd->depth == 0)
+		pin(ctx, rd);
+
+	for (i = 0; i < nkeys; i++) {
+		findrule(rd, aclrule, aclrulesize, keys[i].remotesel,
+		    keys[i].remoteselsize, keys[i].localid,
+		    keys[i].localidsize);
+		if (*aclrulesize > 0)
+			break;
+	}
+
+	*idx = i;
+	return 0;
+}
+
+/*
+ * Search for a communication ACL rule based on a remote selector and local ID.
+ *
+ * "aclrule" must be allocated by the caller. "aclrulesize" is a value/result
+ * parameter. If no ACL rule is found then "aclrule" is left untouched and
+ * "aclrulesize" is set to 0.
+ *
+ * Must return 0 on success, -1 on error. If no "aclrule" is found, 0 is
+ * returned and *aclrulesize is set to 0.
+ */
+int
+a2acl_getaclrule(a2acl_ctx *ctx, char *aclrule, size_t *aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
+{
+	const char *rule;
+	size_t rulesize;
+
+	if (aclrule == NULL || aclrulesize == NULL)
+		return -1;
+
+	if (a2acl_viewaclrule(ctx, &rule, &rulesize, remotesel, remoteselsize,
+	    localid, localidsize) == -1)
+		return -1;
+
+	if (rulesize > *aclrulesize)
+		return -1;
+
+	if (rulesize > 0)
+		memcpy(aclrule, rule, rulesize);
+	*aclrulesize = rulesize;
+	return 0;
+}
+
+/*
+ * Copy the metadata record into "meta". "metasize" is a value/result
+ * parameter and is set to 0 if there is no metadata record.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_getmeta(a2acl_ctx *ctx, void *meta, size_t *metasize)
+{
+	int r;
+
+	/* a reader might switch to a new generation at the same time */
+	pthread_mutex_lock(&ctx->rdlock);
+	r = -1;
+	if (ctx->metasize <= *metasize) {
+		if (ctx->metasize > 0)
+			memcpy(meta, ctx->meta, ctx->metasize);
+		*metasize = ctx->metasize;
+		r = 0;
+	}
+	pthread_mutex_unlock(&ctx->rdlock);
+
+	return r;
+}
+
+/*
+ * Replace the metadata record with a copy of "meta". It is written with the
+ * next image, which is a copy of the current one if no rules changed.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_putmeta(a2acl_ctx *ctx, const void *meta, size_t metasize)
+{
+	char *cp;
+
+	if (ctx->metasize == metasize && metasize > 0 &&
+	    memcmp(ctx->meta, meta, metasize) == 0)
+		return 0;
+
+	if ((cp = malloc(metasize + 1)) == NULL)
+		return -1;
+	memcpy(cp, meta, metasize);
+
+	free(ctx->meta);
+	ctx->meta = cp;
+	ctx->metasize = metasize;
+	ctx->dirty = 1;
+	return 0;
+}
+
+/*
+ * Begin a read in the calling thread. Any changes are written first. The
+ * outermost read switches to a new image if one was installed at the path of
+ * the database, which is seen within CHECKINTERVAL seconds, see pin. After
+ * that the image doesn't change during lookups until the matching
+ * a2acl_endread.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_beginread(a2acl_ctx *ctx)
+{
+	struct reader *rd;
+
+	if ((ctx->dirty || ctx->unsaved) && save(ctx) == -1)
+		return -1;
+
+	if ((rd = getreader(ctx)) == NULL)
+		return -1;
+
+	if (rd->depth == 0)
+		pin(ctx, rd);
+
+	rd->depth++;
+	return 0;
+}
+
+/*
+ * End a read that was started with a2acl_beginread. The image stays mapped
+ * until the next outermost read of the thread, so that rules that were looked
+ * up remain valid.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_endread(a2acl_ctx *ctx)
+{
+	struct reader *rd;
+
+	if ((rd = pthread_getspecific(ctx->rdkey)) == NULL || rd->depth == 0)
+		return -1;
+
+	rd->depth--;
+	return 0;
+}
+
+/*
+ * Update "stats" with the lookup statistics of all threads. Lookups that are
+ * done at the same time might not be counted yet.
+ *
+ * Must return 0 on success, -1 on failure.
+ */
+int
+a2acl_stats(a2acl_ctx *ctx, struct a2aclstats *stats)
+{
+	struct reader *rd;
+
+	pthread_mutex_lock(&ctx->rdlock);
+	*stats = ctx->stats;
+	for (rd = ctx->readers; rd != NULL; rd = rd->next) {
+		stats->probes += atomic_load_explicit(&rd->probes,
+		    memory_order_relaxed);
+		stats->skipped += atomic_load_explicit(&rd->skipped,
+		    memory_order_relaxed);
+		stats->falsepos += atomic_load_explicit(&rd->falsepos,
+		    memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&ctx->rdlock);
+
+	stats->fprate = 0;
+	if (stats->skipped + stats->falsepos > 0)
+		stats->fprate = (double)stats->falsepos /
+		    (stats->skipped + stats->falsepos);
+
+	return 0;
+}
@@ -27,7 +27,7 @@ static const char *progname;
 static int verbose;
 
 void printusage(FILE *);
-int whichlist(const char *, const char *);
+int whichlist(a2acl_ctx *, const char *, const char *);
 
 /*
  * Test if a communication pair may communicate with each other under a given
@@ -48,22 +48,32 @@ int whichlist(const char *, const char *);
  *   A - Abandoned
  *
  * Note that if a policy is not defined, it defaults to Greylist.
+ *
+ * With "-c" only the database cache of the policy is brought up to date, so that
+ * it can be compiled ahead of the processes that use it. Returns 0 on success
+ * and 4 if an error occurred.
  */
 
 int
 main(int argc, char *argv[])
 {
+	a2acl_ctx *ctx;
 	char errstr[100];
 	size_t t, u;
-	int r, list;
+	int r, list, compile;
 
 	if ((progname = basename(argv[0])) == NULL) {
 		perror("basename");
 		exit(1);
 	}
 
-	while ((r = getopt(argc, argv, "hqv")) != -1) {
+	compile = 0;
+
+	while ((r = getopt(argc, argv, "chqv")) != -1) {
 		switch (r) {
+		case 'c':
+			compile = 1;
+			break;
 		case 'h':
 			printusage(stdout);
 			exit(0);
@@ -82,16 +92,29 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 3) {
+	if (argc != (compile ? 1 : 3)) {
 		printusage(stderr);
 		exit(1);
 	}
 
-	if (a2acl_fromfile(argv[0], &t, &u, errstr, sizeof(errstr)) == -1) {
+	if (a2acl_fromfile(&ctx, argv[0], &t, &u, errstr,
+	    sizeof(errstr)) == -1) {
 		fprintf(stderr, "%s: %s, %s\n", argv[0], strerror(errno), errstr);
 		exit(4);
 	}
 
+	if (compile) {
+		/* any changes that are left are written by a2acl_dbclose */
+		if (a2acl_dbclose(ctx) == -1) {
+			fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+			exit(4);
+		}
+		if (verbose > 0)
+			fprintf(stdout, "total number of ACL rules: %zu, newly "
+			    "imported %zu\n", t, u);
+		return 0;
+	}
+
 	if (t == 0) {
 		fprintf(stderr, "%s: empty ruleset\n", argv[0]);
 		exit(4);
@@ -100,8 +123,8 @@ main(int argc, char *argv[])
 	if (verbose > 0)
 		fprintf(stdout, "total number of ACL rules: %zu, newly imported %zu\n", t, u);
 
-	list = whichlist(argv[1], argv[2]);
-	a2acl_dbclose();
+	list = whichlist(ctx, argv[1], argv[2]);
+	a2acl_dbclose(ctx);
 
 	if (verbose > -1)
 		fprintf(stdout, "%c\n", list);
@@ -120,7 +143,7 @@ main(int argc, char *argv[])
  * Return 'W', 'G', 'B' or 'A' on success, -1 on error.
  */
 int
-whichlist(const char *remotestr, const char *localstr)
+whichlist(a2acl_ctx *ctx, const char *remotestr, const char *localstr)
 {
 	a2id remoteid, localid;
 	int list;
@@ -135,7 +158,7 @@ whichlist(const char *remotestr, const char *localstr)
 		exit(4);
 	}
 
-	if (a2acl_whichlist((char *)&list, &remoteid, &localid) == -1) {
+	if (a2acl_whichlist(ctx, (char *)&list, &remoteid, &localid) == -1) {
 		fprintf(stderr, "internal error\n");
 		exit(4);
 	}
@@ -146,5 +169,6 @@ whichlist(const char *remotestr, const char *localstr)
 void
 printusage(FILE *stream)
 {
-	fprintf(stream, "usage: %s [-qv] policyfile remoteid localid\n", progname);
+	fprintf(stream, "usage: %s [-qv] policyfile remoteid localid\n"
+	    "       %s -c [-qv] policyfile\n", progname, progname);
 }
@@ -14,8 +14,11 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
 #include <libgen.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "a2acl.h"
@@ -29,6 +32,8 @@ void printusage(FILE *);
 int
 main(int argc, char *argv[])
 {
+	a2acl_ctx *ctx;
+	const char *localid;
 	int c, i;
 
 	if ((progname = basename(argv[0])) == NULL) {
@@ -36,11 +41,16 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "bhqv")) != -1) {
+	localid = NULL;
+
+	while ((c = getopt(argc, argv, "bhl:qv")) != -1) {
 		switch (c) {
 		case 'h':
 			printusage(stdout);
 			exit(0);
+		case 'l':
+			localid = optarg;
+			break;
 		case 'q':
 			verbose--;
 			break;
@@ -68,13 +78,16 @@ main(int argc, char *argv[])
 			fprintf(stdout, "%s\n", argv[i]);
 		}
 
-		if (a2acl_dbopen(argv[i]) == -1) {
+		if (a2acl_dbopen(&ctx, argv[i]) == -1) {
 			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
 			exit(4);
 		}
 
-		printdb(stdout);
-		a2acl_dbclose();
+		if (localid != NULL)
+			printlocalid(stdout, ctx, localid);
+		else
+			printdb(stdout, ctx);
+		a2acl_dbclose(ctx);
 	}
 
 	return 0;
@@ -83,5 +96,5 @@ main(int argc, char *argv[])
 void
 printusage(FILE *fp)
 {
-	fprintf(fp, "usage: %s [-qv] <file>\n", progname);
+	fprintf(fp, "usage: %s [-qv] [-l localid] <file> ...\n", progname);
 }
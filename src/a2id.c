@@ -15,12 +15,22 @@
  */
 
 #include <assert.h>
-#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define A2ID_SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE __attribute__((always_inline)) inline
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 /*
  * ARPA2 ID library
  *
@@ -41,6 +51,9 @@
 struct a2id {
 	enum A2ID_TYPE type;
 	int hassig;	/* whether the ID has a signature */
+	uint8_t hasupper;	/* whether the ID has upper case characters */
+	uint8_t emptylabel;	/* whether the domain has an empty label, see
+				 * emptylabel */
 	int nropts;	/* total number of options, may exceed three */
 	int generalized;	/* total times this a2id is generalized */
 	char *localpart;	/* points to '+' or terminating nul in str */
@@ -48,8 +61,9 @@ struct a2id {
 	char *firstopt;	/* points to '+' or terminating nul in str */
 	char *sigflags;	/* points to '+' or terminating nul in str */
 	char *domain;	/* points to '@' in str */
-	char _str[A2ID_MAXSZ];	/* contains the actual id, might be
-					 * broken up by generalization */
+	const char *view;	/* if not NULL, all pointers point into this
+				 * caller owned string instead of into str,
+				 * see a2id_fromview */
 	size_t localpartlen;
 	size_t basenamelen;
 	size_t firstoptlen;
@@ -57,6 +71,148 @@ struct a2id {
 				   trailing '+' */
 	size_t domainlen;	/* can not be 0 because of '@' requirement */
 	size_t idlen;
+	char _str[A2ID_MAXSZ];	/* contains the actual id, might be
+					 * broken up by generalization, kept
+					 * last so that all metadata precedes
+					 * the string */
+};
+
+/*
+ * The metadata of an ARPA2 Identifier with all pointers of struct a2id stored
+ * as offsets into the string of the id.
+ *
+ * Note: the total size of an id is less than A2ID_MAXSZ so all offsets and
+ * lengths fit in 16 bits.
+ */
+struct a2idoffs {
+	uint8_t type;
+	uint8_t hassig;
+	uint8_t hasupper;
+	uint8_t emptylabel;
+	uint16_t nropts;
+	uint16_t generalized;
+	uint16_t localpart;
+	uint16_t basename;
+	uint16_t firstopt;
+	uint16_t sigflags;
+	uint16_t domain;
+	uint16_t localpartlen;
+	uint16_t basenamelen;
+	uint16_t firstoptlen;
+	uint16_t sigflagslen;
+	uint16_t domainlen;
+	uint16_t idlen;
+};
+
+/*
+ * Compact, variable sized copy of an ARPA2 Identifier. All metadata fits in the
+ * first cache line, followed by the first part of the id. "str" is sized to
+ * the id, see a2id_tocompact.
+ */
+struct a2id_compact {
+	struct a2idoffs offs;
+	uint16_t strsz;	/* size of "str" */
+	char str[];
+};
+
+/*
+ * Compiled ARPA2 ID Selector, see a2idsel_compile. All strings are stored in
+ * "str", folded to lower case, except for the signature flags which are case
+ * sensitive.
+ */
+#define SEL_LOCALPART	0x01	/* the localpart must match */
+#define SEL_SERVICE	0x02	/* the subject must be a service */
+#define SEL_SIG		0x04	/* the subject must have a signature */
+#define SEL_SIGFLAGS	0x08	/* the signature flags must be equal */
+#define SEL_WILDSEG	0x10	/* some localpart segments are empty */
+#define SEL_LABELLOOP	0x20	/* empty labels between other labels */
+
+struct a2idsel {
+	uint8_t flags;
+	uint16_t nropts;
+	uint16_t localpartlen;	/* of the selector */
+	uint16_t segs;	/* all segments, without service and signature */
+	uint16_t segslen;
+	uint16_t sigflags;	/* including leading '+' */
+	uint16_t sigflagslen;
+	uint16_t domain;	/* complete domain, including '@' */
+	uint16_t domainlen;
+	uint16_t suffix;	/* labels after the leading empty labels */
+	uint16_t suffixlen;	/* excluding any ROOT dot */
+	uint16_t wildlabels;	/* number of leading empty labels */
+	uint16_t strsz;	/* size of "str" */
+	char str[];
+};
+
+/*
+ * Set of ARPA2 ID Selectors, see a2idselset_new. All labels of the domains of
+ * the selectors are stored in a trie, starting from the back. Every node of the
+ * domain trie has two tries of the localpart segments, one for generic and one
+ * for service selectors. An empty label or segment is a wildcard and is stored
+ * as a separate child. All other children are found via one hash table with
+ * all edges. Every selector is stored at the node where its last label or
+ * segment ends.
+ */
+#define SELSET_NONE SIZE_MAX
+
+struct selsetnode {
+	size_t wild;	/* child for an empty label or segment */
+	size_t lproot[2];	/* localpart tries, generic and service */
+	size_t sels;	/* first selector that ends at this node */
+};
+
+struct selsetedge {
+	size_t parent;
+	size_t child;	/* SELSET_NONE if the slot is free */
+	size_t key;	/* offset of the folded label or segment in "keys" */
+	size_t keylen;
+	uint32_t hash;
+};
+
+struct selsetsel {
+	a2idsel *sel;
+	size_t next;	/* next selector that ends at the same node */
+};
+
+struct a2idselset {
+	struct selsetnode *nodes;	/* the root of the domain trie is 0 */
+	size_t nnodes, nodessz;
+	struct selsetedge *edges;	/* open addressing, power of two */
+	size_t nedges, edgessz;
+	char *keys;
+	size_t keyslen, keyssz;
+	struct selsetsel *sels;	/* in insertion order */
+	size_t nsels, selssz;
+};
+
+/*
+ * An ARPA2 Identifier in a caller owned buffer, see a2id_view_parse.
+ *
+ * Note: the size of the public opaque a2id_view must be kept in sync with this
+ * struct.
+ */
+struct a2id_view {
+	const char *buf;
+	struct a2idoffs offs;
+};
+
+/*
+ * Read-only generalization of an ARPA2 Identifier, see a2id_gencursor_init.
+ * Instead of modifying the id, only the lengths of the parts that are left are
+ * kept, and each part is read from "id" when writing out a selector.
+ *
+ * Note: the size of the public opaque a2id_gencursor must be kept in sync with
+ * this struct.
+ */
+struct a2id_gencursor {
+	const struct a2id *id;
+	const char *domain;	/* points after the '@' */
+	size_t domainlen;	/* excluding the '@' */
+	size_t localpartlen;
+	size_t basenamelen;
+	size_t sigflagslen;
+	int nropts;
+	int started;	/* whether the id itself is returned already */
 };
 
 /*
@@ -183,6 +339,8 @@ copy(struct a2id *out, const struct a2id *id)
 
 	out->type = id->type;
 	out->hassig = id->hassig;
+	out->hasupper = id->hasupper;
+	out->emptylabel = id->emptylabel;
 	out->nropts = id->nropts;
 
 	return 0;
@@ -231,62 +389,40 @@ static const char basechar[256] = {
 	/* let rest of static array initialize to 0 */
 };
 
+enum parsestates { S, SERVICE, LOCALPART, OPTION, NEWLABEL, DOMAIN };
+
 /*
- * Static ARPA2 ID parser.
- *
- * Parse the string "in" and writes the result in "out". "in" must be a nul
- * terminated string. "isselector" is a boolean that indicates wheter or not the
- * input should be parsed as a selector. A selector is a generalization of an
- * A2ID.
- *
- * On success the following fiels of the "out" structure are set:
- *
- *	type
- *	hassig	whether the ID has a signature or not
- *	nropts	total number of options
- *	localpart	points to the first character of the ID
- *	localpartlen	length, 0 if there is no localpart
- *	basename	points to the first character of the name
- *	basenamelen	length, 0 if there is no basename
- *	firstopt	points to leading '+' if it exists
- *	firstoptlen	length including leading '+', 0 if there is no firstopt
- *	sigflags	points to leading '+' if it exists
- *	sigflagslen	length including leading '+', 0 if there are no sigflags
- *	domain	points to leading '@', always exists in a valid ID
- *	domainlen	length including '@', every valid ID requires a domain
- *	idlen	total length of the ID
- *
- * "localpart", "basename", "firstopt", "sigflags" and "domain" are not
- * guaranteed to be nul terminated.
- *
- * On error "idlen" contains the length of the string up to but not including
- * the first erroneous character in "in". Another way to read this is, on error
- * "idlen" contains the index of the first erroneaous character in "in".
- *
- * Return 0 if "in" is a valid A2ID and could be parsed, -1 otherwise.
+ * Intermediate state of the parser.
  */
-static int
-parsestr(struct a2id *a2id, const char *in, int isselector)
-{
-	struct a2id *out = (struct a2id *)a2id;
-	enum states { S, SERVICE, LOCALPART, OPTION, NEWLABEL, DOMAIN } state;
-	char *curopt, *prevopt, *secondopt;
-	size_t i;
-	unsigned char c;
-
-	if (in == NULL || out == NULL)
-		return -1;
+struct parsestate {
+	enum parsestates state;
+	int isselector;
+	char *curopt;
+	char *prevopt;
+	char *secondopt;
+};
 
-	secondopt = prevopt = curopt = NULL;
+/*
+ * Reset all fields of "out" and initialize "ps" for parsing.
+ */
+static void
+parseinit(struct a2id *out, struct parsestate *ps, int isselector)
+{
+	ps->state = S;
+	ps->isselector = isselector;
+	ps->secondopt = ps->prevopt = ps->curopt = NULL;
 
 	out->generalized = 0;
 	out->hassig = 0;
+	out->hasupper = 0;
+	out->emptylabel = 0;
 	out->nropts = 0;
 	out->localpart = NULL;
 	out->basename = NULL;
 	out->firstopt = NULL;
 	out->sigflags = NULL;
 	out->domain = NULL;
+	out->view = NULL;
 	out->type = A2IDT_GENERIC;
 	out->localpartlen = 0;
 	out->basenamelen = 0;
@@ -294,102 +430,162 @@ parsestr(struct a2id *a2id, const char *in, int isselector)
 	out->sigflagslen = 0;
 	out->domainlen = 0;
 	out->idlen = 0;
+}
 
-	state = S;
-	for (i = 0; i < A2ID_MAXLEN && in[i] != '\0'; i++) {
-		c = in[i];
-
-		/* Copy string. */
-		out->_str[i] = c;
-
-		switch (state) {
-		case S:
-			if (basechar[c] || c == '.') {
-				out->localpart = &out->_str[i];
-				out->basename = &out->_str[i];
-				state = LOCALPART;
-			} else if (c == '+') {
-				out->localpart = &out->_str[i];
-				state = SERVICE;
-			} else if (c == '@') {
-				out->domain = &out->_str[i];
-				state = NEWLABEL;
-			} else
-				goto done;
-			break;
-		case SERVICE:
-			if (basechar[c] || c == '.') {
-				out->basename = &out->_str[i];
-				state = LOCALPART;
-			} else if (isselector && c == '@') {
-				out->domain = &out->_str[i];
-				state = NEWLABEL;
-			} else if (isselector && c == '+') {
-				curopt = &out->_str[i];
+/*
+ * Feed character "c" at index "i" of the input to the state machine.
+ *
+ * Note that a basechar never changes the state if it is preceded by another
+ * basechar. This is what allows parseblocks to only feed the first character
+ * of each run of basechars.
+ *
+ * Must be inlined, the per character call overhead is noticeable otherwise.
+ *
+ * Return 0 if "c" is allowed in the current state, -1 otherwise.
+ */
+static ALWAYS_INLINE int
+parsestep(struct a2id *out, struct parsestate *ps, unsigned char c, size_t i)
+{
+	switch (ps->state) {
+	case S:
+		if (basechar[c] || c == '.') {
+			out->localpart = &out->_str[i];
+			out->basename = &out->_str[i];
+			ps->state = LOCALPART;
+		} else if (c == '+') {
+			out->localpart = &out->_str[i];
+			ps->state = SERVICE;
+		} else if (c == '@') {
+			out->domain = &out->_str[i];
+			ps->state = NEWLABEL;
+		} else
+			return -1;
+		break;
+	case SERVICE:
+		if (basechar[c] || c == '.') {
+			out->basename = &out->_str[i];
+			ps->state = LOCALPART;
+		} else if (ps->isselector && c == '@') {
+			out->domain = &out->_str[i];
+			ps->state = NEWLABEL;
+		} else if (ps->isselector && c == '+') {
+			ps->curopt = &out->_str[i];
+			out->firstopt = &out->_str[i];
+			out->nropts++;
+			ps->state = OPTION;
+		} else
+			return -1;
+		break;
+	case LOCALPART:
+		if (basechar[c] || c == '.') {
+			/* keep going */
+		} else if (c == '+') {
+			ps->prevopt = ps->curopt;
+			ps->curopt = &out->_str[i];
+			if (out->firstopt == NULL) {
 				out->firstopt = &out->_str[i];
-				out->nropts++;
-				state = OPTION;
-			} else
-				goto done;
-			break;
-		case LOCALPART:
-			if (basechar[c] || c == '.') {
-				/* keep going */
-			} else if (c == '+') {
-				prevopt = curopt;
-				curopt = &out->_str[i];
-				if (out->firstopt == NULL) {
-					out->firstopt = &out->_str[i];
-				} else if (secondopt == NULL) {
-					secondopt = &out->_str[i];
-				}
-
-				out->nropts++;
-				state = OPTION;
-			} else if (c == '@') {
-				out->domain = &out->_str[i];
-				state = NEWLABEL;
-			} else
-				goto done;
-			break;
-		case OPTION:
-			if (basechar[c] || c == '.') {
-				state = LOCALPART;
-			} else if (c == '+') {
-				prevopt = curopt;
-				curopt = &out->_str[i];
-				if (secondopt == NULL) {
-					secondopt = &out->_str[i];
-				}
-				out->nropts++;
-			} else if (c == '@') {
-				out->domain = &out->_str[i];
-				state = NEWLABEL;
-			} else
-				goto done;
-			break;
-		case DOMAIN:
-			if (basechar[c]) {
-				/* keep going */
-			} else if (c == '.') {
-				state = NEWLABEL;
-			} else
-				goto done;
-			break;
-		case NEWLABEL:
-			if (basechar[c]) {
-				state = DOMAIN;
-			} else if (isselector && c == '.') {
-				/* keep going */
-			} else
-				goto done;
-			break;
-		default:
-			abort();
-		}
+			} else if (ps->secondopt == NULL) {
+				ps->secondopt = &out->_str[i];
+			}
+
+			out->nropts++;
+			ps->state = OPTION;
+		} else if (c == '@') {
+			out->domain = &out->_str[i];
+			ps->state = NEWLABEL;
+		} else
+			return -1;
+		break;
+	case OPTION:
+		if (basechar[c] || c == '.') {
+			ps->state = LOCALPART;
+		} else if (c == '+') {
+			ps->prevopt = ps->curopt;
+			ps->curopt = &out->_str[i];
+			if (ps->secondopt == NULL) {
+				ps->secondopt = &out->_str[i];
+			}
+			out->nropts++;
+		} else if (c == '@') {
+			out->domain = &out->_str[i];
+			ps->state = NEWLABEL;
+		} else
+			return -1;
+		break;
+	case DOMAIN:
+		if (basechar[c]) {
+			/* keep going */
+		} else if (c == '.') {
+			ps->state = NEWLABEL;
+		} else
+			return -1;
+		break;
+	case NEWLABEL:
+		if (basechar[c]) {
+			ps->state = DOMAIN;
+		} else if (ps->isselector && c == '.') {
+			/* keep going */
+		} else
+			return -1;
+		break;
+	default:
+		abort();
 	}
 
-done:
+	return 0;
+}
+
+/*
+ * Return 1 if any of the first "n" characters of "s" is an upper case ASCII
+ * character, 0 otherwise.
+ */
+static int
+hasupper(const char *s, size_t n)
+{
+	unsigned char r;
+	size_t i;
+
+	/* no early exit so that this is vectorized */
+	for (r = 0, i = 0; i < n; i++)
+		r |= (unsigned char)(s[i] - 'A') < 26;
+
+	return r;
+}
+
+/*
+ * Return 1 if the domain "d" of "n" characters, including the leading '@', has
+ * an empty label, 0 otherwise. An optional trailing ROOT dot is not counted as
+ * an empty label, but a domain without any labels is.
+ */
+static int
+emptylabel(const char *d, size_t n)
+{
+	char prev;
+	size_t i;
+
+	assert(n > 0 && d[0] == '@');
+
+	if (d[n - 1] == '.')
+		n--;
+
+	for (prev = '.', i = 1; i < n; prev = d[i], i++)
+		if (d[i] == '.' && prev == '.')
+			return 1;
+
+	return prev == '.';
+}
+
+/*
+ * Finish parsing of "in" after the state machine stopped at index "i". "_str"
+ * must contain a copy of the first "i" characters of "in". See parse for
+ * "inlen".
+ *
+ * Return 0 if "in" is a valid A2ID, -1 otherwise.
+ */
+static int
+parsefinish(struct a2id *out, struct parsestate ps, const char *in,
+    size_t inlen, size_t i)
+{
 	/* Ensure termination. */
 	out->idlen = i;
 	out->_str[i] = '\0';
@@ -398,22 +594,25 @@ done:
 
 	/*
 	 * Make sure the end of the input is reached and the state is one of the
-	 * final states.
+	 * final states. A nul byte is only allowed as the terminator of "in" if
+	 * no length is given.
 	 */
-	if (in[i] != '\0')
+	if (i < inlen && (inlen != SIZE_MAX || in[i] != '\0'))
 		return -1;
 
-	if (isselector) {
-		if (state != DOMAIN && state != NEWLABEL)
+	if (ps.isselector) {
+		if (ps.state != DOMAIN && ps.state != NEWLABEL)
 			return -1;
 	} else {
-		if (state != DOMAIN)
+		if (ps.state != DOMAIN)
 			return -1;
 	}
 
-	/* Determine type. */
+	out->hasupper = hasupper(in, i);
+
+	/* Determine type, the localpart always starts at the first character. */
 	if (out->localpart) {
-		if (*out->localpart == '+')
+		if (in[0] == '+')
 			out->type = A2IDT_SERVICE;
 		else
 			out->type = A2IDT_GENERIC;
@@ -426,16 +625,21 @@ done:
 	out->domainlen = &out->_str[i] - out->domain;
 	assert(out->domainlen > 0);
 
+	/* Only a selector can have empty labels, "_str" might not be set. */
+	if (ps.isselector)
+		out->emptylabel = emptylabel(&in[out->domain - out->_str],
+		    out->domainlen);
+
 	out->localpartlen = out->domain - out->_str;
 
 	if (out->localpartlen == 0)
 		out->localpart = &out->_str[i];
 
 	/* First determine if there was a signature. */
-	if (curopt && prevopt && curopt + 1 == out->domain) {
+	if (ps.curopt && ps.prevopt && ps.curopt + 1 == out->domain) {
 		out->hassig = 1;
-		out->sigflags = prevopt;
-		out->sigflagslen = curopt - prevopt;
+		out->sigflags = ps.prevopt;
+		out->sigflagslen = ps.curopt - ps.prevopt;
 
 		/*
 		 * Undo the signature which has a leading and trailing '+' that
@@ -453,8 +657,8 @@ done:
 	}
 
 	if (out->firstopt) {
-		if (secondopt) {
-			out->firstoptlen = secondopt - out->firstopt;
+		if (ps.secondopt) {
+			out->firstoptlen = ps.secondopt - out->firstopt;
 		} else if (out->sigflagslen)
 			out->firstoptlen = out->sigflags - out->firstopt;
 		else
@@ -481,310 +685,2266 @@ done:
 }
 
 /*
- * Read and parse a string into an ARPA2 ID.
+ * Static ARPA2 ID parser.
  *
- * "in" must be a nul terminated string. "isselector" is a boolean that
- * indicates whether or not the input should be parsed as a selector. A valid ID
- * is always a valid selector, but the opposite is not necessarily true.
+ * Parse the string "in" and writes the result in "out". If "inlen" is SIZE_MAX
+ * "in" must be a nul terminated string, otherwise "in" consists of exactly
+ * "inlen" characters and does not need to be nul terminated. "isselector" is a
+ * boolean that indicates wheter or not the input should be parsed as a
+ * selector. A selector is a generalization of an A2ID.
  *
- * Return 0 if "in" is a valid A2ID, -1 otherwise.
+ * On success the following fiels of the "out" structure are set:
+ *
+ *	type
+ *	hassig	whether the ID has a signature or not
+ *	hasupper	whether the ID has upper case characters or not
+ *	nropts	total number of options
+ *	localpart	points to the first character of the ID
+ *	localpartlen	length, 0 if there is no localpart
+ *	basename	points to the first character of the name
+ *	basenamelen	length, 0 if there is no basename
+ *	firstopt	points to leading '+' if it exists
+ *	firstoptlen	length including leading '+', 0 if there is no firstopt
+ *	sigflags	points to leading '+' if it exists
+ *	sigflagslen	length including leading '+', 0 if there are no sigflags
+ *	domain	points to leading '@', always exists in a valid ID
+ *	domainlen	length including '@', every valid ID requires a domain
+ *	idlen	total length of the ID
+ *
+ * "localpart", "basename", "firstopt", "sigflags" and "domain" are not
+ * guaranteed to be nul terminated.
+ *
+ * On error "idlen" contains the length of the string up to but not including
+ * the first erroneous character in "in". Another way to read this is, on error
+ * "idlen" contains the index of the first erroneaous character in "in".
+ *
+ * If "copystr" is 0, "in" is not copied into "_str" and all pointers are only
+ * meaningful as offsets relative to "_str", see a2id_view_parse.
+ *
+ * This parser processes one character at a time and is the reference
+ * implementation for parseblocks.
+ *
+ * Return 0 if "in" is a valid A2ID and could be parsed, -1 otherwise.
  */
-int
-a2id_fromstr(a2id *a2id, const char *in, int isselector)
+static int
+parse(struct a2id *out, const char *in, size_t inlen, int isselector,
+    int copystr)
 {
-	return parsestr((struct a2id*)a2id, in, isselector);
+	struct parsestate ps;
+	size_t i, max;
+	unsigned char c;
+
+	if (in == NULL || out == NULL)
+		return -1;
+
+	parseinit(out, &ps, isselector);
+
+	max = inlen < A2ID_MAXLEN ? inlen : A2ID_MAXLEN;
+
+	for (i = 0; i < max && in[i] != '\0'; i++) {
+		c = in[i];
+
+		/* Copy string. */
+		if (copystr)
+			out->_str[i] = c;
+
+		if (parsestep(out, &ps, c, i) == -1)
+			break;
+	}
+
+	return parsefinish(out, ps, in, inlen, i);
 }
 
+#ifdef A2ID_SIMD
 /*
- * Match an ARPA2 ID with an ARPA2 ID Selector.
- *
- * Return 1 if the subject matches the selector, 0 otherwise. If the localpart
- * and/or domain in the selector are an empty string it is considered to be a
- * match to the respective part in the subject.
+ * Block classifiers. Return a mask with a bit set for every character in the
+ * block of 64 characters at "p" that is not a basechar, i.e. '+', '@', '.', a
+ * nul byte or any other character that is not allowed in an A2ID. All 64
+ * characters must be readable, "p" does not need to be aligned.
  */
-int
-a2id_match(const a2id *subject, const a2id *selector)
+__attribute__((target("sse2")))
+static uint64_t
+classify_sse2(const char *p)
 {
-	const struct a2id *subid = (const struct a2id *)subject;
-	const struct a2id *selid = (const struct a2id *)selector;
-	char *selp, *subp;
-	size_t selplen, subplen;
-	int n;
+	__m128i v, ok;
+	uint64_t m;
+	int i;
 
-	assert(subid && selid);
+	for (m = 0, i = 0; i < 64; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&p[i]);
 
-	if (selid->localpartlen > 0) {
-		if (selid->localpartlen > subid->localpartlen)
-			return 0;
+		/* 0x21 - 0x7e, note that 0x80 - 0xff are negative */
+		ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x20)),
+		    _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
 
-		if (selid->hassig) {
-			if (!subid->hassig)
-				return 0;
+		ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+		    ok);
+		ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('@')),
+		    ok);
+		ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+		    ok);
 
-			/* if sigflags selector is not empty it must match */
-			if (selid->sigflagslen > 1 &&
-			    selid->sigflagslen != subid->sigflagslen)
-					return 0;
+		m |= (uint64_t)(~_mm_movemask_epi8(ok) & 0xffff) << i;
+	}
 
-			if (selid->sigflagslen > 1 &&
-			    strncmp(selid->sigflags, subid->sigflags,
-			    selid->sigflagslen) != 0)
-				return 0;
-		}
+	return m;
+}
 
-		/* compare each segment */
-		selp = selid->localpart;
-		subp = subid->localpart;
+__attribute__((target("avx2")))
+static uint64_t
+classify_avx2(const char *p)
+{
+	__m256i v, ok;
+	uint64_t m;
+	int i;
+
+	for (m = 0, i = 0; i < 64; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)&p[i]);
+
+		/* 0x21 - 0x7e, note that 0x80 - 0xff are negative */
+		ok = _mm256_and_si256(_mm256_cmpgt_epi8(v,
+		    _mm256_set1_epi8(0x20)), _mm256_cmpgt_epi8(
+		    _mm256_set1_epi8(0x7f), v));
+
+		ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v,
+		    _mm256_set1_epi8('+')), ok);
+		ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v,
+		    _mm256_set1_epi8('@')), ok);
+		ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v,
+		    _mm256_set1_epi8('.')), ok);
+
+		m |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(ok) << i;
+	}
 
-		if (selid->type == A2IDT_SERVICE) {
-			if (subid->type != A2IDT_SERVICE)
-				return 0;
+	return m;
+}
 
-			/* skip leading '+' */
-			selp++;
-			subp++;
-		}
+/*
+ * Like classify_sse2 but sort the special characters in the block of 64
+ * characters at "p" into separate masks of '+', '@', '.' and all other characters
+ * that are not a basechar.
+ */
+struct blockmasks {
+	uint64_t plus;
+	uint64_t at;
+	uint64_t dot;
+	uint64_t other;
+	uint64_t upper;	/* only set by classifychunk_sse2 */
+};
 
-		if (selid->nropts > subid->nropts)
-			return 0;
+__attribute__((target("sse2")))
+static void
+classifymasks_sse2(struct blockmasks *bm, const char *p)
+{
+	__m128i v, plus, at, dot, ok;
+	int i;
 
-		/* Compare base and option segments. */
-		for (n = -1; n < selid->nropts; n++) {
-			/* lock-step comparison up till next separator */
-			for (selplen = subplen = 0;
-			    *selp != '+' && *selp != '@' && *selp != '\0' &&
-			    *subp != '+' && *subp != '@' && *subp != '\0';
-			    selplen++, selp++,
-			    subplen++, subp++) {
-				if (tolower(*selp) != tolower(*subp))
-					break;
-			}
+	memset(bm, 0, sizeof(*bm));
 
-			/* selector must have reached a separator */
-			if (*selp != '+' && *selp != '@' && *selp != '\0')
-				return 0;
+	for (i = 0; i < 64; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&p[i]);
 
-			/*
-			 * If there is no text in the segment of the selector
-			 * after the last '+', any segment in the subject will
-			 * do, as long as it exists (except for a leading or
-			 * trailing '+' which indicates a service or a
-			 * signature, respectively).
-			 */
-			if (selplen == 0) {
-				if (*subp == '+' ||
-				    *subp == '@' ||
-				    *subp == '\0')
-					return 0;
+		/* 0x21 - 0x7e, note that 0x80 - 0xff are negative */
+		ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x20)),
+		    _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
 
-				while (*subp != '+' && *subp != '@' && *subp != '\0')
-					subp++;
-			}
+		plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+		at = _mm_cmpeq_epi8(v, _mm_set1_epi8('@'));
+		dot = _mm_cmpeq_epi8(v, _mm_set1_epi8('.'));
 
-			if (*subp != '+' && *subp != '@' && *subp != '\0')
-				return 0;
+		bm->plus |= (uint64_t)_mm_movemask_epi8(plus) << i;
+		bm->at |= (uint64_t)_mm_movemask_epi8(at) << i;
+		bm->dot |= (uint64_t)_mm_movemask_epi8(dot) << i;
+		bm->other |= (uint64_t)(~_mm_movemask_epi8(ok) & 0xffff) << i;
+	}
+}
 
-			if (*selp == '@' || *selp == '\0')
-				break; /* done, every selector segment matches */
+/*
+ * Block based ARPA2 ID parser, yields the exact same results as parse.
+ *
+ * Instead of feeding every character to the state machine, "classify" is used
+ * to find all special characters in a block of 64 characters at once. Only
+ * these, and the first character of every run of basechars in between, are
+ * fed to the state machine. The string is copied in one go when done.
+ *
+ * Only characters of the input are loaded. The end of a nul terminated string
+ * is found first, and the last block of less than 64 characters is copied to a
+ * buffer that is padded with nul bytes before it is classified.
+ */
+static int
+parseblocks(struct a2id *out, const char *in, size_t inlen, int isselector,
+    int copystr, uint64_t (*classify)(const char *))
+{
+	struct parsestate ps;
+	char tail[64];
+	uint64_t m;
+	size_t i, blk, next, max;
 
-			if (*subp != '+')
-				return 0;
+	if (in == NULL || out == NULL)
+		return -1;
 
-			selp++;
-			subp++;
+	parseinit(out, &ps, isselector);
+
+	max = inlen < A2ID_MAXLEN ? inlen : A2ID_MAXLEN;
+	if (inlen == SIZE_MAX)
+		max = strnlen(in, max);
+
+	/* index of the first character not yet fed to the state machine */
+	next = 0;
+
+	/* "blk" is the index in "in" of the character at bit 0 of "m" */
+	for (blk = 0; blk < max; blk += 64) {
+		if (max - blk >= sizeof(tail)) {
+			m = classify(&in[blk]);
+		} else {
+			/* the nul bytes end the input */
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, &in[blk], max - blk);
+			m = classify(tail);
+		}
+
+		for (; m != 0; m &= m - 1) {
+			i = blk + __builtin_ctzll(m);
+			if (i >= max || in[i] == '\0')
+				goto end;
+
+			/* Start of a run of basechars. */
+			if (next < i)
+				parsestep(out, &ps, in[next], next);
+
+			if (parsestep(out, &ps, in[i], i) == -1)
+				goto copy;
+
+			next = i + 1;
 		}
 	}
+	i = max;
 
-	if (selid->domainlen > 0) {
-		/*
-		 * Can't compare domain lengths because of optional trailing
-		 * dots and possibly empty labels in the selector.
-		 */
-		if (subid->domainlen < 1)
-			return 0;
+end:
+	if (i > max)
+		i = max;
 
-		/* compare each label, starting from the back */
-		assert(*selid->domain == '@' && *subid->domain == '@');
-		selp = &selid->domain[selid->domainlen - 1];
-		subp = &subid->domain[subid->domainlen - 1];
+	/* Trailing run of basechars. */
+	if (next < i)
+		parsestep(out, &ps, in[next], next);
 
-		for (;;) {
-			/* Step over leading dot of current label. */
-			if (*selp == '.') /* ROOT dot is optional */
-				selp--;
-
-			if (*subp == '.')
-				subp--;
-
-			/* lock-step comparison */
-			for (selplen = subplen = 0;
-			    *selp != '@' && *selp != '.' &&
-			    *subp != '@' && *subp != '.';
-			    selplen++, selp--,
-			    subplen++, subp--) {
-				if (tolower(*selp) != tolower(*subp))
-					break;
-			}
+copy:
+	if (copystr)
+		memcpy(out->_str, in, i);
 
-			if (*selp != '@' && *selp != '.')
-				return 0;
+	return parsefinish(out, ps, in, inlen, i);
+}
 
-			if (selplen == 0) {
-				/*
-				 * A dot without label means there must be a
-				 * label in the subject, no matter what the
-				 * content.
-				 */
-				if (*subp == '@' || *subp == '.')
-					return 0;
+/*
+ * Bit parallel ARPA2 ID parser for short IDs of known length, yields the exact
+ * same results as parse.
+ *
+ * The positions of all '+', '@' and '.' characters of an ID of at most 64
+ * characters fit in a 64 bit mask each. For a valid ID the result of the state
+ * machine follows directly from these masks: the domain starts at the only '@',
+ * options start at every '+' before it, except for a leading '+' of a service.
+ * This avoids feeding characters one by one and the mispredicted branches that
+ * come with it.
+ *
+ * Only the common valid forms are handled, anything else is left to the other
+ * parsers so that these determine the error offset. Requires SSE2.
+ *
+ * Return 0 if "in" is a valid A2ID, 1 if "in" should be parsed by another
+ * parser.
+ */
+static int
+parsemasks(struct a2id *out, const char *in, size_t inlen, int isselector,
+    int copystr)
+{
+	struct blockmasks bm;
+	struct parsestate ps;
+	char buf[64];
+	uint64_t valid, plus, at, dot, dom, m;
+	size_t a, last;
 
-				/*
-				 * Jump over the label now that we now it's
-				 * there.
-				 */
-				while (*subp != '@' && *subp != '.')
-					subp--;
-			}
+	if (inlen == 0 || inlen > sizeof(buf))
+		return 1;
 
-			if (*subp != '@' && *subp != '.')
-				return 0;
+	valid = inlen == 64 ? ~(uint64_t)0 : ((uint64_t)1 << inlen) - 1;
+	last = inlen - 1;
+
+	/* Don't load beyond the input, pad a short ID. */
+	if (inlen == sizeof(buf)) {
+		classifymasks_sse2(&bm, in);
+	} else {
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, in, inlen);
+		classifymasks_sse2(&bm, buf);
+	}
+	plus = bm.plus & valid;
+	at = bm.at & valid;
+	dot = bm.dot & valid;
+	m = bm.other;
+
+	/* Any other special character is an error. */
+	if (m & valid)
+		return 1;
+
+	/* Exactly one '@'. */
+	if (at == 0 || (at & (at - 1)) != 0)
+		return 1;
+
+	a = __builtin_ctzll(at);
+	dom = valid & ~(at | (at - 1));
+
+	if (plus & dom)
+		return 1;
+
+	/*
+	 * An ID requires non-empty labels, a selector allows empty labels and
+	 * an empty domain.
+	 */
+	if (!isselector) {
+		if (a == last || in[a + 1] == '.' || in[last] == '.' ||
+		    (dot & (dot >> 1) & dom))
+			return 1;
+	}
+
+	parseinit(out, &ps, isselector);
+
+	out->domain = &out->_str[a];
+
+	if (a > 0) {
+		plus &= at - 1;
+		out->localpart = &out->_str[0];
+		out->basename = &out->_str[0];
 
-			if (*selp == '@')
-				break; /* done, every selector label matches */
+		/* A service must be followed by a basename. */
+		if (plus & 1) {
+			if (a == 1 || (plus & 2))
+				return 1;
+			out->basename = &out->_str[1];
+			plus &= ~(uint64_t)1;
+		}
+
+		if (plus) {
+			out->nropts = __builtin_popcountll(plus);
+			out->firstopt = &out->_str[__builtin_ctzll(plus)];
+			ps.curopt = &out->_str[63 - __builtin_clzll(plus)];
+			if (out->nropts > 1) {
+				m = plus & (plus - 1);
+				ps.secondopt = &out->_str[__builtin_ctzll(m)];
+				m = plus & ~((uint64_t)1 << (63 -
+				    __builtin_clzll(plus)));
+				ps.prevopt = &out->_str[63 - __builtin_clzll(m)];
+			}
 		}
 	}
 
-	/* Match if we made it this far. */
+	if (in[last] == '.' || a == last)
+		ps.state = NEWLABEL;
+	else
+		ps.state = DOMAIN;
 
-	return 1;
+	if (copystr)
+		memcpy(out->_str, in, inlen);
+
+	return parsefinish(out, ps, in, inlen, inlen);
 }
 
 /*
- * Generalize an A2ID structure by one step. Generalization is the process of
- * removing segments and labels from the localpart and domain, in that order.
- * Each function call represents one generalization. As long as there are
- * segments in the localpart, one segment is removed from the localpart from
- * right to left. As soon as the localpart can't be generalized any further,
- * domain labels are removed from left to right, until no labels are left. "id"
- * is a value/result parameter.
+ * Copy the 16 characters in "v" to "dst" and add them to the masks in "bm",
+ * with the first character at bit "off". Upper case letters are recorded as
+ * well, so that no other pass over the characters is needed.
+ */
+__attribute__((target("sse2")))
+static ALWAYS_INLINE void
+classifychunk_sse2(struct blockmasks *bm, char *dst, __m128i v, size_t off)
+{
+	__m128i ok, upper;
+
+	_mm_storeu_si128((__m128i *)dst, v);
+
+	/* 0x21 - 0x7e, note that 0x80 - 0xff are negative */
+	ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x20)),
+	    _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+	upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	    _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+
+	bm->plus |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+	    _mm_set1_epi8('+'))) << off;
+	bm->at |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+	    _mm_set1_epi8('@'))) << off;
+	bm->dot |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+	    _mm_set1_epi8('.'))) << off;
+	bm->other |= (uint64_t)(~_mm_movemask_epi8(ok) & 0xffff) << off;
+	bm->upper |= (uint64_t)_mm_movemask_epi8(upper) << off;
+}
+
+/*
+ * Single pass ARPA2 ID parser for short IDs of known length, used by
+ * a2id_fromstr_many. Yields the exact same results as parse.
  *
- * Returns 1 if a component is removed from the localpart or the domain.
- * Returns 0 if "id" can not be further generalized.
+ * Like parsemasks, but the ID is copied to "_str" and classified in the same
+ * pass, 16 characters at a time. Because the length is known up front, the
+ * last chunk is loaded so that it ends at the last character, overlapping the
+ * previous one, and never beyond the input, so no padded copy is needed. The
+ * fields are derived from the masks directly instead of through the state
+ * machine, and whether there are upper case characters follows from a mask as
+ * well. Only an ID of less than 16 characters is padded.
  *
- * XXX don't move domain by removing every label, just increment the domain
- * pointer now that the memory is allocated statically in the structure.
+ * Only the common valid forms are handled, anything else is left to the other
+ * parsers so that these determine the error offset. Requires SSE2.
+ *
+ * Return 0 if "in" is a valid A2ID, 1 if "in" should be parsed by another
+ * parser.
  */
-int
-a2id_generalize(a2id *a2id)
+__attribute__((target("sse2")))
+static int
+parsechunks(struct a2id *out, const char *in, size_t inlen, int isselector)
 {
-	struct a2id *id = (struct a2id *)a2id;
-	char *cp;
-	size_t i, n;
+	struct blockmasks bm;
+	uint64_t valid, plus, at, dot, dom;
+	size_t a, last, off, first, next, prev;
+	char buf[16], *str, *end;
+	int nropts, sig;
 
-	if (id == NULL)
-		return 0;
+	if (inlen == 0 || inlen > 64)
+		return 1;
 
-	if (id->sigflagslen > 0) {
-		if (id->sigflagslen > 1) {
-			/* remove signature data, but leave trailing '+' */
-			*(id->sigflags + 1) = '+';
-			*(id->sigflags + 2) = '\0';
-			id->localpartlen -= id->sigflagslen - 1;
-			id->sigflagslen = 1;
-		} else {
-			/* remove signature and trailing '+' */
-			*id->sigflags = '\0';
-			id->localpartlen -= id->sigflagslen + 1;
-			id->sigflagslen = 0;
-			id->hassig = 0;
+	str = out->_str;
+	memset(&bm, 0, sizeof(bm));
+
+	if (inlen < sizeof(buf)) {
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, in, inlen);
+		classifychunk_sse2(&bm, str,
+		    _mm_loadu_si128((const __m128i *)buf), 0);
+	} else {
+		for (off = 0; off < inlen; off += 16) {
+			if (off > inlen - 16)
+				off = inlen - 16;
+			classifychunk_sse2(&bm, &str[off],
+			    _mm_loadu_si128((const __m128i *)&in[off]), off);
 		}
+	}
 
-		id->idlen = id->localpartlen + id->domainlen;
-		id->generalized++;
+	valid = inlen == 64 ? ~(uint64_t)0 : ((uint64_t)1 << inlen) - 1;
+	last = inlen - 1;
+	plus = bm.plus & valid;
+	at = bm.at & valid;
+	dot = bm.dot & valid;
+
+	/* Any other special character, or not exactly one '@', is an error. */
+	if ((bm.other & valid) || at == 0 || (at & (at - 1)) != 0)
+		return 1;
+
+	a = __builtin_ctzll(at);
+	dom = valid & ~(at | (at - 1));
+
+	if (plus & dom)
 		return 1;
+
+	/* See parsemasks. */
+	if (!isselector) {
+		if (a == last || str[a + 1] == '.' || str[last] == '.' ||
+		    (dot & (dot >> 1) & dom))
+			return 1;
 	}
 
-	if (id->nropts > 0) {
-		cp = &id->localpart[id->localpartlen - 1];
+	end = &str[inlen];
+	*end = '\0';
 
-		/*
-		 * Either delete the option data, or the option. If there is
-		 * only a trailing '+', remove the option, else everything up
-		 * to the previous '+' is removed, exclusive.
-		 */
+	out->type = A2IDT_GENERIC;
+	out->hassig = 0;
+	out->hasupper = (bm.upper & valid) != 0;
+	out->emptylabel = isselector ? emptylabel(&str[a], inlen - a) : 0;
+	out->nropts = 0;
+	out->generalized = 0;
+	out->localpart = str;
+	out->basename = str;
+	out->firstopt = end;
+	out->sigflags = end;
+	out->domain = &str[a];
+	out->view = NULL;
+	out->localpartlen = a;
+	out->firstoptlen = 0;
+	out->sigflagslen = 0;
+	out->domainlen = inlen - a;
+	out->idlen = inlen;
 
-		/* remove the option */
-		if (*cp == '+') {
-			*cp = '\0';
-			id->nropts--;
-			id->localpartlen--;
+	if (a == 0) {
+		out->type = A2IDT_DOMAINONLY;
+		out->localpart = end;
+		out->basename = end;
+		out->basenamelen = 0;
+		return 0;
+	}
 
-			if (id->nropts == 0) {
-				*id->firstopt = '\0';
-				id->firstoptlen = 0;
-			}
-		} else /* remove option data only */
-			for (; *cp != '+'; cp--, id->localpartlen--)
-				*cp = '\0';
+	plus &= at - 1;
 
-		id->idlen = id->localpartlen + id->domainlen;
-		id->generalized++;
-		return 1;
+	/* A service must be followed by a basename. */
+	if (plus & 1) {
+		if (a == 1 || (plus & 2))
+			return 1;
+		out->type = A2IDT_SERVICE;
+		out->basename = &str[1];
+		plus &= ~(uint64_t)1;
 	}
 
-	if (id->basenamelen > 0) {
-		*id->basename = '\0';
-		id->localpartlen -= id->basenamelen;
-		id->basenamelen = 0;
-		id->idlen = id->localpartlen + id->domainlen;
-		id->generalized++;
-		return 1;
+	nropts = __builtin_popcountll(plus);
+
+	/* A signature is the last two options if the last ends at the '@'. */
+	sig = 0;
+	if (nropts >= 2 && (plus & (at >> 1))) {
+		prev = 63 - __builtin_clzll(plus & ~(at >> 1));
+		out->hassig = 1;
+		out->sigflags = &str[prev];
+		out->sigflagslen = a - 1 - prev;
+		sig = 1;
+		nropts -= 2;
 	}
 
-	/* Strip next label. */
+	out->nropts = nropts;
+
+	if (nropts > 0) {
+		first = __builtin_ctzll(plus);
+		plus &= plus - 1;
+		next = plus ? (size_t)__builtin_ctzll(plus) : a;
+		out->firstopt = &str[first];
+		out->firstoptlen = next - first;
+		out->basenamelen = out->firstopt - out->basename;
+	} else if (sig) {
+		out->basenamelen = out->sigflags - out->basename;
+	} else {
+		out->basenamelen = out->domain - out->basename;
+	}
 
-	assert(id->domain[0] == '@');
+	return 0;
+}
 
-	cp = id->domain;
-	/* step over '@' */
-	cp++;
-	if (cp[0] != '.' || cp[1] != '\0') {
-		/*
-		 * Either remove leading dot, or up to, but not including, next
-		 * dot.
-		 */
+/*
+ * The block classifier used by parsestr, resolved to the best implementation
+ * the CPU supports, if any. It is set before main is called and only read
+ * after that, so that threads can parse without synchronization.
+ */
+static uint64_t (*classify)(const char *);
+
+__attribute__((constructor))
+static void
+initclassify(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		classify = classify_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		classify = classify_sse2;
+}
+#endif /* A2ID_SIMD */
+
+/*
+ * Parse "in" into "out", see parse. Use the block based parsers if the CPU has
+ * support for it.
+ */
+static int
+parselen(struct a2id *out, const char *in, size_t inlen, int isselector,
+    int copystr)
+{
+#ifdef A2ID_SIMD
+	size_t len;
 
-		assert(id->domainlen >= 2);
+	if (classify && in != NULL && out != NULL) {
+		/* a string that is longer than 64 characters is not a candidate */
+		len = inlen == SIZE_MAX ? strnlen(in, 65) : inlen;
+		if (parsemasks(out, in, len, isselector, copystr) == 0)
+			return 0;
 
-		/* Find the number of characters before the first dot. */
-		n = strcspn(cp, ".");
+		return parseblocks(out, in, inlen, isselector, copystr,
+		    classify);
+	}
+#endif
 
-		/* If the first character is a dot, remove the dot itself. */
-		if (n == 0)
-			n = 1;
+	return parse(out, in, inlen, isselector, copystr);
+}
 
-		/* move rtl */
-		for (i = 0; cp[i + n]; i++)
-			cp[i] = cp[i + n];
+/*
+ * Parse "in" of "inlen" characters into "out", see parse. Use the single pass
+ * parser if the CPU has support for it.
+ */
+static int
+parsesized(struct a2id *out, const char *in, size_t inlen, int isselector)
+{
+#ifdef A2ID_SIMD
+	if (classify && parsechunks(out, in, inlen, isselector) == 0)
+		return 0;
+#endif
 
-		/* and terminate */
-		cp[i] = '\0';
+	return parselen(out, in, inlen, isselector, 1);
+}
 
-		id->domainlen -= n;
+/*
+ * Parse the nul terminated string "in" into "out", see parse.
+ */
+static int
+parsestr(struct a2id *out, const char *in, int isselector)
+{
+	return parselen(out, in, SIZE_MAX, isselector, 1);
+}
 
-		/* On end of string, ensure terminating ROOT dot. */
-		if (cp[n] == '\0') {
-			cp[0] = '.';
-			cp[1] = '\0';
-			id->domainlen = 2;
+/*
+ * Read and parse a string into an ARPA2 ID.
+ *
+ * "in" must be a nul terminated string. "isselector" is a boolean that
+ * indicates whether or not the input should be parsed as a selector. A valid ID
+ * is always a valid selector, but the opposite is not necessarily true.
+ *
+ * Return 0 if "in" is a valid A2ID, -1 otherwise.
+ */
+int
+a2id_fromstr(a2id *a2id, const char *in, int isselector)
+{
+	return parsestr((struct a2id*)a2id, in, isselector);
+}
+
+/*
+ * Read and parse "n" strings into ARPA2 IDs.
+ *
+ * "in" and "inlen" are arrays of "n" strings and their respective lengths. The
+ * strings do not need to be nul terminated. Each string is parsed into the
+ * element of "out" with the same index. "isselector" applies to all strings,
+ * see a2id_fromstr(3).
+ *
+ * "status" must have room for "n" elements. Each element is set to 0 if the
+ * corresponding string is a valid A2ID, or -1 otherwise. If "erroff" is not
+ * NULL it must have room for "n" elements as well. On error each element is
+ * set to the index of the first erroneous character in the corresponding
+ * string, on success it is set to the length of the A2ID.
+ *
+ * Because the length of each string is known up front, IDs of up to 64
+ * characters are copied and parsed in a single pass, see parsechunks.
+ *
+ * Return the number of valid A2IDs.
+ */
+size_t
+a2id_fromstr_many(a2id *out, int *status, size_t *erroff,
+    const char *const *in, const size_t *inlen, size_t n, int isselector)
+{
+	struct a2id *id;
+	size_t i, nvalid;
+
+	if (out == NULL || status == NULL || in == NULL || inlen == NULL)
+		return 0;
+
+	nvalid = 0;
+	for (i = 0; i < n; i++) {
+		id = (struct a2id *)&out[i];
+
+		if (in[i] == NULL) {
+			status[i] = -1;
+			if (erroff)
+				erroff[i] = 0;
+			continue;
 		}
 
-		return 1;
+		status[i] = parsesized(id, in[i], inlen[i], isselector);
+		if (status[i] == 0)
+			nvalid++;
+
+		if (erroff)
+			erroff[i] = id->idlen;
+	}
+
+	return nvalid;
+}
+
+/*
+ * Return the length of the localpart segment at "s", up to the next '+', '@'
+ * or nul byte.
+ */
+static size_t
+seglen(const char *s)
+{
+	size_t n;
+
+	for (n = 0; s[n] != '+' && s[n] != '@' && s[n] != '\0'; n++)
+		;
+
+	return n;
+}
+
+/*
+ * Return 1 if the first "n" characters of "a" and "b" are equal, ignoring the
+ * case of ASCII letters unless "folded" is set, in which case both are known
+ * to not contain any upper case characters. Return 0 otherwise.
+ *
+ * Note that tolower(3) is not used, since it is locale dependent and can not
+ * be vectorized. An A2ID only contains US-ASCII anyway.
+ */
+static int
+sameci(const char *a, const char *b, size_t n, int folded)
+{
+	unsigned char ca, cb;
+	size_t i;
+
+	if (folded)
+		return memcmp(a, b, n) == 0;
+
+	for (i = 0; i < n; i++) {
+		ca = a[i];
+		cb = b[i];
+		ca += ((unsigned char)(ca - 'A') < 26) << 5;
+		cb += ((unsigned char)(cb - 'A') < 26) << 5;
+		if (ca != cb)
+			return 0;
 	}
 
+	return 1;
+}
+
+/*
+ * Return the lower case of the ASCII character "c".
+ */
+static char
+tolowerascii(char c)
+{
+	return c + (((unsigned char)(c - 'A') < 26) << 5);
+}
+
+/*
+ * Return 1 if the "n" characters of "s" contain "c" twice in a row, 0
+ * otherwise.
+ */
+static int
+hasdouble(const char *s, size_t n, char c)
+{
+	size_t i;
+
+	for (i = 1; i < n; i++)
+		if (s[i] == c && s[i - 1] == c)
+			return 1;
+
 	return 0;
 }
 
+/*
+ * Compare each label of the domain "seld" of a selector with the respective
+ * label of the domain "subd" of a subject, starting from the back. Both
+ * domains start with an '@'. See sameci for "folded".
+ *
+ * Return 1 if every label of the selector matches, 0 otherwise.
+ */
+static int
+matchlabels(const char *subd, size_t subdlen, const char *seld,
+    size_t seldlen, int folded)
+{
+	const char *selp, *subp;
+	size_t selplen, subplen;
+
+	selp = &seld[seldlen - 1];
+	subp = &subd[subdlen - 1];
+
+	for (;;) {
+		/* Step over leading dot of current label. */
+		if (*selp == '.') /* ROOT dot is optional */
+			selp--;
+
+		if (*subp == '.')
+			subp--;
+
+		/* step back to the separator before each label */
+		for (selplen = 0; *selp != '@' && *selp != '.'; selplen++)
+			selp--;
+
+		for (subplen = 0; *subp != '@' && *subp != '.'; subplen++)
+			subp--;
+
+		/*
+		 * A dot without label means there must be a label in the
+		 * subject, no matter what the content. Otherwise the labels
+		 * must be equal.
+		 */
+		if (selplen == 0) {
+			if (subplen == 0)
+				return 0;
+		} else if (selplen != subplen ||
+		    !sameci(selp + 1, subp + 1, selplen, folded))
+			return 0;
+
+		if (*selp == '@')
+			return 1; /* done, every selector label matches */
+	}
+}
+
+/*
+ * Match an ARPA2 ID with an ARPA2 ID Selector.
+ *
+ * Return 1 if the subject matches the selector, 0 otherwise. If the localpart
+ * and/or domain in the selector are an empty string it is considered to be a
+ * match to the respective part in the subject.
+ */
+static int
+match(const struct a2id *subid, const struct a2id *selid)
+{
+	char *selp, *subp;
+	size_t selplen, subplen;
+	int n, folded;
+
+	assert(subid && selid);
+
+	/* Compare case sensitive if there is nothing to fold. */
+	folded = !subid->hasupper && !selid->hasupper;
+
+	if (selid->localpartlen > 0) {
+		if (selid->localpartlen > subid->localpartlen)
+			return 0;
+
+		if (selid->hassig) {
+			if (!subid->hassig)
+				return 0;
+
+			/* if sigflags selector is not empty it must match */
+			if (selid->sigflagslen > 1 &&
+			    selid->sigflagslen != subid->sigflagslen)
+					return 0;
+
+			if (selid->sigflagslen > 1 &&
+			    strncmp(selid->sigflags, subid->sigflags,
+			    selid->sigflagslen) != 0)
+				return 0;
+		}
+
+		/* compare each segment */
+		selp = selid->localpart;
+		subp = subid->localpart;
+
+		if (selid->type == A2IDT_SERVICE) {
+			if (subid->type != A2IDT_SERVICE)
+				return 0;
+
+			/* skip leading '+' */
+			selp++;
+			subp++;
+		}
+
+		if (selid->nropts > subid->nropts)
+			return 0;
+
+		/* Compare base and option segments. */
+		for (n = -1; n < selid->nropts; n++) {
+			/* up till next separator, '+', '@' or '\0' */
+			selplen = seglen(selp);
+			subplen = seglen(subp);
+
+			/*
+			 * If there is no text in the segment of the selector
+			 * after the last '+', any segment in the subject will
+			 * do, as long as it exists (except for a leading or
+			 * trailing '+' which indicates a service or a
+			 * signature, respectively). Otherwise the segments
+			 * must be equal.
+			 */
+			if (selplen == 0) {
+				if (subplen == 0)
+					return 0;
+			} else if (selplen != subplen ||
+			    !sameci(selp, subp, selplen, folded))
+				return 0;
+
+			selp += selplen;
+			subp += subplen;
+
+			if (*selp == '@' || *selp == '\0')
+				break; /* done, every selector segment matches */
+
+			if (*subp != '+')
+				return 0;
+
+			selp++;
+			subp++;
+		}
+	}
+
+	if (selid->domainlen > 0) {
+		/*
+		 * Can't compare domain lengths because of optional trailing
+		 * dots and possibly empty labels in the selector.
+		 */
+		if (subid->domainlen < 1)
+			return 0;
+
+		assert(*selid->domain == '@' && *subid->domain == '@');
+
+		/*
+		 * Without empty labels in the selector, each label of the
+		 * selector must equal the respective label of the subject so
+		 * the selector domain must be a suffix of the subject domain
+		 * that starts at a label boundary, not counting ROOT dots.
+		 */
+		if (!selid->emptylabel) {
+			selp = selid->domain;
+			subp = subid->domain;
+			selplen = selid->domainlen;
+			subplen = subid->domainlen;
+
+			if (selp[selplen - 1] == '.')
+				selplen--;
+
+			if (subp[subplen - 1] == '.')
+				subplen--;
+
+			/* compare without the '@' of the selector */
+			selp++;
+			selplen--;
+
+			if (selplen >= subplen)
+				return 0;
+
+			subp += subplen - selplen;
+
+			if (subp[-1] != '.' && subp[-1] != '@')
+				return 0;
+
+			return sameci(selp, subp, selplen, folded);
+		}
+
+		return matchlabels(subid->domain, subid->domainlen,
+		    selid->domain, selid->domainlen, folded);
+	}
+
+	/* Match if we made it this far. */
+
+	return 1;
+}
+
+int
+a2id_match(const a2id *subject, const a2id *selector)
+{
+	return match((const struct a2id *)subject,
+	    (const struct a2id *)selector);
+}
+
+/*
+ * Return the number of bytes of the string of "id" that are in use. This is not
+ * necessarily "idlen" + 1 since generalization leaves nul bytes in the
+ * localpart and parts that are empty may point to the original terminating nul
+ * byte. The last byte is always the terminating nul, which is not there if "id"
+ * is a view.
+ */
+static size_t
+strsize(const struct a2id *id)
+{
+	const char *end;
+
+	end = id->domain + id->domainlen;
+	if (id->localpart > end)
+		end = id->localpart;
+	if (id->basename > end)
+		end = id->basename;
+	if (id->firstopt > end)
+		end = id->firstopt;
+	if (id->sigflags > end)
+		end = id->sigflags;
+
+	return end - (id->view ? id->view : id->_str) + 1;
+}
+
+/*
+ * Copy the caller owned string of "id", created by a2id_fromview, into "_str"
+ * so that it may be modified.
+ */
+static void
+unview(struct a2id *id)
+{
+	size_t n;
+
+	n = strsize(id) - 1;
+	memcpy(id->_str, id->view, n);
+	id->_str[n] = '\0';
+
+	id->localpart = &id->_str[id->localpart - id->view];
+	id->basename = &id->_str[id->basename - id->view];
+	id->firstopt = &id->_str[id->firstopt - id->view];
+	id->sigflags = &id->_str[id->sigflags - id->view];
+	id->domain = &id->_str[id->domain - id->view];
+	id->view = NULL;
+}
+
+/*
+ * Generalize an A2ID structure by one step. Generalization is the process of
+ * removing segments and labels from the localpart and domain, in that order.
+ * Each function call represents one generalization. As long as there are
+ * segments in the localpart, one segment is removed from the localpart from
+ * right to left. As soon as the localpart can't be generalized any further,
+ * domain labels are removed from left to right, until no labels are left. "id"
+ * is a value/result parameter.
+ *
+ * Returns 1 if a component is removed from the localpart or the domain.
+ * Returns 0 if "id" can not be further generalized.
+ *
+ * A domain label is removed by moving the domain pointer forward and writing a
+ * new '@' right before the remaining labels, the rest of the domain is never
+ * moved.
+ */
+static int
+generalize(struct a2id *id)
+{
+	char *cp;
+	size_t len, n;
+
+	if (id == NULL)
+		return 0;
+
+	/* Never modify the string of a view, copy it first. */
+	if (id->view)
+		unview(id);
+
+	if (id->sigflagslen > 0) {
+		if (id->sigflagslen > 1) {
+			/* remove signature data, but leave trailing '+' */
+			*(id->sigflags + 1) = '+';
+			*(id->sigflags + 2) = '\0';
+			id->localpartlen -= id->sigflagslen - 1;
+			id->sigflagslen = 1;
+		} else {
+			/* remove signature and trailing '+' */
+			*id->sigflags = '\0';
+			id->localpartlen -= id->sigflagslen + 1;
+			id->sigflagslen = 0;
+			id->hassig = 0;
+		}
+
+		id->idlen = id->localpartlen + id->domainlen;
+		id->generalized++;
+		return 1;
+	}
+
+	if (id->nropts > 0) {
+		cp = &id->localpart[id->localpartlen - 1];
+
+		/*
+		 * Either delete the option data, or the option. If there is
+		 * only a trailing '+', remove the option, else everything up
+		 * to the previous '+' is removed, exclusive.
+		 */
+
+		/* remove the option */
+		if (*cp == '+') {
+			*cp = '\0';
+			id->nropts--;
+			id->localpartlen--;
+
+			if (id->nropts == 0) {
+				*id->firstopt = '\0';
+				id->firstoptlen = 0;
+			}
+		} else /* remove option data only */
+			for (; *cp != '+'; cp--, id->localpartlen--)
+				*cp = '\0';
+
+		id->idlen = id->localpartlen + id->domainlen;
+		id->generalized++;
+		return 1;
+	}
+
+	if (id->basenamelen > 0) {
+		*id->basename = '\0';
+		id->localpartlen -= id->basenamelen;
+		id->basenamelen = 0;
+		id->idlen = id->localpartlen + id->domainlen;
+		id->generalized++;
+		return 1;
+	}
+
+	/* Strip next label. */
+
+	assert(id->domain[0] == '@');
+	assert(id->domainlen >= 1);
+
+	/* step over '@' */
+	cp = id->domain + 1;
+	len = id->domainlen - 1;
+
+	/* no labels left, or only the ROOT dot */
+	if (len == 0 || (len == 1 && cp[0] == '.'))
+		return 0;
+
+	/*
+	 * Either remove leading dot, or up to, but not including, next dot.
+	 */
+
+	if (cp[0] == '.') {
+		n = 1;
+	} else if ((cp = memchr(cp, '.', len)) != NULL) {
+		n = cp - (id->domain + 1);
+	} else {
+		n = len;
+	}
+
+	if (n < len) {
+		id->domain += n;
+		id->domainlen -= n;
+		id->domain[0] = '@';
+	} else {
+		/* On end of string, ensure terminating ROOT dot. */
+		id->domain += id->domainlen - 2;
+		id->domainlen = 2;
+		id->domain[0] = '@';
+		id->domain[1] = '.';
+	}
+
+	/*
+	 * After removing a label the domain starts with an empty label, after
+	 * removing a leading dot any of the remaining labels might be empty.
+	 */
+	if (id->domain[1] == '.')
+		id->emptylabel = 1;
+	else
+		id->emptylabel = emptylabel(id->domain, id->domainlen);
+
+	return 1;
+}
+
+int
+a2id_generalize(a2id *a2id)
+{
+	return generalize((struct a2id *)a2id);
+}
+
+/*
+ * Prepare "cursor" to return every generalization of "a2id" without modifying
+ * "a2id", see a2id_gencursor_next. "a2id" must not be modified or released
+ * as long as "cursor" is used.
+ */
+void
+a2id_gencursor_init(a2id_gencursor *cursor, const a2id *a2id)
+{
+	struct a2id_gencursor *gc = (struct a2id_gencursor *)cursor;
+	const struct a2id *id = (const struct a2id *)a2id;
+
+	gc->id = id;
+	gc->domain = id->domain + 1;
+	gc->domainlen = id->domainlen - 1;
+	gc->localpartlen = id->localpartlen;
+	gc->basenamelen = id->basenamelen;
+	gc->sigflagslen = id->sigflagslen;
+	gc->nropts = id->nropts;
+	gc->started = 0;
+}
+
+/*
+ * Generalize "gc" by one step, exactly like generalize does with an id.
+ *
+ * Returns 1 if a component is removed from the localpart or the domain.
+ * Returns 0 if "gc" can not be further generalized.
+ */
+static int
+gencursorstep(struct a2id_gencursor *gc)
+{
+	const char *cp;
+	size_t n;
+
+	if (gc->sigflagslen > 0) {
+		if (gc->sigflagslen > 1) {
+			/* leave an empty signature */
+			gc->localpartlen -= gc->sigflagslen - 1;
+			gc->sigflagslen = 1;
+		} else {
+			/* remove signature and trailing '+' */
+			gc->localpartlen -= 2;
+			gc->sigflagslen = 0;
+		}
+
+		return 1;
+	}
+
+	if (gc->nropts > 0) {
+		cp = &gc->id->localpart[gc->localpartlen - 1];
+
+		/* remove the option, or only the option data */
+		if (*cp == '+') {
+			gc->nropts--;
+			gc->localpartlen--;
+		} else
+			for (; *cp != '+'; cp--)
+				gc->localpartlen--;
+
+		return 1;
+	}
+
+	if (gc->basenamelen > 0) {
+		gc->localpartlen -= gc->basenamelen;
+		gc->basenamelen = 0;
+		return 1;
+	}
+
+	/* no labels left, or only the ROOT dot */
+	if (gc->domainlen == 0 || (gc->domainlen == 1 && gc->domain[0] == '.'))
+		return 0;
+
+	if (gc->domain[0] == '.') {
+		n = 1;
+	} else if ((cp = memchr(gc->domain, '.', gc->domainlen)) != NULL) {
+		n = cp - gc->domain;
+	} else {
+		n = gc->domainlen;
+	}
+
+	if (n < gc->domainlen) {
+		gc->domain += n;
+		gc->domainlen -= n;
+	} else {
+		gc->domain = ".";
+		gc->domainlen = 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Write the next generalization of the id of "cursor" into "dst", starting
+ * with the id itself. Up to "dstsz" - 1 characters are copied. It is
+ * guaranteed that "dst" is terminated with a nul byte, unless "dstsz" is 0.
+ * Furthermore, if "dstsz" >= A2ID_MAXSZ, then every generalization will
+ * always fit.
+ *
+ * Returns the length of the string that would have been output, as if the size
+ * were unlimited (not including the terminating nul byte). Thus, if the return
+ * value is >= "dstsz", then "dst" was truncated. Returns 0 if there are no more
+ * generalizations, in which case "dst" is not touched.
+ */
+size_t
+a2id_gencursor_next(char *dst, size_t dstsz, a2id_gencursor *cursor)
+{
+	struct a2id_gencursor *gc = (struct a2id_gencursor *)cursor;
+	size_t len, i, n;
+
+	if (gc->started && gencursorstep(gc) == 0)
+		return 0;
+
+	gc->started = 1;
+
+	len = gc->localpartlen + 1 + gc->domainlen;
+
+	if (dstsz == 0)
+		return len;
+
+	i = dstsz - 1 > gc->localpartlen ? gc->localpartlen : dstsz - 1;
+	memcpy(dst, gc->id->localpart, i);
+
+	/* the trailing '+' of an empty signature might not be in the id */
+	if (gc->sigflagslen == 1 && i == gc->localpartlen)
+		dst[i - 1] = '+';
+
+	if (i < dstsz - 1)
+		dst[i++] = '@';
+
+	n = dstsz - 1 - i > gc->domainlen ? gc->domainlen : dstsz - 1 - i;
+	memcpy(&dst[i], gc->domain, n);
+	i += n;
+
+	dst[i] = '\0';
+
+	return len;
+}
+
+/*
+ * Write every generalization of "a2id" into "buf", from the id itself up to and
+ * including the most general selector, see a2id_generalize. Each selector is
+ * nul terminated and starts at "buf" + "offsets[i]". "offsets[n]" is set to the
+ * total number of bytes used, so the length of each selector is "offsets[i +
+ * 1]" - "offsets[i]" - 1. "offsets" must have room for "maxn" + 1 elements.
+ *
+ * Each selector is assembled from the parts of "a2id" that are left, so no
+ * selector is derived from a copy of the previous one.
+ *
+ * Returns the number of selectors "n". Returns 0 if "bufsz" or "maxn" are too
+ * small to hold all selectors, in which case the contents of "buf" and
+ * "offsets" are undefined.
+ */
+size_t
+a2id_generalizations(const a2id *a2id, char *buf, size_t bufsz,
+    size_t *offsets, size_t maxn)
+{
+	a2id_gencursor cursor;
+	size_t len, n, off;
+
+	a2id_gencursor_init(&cursor, a2id);
+
+	off = 0;
+	for (n = 0; (len = a2id_gencursor_next(&buf[off], bufsz - off,
+	    &cursor)) > 0; n++) {
+		if (n == maxn || len >= bufsz - off)
+			return 0;
+
+		offsets[n] = off;
+		off += len + 1;
+	}
+
+	offsets[n] = off;
+
+	return n;
+}
+
+/*
+ * Make "shell" represent the id described by "offs" by pointing all pointers
+ * into "str". Only the metadata of "shell" is set, "_str" is not used, which is
+ * enough for all functions except generalize since these only use the pointers
+ * into the string.
+ */
+static void
+toshell(struct a2id *shell, const struct a2idoffs *offs, char *str)
+{
+	shell->type = offs->type;
+	shell->hassig = offs->hassig;
+	shell->hasupper = offs->hasupper;
+	shell->emptylabel = offs->emptylabel;
+	shell->nropts = offs->nropts;
+	shell->generalized = offs->generalized;
+	shell->localpart = &str[offs->localpart];
+	shell->basename = &str[offs->basename];
+	shell->firstopt = &str[offs->firstopt];
+	shell->sigflags = &str[offs->sigflags];
+	shell->domain = &str[offs->domain];
+	shell->view = NULL;
+	shell->localpartlen = offs->localpartlen;
+	shell->basenamelen = offs->basenamelen;
+	shell->firstoptlen = offs->firstoptlen;
+	shell->sigflagslen = offs->sigflagslen;
+	shell->domainlen = offs->domainlen;
+	shell->idlen = offs->idlen;
+}
+
+/*
+ * Store the metadata of "id" in "offs", with all pointers relative to "str".
+ */
+static void
+fromshell(struct a2idoffs *offs, const struct a2id *id, const char *str)
+{
+	offs->type = id->type;
+	offs->hassig = id->hassig;
+	offs->hasupper = id->hasupper;
+	offs->emptylabel = id->emptylabel;
+	offs->nropts = id->nropts;
+	offs->generalized = id->generalized;
+	offs->localpart = id->localpart - str;
+	offs->basename = id->basename - str;
+	offs->firstopt = id->firstopt - str;
+	offs->sigflags = id->sigflags - str;
+	offs->domain = id->domain - str;
+	offs->localpartlen = id->localpartlen;
+	offs->basenamelen = id->basenamelen;
+	offs->firstoptlen = id->firstoptlen;
+	offs->sigflagslen = id->sigflagslen;
+	offs->domainlen = id->domainlen;
+	offs->idlen = id->idlen;
+}
+
+/*
+ * Write a compact copy of "a2id" into "dst" if it is at least "dstsz" bytes.
+ * If "dst" is NULL or too small nothing is written.
+ *
+ * Returns the size of the compact copy. Thus, if the return value is >
+ * "dstsz", then nothing is written and a buffer of at least the returned
+ * size is needed.
+ */
+size_t
+a2id_tocompact(a2id_compact *dst, size_t dstsz, const a2id *a2id)
+{
+	const struct a2id *id = (const struct a2id *)a2id;
+	size_t strsz, size;
+
+	strsz = strsize(id);
+	size = sizeof(*dst) + strsz;
+
+	if (dst == NULL || dstsz < size)
+		return size;
+
+	fromshell(&dst->offs, id, id->view ? id->view : id->_str);
+	dst->strsz = strsz;
+	memcpy(dst->str, id->view ? id->view : id->_str, strsz - 1);
+	dst->str[strsz - 1] = '\0';
+
+	return size;
+}
+
+/*
+ * Convert the compact id "src" back into an ARPA2 ID.
+ */
+void
+a2id_fromcompact(a2id *dst, const a2id_compact *src)
+{
+	struct a2id *id = (struct a2id *)dst;
+
+	memcpy(id->_str, src->str, src->strsz);
+	toshell(id, &src->offs, id->_str);
+}
+
+/*
+ * Match a compact ARPA2 ID with a compact ARPA2 ID Selector, see a2id_match.
+ */
+int
+a2id_compact_match(const a2id_compact *subject, const a2id_compact *selector)
+{
+	struct a2id subid, selid;
+
+	toshell(&subid, &subject->offs, (char *)subject->str);
+	toshell(&selid, &selector->offs, (char *)selector->str);
+
+	return match(&subid, &selid);
+}
+
+/*
+ * Generalize a compact ARPA2 ID in place, see a2id_generalize.
+ */
+int
+a2id_compact_generalize(a2id_compact *cid)
+{
+	struct a2id id;
+	int r;
+
+	toshell(&id, &cid->offs, cid->str);
+
+	if ((r = generalize(&id)) == 1)
+		fromshell(&cid->offs, &id, cid->str);
+
+	return r;
+}
+
+/*
+ * Write a compiled copy of "selector" into "dst" if it is at least "dstsz"
+ * bytes. If "dst" is NULL or too small nothing is written. A compiled selector
+ * can only be used with a2idsel_match and is independent of "selector".
+ *
+ * Returns the size of the compiled selector. Thus, if the return value is >
+ * "dstsz", then nothing is written and a buffer of at least the returned size
+ * is needed.
+ */
+size_t
+a2idsel_compile(a2idsel *dst, size_t dstsz, const a2id *selector)
+{
+	const struct a2id *id = (const struct a2id *)selector;
+	const char *segs, *d;
+	char *cp;
+	size_t segslen, size, e, i;
+
+	/* all segments, up to the signature */
+	segs = id->localpart;
+	if (id->type == A2IDT_SERVICE)
+		segs++;
+
+	if (id->hassig)
+		segslen = id->sigflags - segs;
+	else
+		segslen = id->localpart + id->localpartlen - segs;
+
+	if (id->localpartlen == 0)
+		segslen = 0;
+
+	size = sizeof(*dst) + segslen + 1 + id->sigflagslen + 1 +
+	    id->domainlen + 1;
+
+	if (dst == NULL || dstsz < size)
+		return size;
+
+	dst->flags = 0;
+	if (id->localpartlen > 0)
+		dst->flags |= SEL_LOCALPART;
+	if (id->type == A2IDT_SERVICE)
+		dst->flags |= SEL_SERVICE;
+	if (id->hassig)
+		dst->flags |= SEL_SIG;
+	if (id->sigflagslen > 1)
+		dst->flags |= SEL_SIGFLAGS;
+
+	dst->nropts = id->nropts;
+	dst->localpartlen = id->localpartlen;
+	dst->strsz = size - sizeof(*dst);
+
+	cp = dst->str;
+
+	dst->segs = cp - dst->str;
+	dst->segslen = segslen;
+	for (i = 0; i < segslen; i++)
+		*cp++ = tolowerascii(segs[i]);
+	*cp++ = '\0';
+
+	/* an empty segment is at the start, at the end or between two '+' */
+	if (dst->flags & SEL_LOCALPART)
+		if (segslen == 0 || segs[0] == '+' || segs[segslen - 1] == '+' ||
+		    hasdouble(segs, segslen, '+'))
+			dst->flags |= SEL_WILDSEG;
+
+	dst->sigflags = cp - dst->str;
+	dst->sigflagslen = id->sigflagslen;
+	memcpy(cp, id->sigflags, id->sigflagslen);
+	cp += id->sigflagslen;
+	*cp++ = '\0';
+
+	dst->domain = cp - dst->str;
+	dst->domainlen = id->domainlen;
+	for (i = 0; i < id->domainlen; i++)
+		*cp++ = tolowerascii(id->domain[i]);
+	*cp++ = '\0';
+
+	/*
+	 * Split the labels, without ROOT dot, in a number of leading empty
+	 * labels and a suffix of labels that must be equal in the subject. If
+	 * there are other empty labels, fall back to comparing label by label.
+	 */
+	d = &dst->str[dst->domain];
+	e = dst->domainlen;
+	if (e > 1 && d[e - 1] == '.')
+		e--;
+
+	for (i = 1; i < e && d[i] == '.'; i++)
+		;
+
+	dst->wildlabels = i - 1;
+	dst->suffix = dst->domain + i;
+	dst->suffixlen = e - i;
+
+	if (dst->suffixlen == 0)
+		dst->wildlabels++;	/* the suffix itself is an empty label */
+	else if (d[e - 1] == '.' || hasdouble(&d[i], e - i, '.'))
+		dst->flags |= SEL_LABELLOOP;
+
+	return size;
+}
+
+/*
+ * Match an ARPA2 ID with a compiled ARPA2 ID Selector. Gives the same result as
+ * a2id_match with the selector that "sel" is compiled from.
+ *
+ * Return 1 if the subject matches the selector, 0 otherwise.
+ */
+int
+a2idsel_match(const a2id *subject, const a2idsel *sel)
+{
+	const struct a2id *subid = (const struct a2id *)subject;
+	const char *selp, *subp, *d;
+	size_t selplen, subplen, e, pos, k;
+	int n, folded;
+
+	/* The selector is folded already. */
+	folded = !subid->hasupper;
+
+	if (sel->flags & SEL_LOCALPART) {
+		if (sel->localpartlen > subid->localpartlen)
+			return 0;
+
+		if (sel->flags & SEL_SIG) {
+			if (!subid->hassig)
+				return 0;
+
+			if ((sel->flags & SEL_SIGFLAGS) &&
+			    (sel->sigflagslen != subid->sigflagslen ||
+			    memcmp(&sel->str[sel->sigflags], subid->sigflags,
+			    sel->sigflagslen) != 0))
+				return 0;
+		}
+
+		subp = subid->localpart;
+
+		if (sel->flags & SEL_SERVICE) {
+			if (subid->type != A2IDT_SERVICE)
+				return 0;
+
+			/* skip leading '+' */
+			subp++;
+		}
+
+		if (sel->nropts > subid->nropts)
+			return 0;
+
+		selp = &sel->str[sel->segs];
+
+		if (!(sel->flags & SEL_WILDSEG)) {
+			/* all segments at once, up to a segment boundary */
+			if (!sameci(selp, subp, sel->segslen, folded))
+				return 0;
+
+			subp += sel->segslen;
+			if (*subp != '+' && *subp != '@' && *subp != '\0')
+				return 0;
+		} else {
+			for (n = -1; n < sel->nropts; n++) {
+				selplen = seglen(selp);
+				subplen = seglen(subp);
+
+				if (selplen == 0) {
+					if (subplen == 0)
+						return 0;
+				} else if (selplen != subplen ||
+				    !sameci(selp, subp, selplen, folded))
+					return 0;
+
+				selp += selplen;
+				subp += subplen;
+
+				if (*selp == '\0')
+					break;
+
+				if (*subp != '+')
+					return 0;
+
+				selp++;
+				subp++;
+			}
+		}
+	}
+
+	if (sel->flags & SEL_LABELLOOP)
+		return matchlabels(subid->domain, subid->domainlen,
+		    &sel->str[sel->domain], sel->domainlen, folded);
+
+	/* subject domain without ROOT dot */
+	d = subid->domain;
+	e = subid->domainlen;
+	if (e > 1 && d[e - 1] == '.')
+		e--;
+
+	/* the suffix must be preceded by a separator */
+	if (sel->suffixlen > 0) {
+		if (sel->suffixlen >= e)
+			return 0;
+
+		pos = e - sel->suffixlen - 1;
+		if (d[pos] != '.' && d[pos] != '@')
+			return 0;
+
+		if (!sameci(&sel->str[sel->suffix], &d[pos + 1],
+		    sel->suffixlen, folded))
+			return 0;
+	} else
+		pos = e;
+
+	/* then there must be a label for each empty label */
+	for (n = 0; n < sel->wildlabels; n++) {
+		if (pos == 0)
+			return 0;
+
+		for (k = pos; d[k - 1] != '.' && d[k - 1] != '@'; k--)
+			;
+
+		if (k == pos)
+			return 0;
+
+		pos = k - 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Make sure "*arr" has room for at least "need" elements of "elsize" bytes.
+ * "*arrsz" is the current number of elements and is updated on growth.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+grow(void *arr, size_t *arrsz, size_t need, size_t elsize)
+{
+	void *p;
+	size_t n;
+
+	if (need <= *arrsz)
+		return 0;
+
+	n = *arrsz ? *arrsz : 16;
+	while (n < need)
+		n *= 2;
+
+	if (n > SIZE_MAX / elsize) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if ((p = realloc(*(void **)arr, n * elsize)) == NULL)
+		return -1;
+
+	*(void **)arr = p;
+	*arrsz = n;
+
+	return 0;
+}
+
+/*
+ * FNV-1a hash of an edge from "parent" with the folded label or segment "key".
+ */
+static uint32_t
+selsethash(size_t parent, const char *key, size_t keylen)
+{
+	uint32_t h;
+	size_t i;
+
+	h = 2166136261U;
+	for (i = 0; i < sizeof(parent); i++) {
+		h ^= (parent >> (i * 8)) & 0xff;
+		h *= 16777619U;
+	}
+
+	for (i = 0; i < keylen; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+ * Return the slot of the edge from "parent" with the folded "key", or the free
+ * slot where it should be added. "set" must have at least one free slot.
+ */
+static size_t
+selsetslot(const struct a2idselset *set, size_t parent, const char *key,
+    size_t keylen, uint32_t hash)
+{
+	const struct selsetedge *edge;
+	size_t i, mask;
+
+	mask = set->edgessz - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		edge = &set->edges[i];
+		if (edge->child == SELSET_NONE)
+			return i;
+
+		if (edge->hash == hash && edge->parent == parent &&
+		    edge->keylen == keylen &&
+		    memcmp(&set->keys[edge->key], key, keylen) == 0)
+			return i;
+	}
+}
+
+/*
+ * Return the child of "parent" for the label or segment "s" of "len" bytes, or
+ * SELSET_NONE if there is none. An empty "s" is a wildcard.
+ */
+static size_t
+selsetfind(const struct a2idselset *set, size_t parent, const char *s,
+    size_t len)
+{
+	char key[A2ID_MAXSZ];
+	size_t i;
+
+	if (len == 0)
+		return set->nodes[parent].wild;
+
+	if (set->nedges == 0)
+		return SELSET_NONE;
+
+	for (i = 0; i < len; i++)
+		key[i] = tolowerascii(s[i]);
+
+	i = selsetslot(set, parent, key, len, selsethash(parent, key, len));
+
+	return set->edges[i].child;
+}
+
+/*
+ * Add a node to "set" and return its index, or SELSET_NONE on failure with
+ * errno set.
+ */
+static size_t
+selsetnewnode(struct a2idselset *set)
+{
+	struct selsetnode *node;
+
+	if (grow(&set->nodes, &set->nodessz, set->nnodes + 1,
+	    sizeof(*set->nodes)) == -1)
+		return SELSET_NONE;
+
+	node = &set->nodes[set->nnodes];
+	node->wild = SELSET_NONE;
+	node->lproot[0] = node->lproot[1] = SELSET_NONE;
+	node->sels = SELSET_NONE;
+
+	return set->nnodes++;
+}
+
+/*
+ * Double the size of the edge table of "set" and rehash all edges.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+static int
+selsetrehash(struct a2idselset *set)
+{
+	struct selsetedge *old, *edge;
+	size_t i, j, oldsz;
+
+	old = set->edges;
+	oldsz = set->edgessz;
+
+	set->edgessz = oldsz ? oldsz * 2 : 64;
+	if ((set->edges = calloc(set->edgessz, sizeof(*set->edges))) == NULL) {
+		set->edges = old;
+		set->edgessz = oldsz;
+		return -1;
+	}
+
+	for (i = 0; i < set->edgessz; i++)
+		set->edges[i].child = SELSET_NONE;
+
+	for (i = 0; i < oldsz; i++) {
+		edge = &old[i];
+		if (edge->child == SELSET_NONE)
+			continue;
+
+		for (j = edge->hash & (set->edgessz - 1);
+		    set->edges[j].child != SELSET_NONE;
+		    j = (j + 1) & (set->edgessz - 1))
+			;
+
+		set->edges[j] = *edge;
+	}
+
+	free(old);
+
+	return 0;
+}
+
+/*
+ * Return the child of "parent" for the label or segment "s" of "len" bytes, and
+ * add it if it does not exist yet. An empty "s" is a wildcard.
+ *
+ * Return the child on success, or SELSET_NONE on failure with errno set.
+ */
+static size_t
+selsetchild(struct a2idselset *set, size_t parent, const char *s, size_t len)
+{
+	struct selsetedge *edge;
+	size_t child, i;
+	uint32_t hash;
+
+	if ((child = selsetfind(set, parent, s, len)) != SELSET_NONE)
+		return child;
+
+	/* keep the edge table at most half full */
+	if ((set->nedges + 1) * 2 > set->edgessz)
+		if (selsetrehash(set) == -1)
+			return SELSET_NONE;
+
+	if (grow(&set->keys, &set->keyssz, set->keyslen + len,
+	    sizeof(*set->keys)) == -1)
+		return SELSET_NONE;
+
+	if ((child = selsetnewnode(set)) == SELSET_NONE)
+		return SELSET_NONE;
+
+	if (len == 0) {
+		set->nodes[parent].wild = child;
+		return child;
+	}
+
+	for (i = 0; i < len; i++)
+		set->keys[set->keyslen + i] = tolowerascii(s[i]);
+
+	hash = selsethash(parent, &set->keys[set->keyslen], len);
+	edge = &set->edges[selsetslot(set, parent, &set->keys[set->keyslen],
+	    len, hash)];
+
+	edge->parent = parent;
+	edge->child = child;
+	edge->key = set->keyslen;
+	edge->keylen = len;
+	edge->hash = hash;
+
+	set->keyslen += len;
+	set->nedges++;
+
+	return child;
+}
+
+/*
+ * Create a new, empty set of ARPA2 ID Selectors.
+ *
+ * Return the set on success, or NULL on failure with errno set.
+ */
+a2idselset *
+a2idselset_new(void)
+{
+	struct a2idselset *set;
+
+	if ((set = calloc(1, sizeof(*set))) == NULL)
+		return NULL;
+
+	/* the root of the domain trie */
+	if (selsetnewnode(set) == SELSET_NONE) {
+		free(set);
+		return NULL;
+	}
+
+	return set;
+}
+
+/*
+ * Release "set" and all its selectors.
+ */
+void
+a2idselset_free(a2idselset *set)
+{
+	size_t i;
+
+	if (set == NULL)
+		return;
+
+	for (i = 0; i < set->nsels; i++)
+		free(set->sels[i].sel);
+
+	free(set->sels);
+	free(set->keys);
+	free(set->edges);
+	free(set->nodes);
+	free(set);
+}
+
+/*
+ * Add a copy of "selector" to "set". Selectors are numbered in the order in
+ * which they are added, starting at 0.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+int
+a2idselset_add(a2idselset *set, const a2id *selector)
+{
+	const struct a2id *id = (const struct a2id *)selector;
+	struct selsetsel *ent;
+	const char *cp, *end, *sep;
+	size_t node, size;
+
+	if (grow(&set->sels, &set->selssz, set->nsels + 1,
+	    sizeof(*set->sels)) == -1)
+		return -1;
+
+	ent = &set->sels[set->nsels];
+
+	size = a2idsel_compile(NULL, 0, selector);
+	if ((ent->sel = malloc(size)) == NULL)
+		return -1;
+	a2idsel_compile(ent->sel, size, selector);
+
+	/* every label from the back, without ROOT dot */
+	cp = id->domain + 1;
+	end = id->domain + id->domainlen;
+	if (end - cp > 0 && end[-1] == '.')
+		end--;
+
+	node = 0;
+	for (;;) {
+		for (sep = end; sep > cp && sep[-1] != '.'; sep--)
+			;
+
+		if ((node = selsetchild(set, node, sep, end - sep)) ==
+		    SELSET_NONE)
+			goto err;
+
+		if (sep == cp)
+			break;
+
+		end = sep - 1;
+	}
+
+	/* every segment, up to the signature */
+	if (id->localpartlen > 0) {
+		if (set->nodes[node].lproot[id->type == A2IDT_SERVICE] ==
+		    SELSET_NONE) {
+			if ((size = selsetnewnode(set)) == SELSET_NONE)
+				goto err;
+			set->nodes[node].lproot[id->type == A2IDT_SERVICE] =
+			    size;
+		}
+		node = set->nodes[node].lproot[id->type == A2IDT_SERVICE];
+
+		cp = id->localpart;
+		if (id->type == A2IDT_SERVICE)
+			cp++;
+
+		if (id->hassig)
+			end = id->sigflags;
+		else
+			end = id->localpart + id->localpartlen;
+
+		for (;;) {
+			for (sep = cp; sep < end && *sep != '+'; sep++)
+				;
+
+			if ((node = selsetchild(set, node, cp, sep - cp)) ==
+			    SELSET_NONE)
+				goto err;
+
+			if (sep == end)
+				break;
+
+			cp = sep + 1;
+		}
+	}
+
+	/* the lists are in reverse insertion order */
+	ent->next = set->nodes[node].sels;
+	set->nodes[node].sels = set->nsels;
+	set->nsels++;
+
+	return 0;
+
+err:
+	free(ent->sel);
+	ent->sel = NULL;
+	return -1;
+}
+
+/* A label or segment of the subject of a query. */
+struct selsetpart {
+	const char *s;
+	size_t len;
+};
+
+struct selsetquery {
+	const struct a2idselset *set;
+	const a2id *subject;
+	struct selsetpart labels[A2ID_MAXSZ / 2 + 1];	/* from the back */
+	struct selsetpart segs[A2ID_MAXSZ / 2 + 1];
+	size_t nlabels, nsegs;
+	int service;
+	int full;	/* whether "ids" is full and sorted */
+	size_t *ids, maxids, n;
+};
+
+/*
+ * Compare two sizes for qsort(3).
+ */
+static int
+cmpsize(const void *a, const void *b)
+{
+	const size_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/*
+ * Add each selector in the list that starts at "sel" to the results of "q" if
+ * it matches. Results are appended until "ids" is full, after that "ids" is
+ * kept sorted and only the first "maxids" selectors are kept.
+ */
+static void
+selsetcollect(struct selsetquery *q, size_t sel)
+{
+	const struct selsetsel *ent;
+	size_t i;
+
+	for (; sel != SELSET_NONE; sel = ent->next) {
+		ent = &q->set->sels[sel];
+
+		/* no need to check selectors that would not make the cut */
+		if (q->full && (q->maxids == 0 || sel > q->ids[q->maxids - 1]))
+			continue;
+
+		if (!a2idsel_match(q->subject, ent->sel))
+			continue;
+
+		if (q->n < q->maxids) {
+			q->ids[q->n++] = sel;
+			continue;
+		}
+
+		if (!q->full) {
+			qsort(q->ids, q->n, sizeof(*q->ids), cmpsize);
+			q->full = 1;
+
+			if (q->maxids == 0 || sel > q->ids[q->maxids - 1])
+				continue;
+		}
+
+		for (i = q->n - 1; i > 0 && q->ids[i - 1] > sel; i--)
+			q->ids[i] = q->ids[i - 1];
+		q->ids[i] = sel;
+	}
+}
+
+/*
+ * Visit every node of a localpart trie from "node" that matches the first
+ * "depth" segments of the subject.
+ */
+static void
+selsetquerysegs(struct selsetquery *q, size_t node, size_t depth)
+{
+	const struct selsetnode *n;
+	size_t child;
+
+	n = &q->set->nodes[node];
+	selsetcollect(q, n->sels);
+
+	if (depth == q->nsegs || q->segs[depth].len == 0)
+		return;
+
+	child = selsetfind(q->set, node, q->segs[depth].s, q->segs[depth].len);
+	if (child != SELSET_NONE)
+		selsetquerysegs(q, child, depth + 1);
+
+	if (n->wild != SELSET_NONE)
+		selsetquerysegs(q, n->wild, depth + 1);
+}
+
+/*
+ * Visit every node of the domain trie from "node" that matches the last
+ * "depth" labels of the subject.
+ */
+static void
+selsetquerylabels(struct selsetquery *q, size_t node, size_t depth)
+{
+	const struct selsetnode *n;
+	size_t child;
+
+	n = &q->set->nodes[node];
+	selsetcollect(q, n->sels);
+
+	if (q->nsegs > 0 && n->lproot[q->service] != SELSET_NONE)
+		selsetquerysegs(q, n->lproot[q->service], 0);
+
+	if (depth == q->nlabels || q->labels[depth].len == 0)
+		return;
+
+	child = selsetfind(q->set, node, q->labels[depth].s,
+	    q->labels[depth].len);
+	if (child != SELSET_NONE)
+		selsetquerylabels(q, child, depth + 1);
+
+	if (n->wild != SELSET_NONE)
+		selsetquerylabels(q, n->wild, depth + 1);
+}
+
+/*
+ * Find the selectors in "set" that match "id". The numbers of the first
+ * "maxids" matching selectors, in insertion order, are written to "ids".
+ *
+ * Returns the number of selectors written to "ids".
+ */
+size_t
+a2idselset_match(const a2idselset *set, const a2id *a2id, size_t *ids,
+    size_t maxids)
+{
+	const struct a2id *id = (const struct a2id *)a2id;
+	struct selsetquery q;
+	const char *cp, *end, *sep;
+
+	q.set = set;
+	q.subject = a2id;
+	q.ids = ids;
+	q.maxids = maxids;
+	q.n = 0;
+	q.full = 0;
+	q.service = id->type == A2IDT_SERVICE;
+
+	/* every label from the back, without ROOT dot */
+	cp = id->domain + 1;
+	end = id->domain + id->domainlen;
+	if (end - cp > 0 && end[-1] == '.')
+		end--;
+
+	q.nlabels = 0;
+	for (;;) {
+		for (sep = end; sep > cp && sep[-1] != '.'; sep--)
+			;
+
+		q.labels[q.nlabels].s = sep;
+		q.labels[q.nlabels].len = end - sep;
+		q.nlabels++;
+
+		if (sep == cp)
+			break;
+
+		end = sep - 1;
+	}
+
+	/* every segment, up to the signature */
+	q.nsegs = 0;
+	if (id->localpartlen > 0) {
+		cp = id->localpart;
+		if (q.service)
+			cp++;
+
+		if (id->hassig)
+			end = id->sigflags;
+		else
+			end = id->localpart + id->localpartlen;
+
+		for (;;) {
+			for (sep = cp; sep < end && *sep != '+'; sep++)
+				;
+
+			q.segs[q.nsegs].s = cp;
+			q.segs[q.nsegs].len = sep - cp;
+			q.nsegs++;
+
+			if (sep == end)
+				break;
+
+			cp = sep + 1;
+		}
+	}
+
+	selsetquerylabels(&q, 0, 0);
+
+	if (!q.full)
+		qsort(ids, q.n, sizeof(*ids), cmpsize);
+
+	return q.n;
+}
+
+/*
+ * Find the first selector in "set", in insertion order, that matches "id" and
+ * write its number to "idx".
+ *
+ * Return 1 if a selector matches, 0 otherwise.
+ */
+int
+a2idselset_first(const a2idselset *set, const a2id *id, size_t *idx)
+{
+	return a2idselset_match(set, id, idx, 1) == 1;
+}
+
+/*
+ * Parse the "len" characters in "buf" into "view" without copying them. "buf"
+ * does not need to be nul terminated and must not be modified or released as
+ * long as "view" is used. "isselector" is a boolean that indicates whether or
+ * not the input should be parsed as a selector.
+ *
+ * Use a2id_fromview to use "view" with the other functions of this library.
+ *
+ * Return 0 if "buf" contains a valid A2ID, -1 otherwise.
+ */
+int
+a2id_view_parse(a2id_view *view, const char *buf, size_t len, int isselector)
+{
+	struct a2id_view *v = (struct a2id_view *)view;
+	struct a2id id;
+
+	if (view == NULL || buf == NULL || len == SIZE_MAX)
+		return -1;
+
+	/*
+	 * Only the metadata of "id" is written, all pointers are relative to
+	 * "_str" which remains untouched except for a terminating nul.
+	 */
+	if (parselen(&id, buf, len, isselector, 0) == -1)
+		return -1;
+
+	v->buf = buf;
+	fromshell(&v->offs, &id, id._str);
+
+	return 0;
+}
+
+/*
+ * Let "dst" refer to the A2ID in "view" without copying the string of the
+ * view. "dst" can be used with all other functions that take an "a2id", but
+ * refers to the buffer of the view as long as it is not generalized. The first
+ * call to a2id_generalize copies the string into "dst".
+ */
+void
+a2id_fromview(a2id *dst, const a2id_view *view)
+{
+	struct a2id *id = (struct a2id *)dst;
+	const struct a2id_view *v = (const struct a2id_view *)view;
+
+	toshell(id, &v->offs, (char *)v->buf);
+	id->view = v->buf;
+}
+
 /*
  * Write info about "a2id" to "d".
  */
@@ -813,7 +2973,7 @@ a2id_dprint(int d, const a2id *a2id)
 	    id->firstoptlen, (int)id->firstoptlen, id->firstopt,
 	    id->sigflagslen, (int)id->sigflagslen, id->sigflags,
 	    id->domainlen, (int)id->domainlen, id->domain,
-	    id->idlen, (int)id->idlen, id->_str);
+	    id->idlen, (int)id->idlen, id->view ? id->view : id->_str);
 }
 
 /*
@@ -45,14 +45,59 @@ typedef struct {
 	uint8_t a2id[((A2ID_MAXLEN) + 128)];
 } a2id;
 
+/* compiled selector, see a2idsel_compile */
+typedef struct a2idsel a2idsel;
+
+/* set of selectors, see a2idselset_new */
+typedef struct a2idselset a2idselset;
+
+/* id in a caller owned buffer, see a2id_view_parse */
+typedef struct {
+	uint8_t a2idview[48];
+} a2id_view;
+
+/* read-only generalization of an id, see a2id_gencursor_init */
+typedef struct {
+	uint8_t a2idgencursor[64];
+} a2id_gencursor;
+
+/* compact, variable sized copy of an id, see a2id_tocompact */
+typedef struct a2id_compact a2id_compact;
+
 /* import from, and export to a nul terminated string */
 int a2id_fromstr(a2id *a2id, const char *in, int isselector);
+size_t a2id_fromstr_many(a2id *out, int *status, size_t *erroff,
+    const char *const *in, const size_t *inlen, size_t n, int isselector);
 size_t a2id_tostr(char *dst, size_t dstsz, const a2id *a2id);
 
 int a2id_hassignature(const a2id *a2id);
 size_t a2id_coreform(char *dst, size_t dstsz, const a2id *a2id);
 int a2id_generalize(a2id *a2id);
+void a2id_gencursor_init(a2id_gencursor *cursor, const a2id *a2id);
+size_t a2id_gencursor_next(char *dst, size_t dstsz, a2id_gencursor *cursor);
+size_t a2id_generalizations(const a2id *a2id, char *buf, size_t bufsz,
+    size_t *offsets, size_t maxn);
 int a2id_match(const a2id *subject, const a2id *selector);
 void a2id_dprint(int d, const a2id *a2id);
 
+size_t a2id_tocompact(a2id_compact *dst, size_t dstsz, const a2id *a2id);
+void a2id_fromcompact(a2id *dst, const a2id_compact *src);
+int a2id_compact_match(const a2id_compact *subject,
+    const a2id_compact *selector);
+int a2id_compact_generalize(a2id_compact *id);
+
+size_t a2idsel_compile(a2idsel *dst, size_t dstsz, const a2id *selector);
+int a2idsel_match(const a2id *subject, const a2idsel *sel);
+
+a2idselset *a2idselset_new(void);
+void a2idselset_free(a2idselset *set);
+int a2idselset_add(a2idselset *set, const a2id *selector);
+size_t a2idselset_match(const a2idselset *set, const a2id *id, size_t *ids,
+    size_t maxids);
+int a2idselset_first(const a2idselset *set, const a2id *id, size_t *idx);
+
+int a2id_view_parse(a2id_view *view, const char *buf, size_t len,
+    int isselector);
+void a2id_fromview(a2id *dst, const a2id_view *view);
+
 #endif /* A2ID_H */
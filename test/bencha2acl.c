@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2019 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Micro benchmarks for the ARPA2 ACL library. Link with one of the database
+ * backends.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/a2acl.h"
+
+#define NRRULES 20000
+#define ROUNDS 20
+#define NRELEM(x) (sizeof(x) / sizeof((x)[0]))
+
+int a2acl_parsepolicy(struct a2aclrule **rules, size_t *nrules,
+    const char *buf, size_t bufsize, int nthreads, char *errstr,
+    size_t errstrsize);
+ssize_t a2acl_compilerule(char *dst, size_t dstsize, const char *aclrule,
+    size_t aclrulesize);
+int a2acl_parsepolicyline(const char **remotesel, size_t *remoteselsize,
+    const char **localid, size_t *localidsize, const char **aclrule,
+    size_t *aclrulesize, const char *line, size_t linesize, const char **err);
+
+static char policy[] = "/tmp/bencha2acl.XXXXXX";
+static char *lines[NRRULES];
+
+/*
+ * Return a monotonic timestamp in nanoseconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Write a policy file with NRRULES unique rules that are not sorted.
+ */
+static void
+genpolicy(void)
+{
+	char buf[200];
+	FILE *fp;
+	int fd, i, n;
+
+	if ((fd = mkstemp(policy)) == -1)
+		err(1, "mkstemp");
+	if ((fp = fdopen(fd, "w")) == NULL)
+		err(1, "fdopen");
+
+	for (i = 0; i < NRRULES; i++) {
+		n = (i * 7919) % NRRULES;
+		snprintf(buf, sizeof(buf), "user%d@example%d.com foo%d@example.net"
+		    " %%W +bar%d %%B +", n, n % 100, n % 10, n % 7);
+		if ((lines[i] = strdup(buf)) == NULL)
+			err(1, "strdup");
+		fprintf(fp, "%s\n", buf);
+	}
+
+	if (fclose(fp) == EOF)
+		err(1, "fclose");
+}
+
+/*
+ * Import the policy by storing each rule on its own, the way a2acl_fromfile
+ * did before it stored all rules at once, and then with a2acl_fromfile.
+ */
+static void
+bench_import(void)
+{
+	const char *remotesel, *localid, *aclrule, *errp;
+	char dbcache[sizeof(policy) + 3], errstr[100];
+	a2acl_ctx *ctx;
+	double start, single, bulk;
+	size_t remoteselsize, localidsize, aclrulesize, n;
+	int i;
+
+	snprintf(dbcache, sizeof(dbcache), "%s.db", policy);
+
+	unlink(dbcache);
+	start = now();
+	if (a2acl_dbopen(&ctx, dbcache) == -1)
+		errx(1, "a2acl_dbopen");
+	for (i = 0; i < NRRULES; i++) {
+		if (a2acl_parsepolicyline(&remotesel, &remoteselsize, &localid,
+		    &localidsize, &aclrule, &aclrulesize, lines[i],
+		    strlen(lines[i]), &errp) == -1)
+			errx(1, "invalid rule: %s", lines[i]);
+		if (a2acl_putaclrule(ctx, aclrule, aclrulesize, remotesel,
+		    remoteselsize, localid, localidsize) == -1)
+			errx(1, "a2acl_putaclrule");
+	}
+	/* some backends only write when the database is closed */
+	if (a2acl_dbclose(ctx) == -1)
+		errx(1, "a2acl_dbclose");
+	single = NRRULES / ((now() - start) / 1e9);
+
+	unlink(dbcache);
+	start = now();
+	if (a2acl_fromfile(&ctx, policy, &n, NULL, errstr,
+	    sizeof(errstr)) == -1)
+		errx(1, "a2acl_fromfile: %s", errstr);
+	bulk = NRRULES / ((now() - start) / 1e9);
+	a2acl_dbclose(ctx);
+
+	if (n != NRRULES)
+		errx(1, "imported %zu rules instead of %d", n, NRRULES);
+
+	printf("a2acl_putaclrule   %10.0f lines/s\n", single);
+	printf("a2acl_fromfile     %10.0f lines/s  %.1fx\n", bulk,
+	    bulk / single);
+
+	unlink(dbcache);
+}
+
+/*
+ * Look up remote ids with a few options and subdomains, of which most
+ * generalizations are not in the policy, and report how many lookups the Bloom
+ * filter answered. Then look up every rule on its own, outside of a read.
+ */
+static void
+bench_lookup(void)
+{
+	static char remotesels[NRRULES][40], localids[NRRULES][30];
+	static a2id remoteids[NRRULES / 10];
+	struct a2aclstats stats;
+	a2acl_ctx *ctx;
+	a2id localid;
+	char buf[200], dbcache[sizeof(policy) + 3], errstr[100], list;
+	double start, lookup, get;
+	size_t i, bufsize;
+	int r;
+
+	snprintf(dbcache, sizeof(dbcache), "%s.db", policy);
+
+	unlink(dbcache);
+	if (a2acl_fromfile(&ctx, policy, NULL, NULL, errstr,
+	    sizeof(errstr)) == -1)
+		errx(1, "a2acl_fromfile: %s", errstr);
+
+	for (i = 0; i < NRELEM(remoteids); i++) {
+		snprintf(buf, sizeof(buf), "user%zu+x+y@mail.dept.example%zu.com",
+		    i, i % 100);
+		if (a2id_fromstr(&remoteids[i], buf, 0) == -1)
+			errx(1, "invalid id: %s", buf);
+	}
+	if (a2id_fromstr(&localid, "foo1@example.net", 0) == -1)
+		errx(1, "invalid id");
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < NRELEM(remoteids); i++)
+			if (a2acl_whichlist_const(ctx, &list, &remoteids[i],
+			    &localid) == -1)
+				errx(1, "a2acl_whichlist_const");
+	lookup = (now() - start) / ROUNDS / NRELEM(remoteids);
+
+	if (a2acl_stats(ctx, &stats) == -1)
+		errx(1, "a2acl_stats");
+
+	printf("a2acl_whichlist    %10.1f ns/id  %.1f probes/id\n", lookup,
+	    (double)stats.probes / ROUNDS / NRELEM(remoteids));
+	printf("filtered probes    %10.1f%%  %.2f%% false positives\n",
+	    100.0 * stats.skipped / stats.probes, 100 * stats.fprate);
+
+	for (i = 0; i < NRRULES; i++) {
+		snprintf(remotesels[i], sizeof(remotesels[i]),
+		    "user%zu@example%zu.com", i, i % 100);
+		snprintf(localids[i], sizeof(localids[i]), "foo%zu@example.net",
+		    i % 10);
+	}
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NRRULES; i++) {
+			bufsize = sizeof(buf);
+			if (a2acl_getaclrule(ctx, buf, &bufsize, remotesels[i],
+			    strlen(remotesels[i]), localids[i],
+			    strlen(localids[i])) == -1 || bufsize == 0)
+				errx(1, "a2acl_getaclrule");
+		}
+	}
+	get = (now() - start) / ROUNDS / NRRULES;
+
+	printf("a2acl_getaclrule   %10.1f ns/rule\n", get);
+
+	a2acl_dbclose(ctx);
+	unlink(dbcache);
+}
+
+/*
+ * Match a local id against a rule with several segments, once stored as text
+ * and once compiled, the way rules are stored on import.
+ */
+static void
+bench_match(void)
+{
+	const char rule[] = "%W +foo +qux+x +qux+y %A +baz %B +bar";
+	char tdb[sizeof(policy) + 5], cdb[sizeof(policy) + 5];
+	a2acl_ctx *tctx, *cctx;
+	a2id remoteid, localid;
+	char compiled[100], list;
+	double start, text, comp;
+	ssize_t size;
+	int r;
+
+	size = a2acl_compilerule(compiled, sizeof(compiled), rule,
+	    sizeof(rule) - 1);
+	if (size < 0 || (size_t)size > sizeof(compiled))
+		errx(1, "a2acl_compilerule");
+
+	snprintf(tdb, sizeof(tdb), "%s.tdb", policy);
+	snprintf(cdb, sizeof(cdb), "%s.cdb", policy);
+	unlink(tdb);
+	unlink(cdb);
+
+	if (a2acl_dbopen(&tctx, tdb) == -1 || a2acl_dbopen(&cctx, cdb) == -1)
+		errx(1, "a2acl_dbopen");
+	if (a2acl_putaclrule(tctx, rule, sizeof(rule) - 1, "@example.com", 12,
+	    "foo@example.net", 15) == -1 ||
+	    a2acl_putaclrule(cctx, compiled, size, "@example.com", 12,
+	    "foo@example.net", 15) == -1)
+		errx(1, "a2acl_putaclrule");
+
+	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1 ||
+	    a2id_fromstr(&localid, "foo+bar@example.net", 0) == -1)
+		errx(1, "invalid id");
+
+	start = now();
+	for (r = 0; r < NRRULES * ROUNDS; r++)
+		if (a2acl_whichlist_const(tctx, &list, &remoteid,
+		    &localid) == -1 || list != 'B')
+			errx(1, "a2acl_whichlist_const");
+	text = (now() - start) / NRRULES / ROUNDS;
+
+	start = now();
+	for (r = 0; r < NRRULES * ROUNDS; r++)
+		if (a2acl_whichlist_const(cctx, &list, &remoteid,
+		    &localid) == -1 || list != 'B')
+			errx(1, "a2acl_whichlist_const");
+	comp = (now() - start) / NRRULES / ROUNDS;
+
+	printf("match text rule    %10.1f ns/id\n", text);
+	printf("match compiled     %10.1f ns/id  %.2fx\n", comp, text / comp);
+
+	a2acl_dbclose(tctx);
+	a2acl_dbclose(cctx);
+	unlink(tdb);
+	unlink(cdb);
+}
+
+/*
+ * Parse the policy with one thread and with one thread per CPU.
+ */
+static void
+bench_parse(void)
+{
+	struct a2aclrule *rules;
+	char *buf, errstr[100];
+	double start, single, multi;
+	size_t bufsize, n;
+	long ncpu;
+	int i, r;
+
+	bufsize = 0;
+	for (i = 0; i < NRRULES; i++)
+		bufsize += strlen(lines[i]) + 1;
+	if ((buf = malloc(bufsize)) == NULL)
+		err(1, "malloc");
+	for (i = 0, n = 0; i < NRRULES; i++) {
+		memcpy(&buf[n], lines[i], strlen(lines[i]));
+		n += strlen(lines[i]);
+		buf[n++] = '\n';
+	}
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++) {
+		if (a2acl_parsepolicy(&rules, &n, buf, bufsize, 1, errstr,
+		    sizeof(errstr)) == -1)
+			errx(1, "a2acl_parsepolicy: %s", errstr);
+		free(rules);
+	}
+	single = NRRULES * ROUNDS / ((now() - start) / 1e9);
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++) {
+		if (a2acl_parsepolicy(&rules, &n, buf, bufsize, ncpu, errstr,
+		    sizeof(errstr)) == -1)
+			errx(1, "a2acl_parsepolicy: %s", errstr);
+		free(rules);
+	}
+	multi = NRRULES * ROUNDS / ((now() - start) / 1e9);
+
+	printf("parse 1 thread     %10.0f lines/s\n", single);
+	printf("parse %2ld threads    %10.0f lines/s  %.1fx\n", ncpu, multi,
+	    multi / single);
+
+	free(buf);
+}
+
+int
+main(void)
+{
+	genpolicy();
+
+	bench_parse();
+	bench_import();
+	bench_lookup();
+	bench_match();
+
+	unlink(policy);
+
+	return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2019 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Micro benchmarks for the ARPA2 ID library.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/a2id.c"
+
+#define NRIDS 10000
+#define NRSELS 1000
+#define ROUNDS 50
+
+static char *ids[NRIDS];
+static size_t idlens[NRIDS];
+
+/*
+ * Return a monotonic timestamp in nanoseconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Append "n" random lowercase characters to "cp".
+ */
+static char *
+randstr(char *cp, size_t n)
+{
+	while (n--)
+		*cp++ = 'a' + rand() % 26;
+
+	return cp;
+}
+
+/*
+ * Generate a list of plausible mail addresses with some options, signatures
+ * and service names.
+ */
+static void
+genids(void)
+{
+	char buf[A2ID_MAXSZ], *cp;
+	int i, j;
+
+	srand(1);
+
+	for (i = 0; i < NRIDS; i++) {
+		cp = buf;
+
+		if (rand() % 20 == 0)
+			*cp++ = '+';
+		cp = randstr(cp, 3 + rand() % 10);
+
+		for (j = rand() % 3; j > 0; j--) {
+			*cp++ = '+';
+			cp = randstr(cp, 1 + rand() % 6);
+		}
+
+		if (rand() % 10 == 0) {
+			*cp++ = '+';
+			cp = randstr(cp, 4);
+			*cp++ = '+';
+		}
+
+		*cp++ = '@';
+		for (j = 1 + rand() % 3; j > 0; j--) {
+			cp = randstr(cp, 2 + rand() % 12);
+			*cp++ = '.';
+		}
+		memcpy(cp, "org", 4);
+		cp += 3;
+
+		idlens[i] = cp - buf;
+		if ((ids[i] = strdup(buf)) == NULL)
+			err(1, "strdup");
+	}
+}
+
+static void
+bench_fromstr(void)
+{
+	static a2id out[NRIDS];
+	static int status[NRIDS];
+	double start, loop, batch;
+	int i, r;
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < NRIDS; i++)
+			if (a2id_fromstr(&out[i], ids[i], 0) == -1)
+				errx(1, "invalid id: %s", ids[i]);
+	loop = (now() - start) / ROUNDS / NRIDS;
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++)
+		if (a2id_fromstr_many(out, status, NULL,
+		    (const char *const *)ids, idlens, NRIDS, 0) != NRIDS)
+			errx(1, "invalid id");
+	batch = (now() - start) / ROUNDS / NRIDS;
+
+	printf("a2id_fromstr       %6.1f ns/id\n", loop);
+	printf("a2id_fromstr_many  %6.1f ns/id  %.2fx\n", batch, loop / batch);
+}
+
+/*
+ * Reference match that folds every character with tolower(3), like a2id_match
+ * did before it used memcmp and an ASCII fold.
+ */
+static int
+refmatch(const a2id *subject, const a2id *selector)
+{
+	const struct a2id *subid = (const struct a2id *)subject;
+	const struct a2id *selid = (const struct a2id *)selector;
+	char *selp, *subp;
+	size_t selplen, subplen;
+	int n;
+
+	if (selid->localpartlen > 0) {
+		if (selid->localpartlen > subid->localpartlen)
+			return 0;
+
+		if (selid->hassig) {
+			if (!subid->hassig)
+				return 0;
+
+			if (selid->sigflagslen > 1 &&
+			    selid->sigflagslen != subid->sigflagslen)
+				return 0;
+
+			if (selid->sigflagslen > 1 &&
+			    strncmp(selid->sigflags, subid->sigflags,
+			    selid->sigflagslen) != 0)
+				return 0;
+		}
+
+		selp = selid->localpart;
+		subp = subid->localpart;
+
+		if (selid->type == A2IDT_SERVICE) {
+			if (subid->type != A2IDT_SERVICE)
+				return 0;
+			selp++;
+			subp++;
+		}
+
+		if (selid->nropts > subid->nropts)
+			return 0;
+
+		for (n = -1; n < selid->nropts; n++) {
+			for (selplen = subplen = 0;
+			    *selp != '+' && *selp != '@' && *selp != '\0' &&
+			    *subp != '+' && *subp != '@' && *subp != '\0';
+			    selplen++, selp++, subplen++, subp++)
+				if (tolower(*selp) != tolower(*subp))
+					break;
+
+			if (*selp != '+' && *selp != '@' && *selp != '\0')
+				return 0;
+
+			if (selplen == 0) {
+				if (*subp == '+' || *subp == '@' ||
+				    *subp == '\0')
+					return 0;
+				while (*subp != '+' && *subp != '@' &&
+				    *subp != '\0')
+					subp++;
+			}
+
+			if (*subp != '+' && *subp != '@' && *subp != '\0')
+				return 0;
+
+			if (*selp == '@' || *selp == '\0')
+				break;
+
+			if (*subp != '+')
+				return 0;
+
+			selp++;
+			subp++;
+		}
+	}
+
+	if (selid->domainlen > 0) {
+		selp = &selid->domain[selid->domainlen - 1];
+		subp = &subid->domain[subid->domainlen - 1];
+
+		for (;;) {
+			if (*selp == '.')
+				selp--;
+			if (*subp == '.')
+				subp--;
+
+			for (selplen = subplen = 0;
+			    *selp != '@' && *selp != '.' &&
+			    *subp != '@' && *subp != '.';
+			    selplen++, selp--, subplen++, subp--)
+				if (tolower(*selp) != tolower(*subp))
+					break;
+
+			if (*selp != '@' && *selp != '.')
+				return 0;
+
+			if (selplen == 0) {
+				if (*subp == '@' || *subp == '.')
+					return 0;
+				while (*subp != '@' && *subp != '.')
+					subp--;
+			}
+
+			if (*subp != '@' && *subp != '.')
+				return 0;
+
+			if (*selp == '@')
+				break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Match "subject" against all selectors with refmatch and return the time per
+ * match. Exit if refmatch and a2id_match disagree.
+ */
+static double
+timerefmatch(const a2id *subject, const a2id *sels)
+{
+	double start, t;
+	int i, r, matches;
+
+	matches = 0;
+	start = now();
+	for (r = 0; r < ROUNDS * 10; r++)
+		for (i = 0; i < NRSELS; i++)
+			matches += refmatch(subject, &sels[i]);
+	t = (now() - start) / ROUNDS / 10 / NRSELS;
+
+	for (i = 0; i < NRSELS; i++)
+		matches -= ROUNDS * 10 * a2id_match(subject, &sels[i]);
+	if (matches != 0)
+		errx(1, "a2id_match matches differently than tolower");
+
+	return t;
+}
+
+/*
+ * Match one subject against many selectors in the same domain as the subject,
+ * once with a subject that is all lower case and once with a subject that
+ * contains upper case characters, with a2id_match and with the tolower(3)
+ * based reference. Then do the same with compiled selectors.
+ */
+static void
+bench_match(void)
+{
+	static a2id sels[NRSELS];
+	static a2idsel *csels[NRSELS];
+	a2id subject;
+	char buf[A2ID_MAXSZ];
+	const char *domain;
+	double start, lower, upper, clower, cupper, rlower, rupper;
+	size_t size;
+	int i, j, r, matches;
+
+	domain = strchr(ids[0], '@');
+
+	/* localparts of the other ids, generalized by a few steps */
+	for (i = 0; i < NRSELS; i++) {
+		snprintf(buf, sizeof(buf), "%.*s%s",
+		    (int)(strchr(ids[i], '@') - ids[i]), ids[i], domain);
+		if (a2id_fromstr(&sels[i], buf, 1) == -1)
+			errx(1, "invalid selector: %s", buf);
+		for (j = rand() % 5; j > 0; j--)
+			a2id_generalize(&sels[i]);
+
+		size = a2idsel_compile(NULL, 0, &sels[i]);
+		if ((csels[i] = malloc(size)) == NULL)
+			err(1, "malloc");
+		a2idsel_compile(csels[i], size, &sels[i]);
+	}
+
+	if (a2id_fromstr(&subject, ids[0], 0) == -1)
+		errx(1, "invalid id: %s", ids[0]);
+
+	rlower = timerefmatch(&subject, sels);
+
+	matches = 0;
+	start = now();
+	for (r = 0; r < ROUNDS * 10; r++)
+		for (i = 0; i < NRSELS; i++)
+			matches += a2id_match(&subject, &sels[i]);
+	lower = (now() - start) / ROUNDS / 10 / NRSELS;
+
+	start = now();
+	for (r = 0; r < ROUNDS * 10; r++)
+		for (i = 0; i < NRSELS; i++)
+			matches -= a2idsel_match(&subject, csels[i]);
+	clower = (now() - start) / ROUNDS / 10 / NRSELS;
+
+	snprintf(buf, sizeof(buf), "%s", ids[0]);
+	buf[0] = buf[0] - 'a' + 'A';
+	if (a2id_fromstr(&subject, buf, 0) == -1)
+		errx(1, "invalid id: %s", buf);
+
+	rupper = timerefmatch(&subject, sels);
+
+	start = now();
+	for (r = 0; r < ROUNDS * 10; r++)
+		for (i = 0; i < NRSELS; i++)
+			matches += a2id_match(&subject, &sels[i]);
+	upper = (now() - start) / ROUNDS / 10 / NRSELS;
+
+	start = now();
+	for (r = 0; r < ROUNDS * 10; r++)
+		for (i = 0; i < NRSELS; i++)
+			matches -= a2idsel_match(&subject, csels[i]);
+	cupper = (now() - start) / ROUNDS / 10 / NRSELS;
+
+	if (matches != 0)
+		errx(1, "compiled selectors match differently");
+
+	printf("tolower match lower %5.1f ns/match\n", rlower);
+	printf("a2id_match lower   %6.1f ns/match  %.2fx\n", lower,
+	    rlower / lower);
+	printf("tolower match upper %5.1f ns/match\n", rupper);
+	printf("a2id_match upper   %6.1f ns/match  %.2fx\n", upper,
+	    rupper / upper);
+	printf("a2idsel_match lower %5.1f ns/match  %.2fx\n", clower,
+	    lower / clower);
+	printf("a2idsel_match upper %5.1f ns/match  %.2fx\n", cupper,
+	    upper / cupper);
+
+	for (i = 0; i < NRSELS; i++)
+		free(csels[i]);
+}
+
+/*
+ * Find all matching selectors among NRIDS selectors, once with a selector set
+ * and once by matching each compiled selector.
+ */
+static void
+bench_selset(void)
+{
+	static a2idsel *csels[NRIDS];
+	static size_t res[NRIDS];
+	a2idselset *set;
+	a2id id;
+	double start, linear, indexed;
+	size_t n, size, total;
+	int i, j, r, matches;
+
+	if ((set = a2idselset_new()) == NULL)
+		err(1, "a2idselset_new");
+
+	for (i = 0; i < NRIDS; i++) {
+		if (a2id_fromstr(&id, ids[i], 1) == -1)
+			errx(1, "invalid selector: %s", ids[i]);
+		for (j = rand() % 4; j > 0; j--)
+			a2id_generalize(&id);
+
+		if (a2idselset_add(set, &id) == -1)
+			err(1, "a2idselset_add");
+
+		size = a2idsel_compile(NULL, 0, &id);
+		if ((csels[i] = malloc(size)) == NULL)
+			err(1, "malloc");
+		a2idsel_compile(csels[i], size, &id);
+	}
+
+	matches = 0;
+	total = 0;
+	start = now();
+	for (r = 0; r < NRSELS; r++) {
+		if (a2id_fromstr(&id, ids[r], 0) == -1)
+			errx(1, "invalid id: %s", ids[r]);
+		for (i = 0; i < NRIDS; i++)
+			matches += a2idsel_match(&id, csels[i]);
+	}
+	linear = (now() - start) / NRSELS;
+
+	start = now();
+	for (r = 0; r < NRSELS; r++) {
+		if (a2id_fromstr(&id, ids[r], 0) == -1)
+			errx(1, "invalid id: %s", ids[r]);
+		n = a2idselset_match(set, &id, res, NRIDS);
+		matches -= n;
+		total += n;
+	}
+	indexed = (now() - start) / NRSELS;
+
+	if (matches != 0)
+		errx(1, "selector set matches differently");
+
+	printf("a2idsel_match x%d %8.1f ns/id  %.1f matches/id\n", NRIDS,
+	    linear, (double)total / NRSELS);
+	printf("a2idselset_match   %8.1f ns/id  %.0fx\n", indexed,
+	    linear / indexed);
+
+	for (i = 0; i < NRIDS; i++)
+		free(csels[i]);
+	a2idselset_free(set);
+}
+
+int
+main(void)
+{
+	genids();
+
+	bench_fromstr();
+	bench_match();
+	bench_selset();
+
+	return 0;
+}
@@ -14,43 +14,90 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/time.h>
+
 #include <assert.h>
 #include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../src/a2acl.h"
 
-static char *aclrule;
+static const char *aclrule;
 static size_t aclrulesize;
 static int fetchcalled;
 static int putcalled;
+static size_t putrules;
+static size_t putfailat = SIZE_MAX;
+static int synccalled;
+static size_t syncrules;
+static int readcalled;
+static int metacalled;
+static char meta[100];
+static size_t metasize;
+static int readdepth;
+static char lastremotesel[A2ID_MAXSZ];
+static char lastlocalid[A2ID_MAXSZ];
 
 struct a2aclit *a2acl_newit(const char *aclrule, size_t aclrulesize);
 int a2acl_nextsegment(char *, struct a2aclseg *, struct a2aclit *);
 int a2acl_parsepolicyline(const char **aclrule, size_t *aclrulesize,
     const char **remotesel, size_t *remoteselsize, const char **localid,
     size_t *localidsize, const char *line, size_t linesize, const char **err);
+ssize_t a2acl_fromdes(a2acl_ctx *ctx, int d, char *errstr, size_t errstrsize);
+ssize_t a2acl_syncdes(a2acl_ctx *ctx, int d, char *errstr, size_t errstrsize);
+int a2acl_parsepolicy(struct a2aclrule **rules, size_t *nrules,
+    const char *buf, size_t bufsize, int nthreads, char *errstr,
+    size_t errstrsize);
+ssize_t a2acl_compilerule(char *dst, size_t dstsize, const char *aclrule,
+    size_t aclrulesize);
 
 /*
- * DB mock.
+ * DB mock. There is only one context, lookups check that it is passed on.
  */
+struct a2acl_ctx {
+	int open;
+};
+
+static a2acl_ctx mockctx;
+
 int
-a2acl_dbopen(const char *path)
+a2acl_dbopen(a2acl_ctx **ctx, const char *path)
 {
 	path = NULL;
+	mockctx.open = 1;
+	*ctx = &mockctx;
+	return 0;
+}
+
+int
+a2acl_dbcreate(a2acl_ctx **ctx, const char *path)
+{
+	return a2acl_dbopen(ctx, path);
+}
+
+int
+a2acl_dbinstall(a2acl_ctx *ctx)
+{
+	assert(ctx == &mockctx);
 	return 0;
 }
 
 int
-a2acl_dbclose(void)
+a2acl_dbclose(a2acl_ctx *ctx)
 {
+	assert(ctx == &mockctx);
+	mockctx.open = 0;
 	return 0;
 }
 
 int
-a2acl_count(size_t *count)
+a2acl_count(a2acl_ctx *ctx, size_t *count)
 {
+	assert(ctx == &mockctx);
 	count = NULL;
 	return 0;
 }
@@ -61,10 +108,12 @@ a2acl_count(size_t *count)
  * Must return 0 on success, -1 on failure.
  */
 int
-a2acl_putaclrule(const char *aclrule, size_t aclrulesize,
-     const char *remotesel, size_t remoteselsize, const char *localid,
+a2acl_putaclrule(a2acl_ctx *ctx, const char *aclrule, size_t aclrulesize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
     size_t localidsize)
 {
+	assert(ctx == &mockctx);
+
 	/* suppress compiler warnings */
 	aclrule = remotesel = localid = NULL;
 	aclrulesize = remoteselsize = localidsize = 0;
@@ -73,33 +122,164 @@ a2acl_putaclrule(const char *aclrule, size_t aclrulesize,
 	return 0;
 }
 
+/*
+ * Stores nothing but counts the calls in "putcalled" and the rules in
+ * "putrules". Fails at rule "putfailat" if it is in range.
+ */
+int
+a2acl_putaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *failed)
+{
+	assert(ctx == &mockctx);
+	assert(rules != NULL);
+
+	putcalled++;
+	if (putfailat < nrules) {
+		*failed = putfailat;
+		return -1;
+	}
+
+	putrules += nrules;
+	return 0;
+}
+
+/*
+ * Stores nothing but counts the calls in "synccalled" and remembers the number
+ * of rules in "syncrules". Reports all rules as changed. Fails at rule
+ * "putfailat" if it is in range.
+ */
+int
+a2acl_syncaclrules(a2acl_ctx *ctx, const struct a2aclrule *rules,
+    size_t nrules, size_t *changed, size_t *failed)
+{
+	assert(ctx == &mockctx);
+	assert(nrules == 0 || rules != NULL);
+
+	synccalled++;
+	if (putfailat < nrules) {
+		*failed = putfailat;
+		return -1;
+	}
+
+	syncrules = nrules;
+	*changed = nrules;
+	return 0;
+}
+
+/*
+ * Keeps one metadata record in "meta".
+ */
+int
+a2acl_getmeta(a2acl_ctx *ctx, void *m, size_t *msize)
+{
+	assert(ctx == &mockctx);
+
+	if (metasize > *msize)
+		return -1;
+
+	memcpy(m, meta, metasize);
+	*msize = metasize;
+	return 0;
+}
+
+/*
+ * Replace the metadata record in "meta" and count the calls in "metacalled".
+ */
+int
+a2acl_putmeta(a2acl_ctx *ctx, const void *m, size_t msize)
+{
+	assert(ctx == &mockctx);
+	assert(msize <= sizeof(meta));
+
+	memcpy(meta, m, msize);
+	metasize = msize;
+	metacalled++;
+	return 0;
+}
+
+/*
+ * Count the number of reads and keep track of the nesting of reads.
+ */
+int
+a2acl_beginread(a2acl_ctx *ctx)
+{
+	assert(ctx == &mockctx);
+
+	readcalled++;
+	readdepth++;
+	return 0;
+}
+
+int
+a2acl_endread(a2acl_ctx *ctx)
+{
+	assert(ctx == &mockctx);
+	assert(readdepth > 0);
+
+	readdepth--;
+	return 0;
+}
+
 /*
  * Fetch a communication ACL rule given a remote and local ID.
  *
  * A shim ACL rule k/v implementation.
  *
- * Returns whatever is stored in the global "aclrule".
+ * Points to whatever is stored in the global "aclrule". Must be called within
+ * a read.
  *
  * Return 0 on success, -1 on error.
  */
 int
-a2acl_getaclrule(char *aclr, size_t *aclrsize, const char *remotesel,
-    size_t remoteselsize, const char *localid, size_t localidsize)
+a2acl_viewaclrule(a2acl_ctx *ctx, const char **aclr, size_t *aclrsize,
+    const char *remotesel, size_t remoteselsize, const char *localid,
+    size_t localidsize)
 {
-	if (aclrulesize > *aclrsize)
-		return -1;
+	assert(ctx == &mockctx);
+	assert(readdepth > 0);
 
-	memcpy(aclr, aclrule, aclrulesize);
+	*aclr = aclrule;
 	*aclrsize = aclrulesize;
 
-	/* suppress compiler warnings */
-	remotesel = localid = NULL;
-	remoteselsize = localidsize = 0;
+	/* record the last lookup */
+	if (remoteselsize >= sizeof(lastremotesel) ||
+	    localidsize >= sizeof(lastlocalid))
+		return -1;
+	memcpy(lastremotesel, remotesel, remoteselsize);
+	lastremotesel[remoteselsize] = '\0';
+	memcpy(lastlocalid, localid, localidsize);
+	lastlocalid[localidsize] = '\0';
 
 	fetchcalled++;
 	return 0;
 }
 
+/*
+ * Fetch the ACL rules of "keys" in turn with a2acl_viewaclrule, so that each
+ * key counts as a fetch, and stop at the first one that is not empty.
+ */
+int
+a2acl_viewaclrules(a2acl_ctx *ctx, size_t *idx, const char **aclr,
+    size_t *aclrsize, const struct a2aclkey *keys, size_t nkeys)
+{
+	size_t i;
+
+	*aclr = NULL;
+	*aclrsize = 0;
+
+	for (i = 0; i < nkeys; i++) {
+		if (a2acl_viewaclrule(ctx, aclr, aclrsize, keys[i].remotesel,
+		    keys[i].remoteselsize, keys[i].localid,
+		    keys[i].localidsize) == -1)
+			return -1;
+		if (*aclrsize > 0)
+			break;
+	}
+
+	*idx = i;
+	return 0;
+}
+
 void
 test_a2acl_nextsegment(void)
 {
@@ -256,22 +436,26 @@ test_a2acl_whichlist(void)
 	if (a2id_fromstr(&localid, "foo+bar@example.net", 0) == -1)
 		abort();
 
+	/* all lookups are done in one read */
 	aclrule = "";
 	aclrulesize = strlen(aclrule);
 	fetchcalled = 0;
+	readcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == 0);
 	assert(list == 'G');
 	assert(fetchcalled == 5);
+	assert(readcalled == 1);
+	assert(readdepth == 0);
 
 	aclrule = "%W +bar";
 	aclrulesize = strlen(aclrule);
 	fetchcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == 0);
 	assert(list == 'W');
 	assert(fetchcalled == 1);
@@ -281,7 +465,7 @@ test_a2acl_whichlist(void)
 	fetchcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == 0);
 	assert(list == 'G');
 	assert(fetchcalled == 5);
@@ -291,7 +475,7 @@ test_a2acl_whichlist(void)
 	fetchcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == 0);
 	assert(list == 'B');
 	assert(fetchcalled == 1);
@@ -301,7 +485,7 @@ test_a2acl_whichlist(void)
 	fetchcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == 0);
 	assert(list == 'G');
 	assert(fetchcalled == 5);
@@ -311,7 +495,7 @@ test_a2acl_whichlist(void)
 	fetchcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == 0);
 	assert(list == 'G');
 	assert(fetchcalled == 5);
@@ -324,7 +508,7 @@ test_a2acl_whichlist(void)
 	fetchcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == 0);
 	assert(list == 'B');
 	assert(fetchcalled == 1);
@@ -334,8 +518,468 @@ test_a2acl_whichlist(void)
 	fetchcalled = 0;
 	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
 		abort();
-	r = a2acl_whichlist(&list, &remoteid, &localid);
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
 	assert(r == -1);
+	assert(readdepth == 0);
+
+	/* the rule is used in place and is not nul terminated */
+	aclrule = "%W +bar+baz%X";
+	aclrulesize = 11;
+	fetchcalled = 0;
+	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
+		abort();
+	r = a2acl_whichlist(&mockctx, &list, &remoteid, &localid);
+	assert(r == 0);
+	assert(list == 'W');
+	assert(fetchcalled == 1);
+}
+
+/*
+ * Compiled rules match the same as the rules they are compiled from.
+ */
+void
+test_a2acl_compilerule(void)
+{
+	static const char *rules[] = {
+		"%W +bar",
+		"%W +baz",
+		"%W +foo +barbaz %B +foo +bar",
+		"%W +foo +barbaz %B +foo+bar",
+		"%W +foo +barbaz %B +foo +bar+baz",
+		"%A +",
+		"%W ++ %B +",
+	};
+	static const char *localids[] = {
+		"foo+bar@example.net", "foo+bar+baz@example.net", "foo@example.net"
+	};
+	a2id remoteid, localid;
+	char compiled[100], str[100], textlist, list;
+	size_t i, j;
+	ssize_t size;
+
+	for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+		size = a2acl_compilerule(compiled, sizeof(compiled), rules[i],
+		    strlen(rules[i]));
+		assert(size > 0 && (size_t)size <= sizeof(compiled));
+
+		/* the same rule, with single spaces */
+		assert(a2acl_ruletostr(str, sizeof(str), compiled, size) ==
+		    (ssize_t)strlen(rules[i]));
+		assert(strcmp(str, rules[i]) == 0);
+
+		for (j = 0; j < sizeof(localids) / sizeof(localids[0]); j++) {
+			if (a2id_fromstr(&localid, localids[j], 0) == -1)
+				abort();
+
+			aclrule = rules[i];
+			aclrulesize = strlen(rules[i]);
+			if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
+				abort();
+			assert(a2acl_whichlist(&mockctx, &textlist, &remoteid,
+			    &localid) == 0);
+
+			aclrule = compiled;
+			aclrulesize = size;
+			if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
+				abort();
+			assert(a2acl_whichlist(&mockctx, &list, &remoteid,
+			    &localid) == 0);
+			assert(list == textlist);
+		}
+	}
+
+	/* extra blanks are not kept */
+	size = a2acl_compilerule(compiled, sizeof(compiled),
+	    "%W  +bar\t%W +qux  %A ++ ", 24);
+	assert(size > 0);
+	assert(a2acl_ruletostr(str, sizeof(str), compiled, size) == 18);
+	assert(strcmp(str, "%W +bar +qux %A ++") == 0);
+
+	/* the size is returned if it doesn't fit */
+	assert(a2acl_compilerule(compiled, 5, "%W +bar", 7) == 10);
+
+	assert(a2acl_compilerule(compiled, sizeof(compiled), "%X +foo",
+	    7) == -1);
+	assert(a2acl_compilerule(compiled, sizeof(compiled), "%W", 2) == -1);
+
+	/* a truncated compiled rule is rejected */
+	size = a2acl_compilerule(compiled, sizeof(compiled), "%W +bar", 7);
+	assert(a2acl_ruletostr(str, sizeof(str), compiled, size - 4) == -1);
+	aclrule = compiled;
+	aclrulesize = size - 1;
+	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
+		abort();
+	assert(a2acl_whichlist(&mockctx, &list, &remoteid, &localid) == -1);
+	assert(readdepth == 0);
+}
+
+/*
+ * Use ids that refer to a line buffer instead of copies.
+ */
+void
+test_a2acl_whichlist_view(void)
+{
+	const char line[] = "foo+bar@example.net baz+qux@example.com";
+	char orig[sizeof(line)];
+	a2id_view remoteview, localview;
+	a2id remoteid, localid;
+	char list;
+
+	memcpy(orig, line, sizeof(line));
+
+	if (a2id_view_parse(&localview, line, 19, 0) == -1)
+		abort();
+	if (a2id_view_parse(&remoteview, &line[20], 19, 0) == -1)
+		abort();
+
+	aclrule = "%W +bar";
+	aclrulesize = strlen(aclrule);
+	fetchcalled = 0;
+	a2id_fromview(&localid, &localview);
+	a2id_fromview(&remoteid, &remoteview);
+	assert(a2acl_whichlist(&mockctx, &list, &remoteid, &localid) == 0);
+	assert(list == 'W');
+	assert(fetchcalled == 1);
+	assert(strcmp(lastremotesel, "baz+qux@example.com") == 0);
+	assert(strcmp(lastlocalid, "foo@example.net") == 0);
+
+	/* Generalization must leave the buffer intact. */
+	aclrule = "";
+	aclrulesize = strlen(aclrule);
+	fetchcalled = 0;
+	a2id_fromview(&remoteid, &remoteview);
+	assert(a2acl_whichlist(&mockctx, &list, &remoteid, &localid) == 0);
+	assert(list == 'G');
+	assert(fetchcalled == 7);
+	assert(strcmp(lastremotesel, "@.") == 0);
+	assert(memcmp(line, orig, sizeof(line)) == 0);
+}
+
+/*
+ * One remote id checked against several local ids must give the same results
+ * as a2acl_whichlist, without modifying the remote id.
+ */
+void
+test_a2acl_whichlist_const(void)
+{
+	const char *localids[] = {
+		"foo+bar@example.net", "foo+baz@example.net", "foo@example.net"
+	};
+	const char *rules[] = { "", "%W +bar", "%W +foo +barbaz %B +foo +bar" };
+	a2id remoteid, gen, localid, orig;
+	char list, constlist;
+	size_t i, j;
+	int calls;
+
+	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
+		abort();
+	memcpy(&orig, &remoteid, sizeof(remoteid));
+
+	for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+		aclrule = rules[i];
+		aclrulesize = strlen(aclrule);
+
+		for (j = 0; j < sizeof(localids) / sizeof(localids[0]); j++) {
+			if (a2id_fromstr(&localid, localids[j], 0) == -1)
+				abort();
+
+			if (a2id_fromstr(&gen, "baz@example.com", 0) == -1)
+				abort();
+			fetchcalled = 0;
+			assert(a2acl_whichlist(&mockctx, &list, &gen,
+			    &localid) == 0);
+			calls = fetchcalled;
+
+			fetchcalled = 0;
+			readcalled = 0;
+			assert(a2acl_whichlist_const(&mockctx, &constlist,
+			    &remoteid, &localid) == 0);
+			assert(constlist == list);
+			assert(fetchcalled == calls);
+			assert(readcalled == 1);
+			assert(readdepth == 0);
+			assert(memcmp(&remoteid, &orig, sizeof(orig)) == 0);
+		}
+	}
+
+	/* the last fetch is for the most general selector */
+	aclrule = "";
+	aclrulesize = strlen(aclrule);
+	assert(a2acl_whichlist_const(&mockctx, &list, &remoteid, &localid) == 0);
+	assert(list == 'G');
+	assert(strcmp(lastremotesel, "@.") == 0);
+
+	aclrule = "%X +foo";
+	aclrulesize = strlen(aclrule);
+	assert(a2acl_whichlist_const(&mockctx, &list, &remoteid,
+	    &localid) == -1);
+}
+
+/*
+ * Import a policy from a pipe, or update the database to it if "sync" is set.
+ */
+static ssize_t
+pipestr(const char *policy, int sync, char *errstr, size_t errstrsize)
+{
+	ssize_t r;
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+	if (write(fds[1], policy, strlen(policy)) != (ssize_t)strlen(policy))
+		err(1, "write");
+	close(fds[1]);
+
+	if (sync)
+		r = a2acl_syncdes(&mockctx, fds[0], errstr, errstrsize);
+	else
+		r = a2acl_fromdes(&mockctx, fds[0], errstr, errstrsize);
+	close(fds[0]);
+	return r;
+}
+
+static ssize_t
+fromstr(const char *policy, char *errstr, size_t errstrsize)
+{
+	return pipestr(policy, 0, errstr, errstrsize);
+}
+
+void
+test_a2acl_fromdes(void)
+{
+	char errstr[100];
+
+	/* all rules are stored at once */
+	putcalled = 0;
+	putrules = 0;
+	assert(fromstr("@. foo@example.net %W +\n"
+	    "baz@example.com foo@example.net %B +bar\n"
+	    "@example.com foo@example.net %A +\n", errstr,
+	    sizeof(errstr)) == 3);
+	assert(putcalled == 1);
+	assert(putrules == 3);
+
+	/* the last line doesn't need a newline */
+	putrules = 0;
+	assert(fromstr("@. foo@example.net %W +\n@. bar@example.net %W +",
+	    errstr, sizeof(errstr)) == 2);
+	assert(putrules == 2);
+
+	/* nothing is stored if a line is invalid */
+	putcalled = 0;
+	assert(fromstr("@. foo@example.net %W +\n@. a@b\n", errstr,
+	    sizeof(errstr)) == -1);
+	assert(putcalled == 0);
+	assert(strcmp(errstr, "illegal ACL rule at line 2: @. a@b") == 0);
+
+	/* ACL rules are checked before anything is stored */
+	assert(fromstr("@. foo@example.net %W +\n@. bar@example.net %X +\n",
+	    errstr, sizeof(errstr)) == -1);
+	assert(putcalled == 0);
+	assert(strcmp(errstr, "illegal ACL rule at line 2: "
+	    "@. bar@example.net %X +") == 0);
+
+	/* the rule that failed is reported */
+	putfailat = 1;
+	assert(fromstr("@. foo@example.net %W +\n@. bar@example.net %W +\n",
+	    errstr, sizeof(errstr)) == -1);
+	assert(strcmp(errstr, "failed to save ACL rule #2: "
+	    "@. bar@example.net %W +") == 0);
+	putfailat = SIZE_MAX;
+
+	putcalled = 0;
+	assert(fromstr("", errstr, sizeof(errstr)) == 0);
+	assert(putcalled == 0);
+}
+
+void
+test_a2acl_syncdes(void)
+{
+	char errstr[100];
+
+	/* the whole policy is passed at once instead of being stored */
+	putcalled = 0;
+	synccalled = 0;
+	assert(pipestr("@. foo@example.net %W +\n"
+	    "baz@example.com foo@example.net %B +bar\n", 1, errstr,
+	    sizeof(errstr)) == 2);
+	assert(synccalled == 1);
+	assert(syncrules == 2);
+	assert(putcalled == 0);
+
+	/* an empty policy removes all rules */
+	assert(pipestr("", 1, errstr, sizeof(errstr)) == 0);
+	assert(synccalled == 2);
+	assert(syncrules == 0);
+
+	/* nothing is changed if a line is invalid */
+	assert(pipestr("@. foo@example.net %W +\n@. a@b\n", 1, errstr,
+	    sizeof(errstr)) == -1);
+	assert(synccalled == 2);
+	assert(strcmp(errstr, "illegal ACL rule at line 2: @. a@b") == 0);
+
+	/* the rule that failed is reported */
+	putfailat = 1;
+	assert(pipestr("@. foo@example.net %W +\n@. bar@example.net %W +\n",
+	    1, errstr, sizeof(errstr)) == -1);
+	assert(strcmp(errstr, "failed to save ACL rule #2: "
+	    "@. bar@example.net %W +") == 0);
+	putfailat = SIZE_MAX;
+}
+
+/*
+ * Write "policy" to the file "filename" and set its modification time to "age"
+ * seconds ago.
+ */
+static void
+writepolicy(const char *filename, const char *policy, int age)
+{
+	struct timeval tv[2];
+	FILE *fp;
+
+	if ((fp = fopen(filename, "w")) == NULL)
+		err(1, "fopen");
+	fputs(policy, fp);
+	if (fclose(fp) == EOF)
+		err(1, "fclose");
+
+	if (gettimeofday(&tv[0], NULL) == -1)
+		err(1, "gettimeofday");
+	tv[0].tv_sec -= age;
+	tv[1] = tv[0];
+	if (utimes(filename, tv) == -1)
+		err(1, "utimes");
+}
+
+/*
+ * An existing cache is only updated if the contents of the policy changed.
+ */
+void
+test_a2acl_fromfile(void)
+{
+	char policy[] = "/tmp/testa2acl.XXXXXX", dbcache[sizeof(policy) + 3];
+	char errstr[100];
+	a2acl_ctx *ctx;
+	size_t upd;
+	int fd;
+
+	if ((fd = mkstemp(policy)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+
+	/* make the cache exist so that it is opened instead of built */
+	snprintf(dbcache, sizeof(dbcache), "%s.db", policy);
+	if ((fd = open(dbcache, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1)
+		err(1, "open");
+	close(fd);
+
+	writepolicy(policy, "@. foo@example.net %W +\n", 100);
+
+	/* a cache without a fingerprint is updated */
+	metasize = 0;
+	metacalled = 0;
+	synccalled = 0;
+	assert(a2acl_fromfile(&ctx, policy, NULL, &upd, errstr,
+	    sizeof(errstr)) == 0);
+	assert(synccalled == 1);
+	assert(upd == 1);
+	assert(metacalled == 1);
+
+	/* an untouched policy is not even read */
+	assert(a2acl_fromfile(&ctx, policy, NULL, &upd, errstr,
+	    sizeof(errstr)) == 0);
+	assert(synccalled == 1);
+	assert(upd == 0);
+	assert(metacalled == 1);
+
+	/* a policy that is rewritten with the same contents is not imported */
+	writepolicy(policy, "@. foo@example.net %W +\n", 50);
+	assert(a2acl_fromfile(&ctx, policy, NULL, &upd, errstr,
+	    sizeof(errstr)) == 0);
+	assert(synccalled == 1);
+	assert(metacalled == 2);
+
+	/* a policy that changed within the same second is still seen */
+	writepolicy(policy, "@. foo@example.net %W +\n", 0);
+	assert(a2acl_fromfile(&ctx, policy, NULL, &upd, errstr,
+	    sizeof(errstr)) == 0);
+	writepolicy(policy, "@. foo@example.net %B +\n", 0);
+	assert(a2acl_fromfile(&ctx, policy, NULL, &upd, errstr,
+	    sizeof(errstr)) == 0);
+	assert(synccalled == 2);
+	assert(syncrules == 1);
+
+	/* an invalid policy leaves the fingerprint alone */
+	metacalled = 0;
+	writepolicy(policy, "@. a@b\n", 10);
+	assert(a2acl_fromfile(&ctx, policy, NULL, &upd, errstr,
+	    sizeof(errstr)) == -1);
+	assert(metacalled == 0);
+
+	unlink(dbcache);
+	unlink(policy);
+}
+
+/*
+ * The same rules and errors must be found with any number of threads.
+ */
+void
+test_a2acl_parsepolicy(void)
+{
+	struct a2aclrule *rules, *exp;
+	char *policy, errstr[100], experr[100];
+	size_t i, n, expn, size;
+	int nthreads;
+
+	size = 1000 * 50;
+	if ((policy = malloc(size)) == NULL)
+		abort();
+
+	n = 0;
+	for (i = 0; i < 1000; i++)
+		n += snprintf(&policy[n], size - n, "user%zu@example.com "
+		    "foo@example.net %%W +\n", i);
+
+	/* without the last newline */
+	n--;
+
+	assert(a2acl_parsepolicy(&exp, &expn, policy, n, 1, errstr,
+	    sizeof(errstr)) == 0);
+	assert(expn == 1000);
+	assert(strncmp(exp[536].remotesel, "user536@example.com",
+	    exp[536].remoteselsize) == 0);
+
+	for (nthreads = 2; nthreads <= 16; nthreads++) {
+		assert(a2acl_parsepolicy(&rules, &i, policy, n, nthreads,
+		    errstr, sizeof(errstr)) == 0);
+		assert(i == expn);
+		assert(memcmp(rules, exp, expn * sizeof(*exp)) == 0);
+		free(rules);
+	}
+	free(exp);
+
+	/* more threads than lines */
+	assert(a2acl_parsepolicy(&rules, &i, policy,
+	    strchr(policy, '\n') - policy + 1, 16, errstr,
+	    sizeof(errstr)) == 0);
+	assert(i == 1);
+	free(rules);
+
+	/* the first of two errors is reported with its line number */
+	memcpy(strstr(policy, "user536@"), "user536\001", 8);
+	memcpy(strstr(policy, "user900@"), "user900\001", 8);
+	assert(a2acl_parsepolicy(&rules, &i, policy, n, 1, experr,
+	    sizeof(experr)) == -1);
+	assert(strncmp(experr, "illegal ACL policy line at #537,",
+	    strlen("illegal ACL policy line at #537,")) == 0);
+
+	for (nthreads = 2; nthreads <= 16; nthreads++) {
+		assert(a2acl_parsepolicy(&rules, &i, policy, n, nthreads,
+		    errstr, sizeof(errstr)) == -1);
+		assert(strcmp(errstr, experr) == 0);
+	}
+
+	free(policy);
 }
 
 void
@@ -396,6 +1040,13 @@ main(void)
 {
 	test_a2acl_nextsegment();
 	test_a2acl_whichlist();
+	test_a2acl_compilerule();
+	test_a2acl_whichlist_view();
+	test_a2acl_whichlist_const();
+	test_a2acl_fromdes();
+	test_a2acl_syncdes();
+	test_a2acl_fromfile();
+	test_a2acl_parsepolicy();
 	test_a2acl_parsepolicyline();
 
 	return 0;
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2019 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Tests of a2acl with the dbm backend, including lookups from several threads
+ * on the same databases.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/a2acl.h"
+
+#define NRTHREADS 8
+#define ROUNDS 2000
+#define NRELEM(x) (sizeof(x) / sizeof((x)[0]))
+
+struct rule {
+	const char *remotesel, *localid, *aclrule;
+};
+
+static const struct rule rulesa[] = {
+	{ "baz@example.com", "foo@example.net", "%B +bar" },
+	{ "@example.com", "foo@example.net", "%W +bar %A +qux" },
+	{ "@.", "foo@example.net", "%B +" },
+};
+
+static const struct rule rulesb[] = {
+	{ "@example.com", "foo@example.net", "%A +bar" },
+};
+
+static const char *remotestrs[] = {
+	"baz@example.com", "qux@example.com", "baz@sub.example.com",
+	"a+b@example.org", "BAZ@Example.com"
+};
+
+static const char *localstrs[] = {
+	"foo@example.net", "foo+bar@example.net", "foo+qux@example.net",
+	"foo+bar+x@example.net"
+};
+
+static a2acl_ctx *ctxa, *ctxb;
+static a2id localids[NRELEM(localstrs)];
+static char expa[NRELEM(remotestrs)][NRELEM(localstrs)];
+static char expb[NRELEM(remotestrs)][NRELEM(localstrs)];
+
+static a2acl_ctx *
+opendb(const struct rule *rules, size_t nrules)
+{
+	a2acl_ctx *ctx;
+	size_t i, n;
+
+	if (a2acl_dbopen(&ctx, NULL) == -1)
+		abort();
+
+	for (i = 0; i < nrules; i++)
+		if (a2acl_putaclrule(ctx, rules[i].aclrule,
+		    strlen(rules[i].aclrule), rules[i].remotesel,
+		    strlen(rules[i].remotesel), rules[i].localid,
+		    strlen(rules[i].localid)) == -1)
+			abort();
+
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == nrules);
+
+	return ctx;
+}
+
+/*
+ * Determine the list of each pair with a freshly parsed remote id.
+ */
+static int
+whichlist(a2acl_ctx *ctx, char *list, size_t remote, size_t local)
+{
+	a2id remoteid;
+
+	if (a2id_fromstr(&remoteid, remotestrs[remote], 0) == -1)
+		return -1;
+
+	return a2acl_whichlist(ctx, list, &remoteid, &localids[local]);
+}
+
+/*
+ * Two databases can be open at the same time.
+ */
+void
+test_a2acl_ctx(void)
+{
+	size_t i, j;
+
+	ctxa = opendb(rulesa, NRELEM(rulesa));
+	ctxb = opendb(rulesb, NRELEM(rulesb));
+
+	for (j = 0; j < NRELEM(localstrs); j++)
+		if (a2id_fromstr(&localids[j], localstrs[j], 0) == -1)
+			abort();
+
+	for (i = 0; i < NRELEM(remotestrs); i++) {
+		for (j = 0; j < NRELEM(localstrs); j++) {
+			assert(whichlist(ctxa, &expa[i][j], i, j) == 0);
+			assert(whichlist(ctxb, &expb[i][j], i, j) == 0);
+		}
+	}
+
+	/* baz@example.com */
+	assert(expa[0][0] == 'B');
+	assert(expa[0][1] == 'B');
+	assert(expa[0][2] == 'A');
+	assert(expb[0][0] == 'G');
+	assert(expb[0][1] == 'A');
+	assert(expb[0][2] == 'G');
+
+	/* qux@example.com */
+	assert(expa[1][1] == 'W');
+	assert(expa[1][2] == 'A');
+	assert(expb[1][1] == 'A');
+
+	/* a+b@example.org */
+	assert(expa[3][1] == 'B');
+	assert(expb[3][1] == 'G');
+}
+
+/*
+ * Updating a database only changes the rules that differ.
+ */
+void
+test_a2acl_sync(void)
+{
+	static const struct rule rulesc[] = {
+		{ "baz@example.com", "foo@example.net", "%B +bar" },
+		{ "@example.com", "foo@example.net", "%W +bar" },
+		{ "@example.org", "foo@example.net", "%W +" },
+	};
+	struct a2aclrule rules[NRELEM(rulesc)];
+	a2acl_ctx *ctx;
+	size_t changed, failed, i, n;
+	char list;
+
+	for (i = 0; i < NRELEM(rulesc); i++) {
+		rules[i].remotesel = rulesc[i].remotesel;
+		rules[i].remoteselsize = strlen(rulesc[i].remotesel);
+		rules[i].localid = rulesc[i].localid;
+		rules[i].localidsize = strlen(rulesc[i].localid);
+		rules[i].aclrule = rulesc[i].aclrule;
+		rules[i].aclrulesize = strlen(rulesc[i].aclrule);
+	}
+
+	ctx = opendb(rulesa, NRELEM(rulesa));
+
+	/* one rule kept, one changed, one removed and one added */
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == 0);
+	assert(changed == 3);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rules));
+
+	assert(whichlist(ctx, &list, 0, 1) == 0);
+	assert(list == 'B');
+	assert(whichlist(ctx, &list, 0, 0) == 0);	/* "@." is gone */
+	assert(list == 'G');
+	assert(whichlist(ctx, &list, 1, 2) == 0);	/* "%A +qux" is gone */
+	assert(list == 'G');
+	assert(whichlist(ctx, &list, 3, 0) == 0);
+	assert(list == 'W');
+
+	/* nothing changes the second time */
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == 0);
+	assert(changed == 0);
+
+	/* an invalid rule leaves the database alone */
+	rules[1].aclrulesize = 0;
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == -1);
+	assert(failed == 1);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rules));
+	assert(whichlist(ctx, &list, 1, 1) == 0);
+	assert(list == 'W');
+
+	/* a key that is repeated leaves the database alone */
+	rules[1].aclrulesize = strlen(rulesc[1].aclrule);
+	rules[2].remotesel = rules[0].remotesel;
+	rules[2].remoteselsize = rules[0].remoteselsize;
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == -1);
+	assert(failed == 2);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rules));
+	assert(whichlist(ctx, &list, 3, 0) == 0);
+	assert(list == 'W');
+
+	/* and fails a bulk import at the repeated key */
+	assert(a2acl_putaclrules(ctx, rules, NRELEM(rules), &failed) == -1);
+	assert(failed == 0);
+	assert(a2acl_syncaclrules(ctx, rules, 0, &changed, &failed) == 0);
+	assert(a2acl_putaclrules(ctx, rules, NRELEM(rules), &failed) == -1);
+	assert(failed == 2);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == 2);
+	rules[2].remotesel = rulesc[2].remotesel;
+	rules[2].remoteselsize = strlen(rulesc[2].remotesel);
+
+	/* all rules are removed */
+	assert(a2acl_syncaclrules(ctx, rules, 0, &changed, &failed) == 0);
+	assert(changed == 2);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == 0);
+
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * A policy is imported without leaving files behind, since the dbm backend
+ * doesn't store anything on disk.
+ */
+void
+test_a2acl_fromfile(void)
+{
+	char policy[] = "/tmp/testa2acldbm.XXXXXX", dbcache[sizeof(policy) + 3];
+	char errstr[100];
+	a2acl_ctx *ctx;
+	size_t tot, upd;
+	FILE *fp;
+	int fd;
+
+	if ((fd = mkstemp(policy)) == -1)
+		err(1, "mkstemp");
+	if ((fp = fdopen(fd, "w")) == NULL)
+		err(1, "fdopen");
+	fprintf(fp, "%s %s %s\n%s %s %s\n", rulesa[0].remotesel,
+	    rulesa[0].localid, rulesa[0].aclrule, rulesa[1].remotesel,
+	    rulesa[1].localid, rulesa[1].aclrule);
+	if (fclose(fp) == EOF)
+		err(1, "fclose");
+
+	assert(a2acl_fromfile(&ctx, policy, &tot, &upd, errstr,
+	    sizeof(errstr)) == 0);
+	assert(tot == 2);
+	assert(upd == 2);
+	assert(a2acl_dbclose(ctx) == 0);
+
+	snprintf(dbcache, sizeof(dbcache), "%s.db", policy);
+	assert(access(dbcache, F_OK) == -1);
+
+	unlink(policy);
+}
+
+/*
+ * Lookups of keys that are not in the database are mostly answered by the
+ * Bloom filter, without changing the outcome.
+ */
+void
+test_a2acl_stats(void)
+{
+	struct a2aclstats stats;
+	a2acl_ctx *ctx;
+	size_t i, j;
+	char list;
+
+	ctx = opendb(rulesa, NRELEM(rulesa));
+
+	assert(a2acl_stats(ctx, &stats) == 0);
+	assert(stats.probes == 0);
+	assert(stats.fprate == 0);
+
+	for (i = 0; i < NRELEM(remotestrs); i++) {
+		for (j = 0; j < NRELEM(localstrs); j++) {
+			assert(whichlist(ctx, &list, i, j) == 0);
+			assert(list == expa[i][j]);
+		}
+	}
+
+	assert(a2acl_stats(ctx, &stats) == 0);
+	assert(stats.probes > NRELEM(remotestrs) * NRELEM(localstrs));
+	assert(stats.skipped > 0);
+	assert(stats.skipped + stats.falsepos < stats.probes);
+	assert(stats.fprate < 0.5);
+
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * Storing a rule with a key that is already in the database fails and leaves
+ * the stored rule alone, and rules can still be found after the table grew many
+ * times.
+ */
+void
+test_a2acl_table(void)
+{
+	char remotesel[100], aclrule[100], buf[100];
+	a2acl_ctx *ctx;
+	size_t i, n, bufsize;
+	int len;
+
+	ctx = opendb(rulesa, NRELEM(rulesa));
+
+	assert(a2acl_putaclrule(ctx, "%W +", 4, rulesa[0].remotesel,
+	    strlen(rulesa[0].remotesel), rulesa[0].localid,
+	    strlen(rulesa[0].localid)) == -1);
+	assert(errno == EEXIST);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rulesa));
+
+	bufsize = sizeof(buf);
+	assert(a2acl_getaclrule(ctx, buf, &bufsize, rulesa[0].remotesel,
+	    strlen(rulesa[0].remotesel), rulesa[0].localid,
+	    strlen(rulesa[0].localid)) == 0);
+	assert(bufsize == strlen(rulesa[0].aclrule));
+	assert(memcmp(buf, rulesa[0].aclrule, bufsize) == 0);
+
+	for (i = 0; i < 5000; i++) {
+		len = snprintf(remotesel, sizeof(remotesel), "u%zu@example.org",
+		    i);
+		snprintf(aclrule, sizeof(aclrule), "%%W +%zu", i);
+		assert(a2acl_putaclrule(ctx, aclrule, strlen(aclrule),
+		    remotesel, len, "foo@example.net", 15) == 0);
+	}
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rulesa) + 5000);
+
+	for (i = 0; i < 5000; i++) {
+		len = snprintf(remotesel, sizeof(remotesel), "u%zu@example.org",
+		    i);
+		snprintf(aclrule, sizeof(aclrule), "%%W +%zu", i);
+		bufsize = sizeof(buf);
+		assert(a2acl_getaclrule(ctx, buf, &bufsize, remotesel, len,
+		    "foo@example.net", 15) == 0);
+		assert(bufsize == strlen(aclrule));
+		assert(memcmp(buf, aclrule, bufsize) == 0);
+	}
+
+	bufsize = sizeof(buf);
+	assert(a2acl_getaclrule(ctx, buf, &bufsize, "u5000@example.org", 17,
+	    "foo@example.net", 15) == 0);
+	assert(bufsize == 0);
+
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * Several keys are looked up at once, and a lookup continues after a rule that
+ * does not match with the next generalization of the remote id.
+ */
+void
+test_a2acl_viewaclrules(void)
+{
+	struct a2aclkey keys[] = {
+		{ "a@example.com", 13, "foo@example.net", 15 },
+		{ "@example.com", 12, "foo@example.net", 15 },
+		{ "@.", 2, "foo@example.net", 15 },
+	};
+	const char *aclrule;
+	char buf[A2ID_MAXSZ], list;
+	a2acl_ctx *ctx;
+	a2id remoteid, localid;
+	size_t aclrulesize, idx;
+
+	ctx = opendb(rulesa, NRELEM(rulesa));
+
+	assert(a2acl_beginread(ctx) == 0);
+
+	assert(a2acl_viewaclrules(ctx, &idx, &aclrule, &aclrulesize, keys,
+	    NRELEM(keys)) == 0);
+	assert(idx == 1);
+	assert(aclrulesize > 0);
+
+	assert(a2acl_viewaclrules(ctx, &idx, &aclrule, &aclrulesize, keys,
+	    1) == 0);
+	assert(idx == 1);
+	assert(aclrulesize == 0);
+
+	assert(a2acl_endread(ctx) == 0);
+
+	/* the rule of baz@example.com does not match, that of @example.com does */
+	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1)
+		abort();
+	assert(a2acl_whichlist(ctx, &list, &remoteid, &localids[2]) == 0);
+	assert(list == 'A');
+	a2id_tostr(buf, sizeof(buf), &remoteid);
+	assert(strcmp(buf, "@example.com") == 0);
+
+	/* no rule is found, the remote id is fully generalized */
+	if (a2id_fromstr(&remoteid, "baz@example.com", 0) == -1 ||
+	    a2id_fromstr(&localid, "bar@example.net", 0) == -1)
+		abort();
+	assert(a2acl_whichlist(ctx, &list, &remoteid, &localid) == 0);
+	assert(list == 'G');
+	a2id_tostr(buf, sizeof(buf), &remoteid);
+	assert(strcmp(buf, "@.") == 0);
+
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * Do all lookups over and over again in both databases. Return the number of
+ * lookups that failed or gave a different result than in one thread.
+ */
+static void *
+stress(void *arg)
+{
+	a2id remoteid;
+	size_t *failed, i, j;
+	char list;
+	int r;
+
+	failed = arg;
+
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NRELEM(remotestrs); i++) {
+			for (j = 0; j < NRELEM(localstrs); j++) {
+				if (whichlist(ctxa, &list, i, j) == -1 ||
+				    list != expa[i][j])
+					(*failed)++;
+
+				if (a2id_fromstr(&remoteid, remotestrs[i],
+				    0) == -1)
+					abort();
+				if (a2acl_whichlist_const(ctxb, &list,
+				    &remoteid, &localids[j]) == -1 ||
+				    list != expb[i][j])
+					(*failed)++;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void
+test_a2acl_threads(void)
+{
+	pthread_t threads[NRTHREADS];
+	size_t failed[NRTHREADS];
+	int i;
+
+	for (i = 0; i < NRTHREADS; i++) {
+		failed[i] = 0;
+		if (pthread_create(&threads[i], NULL, stress, &failed[i]) != 0)
+			err(1, "pthread_create");
+	}
+
+	for (i = 0; i < NRTHREADS; i++) {
+		if (pthread_join(threads[i], NULL) != 0)
+			err(1, "pthread_join");
+		assert(failed[i] == 0);
+	}
+
+	assert(a2acl_dbclose(ctxa) == 0);
+	assert(a2acl_dbclose(ctxb) == 0);
+}
+
+int
+main(void)
+{
+	test_a2acl_ctx();
+	test_a2acl_stats();
+	test_a2acl_table();
+	test_a2acl_viewaclrules();
+	test_a2acl_threads();
+	test_a2acl_sync();
+	test_a2acl_fromfile();
+
+	return 0;
+}
@@ -0,0 +1,845 @@
+/*
+ * Copyright (c) 2019 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Tests of a2acl with the LMDB backend, including lookups from several threads
+ * on the same databases. The records of a database are also inspected with
+ * LMDB itself, but only while no context has the database open, since LMDB
+ * does not support opening the same environment twice in one process.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <lmdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/a2acl.h"
+
+#define NRTHREADS 8
+#define ROUNDS 2000
+#define NRRULES 150000	/* more than one chunk of a bulk import */
+#define NRELEM(x) (sizeof(x) / sizeof((x)[0]))
+
+struct rule {
+	const char *remotesel, *localid, *aclrule;
+};
+
+static const struct rule rulesa[] = {
+	{ "baz@example.com", "foo@example.net", "%B +bar" },
+	{ "@example.com", "foo@example.net", "%W +bar %A +qux" },
+	{ "@.", "foo@example.net", "%B +" },
+};
+
+static const struct rule rulesb[] = {
+	{ "@example.com", "foo@example.net", "%A +bar" },
+};
+
+static const char *remotestrs[] = {
+	"baz@example.com", "qux@example.com", "baz@sub.example.com",
+	"a+b@example.org", "BAZ@Example.com"
+};
+
+static const char *localstrs[] = {
+	"foo@example.net", "foo+bar@example.net", "foo+qux@example.net",
+	"foo+bar+x@example.net"
+};
+
+/* the records that are not rules, see src/a2acl_dblmdb.c */
+static const char layoutkey[] = "\0a2acl layout";
+static const char valueskey[] = "\0a2acl values";
+
+static char dir[] = "/tmp/testa2acllmdb.XXXXXX";
+static a2acl_ctx *ctxa, *ctxb;
+static a2id localids[NRELEM(localstrs)];
+static char expa[NRELEM(remotestrs)][NRELEM(localstrs)];
+static char expb[NRELEM(remotestrs)][NRELEM(localstrs)];
+
+/*
+ * Set "path" to the file "name" in the directory of the test.
+ */
+static void
+testpath(char *path, size_t pathsize, const char *name)
+{
+	if ((size_t)snprintf(path, pathsize, "%s/%s", dir, name) >= pathsize)
+		errx(1, "path too long");
+}
+
+/*
+ * Set "rules" to the rules in "src".
+ */
+static void
+torules(struct a2aclrule *rules, const struct rule *src, size_t nrules)
+{
+	size_t i;
+
+	for (i = 0; i < nrules; i++) {
+		rules[i].remotesel = src[i].remotesel;
+		rules[i].remoteselsize = strlen(src[i].remotesel);
+		rules[i].localid = src[i].localid;
+		rules[i].localidsize = strlen(src[i].localid);
+		rules[i].aclrule = src[i].aclrule;
+		rules[i].aclrulesize = strlen(src[i].aclrule);
+	}
+}
+
+/*
+ * Open the database "name" and store "nrules" rules with one bulk import.
+ */
+static a2acl_ctx *
+opendb(const char *name, const struct rule *src, size_t nrules)
+{
+	struct a2aclrule rules[10];
+	char path[100];
+	a2acl_ctx *ctx;
+	size_t n, failed;
+
+	assert(nrules <= NRELEM(rules));
+	torules(rules, src, nrules);
+
+	testpath(path, sizeof(path), name);
+	if (a2acl_dbopen(&ctx, path) == -1)
+		abort();
+
+	assert(a2acl_putaclrules(ctx, rules, nrules, &failed) == 0);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == nrules);
+
+	return ctx;
+}
+
+/*
+ * Copy the value of the record with "key" of "keysize" bytes in the database
+ * "name" into "buf", with LMDB itself.
+ *
+ * Return the size of the value, 0 if there is no such record.
+ */
+static size_t
+rawget(const char *name, const void *key, size_t keysize, char *buf,
+    size_t bufsize)
+{
+	MDB_env *env;
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_val k, v;
+	char path[100];
+	int r;
+
+	testpath(path, sizeof(path), name);
+	if (mdb_env_create(&env) != 0 ||
+	    mdb_env_open(env, path, MDB_NOSUBDIR | MDB_RDONLY, 0640) != 0 ||
+	    mdb_txn_begin(env, NULL, MDB_RDONLY, &txn) != 0 ||
+	    mdb_dbi_open(txn, NULL, 0, &dbi) != 0)
+		errx(1, "can't open %s", path);
+
+	k.mv_data = (void *)key;
+	k.mv_size = keysize;
+	v.mv_size = 0;
+	if ((r = mdb_get(txn, dbi, &k, &v)) == 0) {
+		assert(v.mv_size <= bufsize);
+		memcpy(buf, v.mv_data, v.mv_size);
+	} else if (r != MDB_NOTFOUND) {
+		errx(1, "mdb_get: %s", mdb_strerror(r));
+	}
+
+	mdb_txn_abort(txn);
+	mdb_env_close(env);
+
+	return r == 0 ? v.mv_size : 0;
+}
+
+/*
+ * Write the rules in "src" to a new database "name" the way the first version
+ * of the backend did: keys of the form "remotesel localid\0" and values with
+ * the size and contents of the remote selector, local ID and ACL rule, each
+ * size in a size_t of which only the first byte was written.
+ */
+static void
+writebaseline(const char *name, const struct rule *src, size_t nrules)
+{
+	MDB_env *env;
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	char path[100], keybuf[100], valbuf[200], *cp;
+	const char *parts[3];
+	size_t i, j, n;
+
+	testpath(path, sizeof(path), name);
+	if (mdb_env_create(&env) != 0 ||
+	    mdb_env_open(env, path, MDB_NOSUBDIR, 0640) != 0 ||
+	    mdb_txn_begin(env, NULL, 0, &txn) != 0 ||
+	    mdb_dbi_open(txn, NULL, 0, &dbi) != 0)
+		errx(1, "can't create %s", path);
+
+	for (i = 0; i < nrules; i++) {
+		n = snprintf(keybuf, sizeof(keybuf), "%s %s", src[i].remotesel,
+		    src[i].localid);
+		key.mv_data = keybuf;
+		key.mv_size = n + 1;
+
+		/* the rest of each size_t was never written */
+		memset(valbuf, 0xa5, sizeof(valbuf));
+		parts[0] = src[i].remotesel;
+		parts[1] = src[i].localid;
+		parts[2] = src[i].aclrule;
+		cp = valbuf;
+		for (j = 0; j < 3; j++) {
+			n = strlen(parts[j]);
+			*cp = n;
+			cp += sizeof(size_t);
+			memcpy(cp, parts[j], n);
+			cp += n;
+		}
+		data.mv_data = valbuf;
+		data.mv_size = cp - valbuf;
+
+		if (mdb_put(txn, dbi, &key, &data, 0) != 0)
+			errx(1, "mdb_put");
+	}
+
+	if (mdb_txn_commit(txn) != 0)
+		errx(1, "mdb_txn_commit");
+	mdb_env_close(env);
+}
+
+/*
+ * Return the ACL rule in "data", a value that was read with rawget, the way
+ * the first version of the backend reads it: each size from the first byte of
+ * its size_t. The size of the ACL rule is returned in "aclrulesize".
+ */
+static const char *
+readbaseline(const char *data, size_t *aclrulesize)
+{
+	const char *cp;
+
+	cp = data;
+	cp += *cp + sizeof(size_t);
+	cp += *cp + sizeof(size_t);
+	*aclrulesize = *cp;
+	return cp + sizeof(size_t);
+}
+
+/*
+ * Write "nrules" rules to the policy file "name".
+ */
+static void
+writepolicy(const char *name, const struct rule *rules, size_t nrules)
+{
+	char path[100];
+	FILE *fp;
+	size_t i;
+
+	testpath(path, sizeof(path), name);
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "fopen");
+	for (i = 0; i < nrules; i++)
+		fprintf(fp, "%s %s %s\n", rules[i].remotesel, rules[i].localid,
+		    rules[i].aclrule);
+	if (fclose(fp) == EOF)
+		err(1, "fclose");
+}
+
+/*
+ * Return the number of files in the directory of the test of which the name
+ * starts with "prefix".
+ */
+static size_t
+countfiles(const char *prefix)
+{
+	struct dirent *de;
+	DIR *dp;
+	size_t n;
+
+	if ((dp = opendir(dir)) == NULL)
+		err(1, "opendir");
+
+	n = 0;
+	while ((de = readdir(dp)) != NULL)
+		if (strncmp(de->d_name, prefix, strlen(prefix)) == 0)
+			n++;
+	closedir(dp);
+
+	return n;
+}
+
+/*
+ * Remove all files in the directory of the test, and the directory.
+ */
+static void
+removeall(void)
+{
+	struct dirent *de;
+	char path[100];
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL)
+		err(1, "opendir");
+
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		testpath(path, sizeof(path), de->d_name);
+		unlink(path);
+	}
+	closedir(dp);
+
+	rmdir(dir);
+}
+
+/*
+ * Determine the list of each pair with a freshly parsed remote id.
+ */
+static int
+whichlist(a2acl_ctx *ctx, char *list, size_t remote, size_t local)
+{
+	a2id remoteid;
+
+	if (a2id_fromstr(&remoteid, remotestrs[remote], 0) == -1)
+		return -1;
+
+	return a2acl_whichlist(ctx, list, &remoteid, &localids[local]);
+}
+
+/*
+ * Two databases can be open at the same time.
+ */
+void
+test_a2acl_ctx(void)
+{
+	size_t i, j;
+
+	ctxa = opendb("a.db", rulesa, NRELEM(rulesa));
+	ctxb = opendb("b.db", rulesb, NRELEM(rulesb));
+
+	for (j = 0; j < NRELEM(localstrs); j++)
+		if (a2id_fromstr(&localids[j], localstrs[j], 0) == -1)
+			abort();
+
+	for (i = 0; i < NRELEM(remotestrs); i++) {
+		for (j = 0; j < NRELEM(localstrs); j++) {
+			assert(whichlist(ctxa, &expa[i][j], i, j) == 0);
+			assert(whichlist(ctxb, &expb[i][j], i, j) == 0);
+		}
+	}
+
+	/* baz@example.com */
+	assert(expa[0][0] == 'B');
+	assert(expa[0][1] == 'B');
+	assert(expa[0][2] == 'A');
+	assert(expb[0][0] == 'G');
+	assert(expb[0][1] == 'A');
+	assert(expb[0][2] == 'G');
+
+	/* qux@example.com */
+	assert(expa[1][1] == 'W');
+	assert(expa[1][2] == 'A');
+	assert(expb[1][1] == 'A');
+
+	/* a+b@example.org */
+	assert(expa[3][1] == 'B');
+	assert(expb[3][1] == 'G');
+}
+
+/*
+ * Reads nest, only a lookup within a read is allowed and a read can't end
+ * more often than it began.
+ */
+void
+test_a2acl_reads(void)
+{
+	const char *aclrule;
+	size_t aclrulesize;
+
+	assert(a2acl_endread(ctxa) == -1);
+	assert(a2acl_viewaclrule(ctxa, &aclrule, &aclrulesize,
+	    "baz@example.com", 15, "foo@example.net", 15) == -1);
+
+	assert(a2acl_beginread(ctxa) == 0);
+	assert(a2acl_beginread(ctxa) == 0);
+	assert(a2acl_viewaclrule(ctxa, &aclrule, &aclrulesize,
+	    "baz@example.com", 15, "foo@example.net", 15) == 0);
+	assert(aclrulesize > 0);
+	assert(a2acl_endread(ctxa) == 0);
+
+	/* still in the outer read */
+	assert(a2acl_viewaclrule(ctxa, &aclrule, &aclrulesize,
+	    "qux@example.com", 15, "foo@example.net", 15) == 0);
+	assert(aclrulesize == 0);
+	assert(a2acl_endread(ctxa) == 0);
+
+	assert(a2acl_endread(ctxa) == -1);
+}
+
+/*
+ * A new database gets keys that start with the local ID followed by the remote
+ * selector with the labels of its domain reversed, and values that are only the
+ * compiled ACL rule after a format byte and its size.
+ */
+void
+test_a2acl_layout(void)
+{
+	static const char key[] = "foo@example.net\0com.example@baz";
+	a2acl_ctx *ctx;
+	char path[100], buf[100];
+	size_t n, bufsize;
+
+	ctx = opendb("layout.db", rulesa, NRELEM(rulesa));
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(rawget("layout.db", layoutkey, sizeof(layoutkey), buf,
+	    sizeof(buf)) == 1);
+	assert(buf[0] == 'L');
+	assert(rawget("layout.db", valueskey, sizeof(valueskey), buf,
+	    sizeof(buf)) == 1);
+	assert(buf[0] == 1);
+
+	n = rawget("layout.db", key, sizeof(key) - 1, buf, sizeof(buf));
+	assert(n > 2);
+	assert(buf[0] == 1);
+	assert((size_t)buf[1] == n - 2);
+
+	/* "@." has an empty domain and local part */
+	n = rawget("layout.db", "foo@example.net\0.@", 18, buf, sizeof(buf));
+	assert(n > 2);
+
+	/* the old layout is not used */
+	assert(rawget("layout.db", "baz@example.com foo@example.net", 32, buf,
+	    sizeof(buf)) == 0);
+
+	/* and the layout is kept when the database is opened again */
+	testpath(path, sizeof(path), "layout.db");
+	assert(a2acl_dbopen(&ctx, path) == 0);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rulesa));
+	bufsize = sizeof(buf);
+	assert(a2acl_getaclrule(ctx, buf, &bufsize, "baz@example.com", 15,
+	    "foo@example.net", 15) == 0);
+	assert(bufsize > 0);
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * Set "rule" to rule "i" of the bulk imports, of which the remote selector is
+ * stored in "remotesel" and the ACL rule in "aclrule".
+ */
+static void
+bulkrule(struct a2aclrule *rule, char *remotesel, char *aclrule, size_t i)
+{
+	snprintf(remotesel, 30, "u%zu@example.org", i);
+	snprintf(aclrule, 30, "%%W +%zu", i);
+	rule->remotesel = remotesel;
+	rule->remoteselsize = strlen(remotesel);
+	rule->localid = "foo@example.net";
+	rule->localidsize = 15;
+	rule->aclrule = aclrule;
+	rule->aclrulesize = strlen(aclrule);
+}
+
+/*
+ * Many rules are stored with one bulk import into an empty database, in more
+ * than one chunk, and then interleaved with the rules of a second import.
+ * A key that is stored already or repeated fails an import at the rule with
+ * that key.
+ */
+void
+test_a2acl_bulk(void)
+{
+	static char remotesels[NRRULES / 2][30], aclrules[NRRULES / 2][30];
+	static struct a2aclrule rules[NRRULES / 2];
+	struct a2aclrule some[3];
+	struct a2aclstats stats;
+	a2acl_ctx *ctx;
+	char somesels[2][30], someaclrules[2][30];
+	char path[100], remotesel[30], buf[100];
+	size_t i, n, failed, bufsize;
+	int len;
+
+	/* the even rules, not in the order of their keys */
+	for (i = 0; i < NRRULES / 2; i++)
+		bulkrule(&rules[i], remotesels[i], aclrules[i],
+		    2 * ((i * 7919) % (NRRULES / 2)));
+
+	testpath(path, sizeof(path), "bulk.db");
+	assert(a2acl_dbopen(&ctx, path) == 0);
+
+	assert(a2acl_putaclrules(ctx, rules, NRRULES / 2, &failed) == 0);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRRULES / 2);
+
+	/* a key that is stored already */
+	bulkrule(&some[0], somesels[0], someaclrules[0], 1);
+	some[1] = rules[7];
+	assert(a2acl_putaclrules(ctx, some, 2, &failed) == -1);
+	assert(failed == 1);
+
+	/* a key that is repeated within the import */
+	bulkrule(&some[1], somesels[1], someaclrules[1], 3);
+	some[2] = some[0];
+	assert(a2acl_putaclrules(ctx, some, 3, &failed) == -1);
+	assert(failed == 2);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRRULES / 2);
+
+	/* the odd rules go in between */
+	for (i = 0; i < NRRULES / 2; i++)
+		bulkrule(&rules[i], remotesels[i], aclrules[i],
+		    2 * ((i * 7919) % (NRRULES / 2)) + 1);
+	assert(a2acl_putaclrules(ctx, rules, NRRULES / 2, &failed) == 0);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRRULES);
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(a2acl_dbopen(&ctx, path) == 0);
+	for (i = 0; i < NRRULES; i++) {
+		len = snprintf(remotesel, sizeof(remotesel), "u%zu@example.org",
+		    i);
+		bufsize = sizeof(buf);
+		assert(a2acl_getaclrule(ctx, buf, &bufsize, remotesel, len,
+		    "foo@example.net", 15) == 0);
+		assert(bufsize > 0);
+
+		len = snprintf(remotesel, sizeof(remotesel), "v%zu@example.org",
+		    i);
+		bufsize = sizeof(buf);
+		assert(a2acl_getaclrule(ctx, buf, &bufsize, remotesel, len,
+		    "foo@example.net", 15) == 0);
+		assert(bufsize == 0);
+	}
+
+	/* the Bloom filter is built again after each import */
+	assert(a2acl_stats(ctx, &stats) == 0);
+	assert(stats.probes == 2 * NRRULES);
+	assert(stats.skipped > NRRULES * 9 / 10);
+
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * Updating a database only changes the rules that differ, and a policy with an
+ * invalid or repeated rule leaves the database alone.
+ */
+void
+test_a2acl_sync(void)
+{
+	static const struct rule rulesc[] = {
+		{ "baz@example.com", "foo@example.net", "%B +bar" },
+		{ "@example.com", "foo@example.net", "%W +bar" },
+		{ "@example.org", "foo@example.net", "%W +" },
+	};
+	struct a2aclrule rules[NRELEM(rulesc)];
+	a2acl_ctx *ctx;
+	size_t changed, failed, n;
+	char list;
+
+	torules(rules, rulesc, NRELEM(rulesc));
+
+	ctx = opendb("sync.db", rulesa, NRELEM(rulesa));
+
+	/* one rule kept, one changed, one removed and one added */
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == 0);
+	assert(changed == 3);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rules));
+
+	assert(whichlist(ctx, &list, 0, 1) == 0);
+	assert(list == 'B');
+	assert(whichlist(ctx, &list, 0, 0) == 0);	/* "@." is gone */
+	assert(list == 'G');
+	assert(whichlist(ctx, &list, 1, 2) == 0);	/* "%A +qux" is gone */
+	assert(list == 'G');
+	assert(whichlist(ctx, &list, 3, 0) == 0);
+	assert(list == 'W');
+
+	/* nothing changes the second time */
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == 0);
+	assert(changed == 0);
+
+	/* an invalid rule leaves the database alone */
+	rules[1].aclrulesize = 0;
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == -1);
+	assert(failed == 1);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rules));
+	assert(whichlist(ctx, &list, 1, 1) == 0);
+	assert(list == 'W');
+
+	/* and so does a key that is repeated */
+	rules[1].aclrulesize = strlen(rulesc[1].aclrule);
+	rules[2].remotesel = rules[0].remotesel;
+	rules[2].remoteselsize = rules[0].remoteselsize;
+	assert(a2acl_syncaclrules(ctx, rules, NRELEM(rules), &changed,
+	    &failed) == -1);
+	assert(failed == 2);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rules));
+	assert(whichlist(ctx, &list, 3, 0) == 0);
+	assert(list == 'W');
+
+	/* all rules are removed */
+	assert(a2acl_syncaclrules(ctx, rules, 0, &changed, &failed) == 0);
+	assert(changed == NRELEM(rules));
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == 0);
+
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * A database of the first version of the backend is never converted, so that
+ * the first version can still read it. Its values are read in place and new
+ * values are written in the same format, with the ACL rule in text form. A
+ * policy cache of that version is brought up to date in place.
+ */
+void
+test_a2acl_migrate(void)
+{
+	a2acl_ctx *ctx;
+	const char *rule;
+	char buf[100], path[100], longsel[200], list;
+	size_t n, tot, upd, bufsize, rulesize;
+
+	writebaseline("old.db", rulesa, NRELEM(rulesa));
+
+	testpath(path, sizeof(path), "old.db");
+	assert(a2acl_dbopen(&ctx, path) == 0);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rulesa));
+
+	/* the ACL rule of the old value, as it was stored */
+	bufsize = sizeof(buf);
+	assert(a2acl_getaclrule(ctx, buf, &bufsize, "baz@example.com", 15,
+	    "foo@example.net", 15) == 0);
+	assert(bufsize == 7);
+	assert(memcmp(buf, "%B +bar", 7) == 0);
+
+	assert(a2acl_putaclrule(ctx, "%W +qux", 7, "qux@example.com", 15,
+	    "foo@example.net", 15) == 0);
+
+	/* too long for a size in the first byte */
+	memset(longsel, 'a', sizeof(longsel));
+	memcpy(&longsel[sizeof(longsel) - 12], "@example.com", 12);
+	assert(a2acl_putaclrule(ctx, "%W +qux", 7, longsel, sizeof(longsel),
+	    "foo@example.net", 15) == -1);
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(rawget("old.db", valueskey, sizeof(valueskey), buf,
+	    sizeof(buf)) == 0);
+	assert(rawget("old.db", layoutkey, sizeof(layoutkey), buf,
+	    sizeof(buf)) == 0);
+
+	/* the old value is untouched */
+	assert(rawget("old.db", "baz@example.com foo@example.net", 32, buf,
+	    sizeof(buf)) == 3 * sizeof(size_t) + 15 + 15 + 7);
+	assert(buf[1] == (char)0xa5);
+	rule = readbaseline(buf, &rulesize);
+	assert(rulesize == 7);
+	assert(memcmp(rule, "%B +bar", 7) == 0);
+
+	/* the new value is of the old format */
+	assert(rawget("old.db", "qux@example.com foo@example.net", 32, buf,
+	    sizeof(buf)) == 3 * sizeof(size_t) + 15 + 15 + 7);
+	assert(buf[1] == 0);
+	rule = readbaseline(buf, &rulesize);
+	assert(rulesize == 7);
+	assert(memcmp(rule, "%W +qux", 7) == 0);
+
+	/* an old policy cache is updated in place */
+	writebaseline("policy.db", rulesa, NRELEM(rulesa));
+	writepolicy("policy", rulesa, NRELEM(rulesa));
+
+	testpath(path, sizeof(path), "policy");
+	assert(a2acl_fromfile(&ctx, path, &tot, &upd, NULL, 0) == 0);
+	assert(tot == NRELEM(rulesa));
+	assert(upd == 0);	/* the same text */
+	assert(whichlist(ctx, &list, 0, 0) == 0);
+	assert(list == 'B');
+	assert(whichlist(ctx, &list, 1, 1) == 0);
+	assert(list == 'W');
+	assert(whichlist(ctx, &list, 3, 0) == 0);
+	assert(list == 'B');
+	assert(a2acl_dbclose(ctx) == 0);
+
+	writepolicy("policy", rulesb, NRELEM(rulesb));
+
+	assert(a2acl_fromfile(&ctx, path, &tot, &upd, NULL, 0) == 0);
+	assert(tot == NRELEM(rulesb));
+	assert(upd == NRELEM(rulesa));	/* one changed, two removed */
+	assert(whichlist(ctx, &list, 1, 1) == 0);
+	assert(list == 'A');
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(rawget("policy.db", valueskey, sizeof(valueskey), buf,
+	    sizeof(buf)) == 0);
+	assert(rawget("policy.db", "@example.com foo@example.net", 29, buf,
+	    sizeof(buf)) == 3 * sizeof(size_t) + 12 + 15 + 7);
+	rule = readbaseline(buf, &rulesize);
+	assert(rulesize == 7);
+	assert(memcmp(rule, "%A +bar", 7) == 0);
+}
+
+/*
+ * A new database is built in a temporary file next to its path and linked into
+ * place once it is installed, which fails if another database was installed
+ * first. A database that is not installed leaves no files behind.
+ */
+void
+test_a2acl_install(void)
+{
+	struct a2aclrule rules[NRELEM(rulesa)];
+	a2acl_ctx *ctx, *other;
+	char path[100], buf[20];
+	size_t failed, n, bufsize;
+
+	torules(rules, rulesa, NRELEM(rulesa));
+	testpath(path, sizeof(path), "new.db");
+
+	assert(a2acl_dbcreate(&ctx, path) == 0);
+	assert(a2acl_putaclrules(ctx, rules, NRELEM(rules), &failed) == 0);
+	assert(access(path, F_OK) == -1 && errno == ENOENT);
+	assert(countfiles("new.db.") == 1);
+
+	/* lookups before the database is installed */
+	bufsize = sizeof(buf);
+	assert(a2acl_getaclrule(ctx, buf, &bufsize, "baz@example.com", 15,
+	    "foo@example.net", 15) == 0);
+	assert(bufsize > 0);
+
+	assert(a2acl_dbcreate(&other, path) == 0);
+	assert(countfiles("new.db.") == 2);
+
+	assert(a2acl_dbinstall(ctx) == 0);
+	assert(access(path, F_OK) == 0);
+	assert(countfiles("new.db.") == 1);
+
+	/* opened again at its path */
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRELEM(rules));
+	bufsize = sizeof(buf);
+	assert(a2acl_getaclrule(ctx, buf, &bufsize, "baz@example.com", 15,
+	    "foo@example.net", 15) == 0);
+	assert(bufsize > 0);
+
+	/* the installed database is never replaced */
+	assert(a2acl_dbinstall(other) == -1);
+	assert(errno == EEXIST);
+	assert(a2acl_dbclose(other) == 0);
+	assert(countfiles("new.db.") == 0);
+
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(rawget("new.db", layoutkey, sizeof(layoutkey), buf,
+	    sizeof(buf)) == 1);
+}
+
+/*
+ * Do all lookups over and over again in both databases, with a read of its own
+ * for each lookup and with all lookups of a round in one read. Return the
+ * number of lookups that failed or gave a different result than in one
+ * thread.
+ */
+static void *
+stress(void *arg)
+{
+	a2id remoteid;
+	size_t *failed, i, j;
+	char list;
+	int r;
+
+	failed = arg;
+
+	for (r = 0; r < ROUNDS; r++) {
+		if (r % 2 && a2acl_beginread(ctxa) == -1)
+			(*failed)++;
+
+		for (i = 0; i < NRELEM(remotestrs); i++) {
+			for (j = 0; j < NRELEM(localstrs); j++) {
+				if (whichlist(ctxa, &list, i, j) == -1 ||
+				    list != expa[i][j])
+					(*failed)++;
+
+				if (a2id_fromstr(&remoteid, remotestrs[i],
+				    0) == -1)
+					abort();
+				if (a2acl_whichlist_const(ctxb, &list,
+				    &remoteid, &localids[j]) == -1 ||
+				    list != expb[i][j])
+					(*failed)++;
+			}
+		}
+
+		if (r % 2 && a2acl_endread(ctxa) == -1)
+			(*failed)++;
+	}
+
+	/* all reads of this thread ended */
+	if (a2acl_endread(ctxa) != -1 || a2acl_endread(ctxb) != -1)
+		(*failed)++;
+
+	return NULL;
+}
+
+void
+test_a2acl_threads(void)
+{
+	pthread_t threads[NRTHREADS];
+	size_t failed[NRTHREADS];
+	int i;
+
+	for (i = 0; i < NRTHREADS; i++) {
+		failed[i] = 0;
+		if (pthread_create(&threads[i], NULL, stress, &failed[i]) != 0)
+			err(1, "pthread_create");
+	}
+
+	for (i = 0; i < NRTHREADS; i++) {
+		if (pthread_join(threads[i], NULL) != 0)
+			err(1, "pthread_join");
+		assert(failed[i] == 0);
+	}
+
+	assert(a2acl_dbclose(ctxa) == 0);
+	assert(a2acl_dbclose(ctxb) == 0);
+}
+
+int
+main(void)
+{
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+
+	test_a2acl_ctx();
+	test_a2acl_reads();
+	test_a2acl_threads();
+	test_a2acl_layout();
+	test_a2acl_bulk();
+	test_a2acl_sync();
+	test_a2acl_migrate();
+	test_a2acl_install();
+
+	removeall();
+
+	return 0;
+}
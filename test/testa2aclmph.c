@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2019 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Tests of a2acl with the dbmph backend, which keeps a policy in an immutable
+ * image file.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/a2acl.h"
+
+#define NRRULES 20000
+#define NRELEM(x) (sizeof(x) / sizeof((x)[0]))
+
+struct rule {
+	const char *remotesel, *localid, *aclrule;
+};
+
+static const struct rule rulesa[] = {
+	{ "baz@example.com", "foo@example.net", "%B +bar" },
+	{ "@example.com", "foo@example.net", "%W +bar %A +qux" },
+	{ "@.", "foo@example.net", "%B +" },
+};
+
+static char policy[] = "/tmp/testa2aclmph.XXXXXX";
+static char dbcache[sizeof(policy) + 3];
+
+/*
+ * Write "nrules" rules to the policy file.
+ */
+static void
+writepolicy(const struct rule *rules, size_t nrules)
+{
+	FILE *fp;
+	size_t i;
+
+	if ((fp = fopen(policy, "w")) == NULL)
+		err(1, "fopen");
+	for (i = 0; i < nrules; i++)
+		fprintf(fp, "%s %s %s\n", rules[i].remotesel, rules[i].localid,
+		    rules[i].aclrule);
+	if (fclose(fp) == EOF)
+		err(1, "fclose");
+}
+
+/*
+ * Return the list of the pair "remote" and "local".
+ */
+static char
+whichlist(a2acl_ctx *ctx, const char *remote, const char *local)
+{
+	a2id remoteid, localid;
+	char list;
+
+	if (a2id_fromstr(&remoteid, remote, 0) == -1 ||
+	    a2id_fromstr(&localid, local, 0) == -1)
+		abort();
+
+	assert(a2acl_whichlist(ctx, &list, &remoteid, &localid) == 0);
+	return list;
+}
+
+/*
+ * A policy is compiled to an image next to it, that is used as is by the next
+ * import and by a database that is opened directly.
+ */
+void
+test_a2acl_image(void)
+{
+	char buf[8];
+	a2acl_ctx *ctx;
+	size_t tot, upd;
+	int fd;
+
+	if ((fd = mkstemp(policy)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+	snprintf(dbcache, sizeof(dbcache), "%s.db", policy);
+
+	writepolicy(rulesa, NRELEM(rulesa));
+
+	assert(a2acl_fromfile(&ctx, policy, &tot, &upd, NULL, 0) == 0);
+	assert(tot == NRELEM(rulesa));
+	assert(upd == NRELEM(rulesa));
+	assert(whichlist(ctx, "baz@example.com", "foo@example.net") == 'B');
+	assert(whichlist(ctx, "qux@example.com", "foo+qux@example.net") == 'A');
+	assert(whichlist(ctx, "a@example.org", "foo@example.net") == 'B');
+	assert(whichlist(ctx, "a@example.org", "bar@example.net") == 'G');
+	assert(a2acl_dbclose(ctx) == 0);
+
+	if ((fd = open(dbcache, O_RDONLY)) == -1)
+		err(1, "open");
+	assert(read(fd, buf, sizeof(buf)) == sizeof(buf));
+	assert(memcmp(buf, "A2ACLMPH", sizeof(buf)) == 0);
+	close(fd);
+
+	/* the cache is up to date */
+	assert(a2acl_fromfile(&ctx, policy, &tot, &upd, NULL, 0) == 0);
+	assert(tot == NRELEM(rulesa));
+	assert(upd == 0);
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(a2acl_dbopen(&ctx, dbcache) == 0);
+	assert(a2acl_count(ctx, &tot) == 0);
+	assert(tot == NRELEM(rulesa));
+	assert(whichlist(ctx, "baz@example.com", "foo+bar@example.net") ==
+	    'B');
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * A changed policy is written to a new image. A database that is still open
+ * keeps seeing the previous one during a read and until it checks for a new
+ * image again, which it does at the next read a second after the last check.
+ */
+void
+test_a2acl_update(void)
+{
+	static const struct rule rulesb[] = {
+		{ "baz@example.com", "foo@example.net", "%W +bar" },
+		{ "@example.com", "foo@example.net", "%W +bar %A +qux" },
+	};
+	a2acl_ctx *old, *ctx;
+	const char *rule;
+	char buf[100];
+	size_t tot, upd, rulesize;
+
+	assert(a2acl_dbopen(&old, dbcache) == 0);
+	assert(a2acl_beginread(old) == 0);
+
+	writepolicy(rulesb, NRELEM(rulesb));
+
+	assert(a2acl_fromfile(&ctx, policy, &tot, &upd, NULL, 0) == 0);
+	assert(tot == NRELEM(rulesb));
+	assert(upd == 2);	/* one changed, one removed */
+	assert(whichlist(ctx, "baz@example.com", "foo+bar@example.net") ==
+	    'W');
+	assert(whichlist(ctx, "a@example.org", "foo@example.net") == 'G');
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(whichlist(old, "baz@example.com", "foo+bar@example.net") ==
+	    'B');
+	assert(a2acl_viewaclrule(old, &rule, &rulesize, "baz@example.com",
+	    15, "foo@example.net", 15) == 0);
+	assert(rulesize > 0 && rulesize <= sizeof(buf));
+	memcpy(buf, rule, rulesize);
+	assert(a2acl_endread(old) == 0);
+
+	/* the rule stays valid until the next read */
+	assert(memcmp(rule, buf, rulesize) == 0);
+
+	/* not checked again yet */
+	assert(whichlist(old, "baz@example.com", "foo+bar@example.net") ==
+	    'B');
+
+	sleep(1);
+	assert(whichlist(old, "baz@example.com", "foo+bar@example.net") ==
+	    'W');
+	assert(whichlist(old, "a@example.org", "foo@example.net") == 'G');
+	assert(a2acl_dbclose(old) == 0);
+
+	assert(a2acl_fromfile(&ctx, policy, &tot, &upd, NULL, 0) == 0);
+	assert(upd == 0);
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * A policy with the same key on two lines is refused at the second line, and
+ * the image is left as it was.
+ */
+void
+test_a2acl_duplicate(void)
+{
+	static const struct rule rulesc[] = {
+		{ "baz@example.com", "foo@example.net", "%W +bar" },
+		{ "@example.com", "foo@example.net", "%W +" },
+		{ "baz@example.com", "foo@example.net", "%B +" },
+	};
+	char errstr[100];
+	a2acl_ctx *ctx;
+	size_t tot, upd;
+
+	writepolicy(rulesc, NRELEM(rulesc));
+
+	assert(a2acl_fromfile(&ctx, policy, &tot, &upd, errstr,
+	    sizeof(errstr)) == -1);
+	assert(strstr(errstr, "#3: baz@example.com") != NULL);
+
+	assert(a2acl_dbopen(&ctx, dbcache) == 0);
+	assert(whichlist(ctx, "baz@example.com", "foo+bar@example.net") ==
+	    'W');
+	assert(whichlist(ctx, "a@example.com", "foo@example.net") == 'G');
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * Every one of many rules is found, rules that are not stored are not found
+ * and a rule that is stored again does not replace the previous one.
+ */
+void
+test_a2acl_many(void)
+{
+	static char remotesels[NRRULES][30], aclrules[NRRULES][20];
+	static struct a2aclrule rules[NRRULES];
+	struct a2aclstats stats;
+	a2acl_ctx *ctx;
+	size_t i, n, failed, bufsize;
+	char buf[20];
+
+	unlink(dbcache);
+
+	for (i = 0; i < NRRULES; i++) {
+		snprintf(remotesels[i], sizeof(remotesels[i]),
+		    "u%zu@example.org", i);
+		snprintf(aclrules[i], sizeof(aclrules[i]), "%%W +%zu", i);
+		rules[i].remotesel = remotesels[i];
+		rules[i].remoteselsize = strlen(remotesels[i]);
+		rules[i].localid = "foo@example.net";
+		rules[i].localidsize = 15;
+		rules[i].aclrule = aclrules[i];
+		rules[i].aclrulesize = strlen(aclrules[i]);
+	}
+
+	assert(a2acl_dbcreate(&ctx, dbcache) == 0);
+	assert(a2acl_putaclrules(ctx, rules, NRRULES, &failed) == 0);
+	assert(a2acl_putaclrule(ctx, "%B +", 4, rules[7].remotesel,
+	    rules[7].remoteselsize, "foo@example.net", 15) == -1);
+	assert(errno == EEXIST);
+	assert(a2acl_putaclrules(ctx, &rules[5], 3, &failed) == -1);
+	assert(failed == 0);
+	assert(a2acl_dbinstall(ctx) == 0);
+	assert(a2acl_count(ctx, &n) == 0);
+	assert(n == NRRULES);
+	assert(a2acl_dbclose(ctx) == 0);
+
+	/* another database can't be installed in its place */
+	assert(a2acl_dbcreate(&ctx, dbcache) == 0);
+	assert(a2acl_dbinstall(ctx) == -1);
+	assert(a2acl_dbclose(ctx) == 0);
+
+	assert(a2acl_dbopen(&ctx, dbcache) == 0);
+	for (i = 0; i < NRRULES; i++) {
+		bufsize = sizeof(buf);
+		assert(a2acl_getaclrule(ctx, buf, &bufsize, rules[i].remotesel,
+		    rules[i].remoteselsize, "foo@example.net", 15) == 0);
+		assert(bufsize == rules[i].aclrulesize);
+		assert(memcmp(buf, rules[i].aclrule, bufsize) == 0);
+	}
+
+	for (i = 0; i < NRRULES; i++) {
+		bufsize = sizeof(buf);
+		assert(a2acl_getaclrule(ctx, buf, &bufsize, rules[i].remotesel,
+		    rules[i].remoteselsize, "bar@example.net", 15) == 0);
+		assert(bufsize == 0);
+	}
+
+	assert(a2acl_stats(ctx, &stats) == 0);
+	assert(stats.probes == 2 * NRRULES);
+	assert(stats.skipped > NRRULES * 9 / 10);
+	assert(stats.fprate < 0.05);
+
+	assert(a2acl_dbclose(ctx) == 0);
+}
+
+/*
+ * An image that is truncated or not an image at all is not opened.
+ */
+void
+test_a2acl_invalid(void)
+{
+	a2acl_ctx *ctx;
+	off_t size;
+	int fd;
+
+	if ((fd = open(dbcache, O_RDWR)) == -1)
+		err(1, "open");
+	if ((size = lseek(fd, 0, SEEK_END)) == -1)
+		err(1, "lseek");
+	if (ftruncate(fd, size - 1) == -1)
+		err(1, "ftruncate");
+	close(fd);
+
+	assert(a2acl_dbopen(&ctx, dbcache) == -1);
+
+	if ((fd = open(dbcache, O_WRONLY|O_TRUNC)) == -1)
+		err(1, "open");
+	assert(write(fd, "not an image", 12) == 12);
+	close(fd);
+
+	assert(a2acl_dbopen(&ctx, dbcache) == -1);
+
+	unlink(dbcache);
+	unlink(policy);
+}
+
+int
+main(void)
+{
+	test_a2acl_image();
+	test_a2acl_update();
+	test_a2acl_duplicate();
+	test_a2acl_many();
+	test_a2acl_invalid();
+
+	return 0;
+}
@@ -15,8 +15,10 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../src/a2id.c"
@@ -335,6 +337,197 @@ test_parsestr(void)
 	assert(parsestr(&id, "foo@example.org.", 1) == 0);
 }
 
+/*
+ * Inputs of the parser and matcher tests, used to compare the different parser
+ * implementations.
+ */
+static const char *corpus[] = {
+	"foo@example.org", "!foo@example.com", "a+b@example.com",
+	"a+b+@example.com", "a+b+c@example.com", "~@example.com",
+	" @example.com", "@", "\x7f@example.com", "+a@example.com",
+	"+@example.com", "a+@example.com", "a++b@example.com",
+	"+a++b@example.com", "++@example.com", "foo! bar~\177@example.com",
+	"@example.com", "user@example.com", "user+subid@example.com",
+	"user+flags+signature@example.com", "+service+arg1+arg2@example.com",
+	"joe@example.com", "fred@foo-9.example.com",
+	"jack@3rd.depts.example.com", "fred.smith@example.com",
+	"fred_smith@example.com", "fred$@example.com",
+	"fred=?#$&*+-/^smith@example.com", "nancy@eng.example.net",
+	"eng.example.net!nancy@example.net", "eng%nancy@example.net",
+	"@privatecorp.example.net", "\\(user\\)@example.net",
+	"<user>@example.net", "alice@xn--tmonesimerkki-bfbb.example.net", "@.",
+	"+@.", "+++++@", "+abc++++@", "+@", "++@", "+++@", "++++@", "G+@",
+	"G++@", "G+++@", "foo+bar++@some.example.org",
+	"foo+bar+other+signflags+@some.example.org", "foo+a@some.example.org",
+	"foo+@some.example.org", "", "joe", "fred@example.net@example.net",
+	"foo@example.org.", "(user)@example.net", "@e.net", "@.com", "@.f",
+	"@.fo", "@n", "@ne", "@net", "@.net", "@net.", "@.net.", "(user)@.",
+	"@example.org", "@.org", "john@example.org", "john@.org", "john@.",
+	"sales+john@example.org", "sales+@example.org", "sales@example.org",
+	"sales+john@.org", "sales+@.org", "sales@.org", "sales+john@.",
+	"sales+@.", "sales@.", "john+singer@example.org", "john+singer@.org",
+	"john+singer@.", "john+option+sig+@example.org",
+	"john++sig+@example.org", "john+option++@example.org",
+	"john++@example.org", "john+sig+@example.org",
+	"john+option@example.org", "john+option+option2++@example.org",
+	"john+@example.org", "john+option@.org", "john+option@.", "@..",
+	"John@.", "jOhn@.", "+smtp@mx1.example.org", "+@mx1.example.org",
+	"+smtp@.example.org", "+@.example.org", "+smtp@.org", "+@.org",
+	"+smtp@.", "@.example.org", "john@.example.org", "john+@.org",
+	"john+@.", "john@nexample.org", "john@example.", "john@.example",
+	"john@.example.", "@...", "sales+john@.example.org",
+	"sales+@.example.org", "sales-@example.org", "+@example.org",
+	"sales+john+@.org", "sales+@.org.sales", "sales@.org.org", "@.org.org",
+	"sales+mary@.", "john@.org.org.", "sales+j@example.org",
+	"sales+joh@example.org", "sales+joh+@example.org",
+	"saless+john@example.org", "sales+john@eexample.org",
+	"sales+johna@example.org", "sales+john+@example.org",
+	"sales.john@example.org", "john+sales@example.org",
+	"salesjohn@example.org", "++@example.org", "+++@example.org",
+	"++++@example.org", "john+option+si@example.org",
+	"john+option+si+@example.org", "joh+@example.org",
+	"johnn+@example.org",
+};
+
+/*
+ * Compare two parse results, including the positions of all parts.
+ */
+static int
+sameparse(const struct a2id *a, const struct a2id *b)
+{
+#define OFF(id, p) ((p) == NULL ? -1 : (p) - (id)->_str)
+	if (a->type != b->type ||
+	    a->hassig != b->hassig ||
+	    a->hasupper != b->hasupper ||
+	    a->emptylabel != b->emptylabel ||
+	    a->nropts != b->nropts ||
+	    a->generalized != b->generalized ||
+	    OFF(a, a->localpart) != OFF(b, b->localpart) ||
+	    OFF(a, a->basename) != OFF(b, b->basename) ||
+	    OFF(a, a->firstopt) != OFF(b, b->firstopt) ||
+	    OFF(a, a->sigflags) != OFF(b, b->sigflags) ||
+	    OFF(a, a->domain) != OFF(b, b->domain) ||
+	    a->localpartlen != b->localpartlen ||
+	    a->basenamelen != b->basenamelen ||
+	    a->firstoptlen != b->firstoptlen ||
+	    a->sigflagslen != b->sigflagslen ||
+	    a->domainlen != b->domainlen ||
+	    a->idlen != b->idlen)
+		return 0;
+#undef OFF
+
+	return memcmp(a->_str, b->_str, a->idlen + 1) == 0;
+}
+
+/* number of inputs parsed by parsemasks and parsechunks in diffparse */
+static size_t nrmasked, nrchunked;
+
+/*
+ * Parse "in" with the reference parser and with every available block
+ * classifier, both nul terminated and length delimited, and make sure all
+ * results are identical.
+ */
+static void
+diffparse(const char *in, int isselector)
+{
+	struct a2id ref, id;
+	size_t len;
+	int r;
+
+	len = strlen(in);
+
+	r = parse(&ref, in, SIZE_MAX, isselector, 1);
+
+	assert(parsestr(&id, in, isselector) == r);
+	assert(sameparse(&ref, &id));
+
+	/* Length delimited input must yield the same result. */
+	assert(parse(&id, in, len, isselector, 1) == r);
+	assert(sameparse(&ref, &id));
+
+#ifdef A2ID_SIMD
+	assert(parseblocks(&id, in, SIZE_MAX, isselector, 1, classify_sse2) == r);
+	assert(sameparse(&ref, &id));
+	assert(parseblocks(&id, in, len, isselector, 1, classify_sse2) == r);
+	assert(sameparse(&ref, &id));
+
+	if (__builtin_cpu_supports("avx2")) {
+		assert(parseblocks(&id, in, SIZE_MAX, isselector, 1,
+		    classify_avx2) == r);
+		assert(sameparse(&ref, &id));
+		assert(parseblocks(&id, in, len, isselector, 1, classify_avx2)
+		    == r);
+		assert(sameparse(&ref, &id));
+	}
+
+	/* parsemasks only handles a subset of the valid IDs. */
+	if (__builtin_cpu_supports("sse2") &&
+	    parsemasks(&id, in, len, isselector, 1) == 0) {
+		assert(r == 0);
+		assert(sameparse(&ref, &id));
+		nrmasked++;
+	}
+
+	/* And so does parsechunks, which only takes length delimited input. */
+	if (__builtin_cpu_supports("sse2") &&
+	    parsechunks(&id, in, len, isselector) == 0) {
+		assert(r == 0);
+		assert(sameparse(&ref, &id));
+		nrchunked++;
+	}
+#endif
+}
+
+void
+test_parsestr_differential(void)
+{
+	const char alphabet[] = "aZ09.+@-_~. +@\x7f\x80\xff";
+	char in[A2ID_MAXLEN + 64];
+	size_t i, j, n;
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		diffparse(corpus[i], 0);
+		diffparse(corpus[i], 1);
+	}
+
+	/* Long runs crossing block boundaries and the maximum length. */
+	for (n = 1; n < sizeof(in); n++) {
+		memset(in, 'a', n);
+		in[n / 2] = '@';
+		in[n] = '\0';
+		diffparse(in, 0);
+		diffparse(in + 1, 1);
+
+		for (j = n / 2 + 8; j < n; j += 9)
+			in[j] = '.';
+		diffparse(in, 0);
+		diffparse(in, 1);
+	}
+
+	/* Random input at every alignment, biased towards special characters. */
+	srand(42);
+	for (i = 0; i < 100000; i++) {
+		n = rand() % 80;
+		if (i % 100 == 0)
+			n = rand() % (sizeof(in) - 1);
+
+		for (j = 0; j < n; j++) {
+			if (rand() % 3)
+				in[j] = alphabet[rand() % 4];
+			else
+				in[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		}
+		in[n] = '\0';
+
+		diffparse(in + (n ? i % n : 0), i & 1);
+	}
+
+#ifdef A2ID_SIMD
+	assert(nrmasked > 1000);
+	assert(nrchunked > 1000);
+#endif
+}
+
 void
 test_parsestr_selector(void)
 {
@@ -664,6 +857,79 @@ test_a2id_generalize(void)
 	assert(strcmp(output, "@.") == 0);
 }
 
+/*
+ * Remove the first label of the domain in the string "id", or the leading dot
+ * of the domain, by moving the rest of the string.
+ */
+static void
+stripfirstlabel(char *id)
+{
+	char *cp;
+	size_t n;
+
+	cp = strchr(id, '@') + 1;
+	if (cp[0] == '\0' || strcmp(cp, ".") == 0)
+		return;
+
+	n = strcspn(cp, ".");
+	if (n == 0)
+		n = 1;
+
+	memmove(cp, cp + n, strlen(cp + n) + 1);
+
+	if (cp[0] == '\0')
+		strcpy(cp, ".");
+}
+
+/*
+ * Generalizing the domain must yield the same ids as removing each label from
+ * the string.
+ */
+void
+test_a2id_generalize_domain(void)
+{
+	const char *extra[] = {
+		"x@ab.c",
+		"@a.b.c.",
+		"@.a..b",
+		"foo+bar@a.bb.ccc.dddd.eeeee.ffffff.ggggggg.hhhhhhhh.org",
+	};
+	a2id id;
+	char exp[A2ID_MAXSZ], out[A2ID_MAXSZ];
+	const char *in, *domain;
+	size_t i, n;
+
+	n = sizeof(corpus) / sizeof(corpus[0]);
+	for (i = 0; i < n + sizeof(extra) / sizeof(extra[0]); i++) {
+		in = i < n ? corpus[i] : extra[i - n];
+
+		if (a2id_fromstr(&id, in, 1) == -1)
+			continue;
+
+		for (;;) {
+			assert(a2id_tostr(exp, sizeof(exp), &id) <
+			    sizeof(exp));
+			domain = ((struct a2id *)&id)->domain;
+
+			if (a2id_generalize(&id) == 0)
+				break;
+
+			/* skip localpart generalizations */
+			if (((struct a2id *)&id)->domain == domain)
+				continue;
+
+			stripfirstlabel(exp);
+			assert(a2id_tostr(out, sizeof(out), &id) <
+			    sizeof(out));
+			assert(strcmp(out, exp) == 0);
+		}
+
+		/* the domain of "@" can not be generalized */
+		assert(strcmp(strchr(exp, '@'), "@.") == 0 ||
+		    strcmp(strchr(exp, '@'), "@") == 0);
+	}
+}
+
 void
 test_a2id_coreform(void)
 {
@@ -721,14 +987,604 @@ test_a2id_localpart_options(void)
 	assert(opts == 1);
 }
 
+void
+test_a2id_fromstr_many(void)
+{
+	const char *in[] = { "foo@example.org", "foo@example.org.", "@.",
+	    "a+b+c@example.com@", NULL, "john+option+sig+@example.org" };
+	size_t inlen[] = { 15, 16, 2, 18, 0, 28 }, erroff[6];
+	a2id out[6], id;
+	char output[128];
+	int status[6];
+	size_t i;
+
+	assert(a2id_fromstr_many(out, status, erroff, in, inlen, 6, 0) == 2);
+	assert(status[0] == 0 && erroff[0] == 15);
+	assert(status[1] == -1 && erroff[1] == 16);
+	assert(status[2] == -1 && erroff[2] == 1);
+	assert(status[3] == -1 && erroff[3] == 17);
+	assert(status[4] == -1 && erroff[4] == 0);
+	assert(status[5] == 0 && erroff[5] == 28);
+
+	assert(a2id_fromstr_many(out, status, NULL, in, inlen, 6, 1) == 4);
+	assert(status[1] == 0 && status[2] == 0);
+
+	for (i = 0; i < 6; i++) {
+		if (status[i] != 0)
+			continue;
+		assert(a2id_fromstr(&id, in[i], 1) == 0);
+		assert(sameparse((struct a2id *)&id, (struct a2id *)&out[i]));
+		assert(a2id_tostr(output, sizeof(output), &out[i]) == inlen[i]);
+		assert(strcmp(output, in[i]) == 0);
+	}
+
+	/* Lengths are honored, an embedded nul is an error. */
+	inlen[0] = 11;
+	assert(a2id_fromstr_many(out, status, erroff, in, inlen, 1, 0) == 1);
+	assert(a2id_tostr(output, sizeof(output), &out[0]) == 11);
+	assert(strcmp(output, "foo@example") == 0);
+
+	in[0] = "foo@exa\0mple.org";
+	inlen[0] = 16;
+	assert(a2id_fromstr_many(out, status, erroff, in, inlen, 1, 0) == 0);
+	assert(erroff[0] == 7);
+}
+
+void
+test_a2id_compact(void)
+{
+	static a2id ids[sizeof(corpus) / sizeof(corpus[0])];
+	static a2id sels[sizeof(corpus) / sizeof(corpus[0])];
+	a2id_compact *cids[sizeof(corpus) / sizeof(corpus[0])];
+	a2id_compact *csels[sizeof(corpus) / sizeof(corpus[0])];
+	struct a2id *id;
+	a2id_compact *cid;
+	a2id full, back;
+	char output[A2ID_MAXSZ], coutput[A2ID_MAXSZ];
+	size_t i, j, n, size;
+	int r;
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		cids[i] = csels[i] = NULL;
+
+		if (a2id_fromstr(&ids[i], corpus[i], 0) == 0) {
+			id = (struct a2id *)&ids[i];
+			size = a2id_tocompact(NULL, 0, &ids[i]);
+			assert(size == sizeof(struct a2id_compact) + id->idlen
+			    + 1);
+			assert((cids[i] = malloc(size)) != NULL);
+			assert(a2id_tocompact(cids[i], size - 1, &ids[i]) ==
+			    size);
+			assert(a2id_tocompact(cids[i], size, &ids[i]) == size);
+			a2id_fromcompact(&back, cids[i]);
+			assert(sameparse(id, (struct a2id *)&back));
+		}
+
+		if (a2id_fromstr(&sels[i], corpus[i], 1) == 0) {
+			size = a2id_tocompact(NULL, 0, &sels[i]);
+			assert((csels[i] = malloc(size)) != NULL);
+			assert(a2id_tocompact(csels[i], size, &sels[i]) == size);
+			a2id_fromcompact(&back, csels[i]);
+			assert(sameparse((struct a2id *)&sels[i],
+			    (struct a2id *)&back));
+		}
+	}
+
+	/* Compact match must yield the same results as a2id_match. */
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		if (cids[i] == NULL)
+			continue;
+
+		for (j = 0; j < sizeof(corpus) / sizeof(corpus[0]); j++) {
+			if (csels[j] == NULL)
+				continue;
+
+			assert(a2id_compact_match(cids[i], csels[j]) ==
+			    a2id_match(&ids[i], &sels[j]));
+		}
+	}
+
+	/*
+	 * Generalize both in lock-step and make sure every step yields the same
+	 * ID, also after converting back and forth in between.
+	 */
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		if ((cid = csels[i]) == NULL)
+			continue;
+
+		full = sels[i];
+		n = 0;
+		do {
+			r = a2id_generalize(&full);
+			assert(a2id_compact_generalize(cid) == r);
+
+			a2id_fromcompact(&back, cid);
+			assert(a2id_tostr(output, sizeof(output), &full) ==
+			    a2id_tostr(coutput, sizeof(coutput), &back));
+			assert(strcmp(output, coutput) == 0);
+
+			for (j = 0; j < sizeof(corpus) / sizeof(corpus[0]);
+			    j++) {
+				if (cids[j] == NULL)
+					continue;
+
+				assert(a2id_compact_match(cids[j], cid) ==
+				    a2id_match(&ids[j], &full));
+			}
+
+			/* Restart from a new compact copy halfway. */
+			if (n++ == 2) {
+				size = a2id_tocompact(NULL, 0, &back);
+				free(cid);
+				assert((cid = malloc(size)) != NULL);
+				assert(a2id_tocompact(cid, size, &back) == size);
+			}
+		} while (r == 1);
+
+		csels[i] = cid;
+	}
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		free(cids[i]);
+		free(csels[i]);
+	}
+}
+
+void
+test_a2id_view(void)
+{
+	static a2id sels[sizeof(corpus) / sizeof(corpus[0])];
+	static int selok[sizeof(corpus) / sizeof(corpus[0])];
+	a2id_view view;
+	a2id id, full;
+	a2id_compact *cid;
+	char buf[A2ID_MAXSZ + 4], orig[A2ID_MAXSZ + 4];
+	char output[A2ID_MAXSZ], foutput[A2ID_MAXSZ];
+	size_t i, j, len, size;
+	int isselector, r;
+
+	assert(sizeof(struct a2id) <= sizeof(a2id));
+	assert(sizeof(struct a2id_view) <= sizeof(a2id_view));
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+		selok[i] = a2id_fromstr(&sels[i], corpus[i], 1) == 0;
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		for (isselector = 0; isselector < 2; isselector++) {
+			/* No terminating nul but trailing garbage. */
+			len = strlen(corpus[i]);
+			memcpy(buf, corpus[i], len);
+			memcpy(&buf[len], "+@.", 4);
+			memcpy(orig, buf, sizeof(buf));
+
+			r = a2id_fromstr(&full, corpus[i], isselector);
+			assert(a2id_view_parse(&view, buf, len, isselector) ==
+			    r);
+			if (r == -1)
+				continue;
+
+			a2id_fromview(&id, &view);
+
+			assert(a2id_tostr(output, sizeof(output), &id) == len);
+			assert(memcmp(output, buf, len) == 0);
+			assert(a2id_coreform(output, sizeof(output), &id) ==
+			    a2id_coreform(foutput, sizeof(foutput), &full));
+			assert(strcmp(output, foutput) == 0);
+			assert(a2id_hassignature(&id) ==
+			    a2id_hassignature(&full));
+
+			for (j = 0; j < sizeof(corpus) / sizeof(corpus[0]);
+			    j++) {
+				if (!selok[j])
+					continue;
+				assert(a2id_match(&id, &sels[j]) ==
+				    a2id_match(&full, &sels[j]));
+				assert(a2id_match(&sels[j], &id) ==
+				    a2id_match(&sels[j], &full));
+			}
+
+			size = a2id_tocompact(NULL, 0, &id);
+			assert(size == a2id_tocompact(NULL, 0, &full));
+			assert((cid = malloc(size)) != NULL);
+			assert(a2id_tocompact(cid, size, &id) == size);
+			a2id_fromcompact(&id, cid);
+			free(cid);
+			assert(sameparse((struct a2id *)&id,
+			    (struct a2id *)&full));
+
+			/* Generalization must not modify the buffer. */
+			a2id_fromview(&id, &view);
+			do {
+				r = a2id_generalize(&full);
+				assert(a2id_generalize(&id) == r);
+				assert(a2id_tostr(output, sizeof(output), &id) ==
+				    a2id_tostr(foutput, sizeof(foutput),
+				    &full));
+				assert(strcmp(output, foutput) == 0);
+			} while (r == 1);
+
+			assert(memcmp(buf, orig, sizeof(buf)) == 0);
+		}
+	}
+
+	/* An embedded nul is an error. */
+	assert(a2id_view_parse(&view, "foo@exa\0mple.org", 16, 0) == -1);
+	assert(a2id_view_parse(&view, "foo@example.org", 11, 0) == 0);
+	a2id_fromview(&id, &view);
+	assert(a2id_tostr(output, sizeof(output), &id) == 11);
+	assert(strcmp(output, "foo@example") == 0);
+}
+
+/*
+ * Upper casing an ID or selector must not change the result of a2id_match,
+ * which uses a different code path if neither contains upper case characters.
+ * Signature flags are case sensitive and are skipped.
+ */
+void
+test_a2id_match_case(void)
+{
+	a2id sub, upsub, sel, upsel;
+	char up[A2ID_MAXSZ];
+	size_t i, j, k;
+	int r;
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		if (a2id_fromstr(&sub, corpus[i], 1) == -1)
+			continue;
+
+		for (k = 0; corpus[i][k] != '\0'; k++)
+			up[k] = toupper((unsigned char)corpus[i][k]);
+		up[k] = '\0';
+		assert(a2id_fromstr(&upsub, up, 1) == 0);
+
+		for (j = 0; j < sizeof(corpus) / sizeof(corpus[0]); j++) {
+			if (a2id_fromstr(&sel, corpus[j], 1) == -1)
+				continue;
+
+			if (((struct a2id *)&sel)->sigflagslen > 1)
+				continue;
+
+			/* upper case every other character */
+			for (k = 0; corpus[j][k] != '\0'; k++)
+				up[k] = k & 1 ? toupper((unsigned char)
+				    corpus[j][k]) : corpus[j][k];
+			up[k] = '\0';
+			assert(a2id_fromstr(&upsel, up, 1) == 0);
+
+			r = a2id_match(&sub, &sel);
+			assert(a2id_match(&upsub, &sel) == r);
+			assert(a2id_match(&sub, &upsel) == r);
+			assert(a2id_match(&upsub, &upsel) == r);
+		}
+	}
+}
+
+/*
+ * A selector without empty labels is matched with a single comparison of the
+ * domain, make sure the flag is set by the parser and kept up to date while
+ * generalizing.
+ */
+void
+test_a2id_emptylabel(void)
+{
+	struct a2id *id;
+	a2id sel, sub;
+
+	id = (struct a2id *)&sel;
+
+	assert(a2id_fromstr(&sel, "@example.org", 1) == 0);
+	assert(id->emptylabel == 0);
+	assert(a2id_fromstr(&sel, "@example.org.", 1) == 0);
+	assert(id->emptylabel == 0);
+	assert(a2id_fromstr(&sel, "@.example.org", 1) == 0);
+	assert(id->emptylabel == 1);
+	assert(a2id_fromstr(&sel, "@example..org", 1) == 0);
+	assert(id->emptylabel == 1);
+	assert(a2id_fromstr(&sel, "@example.org..", 1) == 0);
+	assert(id->emptylabel == 1);
+	assert(a2id_fromstr(&sel, "@.", 1) == 0);
+	assert(id->emptylabel == 1);
+
+	/* "@example.org" -> "@.org" -> "@org" -> "@." */
+	assert(a2id_fromstr(&sel, "@example.org", 1) == 0);
+	assert(a2id_generalize(&sel) == 1);
+	assert(id->emptylabel == 1);
+	assert(a2id_generalize(&sel) == 1);
+	assert(id->emptylabel == 0);
+	assert(a2id_generalize(&sel) == 1);
+	assert(id->emptylabel == 1);
+
+	assert(a2id_fromstr(&sub, "foo@sub.example.org", 0) == 0);
+	assert(a2id_fromstr(&sel, "@example.org", 1) == 0);
+	assert(a2id_match(&sub, &sel) == 1);
+	assert(a2id_fromstr(&sel, "@ample.org", 1) == 0);
+	assert(a2id_match(&sub, &sel) == 0);
+	assert(a2id_fromstr(&sel, "@sub.example.org.", 1) == 0);
+	assert(a2id_match(&sub, &sel) == 1);
+	assert(a2id_fromstr(&sel, "@x.sub.example.org", 1) == 0);
+	assert(a2id_match(&sub, &sel) == 0);
+	assert(a2id_fromstr(&sel, "@.example.org", 1) == 0);
+	assert(a2id_match(&sub, &sel) == 1);
+	assert(a2id_fromstr(&sel, "@..example.org", 1) == 0);
+	assert(a2id_match(&sub, &sel) == 0);
+}
+
+/*
+ * A generalization cursor must yield the same selectors as generalizing a copy
+ * of the id, without modifying the id.
+ */
+void
+test_a2id_gencursor(void)
+{
+	a2id id, gen, orig;
+	a2id_gencursor cursor;
+	char exp[A2ID_MAXSZ], out[A2ID_MAXSZ], small[8];
+	size_t i, len;
+	int isselector;
+
+	assert(sizeof(struct a2id_gencursor) <= sizeof(a2id_gencursor));
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		for (isselector = 0; isselector < 2; isselector++) {
+			if (a2id_fromstr(&id, corpus[i], isselector) == -1)
+				continue;
+
+			/* the pointers of a copy would point into "id" */
+			assert(a2id_fromstr(&gen, corpus[i], isselector) == 0);
+			memcpy(&orig, &id, sizeof(id));
+
+			a2id_gencursor_init(&cursor, &id);
+
+			do {
+				len = a2id_tostr(exp, sizeof(exp), &gen);
+				assert(a2id_gencursor_next(out, sizeof(out),
+				    &cursor) == len);
+				assert(strcmp(out, exp) == 0);
+			} while (a2id_generalize(&gen) == 1);
+
+			assert(a2id_gencursor_next(out, sizeof(out), &cursor)
+			    == 0);
+			assert(memcmp(&id, &orig, sizeof(id)) == 0);
+		}
+	}
+
+	/* truncation */
+	assert(a2id_fromstr(&id, "foo+bar+sig+@example.org", 0) == 0);
+	a2id_gencursor_init(&cursor, &id);
+	assert(a2id_gencursor_next(small, sizeof(small), &cursor) == 24);
+	assert(strcmp(small, "foo+bar") == 0);
+	assert(a2id_gencursor_next(small, sizeof(small), &cursor) == 21);
+	assert(strcmp(small, "foo+bar") == 0);
+	assert(a2id_gencursor_next(NULL, 0, &cursor) == 19);
+	assert(a2id_gencursor_next(small, 4, &cursor) == 16);
+	assert(strcmp(small, "foo") == 0);
+	assert(a2id_gencursor_next(small, 5, &cursor) == 15);
+	assert(strcmp(small, "foo@") == 0);
+}
+
+/*
+ * The generalization chain must consist of the same selectors as returned by
+ * a generalization cursor, and must not be written if it does not fit.
+ */
+void
+test_a2id_generalizations(void)
+{
+	a2id id;
+	a2id_gencursor cursor;
+	char buf[8 * A2ID_MAXSZ], exp[A2ID_MAXSZ];
+	size_t offsets[64], i, j, n, len;
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		if (a2id_fromstr(&id, corpus[i], 1) == -1)
+			continue;
+
+		n = a2id_generalizations(&id, buf, sizeof(buf), offsets, 63);
+		assert(n > 0);
+
+		a2id_gencursor_init(&cursor, &id);
+		for (j = 0; j < n; j++) {
+			len = a2id_gencursor_next(exp, sizeof(exp), &cursor);
+			assert(len == offsets[j + 1] - offsets[j] - 1);
+			assert(strcmp(&buf[offsets[j]], exp) == 0);
+		}
+		assert(a2id_gencursor_next(exp, sizeof(exp), &cursor) == 0);
+
+		/* one selector or one byte less must not fit */
+		assert(a2id_generalizations(&id, buf, sizeof(buf), offsets,
+		    n - 1) == 0);
+		assert(a2id_generalizations(&id, buf, offsets[n] - 1, offsets,
+		    n) == 0);
+		assert(a2id_generalizations(&id, buf, offsets[n], offsets, n)
+		    == n);
+	}
+
+	assert(a2id_fromstr(&id, "a+b@example.org", 0) == 0);
+	assert(a2id_generalizations(&id, buf, sizeof(buf), offsets, 63) == 7);
+	assert(memcmp(buf, "a+b@example.org\0a+@example.org\0a@example.org\0"
+	    "@example.org\0@.org\0@org\0@.", offsets[7]) == 0);
+}
+
+/*
+ * A compiled selector must match the same ids as the selector it is compiled
+ * from, also after generalization and with upper case characters.
+ */
+void
+test_a2idsel(void)
+{
+	const char *extra[] = {
+		"@a..example.org", "@example.org..", "@..example.org.",
+		"foo@a.b.example.org", "foo++bar@..org", "Foo+x+bar@a.b.org",
+		"+svc++@.a.b", "+svc+a+b@x.a.b", "a+b+c+@x.y", "a+b+c+SIG+@x.y",
+		"@", "@.", "@..", "a@b", "a+@b..",
+	};
+	const char *ids[sizeof(corpus) / sizeof(corpus[0]) +
+	    sizeof(extra) / sizeof(extra[0])];
+	static char buf[A2ID_MAXSZ * 4], upbuf[A2ID_MAXSZ * 4];
+	a2id sub, sel, upsub, upsel;
+	a2idsel *csel, *cupsel;
+	char up[A2ID_MAXSZ];
+	size_t i, j, k, n, size;
+	int r;
+
+	n = 0;
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+		ids[n++] = corpus[i];
+	for (i = 0; i < sizeof(extra) / sizeof(extra[0]); i++)
+		ids[n++] = extra[i];
+
+	csel = (a2idsel *)buf;
+	cupsel = (a2idsel *)upbuf;
+
+	for (j = 0; j < n; j++) {
+		if (a2id_fromstr(&sel, ids[j], 1) == -1)
+			continue;
+
+		for (k = 0; ids[j][k] != '\0'; k++)
+			up[k] = toupper((unsigned char)ids[j][k]);
+		up[k] = '\0';
+		assert(a2id_fromstr(&upsel, up, 1) == 0);
+
+		do {
+			size = a2idsel_compile(NULL, 0, &sel);
+			assert(size <= sizeof(buf));
+			assert(a2idsel_compile(csel, size - 1, &sel) == size);
+			assert(a2idsel_compile(csel, size, &sel) == size);
+			assert(a2idsel_compile(cupsel, sizeof(upbuf), &upsel)
+			    <= sizeof(upbuf));
+
+			for (i = 0; i < n; i++) {
+				if (a2id_fromstr(&sub, ids[i], 1) == -1)
+					continue;
+
+				for (k = 0; ids[i][k] != '\0'; k++)
+					up[k] = toupper((unsigned char)
+					    ids[i][k]);
+				up[k] = '\0';
+				assert(a2id_fromstr(&upsub, up, 1) == 0);
+
+				do {
+					r = a2id_match(&sub, &sel);
+					assert(a2idsel_match(&sub, csel) == r);
+					assert(a2id_match(&upsub, &sel) ==
+					    a2idsel_match(&upsub, csel));
+					assert(a2id_match(&sub, &upsel) ==
+					    a2idsel_match(&sub, cupsel));
+				} while (a2id_generalize(&sub) == 1 &&
+				    a2id_generalize(&upsub) == 1);
+			}
+		} while (a2id_generalize(&sel) == 1 &&
+		    a2id_generalize(&upsel) == 1);
+	}
+}
+
+/*
+ * A set of selectors must find the same selectors as matching each of them
+ * with a2id_match, in insertion order.
+ */
+void
+test_a2idselset(void)
+{
+	const char *extra[] = {
+		"@a..example.org", "@example.org..", "@..example.org.",
+		"foo@a.b.example.org", "foo++bar@..org", "Foo+x+bar@a.b.org",
+		"+svc++@.a.b", "+svc+a+b@x.a.b", "a+b+c+@x.y", "a+b+c+SIG+@x.y",
+		"@", "@.", "@..", "a@b", "a+@b..", "FOO@EXAMPLE.ORG",
+	};
+	static a2id sels[1024];
+	a2idselset *set;
+	a2id sub;
+	char up[A2ID_MAXSZ];
+	const char *in;
+	size_t ids[1024], exp[1024], i, j, k, g, n, nsels, nids, first;
+
+	assert((set = a2idselset_new()) != NULL);
+
+	/* every generalization of every selector */
+	nsels = 0;
+	n = sizeof(corpus) / sizeof(corpus[0]);
+	for (i = 0; i < n + sizeof(extra) / sizeof(extra[0]); i++) {
+		in = i < n ? corpus[i] : extra[i - n];
+
+		if (a2id_fromstr(&sels[nsels], in, 1) == -1)
+			continue;
+
+		/* parse again for each number of generalizations */
+		for (g = 0; ; g++) {
+			assert(nsels < sizeof(sels) / sizeof(sels[0]));
+			assert(a2id_fromstr(&sels[nsels], in, 1) == 0);
+
+			for (j = 0; j < g; j++)
+				if (a2id_generalize(&sels[nsels]) == 0)
+					break;
+
+			if (j < g)
+				break;
+
+			assert(a2idselset_add(set, &sels[nsels]) == 0);
+			nsels++;
+		}
+	}
+
+	for (i = 0; i < n + sizeof(extra) / sizeof(extra[0]); i++) {
+		in = i < n ? corpus[i] : extra[i - n];
+
+		for (k = 0; k < 2; k++) {
+			if (k == 0) {
+				if (a2id_fromstr(&sub, in, 1) == -1)
+					break;
+			} else {
+				for (j = 0; in[j] != '\0'; j++)
+					up[j] = toupper((unsigned char)in[j]);
+				up[j] = '\0';
+				assert(a2id_fromstr(&sub, up, 1) == 0);
+			}
+
+			do {
+				nids = 0;
+				for (j = 0; j < nsels; j++)
+					if (a2id_match(&sub, &sels[j]))
+						exp[nids++] = j;
+
+				assert(a2idselset_match(set, &sub, ids, 1024)
+				    == nids);
+				assert(memcmp(ids, exp, nids * sizeof(ids[0]))
+				    == 0);
+
+				/* only the first few */
+				assert(a2idselset_match(set, &sub, ids, 2) ==
+				    (nids < 2 ? nids : 2));
+				assert(memcmp(ids, exp, (nids < 2 ? nids : 2) *
+				    sizeof(ids[0])) == 0);
+
+				assert(a2idselset_first(set, &sub, &first) ==
+				    (nids > 0));
+				assert(nids == 0 || first == exp[0]);
+			} while (a2id_generalize(&sub) == 1);
+		}
+	}
+
+	a2idselset_free(set);
+}
+
 int
 main(void)
 {
 	test_parsestr();
 	test_parsestr_selector();
+	test_parsestr_differential();
 	test_a2id_generalize();
+	test_a2id_generalize_domain();
 	test_a2id_coreform();
 	test_a2id_localpart_options();
+	test_a2id_fromstr_many();
+	test_a2id_compact();
+	test_a2id_view();
+	test_a2id_match_case();
+	test_a2id_emptylabel();
+	test_a2id_gencursor();
+	test_a2id_generalizations();
+	test_a2idsel();
+	test_a2idselset();
 
 	return 0;
 }